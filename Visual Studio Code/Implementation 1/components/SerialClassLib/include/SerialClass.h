@@ -0,0 +1,115 @@
+#ifndef SerialClass_H
+#define SerialClass_H
+
+// Author - Ben Sturdy
+// This file implements a class 'Serial Class'. This class should be instantiated
+// only once in a project. This class runs the SLIP link between a root gateway
+// node and the host master over a UART, in place of the WiFi router uplink.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "driver/uart.h"
+#include "esp_log.h"
+#include "SlipCodec.h"
+#include <cstddef>
+#include <cstdint>
+
+#ifndef CONFIG_ESP_SERIAL_UART_NUM
+#define CONFIG_ESP_SERIAL_UART_NUM 1
+#endif
+
+#ifndef CONFIG_ESP_SERIAL_BAUD_RATE
+#define CONFIG_ESP_SERIAL_BAUD_RATE 921600
+#endif
+
+#ifndef CONFIG_ESP_SERIAL_TX_PIN
+#define CONFIG_ESP_SERIAL_TX_PIN 17
+#endif
+
+#ifndef CONFIG_ESP_SERIAL_RX_PIN
+#define CONFIG_ESP_SERIAL_RX_PIN 18
+#endif
+
+static const size_t SERIAL_MAX_FRAME_SIZE = 1500;   // Same as the largest UDP datagram the mesh handles
+static const size_t SERIAL_RX_BUFFER_SIZE = 4096;
+static const size_t SERIAL_TX_BUFFER_SIZE = 8192;   // Lets a burst of upstream frames queue without blocking the mesh
+
+
+
+struct SerialLinkStats
+{
+    uint32_t FramesSent;
+    uint32_t FramesReceived;
+    uint32_t FramesDropped;        // Oversized or badly escaped frames from the host
+    uint32_t SendFailures;         // Frames that did not fit the TX buffer
+    uint64_t BytesSent;            // Encoded bytes, what the baud rate has to carry
+};
+
+
+
+class SerialClass
+{
+    private:
+        SerialClass();
+        ~SerialClass();
+
+        static void ReceiveTask(void* pvParameters);
+        TaskHandle_t ReceiveTaskHandle = nullptr;
+
+        void (*FrameHandler)(const uint8_t* Data, size_t Length) = nullptr;
+        SlipDecoder<SERIAL_MAX_FRAME_SIZE> Decoder;
+        SerialLinkStats Stats{};
+
+
+        // Encoding buffer for SendFrame, too large for the stack of the tasks that send.
+        // TxMutex guards it and the send counters in Stats.
+        SemaphoreHandle_t TxMutex = nullptr;
+        uint8_t TxEncoded[SlipMaxEncodedSize(SERIAL_MAX_FRAME_SIZE)]{};
+        bool IsLinkSetup = false;
+        bool IsRuntimeLoggingEnabled = true;
+
+
+
+    public:
+        // Singleton Instance
+        static SerialClass& GetInstance();
+        SerialClass(const SerialClass&) = delete;
+        void operator=(const SerialClass&) = delete;
+
+
+
+        /**
+         * @brief Install the UART driver with the Kconfig port, pins and baud rate and start the receive task. Every complete frame from the host is passed to FrameHandler on the receive task.
+         * @param Handler Called once per decoded frame.
+         * @param CoreToUse Core for the receive task.
+         * @return bool: True if the link is up.
+         */
+        bool SetupSlipLink(void (*Handler)(const uint8_t* Data, size_t Length), uint8_t CoreToUse);
+
+
+
+        /**
+         * @brief SLIP-encode a frame and queue it on the UART. Senders take turns on one encoding buffer and the frame is written in one call, so frames from different tasks never interleave.
+         * @param Data Frame to send.
+         * @param Length Number of bytes in Data, at most SERIAL_MAX_FRAME_SIZE.
+         * @return bool: True if the whole frame was queued.
+         */
+        bool SendFrame(const uint8_t* Data, size_t Length);
+
+
+
+        /**
+         * @brief Get the bytes per second the link can carry, 8N1 framing included.
+         * @return uint32_t: The link capacity.
+         */
+        static constexpr uint32_t GetCapacityBytesPerS() { return CONFIG_ESP_SERIAL_BAUD_RATE / 10; }
+
+
+
+        bool IsLinkUp() const { return IsLinkSetup; }
+        SerialLinkStats GetStats() const;
+        void SetRuntimeLogging(bool EnableRuntimeLogging) { IsRuntimeLoggingEnabled = EnableRuntimeLogging; }
+};
+
+#endif
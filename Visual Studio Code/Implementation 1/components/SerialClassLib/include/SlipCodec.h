@@ -0,0 +1,145 @@
+#ifndef SlipCodec_H
+#define SlipCodec_H
+
+// Author - Ben Sturdy
+// SLIP framing (RFC 1055) for the serial link between the root gateway and the
+// host. Plain C++ with no ESP-IDF dependencies, so the host bridge tool builds
+// against this same file.
+
+#include <cstddef>
+#include <cstdint>
+
+constexpr uint8_t SLIP_END     = 0xC0;
+constexpr uint8_t SLIP_ESC     = 0xDB;
+constexpr uint8_t SLIP_ESC_END = 0xDC;
+constexpr uint8_t SLIP_ESC_ESC = 0xDD;
+
+
+
+/**
+ * @brief Worst case encoded size of a frame: every byte escaped, plus a leading and a trailing END.
+ */
+constexpr size_t SlipMaxEncodedSize(size_t Length) { return 2 * Length + 2; }
+
+
+
+/**
+ * @brief Encode one frame. A leading END flushes any line noise the receiver has collected.
+ * @param Data Frame to encode.
+ * @param Length Number of bytes in Data.
+ * @param Out Output buffer.
+ * @param OutSize Size of Out, at least SlipMaxEncodedSize(Length) to be safe.
+ * @return size_t: The number of encoded bytes, 0 if Out is too small.
+ */
+inline size_t SlipEncode(const uint8_t* Data, size_t Length, uint8_t* Out, size_t OutSize)
+{
+    if (Data == nullptr || Out == nullptr || OutSize < 2) return 0;
+
+    size_t Position = 0;
+    Out[Position++] = SLIP_END;
+
+    for (size_t i = 0; i < Length; i++)
+    {
+        const uint8_t Byte = Data[i];
+        const bool IsEscaped = (Byte == SLIP_END || Byte == SLIP_ESC);
+
+        if (Position + (IsEscaped ? 2 : 1) + 1 > OutSize) return 0;
+
+        if (Byte == SLIP_END)
+        {
+            Out[Position++] = SLIP_ESC;
+            Out[Position++] = SLIP_ESC_END;
+        }
+        else if (Byte == SLIP_ESC)
+        {
+            Out[Position++] = SLIP_ESC;
+            Out[Position++] = SLIP_ESC_ESC;
+        }
+        else
+        {
+            Out[Position++] = Byte;
+        }
+    }
+
+    Out[Position++] = SLIP_END;
+    return Position;
+}
+
+
+
+// Byte-at-a-time decoder. Frames longer than the buffer and bad escapes are
+// dropped whole, the decoder resynchronises on the next END.
+template <size_t BufferSize>
+class SlipDecoder
+{
+    private:
+        uint8_t Buffer[BufferSize]{};
+        size_t Length = 0;
+        bool IsEscaping = false;
+        bool IsDiscarding = false;
+        uint32_t DroppedFrames = 0;
+
+
+
+    public:
+
+        /**
+         * @brief Feed one received byte.
+         * @return size_t: The length of the frame now held in GetFrame(), or 0 if no frame completed on this byte.
+         */
+        size_t Push(uint8_t Byte)
+        {
+            if (Byte == SLIP_END)
+            {
+                const size_t FrameLength = IsDiscarding ? 0 : Length;
+                Length = 0;
+                IsEscaping = false;
+                IsDiscarding = false;
+                return FrameLength; // Back-to-back ENDs give empty frames, reported as 0
+            }
+
+            if (IsDiscarding) return 0;
+
+            if (IsEscaping)
+            {
+                IsEscaping = false;
+                if (Byte == SLIP_ESC_END) Byte = SLIP_END;
+                else if (Byte == SLIP_ESC_ESC) Byte = SLIP_ESC;
+                else
+                {
+                    Discard();
+                    return 0;
+                }
+            }
+            else if (Byte == SLIP_ESC)
+            {
+                IsEscaping = true;
+                return 0;
+            }
+
+            if (Length >= BufferSize)
+            {
+                Discard();
+                return 0;
+            }
+
+            Buffer[Length++] = Byte;
+            return 0;
+        }
+
+
+
+        const uint8_t* GetFrame() const { return Buffer; }
+        uint32_t GetDroppedFrameCount() const { return DroppedFrames; }
+
+
+
+    private:
+        void Discard()
+        {
+            IsDiscarding = true;
+            DroppedFrames++;
+        }
+};
+
+#endif
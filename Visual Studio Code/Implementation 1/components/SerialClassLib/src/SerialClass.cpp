@@ -0,0 +1,160 @@
+#include "SerialClass.h"
+
+// Author - Ben Sturdy
+// This file implements a class 'Serial Class'. This class should be instantiated
+// only once in a project. This class runs the SLIP link between a root gateway
+// node and the host master over a UART, in place of the WiFi router uplink.
+
+
+
+
+
+//==============================================================================// 
+//                                                                              //
+//                            Serial Class                                      //
+//                                                                              //
+//==============================================================================// 
+
+#define SERIAL_TAG "Serial Class"
+
+static const uart_port_t SerialPort = (uart_port_t)CONFIG_ESP_SERIAL_UART_NUM;
+
+
+
+// Singleton Instance
+SerialClass& SerialClass::GetInstance()
+{
+    static SerialClass Instance;
+    return Instance;
+}
+
+// Constructor
+SerialClass::SerialClass() = default;
+
+// Destructor
+SerialClass::~SerialClass() = default;
+
+
+
+bool SerialClass::SetupSlipLink(void (*Handler)(const uint8_t* Data, size_t Length), uint8_t CoreToUse)
+{
+    if (IsLinkSetup) return true;
+    if (Handler == nullptr) return false;
+
+    uart_config_t UartConfig = {};
+    UartConfig.baud_rate = CONFIG_ESP_SERIAL_BAUD_RATE;
+    UartConfig.data_bits = UART_DATA_8_BITS;
+    UartConfig.parity = UART_PARITY_DISABLE;
+    UartConfig.stop_bits = UART_STOP_BITS_1;
+    UartConfig.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+    UartConfig.source_clk = UART_SCLK_DEFAULT;
+
+    if (TxMutex == nullptr) TxMutex = xSemaphoreCreateMutex();
+    if (TxMutex == nullptr) return false;
+
+    if (uart_driver_install(SerialPort, SERIAL_RX_BUFFER_SIZE, SERIAL_TX_BUFFER_SIZE, 0, nullptr, 0) != ESP_OK) return false;
+
+    if (uart_param_config(SerialPort, &UartConfig) != ESP_OK ||
+        uart_set_pin(SerialPort, CONFIG_ESP_SERIAL_TX_PIN, CONFIG_ESP_SERIAL_RX_PIN, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE) != ESP_OK)
+    {
+        uart_driver_delete(SerialPort);
+        return false;
+    }
+
+    FrameHandler = Handler;
+
+    if (xTaskCreatePinnedToCore(&SerialClass::ReceiveTask,
+                                "SerialRx",
+                                6144,
+                                this,
+                                6,          // Above the UDP tasks, downstream commands should not wait behind forwarding
+                                &ReceiveTaskHandle,
+                                CoreToUse) != pdPASS)
+    {
+        uart_driver_delete(SerialPort);
+        FrameHandler = nullptr;
+        return false;
+    }
+
+    IsLinkSetup = true;
+    if (IsRuntimeLoggingEnabled) ESP_LOGI(SERIAL_TAG, "SLIP link up on UART%d at %d baud", (int)SerialPort, CONFIG_ESP_SERIAL_BAUD_RATE);
+
+    return true;
+}
+
+
+
+bool SerialClass::SendFrame(const uint8_t* Data, size_t Length)
+{
+    if (!IsLinkSetup || Data == nullptr || Length == 0 || Length > SERIAL_MAX_FRAME_SIZE) return false;
+
+    // The UDP, mesh and OTA tasks all send to the host, one at a time through the member buffer
+    if (xSemaphoreTake(TxMutex, portMAX_DELAY) != pdTRUE) return false;
+
+    bool IsQueued = false;
+    const size_t EncodedLength = SlipEncode(Data, Length, TxEncoded, sizeof(TxEncoded));
+    if (EncodedLength > 0)
+    {
+        // uart_write_bytes copies into the TX ring buffer, the encoding buffer is free again once it returns
+        IsQueued = uart_write_bytes(SerialPort, TxEncoded, EncodedLength) == (int)EncodedLength;
+
+        if (IsQueued)
+        {
+            Stats.FramesSent++;
+            Stats.BytesSent += EncodedLength;
+        }
+        else Stats.SendFailures++;
+    }
+
+    xSemaphoreGive(TxMutex);
+    return IsQueued;
+}
+
+
+
+SerialLinkStats SerialClass::GetStats() const
+{
+    // The send counters are only consistent under the TX lock, the receive counters have one writer
+    if (TxMutex == nullptr || xSemaphoreTake(TxMutex, portMAX_DELAY) != pdTRUE) return Stats;
+
+    const SerialLinkStats Copy = Stats;
+    xSemaphoreGive(TxMutex);
+    return Copy;
+}
+
+
+
+void SerialClass::ReceiveTask(void* pvParameters)
+{
+    SerialClass* Instance = static_cast<SerialClass*>(pvParameters);
+    uint8_t Chunk[256];
+
+    while (true)
+    {
+        // uart_read_bytes waits for the full length, so block on one byte and
+        // then take whatever else is already buffered, a frame is never held back
+        int Read = uart_read_bytes(SerialPort, Chunk, 1, portMAX_DELAY);
+        if (Read <= 0) continue;
+
+        size_t Buffered = 0;
+        if (uart_get_buffered_data_len(SerialPort, &Buffered) == ESP_OK && Buffered > 0)
+        {
+            const size_t ToRead = (Buffered < sizeof(Chunk) - 1) ? Buffered : sizeof(Chunk) - 1;
+            const int More = uart_read_bytes(SerialPort, Chunk + 1, ToRead, 0);
+            if (More > 0) Read += More;
+        }
+
+        for (int i = 0; i < Read; i++)
+        {
+            const size_t FrameLength = Instance->Decoder.Push(Chunk[i]);
+            if (FrameLength == 0) continue;
+
+            Instance->Stats.FramesReceived++;
+            Instance->FrameHandler(Instance->Decoder.GetFrame(), FrameLength);
+        }
+
+        Instance->Stats.FramesDropped = Instance->Decoder.GetDroppedFrameCount();
+    }
+
+    vTaskDelete(nullptr);
+}
@@ -0,0 +1,86 @@
+#ifndef CycleHistogram_H
+#define CycleHistogram_H
+
+// Author - Ben Sturdy
+// Fixed-bucket log-scale histogram of microsecond durations. Each power of two
+// is split into CYCLE_HISTOGRAM_SUB_BUCKETS linear steps, so every bucket is
+// at most 25% wide whether it holds 3 us or 300 ms, and p99.9 of a 1 ms loop
+// comes out to within a quarter of its true value. One task writes, any task
+// reads: the writer only increments, a reset is a baseline kept by the reader,
+// so neither side ever waits for the other.
+
+#include <cstddef>
+#include <cstdint>
+
+static const uint32_t CYCLE_HISTOGRAM_SUB_BITS = 2;
+static const uint32_t CYCLE_HISTOGRAM_SUB_BUCKETS = 1u << CYCLE_HISTOGRAM_SUB_BITS; // Linear steps per power of two
+static const uint32_t CYCLE_HISTOGRAM_MAX_EXPONENT = 20;         // Last exact power of two, 2^21 us (2.1 s) and above share the top bucket
+static const size_t CYCLE_HISTOGRAM_BUCKETS = CYCLE_HISTOGRAM_SUB_BUCKETS +
+                                              (CYCLE_HISTOGRAM_MAX_EXPONENT - CYCLE_HISTOGRAM_SUB_BITS + 1) * CYCLE_HISTOGRAM_SUB_BUCKETS + 1;
+
+
+
+struct CycleHistogramSnapshot
+{
+    uint32_t Buckets[CYCLE_HISTOGRAM_BUCKETS];
+    uint32_t Count;                   // Samples since the last reset
+    uint32_t MinUs;                   // 0 if there are no samples
+    uint32_t MaxUs;
+
+
+
+    /**
+     * @brief Upper bound of the bucket that holds the given percentile, never above MaxUs.
+     * @param Percentile Fraction of samples at or below the result, e.g. 0.999.
+     * @return uint32_t: The duration in microseconds, 0 if there are no samples.
+     */
+    uint32_t PercentileUs(float Percentile) const;
+
+
+
+    /**
+     * @brief Lower bound of a bucket, in microseconds.
+     * @param Index Bucket index, 0 to CYCLE_HISTOGRAM_BUCKETS - 1.
+     * @return uint32_t: The smallest duration counted in that bucket.
+     */
+    static uint32_t BucketLowerUs(size_t Index);
+};
+
+
+
+class CycleHistogram
+{
+    private:
+
+        // Writer side, only Record() stores to these
+        volatile uint32_t Buckets[CYCLE_HISTOGRAM_BUCKETS]{};
+        volatile uint32_t MinUs = UINT32_MAX;
+        volatile uint32_t MaxUs = 0;
+
+        // Reader side. A reset moves the baseline and asks the writer to restart min and max.
+        uint32_t Baseline[CYCLE_HISTOGRAM_BUCKETS]{};
+        volatile bool IsExtremesResetPending = false;
+
+        static size_t BucketOf(uint32_t Us);
+
+
+
+    public:
+
+        /**
+         * @brief Count one duration. Only one task or ISR may call this, it is in IRAM for the ISR.
+         * @param Us Duration in microseconds.
+         */
+        void Record(uint32_t Us);
+
+
+
+        /**
+         * @brief Copy the counts since the last reset. Safe from any task while Record() runs.
+         * @param ResetAfterRead Start a new measurement window after this read.
+         * @return CycleHistogramSnapshot: Counts, min and max of the window.
+         */
+        CycleHistogramSnapshot Snapshot(bool ResetAfterRead);
+};
+
+#endif
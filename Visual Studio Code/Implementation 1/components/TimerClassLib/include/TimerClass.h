@@ -1,11 +1,181 @@
 #ifndef TimerClass_H
 #define TimerClass_H
 
-#include "driver/timer.h"
+#include "driver/gptimer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_timer.h"
+#include "CycleHistogram.h"
+
+// What the cyclic task does when a cycle runs past the next release. A hung task,
+// one the watchdog finds still running CONFIG_ESP_OVERRUN_RESTART_TRIPS times in a row,
+// is restarted under every policy.
+enum class TimerOverrunPolicy : uint8_t
+{
+    SkipNext = 0,   // Drop the releases missed during the overrun, resume on the next one
+    CatchUp,        // Run the missed releases back to back, at most TIMER_CATCH_UP_LIMIT
+    Degraded,       // Run every TIMER_DEGRADED_DIVIDER releases until the task fits a period again
+    Restart,        // Delete and recreate the task on the first watchdog trip, late cycles are skipped
+};
+static const uint8_t TIMER_OVERRUN_POLICY_COUNT = 4;
+static const uint32_t TIMER_CATCH_UP_LIMIT = 4;
+static const uint32_t TIMER_DEGRADED_DIVIDER = 2;
+static const uint32_t TIMER_DEGRADED_CLEAN_CYCLES = 100;      // Runs within one full period before the full rate returns
+
+// Multi-rate scheduler limits. Every divider must divide, or be divided by, every
+// other one, so the largest divider is the hyperperiod and phases never drift.
+static const uint8_t TIMER_MAX_SCHEDULED_TASKS = 8;
+static const uint32_t TIMER_MAX_RATE_DIVIDER = 1000;           // Largest hyperperiod, 1 s at a 1 ms base period
+static const uint32_t TIMER_PHASE_AUTO = UINT32_MAX;           // Place the task in the least loaded phase
+static const UBaseType_t TIMER_SCHEDULED_TOP_PRIORITY = configMAX_PRIORITIES - 3; // Below CyclicTask and WatchdogTask
+static const uint32_t TIMER_SCHEDULED_STACK_SIZE = 4096;
+
+// Timing of the cyclic task, all in microseconds. Wake latency is CyclicISR to
+// CyclicTask running, slack is the end of UserTask to the next CyclicISR.
+struct TimerCycleStats
+{
+    CycleHistogramSnapshot WakeLatency;
+    CycleHistogramSnapshot Execution;       // UserTask alone
+    CycleHistogramSnapshot Slack;           // 0 for a cycle that ran into the next one
+    CycleHistogramSnapshot PeriodJitter;    // |ISR to ISR interval - period|, consecutive cycles only
+    CycleHistogramSnapshot WakeJitter;      // |task wake to wake interval - period|, what task mode code sees
+    uint32_t Overruns;                      // Cycles with no slack left, since boot
+    uint32_t PeriodUs;
+    uint32_t WatchdogTimeoutUs;             // Execution above this trips the watchdog
+};
+
+// ISR mode, a short IRAM function run inside CyclicISR every cycle. It cannot be
+// preempted, so one that runs over its budget TIMER_ISR_BUDGET_STRIKES times in a
+// row is removed rather than allowed to hold the core.
+static const uint8_t TIMER_ISR_BUDGET_STRIKES = 3;
+
+struct TimerIsrStats
+{
+    CycleHistogramSnapshot Execution;
+    CycleHistogramSnapshot StartJitter;     // |start to start interval - period|
+    uint32_t BudgetUs;
+    uint32_t BudgetOverruns;
+    bool IsInstalled;
+    bool IsDisabled;                        // Removed for running over budget
+};
+
+struct TimerJitterBenchmark
+{
+    uint32_t PeriodUs;
+    uint32_t IsrJitterP999Us;
+    uint32_t IsrJitterMaxUs;
+    uint32_t TaskJitterP999Us;
+    uint32_t TaskJitterMaxUs;
+    uint32_t TaskOverruns;                  // Cycles the task missed at this period
+};
+
+// Runtime period changes land on a cycle boundary. The auto-tuner sizes the period
+// from the worst alarm to end of cycle time in each window, plus a margin.
+static const uint32_t TIMER_MIN_PERIOD_US = 50;
+static const uint32_t TIMER_AUTOTUNE_WINDOW_MS = 2000;
+static const uint32_t TIMER_AUTOTUNE_MIN_CYCLES = 100;         // Fewer cycles in a window says too little to act on
+static const uint32_t TIMER_AUTOTUNE_STABLE_WINDOWS = 3;       // Windows in a row that allow a shorter period
+static const uint32_t TIMER_AUTOTUNE_STEP_US = 10;
+
+struct TimerAutoTuneStats
+{
+    bool IsEnabled;
+    uint32_t PeriodUs;
+    uint32_t WatchdogUs;
+    uint32_t WorstResponseUs;       // Last window, alarm to end of cycle
+    uint32_t MinPeriodUs;
+    uint32_t MaxPeriodUs;
+    uint32_t Changes;
+};
+
+// Phase lock to an outside cycle, the master's on a mesh node. The reference gives its period
+// and where a local time falls in its cycle. Each update measures where the last alarm fell and
+// trims the alarm count of the cycles that follow: the proportional part pulls the phase in, the
+// integral takes out the crystal's rate error, so CyclicISR fires on the reference's boundaries.
+enum class TimerPhaseLockState : uint8_t
+{
+    Off = 0,        // No reference set
+    Acquiring,      // Reference present, error not yet inside TIMER_PHASE_LOCK_WINDOW_US
+    Locked,
+    Holdover,       // Reference lost, the rate trim stays so the phase drifts away slowly
+};
+static const uint32_t TIMER_PHASE_LOCK_UPDATE_MS = 100;
+static const uint32_t TIMER_PHASE_LOCK_WINDOW_US = 50;         // Lock is claimed inside this
+static const uint32_t TIMER_PHASE_LOCK_COUNT = 10;             // Updates in a row inside the window before lock is claimed
+static const uint32_t TIMER_PHASE_UNLOCK_US = 200;             // Lock is lost outside this
+static const float TIMER_PHASE_LOCK_KP = 0.5f;                 // Share of the phase error taken out before the next update
+static const float TIMER_PHASE_LOCK_KI = 0.1f;                 // Share of the phase error added to the rate trim
+static const float TIMER_PHASE_LOCK_MAX_PPM = 500.0f;          // Rate trim limit, crystal tolerance of both ends with margin
+static const uint32_t TIMER_PHASE_LOCK_MAX_TRIM_DIVIDER = 16;  // A cycle is stretched or shortened by at most 1/16 of the period
+
+struct TimerPhaseLockStats
+{
+    TimerPhaseLockState State;
+    int32_t PhaseErrorUs;                   // Last alarm against the reference's cycle start, positive if late
+    CycleHistogramSnapshot PhaseError;      // |error| of every update while locked
+    float RateTrimPpm;                      // Integral, the local crystal against the reference, positive if it runs fast
+    float TrimUs;                           // Added to each cycle until the next update
+    uint32_t ReferencePeriodUs;
+    uint32_t Updates;
+    uint32_t Locks;
+    uint32_t LockLosses;                    // Error past TIMER_PHASE_UNLOCK_US or the reference lost while locked
+    uint32_t NoReference;                   // Updates without a usable reference
+    uint32_t PeriodChanges;                 // The period taken from the reference
+};
+
+// Overrun counters since boot. Duration is how far a cycle ended past its deadline, recovery
+// is the missed deadline to the end of the next full-rate cycle that finished in time.
+struct TimerOverrunStats
+{
+    TimerOverrunPolicy Policy;
+    bool IsDegraded;
+    uint32_t MissedReleases;        // Came in while the task was still running
+    uint32_t SkippedReleases;
+    uint32_t CaughtUpReleases;
+    uint32_t DegradedEntries;
+    uint32_t WatchdogTrips;
+    uint32_t Restarts;
+    CycleHistogramSnapshot Duration;
+    CycleHistogramSnapshot Recovery[TIMER_OVERRUN_POLICY_COUNT];    // Indexed by policy
+};
+
+struct TimerOverrunBenchmark
+{
+    TimerOverrunPolicy Policy;
+    uint32_t Samples;               // Recoveries measured
+    uint32_t MedianUs;
+    uint32_t MaxUs;
+};
+
+// One task on the multi-rate scheduler, released from CyclicISR every RateDivider periods
+struct TimerTaskConfig
+{
+    void (*Function)(void*);
+    void* Argument;
+    const char* Name;
+    uint32_t RateDivider;       // 1 = every period
+    uint32_t Phase;             // Period within the divider it runs in, or TIMER_PHASE_AUTO
+    UBaseType_t Priority;       // 0 = rate monotonic, the faster task gets the higher priority
+    uint32_t BudgetUs;          // Expected execution time, used to place phases and count budget overruns
+    uint32_t WatchdogUs;        // 0 = none, a run longer than this is flagged by CyclicISR
+    uint32_t StackSize;         // 0 = TIMER_SCHEDULED_STACK_SIZE
+};
+
+struct TimerTaskStats
+{
+    const char* Name;
+    uint32_t RateDivider;
+    uint32_t Phase;             // As placed, never TIMER_PHASE_AUTO
+    UBaseType_t Priority;       // As set on the FreeRTOS task
+    uint32_t BudgetUs;
+    CycleHistogramSnapshot Execution;
+    uint32_t Releases;          // Periods the task was due in
+    uint32_t Runs;
+    uint32_t DeadlineMisses;    // Due while still running or not yet started, the release is dropped
+    uint32_t BudgetOverruns;    // Runs longer than BudgetUs
+    uint32_t WatchdogTrips;     // Runs still going after WatchdogUs
+};
 
 class TimerClass
 {
@@ -17,14 +187,52 @@ class TimerClass
 
         // Setup methods
         bool SetupCyclicTask(void (*TaskToRun)(void*), uint8_t CoreToUse);
+
+        // ISR mode, IsrFunction must be IRAM_ATTR and short. It runs alongside the task, or
+        // alone if SetupCyclicTask is given no task.
+        bool SetupCyclicIsr(void (*IsrFunction)(void*), uint32_t BudgetUs);
+        void GetIsrStats(TimerIsrStats& Stats, bool ResetAfterRead);
+
+        // Runs DurationMs at each period and compares ISR mode and task mode start jitter,
+        // then restores the configured period
+        bool BenchmarkIsrJitter(const uint32_t* PeriodsUs, uint8_t Count, uint32_t DurationMs, TimerJitterBenchmark* Results);
         void SetWatchdogOnOff(bool IsWatchdogEnabled);
+        void SetOverrunPolicy(TimerOverrunPolicy Policy) { OverrunPolicy = Policy; }
+
+        // Stalls the cyclic task OverrunUs past the end of UserTask, Repeats times per policy.
+        // Blocks the caller for about a second per repeat, the policy in force is restored after.
+        bool BenchmarkOverrunPolicies(uint32_t OverrunUs, uint8_t Repeats, TimerOverrunBenchmark (&Results)[TIMER_OVERRUN_POLICY_COUNT]);
+
+        // Multi-rate scheduler, register from one task, before or after SetupCyclicTask
+        bool RegisterTask(const TimerTaskConfig& Config);
+        uint8_t GetScheduledTaskCount() const { return ScheduledCount; }
+        bool GetScheduledTaskStats(uint8_t Index, TimerTaskStats& Stats, bool ResetAfterRead);
+        uint32_t GetPlannedPeakLoadUs() const { return PlannedPeakLoadUs; }
 
         // Getters
         uint64_t GetCyclicIsrCounter() const { return CyclicIsrCounter; }
         uint64_t GetCyclicTaskCounter() const { return CyclicTaskCounter; }
         uint64_t GetWatchdogIsrCounter() const { return WatchdogISRCounter; }
         uint64_t GetWatchdogTaskCounter() const { return WatchdogTaskCounter; }
-        uint64_t GetTimerFrequency() const { return 80000000.0 / Prescalar; }
+        uint64_t GetTimerFrequency() const { return 80000000 / Prescalar; }
+        uint32_t GetCyclePeriodUs() const { return CyclePeriodUs; }
+        int64_t GetCycleStartUs() const;       // Local time of the alarm that released the current cycle
+
+        // Runtime period, applied by CyclicISR at the next cycle boundary. Scheduled task
+        // rates are in base periods, so they scale with it.
+        bool SetCyclePeriod(uint32_t PeriodUs, uint32_t WatchdogUs);
+        bool SetAutoTune(bool Enabled, uint32_t MarginPercent, uint32_t MinPeriodUs, uint32_t MaxPeriodUs); // Refused while phase locked
+        void GetAutoTuneStats(TimerAutoTuneStats& Stats) const;
+
+        // Phase lock, Reference returns false while it has nothing to lock to. The period follows the
+        // reference's, so not together with the auto-tuner. nullptr turns it off.
+        bool SetPhaseReference(bool (*Reference)(int64_t LocalUs, uint32_t& PeriodUs, uint32_t& PhaseUs));
+        void GetPhaseLockStats(TimerPhaseLockStats& Stats, bool ResetAfterRead);
+
+        // Lock free, callable from any task while the cyclic task runs
+        void GetCycleStats(TimerCycleStats& Stats, bool ResetAfterRead);
+        void GetOverrunStats(TimerOverrunStats& Stats, bool ResetAfterRead);
+        TimerOverrunPolicy GetOverrunPolicy() const { return OverrunPolicy; }
         
         TaskHandle_t GetCyclicTaskHandle() const { return CyclicTaskHandle; }
         TaskHandle_t GetWatchdogTaskHandle() const { return WatchdogTaskHandle; }
@@ -35,14 +243,22 @@ class TimerClass
         ~TimerClass();
 
         // Helper to setup hardware timers
-        bool SetupTimer(float CycleTimeInMs, float WatchdogTime, uint16_t Prescalar);
+        bool SetupTimer(uint32_t PeriodUs, uint32_t WatchdogUs, uint16_t Prescalar);
+        uint64_t TicksFromUs(uint32_t Us) const { return GetTimerFrequency() * Us / 1000000; }
         bool IsSetupDone;
 
         // Static ISRs & Tasks 
-        static bool IRAM_ATTR CyclicISR(void* arg);
-        static bool IRAM_ATTR WatchdogISR(void* arg);
+        static bool IRAM_ATTR CyclicISR(gptimer_handle_t Timer, const gptimer_alarm_event_data_t* Event, void* arg);
+        static bool IRAM_ATTR WatchdogISR(gptimer_handle_t Timer, const gptimer_alarm_event_data_t* Event, void* arg);
         static void CyclicTask(void *pvParameters);
         static void WatchdogTask(void *pvParameters);
+        static void ScheduledTaskLoop(void *pvParameters);
+        void RunIsrTask(uint32_t FiredUs);
+        void ArmWatchdog();
+        static void AutoTuneCallback(void* arg);
+
+        gptimer_handle_t CyclicTimer = nullptr;
+        gptimer_handle_t WatchdogTimer = nullptr;
 
         // Instance Variables
         static const int CyclicTaskStackSize = 4096;
@@ -59,17 +275,136 @@ class TimerClass
         volatile uint64_t WatchdogISRCounter = 0;
         volatile uint64_t WatchdogTaskCounter = 0;
 
+        // Stamped by CyclicISR, 32 bit so the task always reads a whole value
+        volatile uint32_t IsrTimestampUs = 0;
+        volatile uint32_t IsrSequence = 0;
+
+        // Written by CyclicTask only
+        uint32_t LastIsrTimestampUs = 0;
+        uint32_t LastIsrSequence = 0;
+        uint32_t LastWokeUs = 0;
+        uint32_t LastGeneration = 0;
+        uint32_t ArmedGeneration = 0;
+        volatile uint32_t CycleOverruns = 0;
+        CycleHistogram WakeLatency;
+        CycleHistogram Execution;
+        CycleHistogram Slack;
+        CycleHistogram PeriodJitter;
+        CycleHistogram WakeJitter;
+
+        // ISR mode, written by CyclicISR only once IsrTask is set
+        void (* volatile IsrTask)(void*) = nullptr;
+        volatile uint32_t IsrBudgetUs = 0;
+        volatile uint32_t IsrBudgetOverruns = 0;
+        volatile bool IsIsrTaskDisabled = false;
+        uint8_t IsrBudgetStrikes = 0;
+        uint32_t LastIsrTaskUs = 0;
+        uint32_t IsrTaskSequence = 0;
+        uint32_t IsrTaskGeneration = 0;
+        CycleHistogram IsrExecution;
+        CycleHistogram IsrStartJitter;
+
+        // Overrun handling, written by CyclicTask, and by WatchdogTask only while it restarts the task
+        void HandleOverrun(uint32_t DeadlineUs, uint32_t EndUs);
+        void NoteOnTime(uint32_t EndUs, uint32_t ElapsedUs, uint32_t PeriodUs);
+        volatile TimerOverrunPolicy OverrunPolicy = TimerOverrunPolicy::SkipNext;
+        volatile uint32_t RunDeadlineUs = 0;
+        volatile uint8_t RunWatchdogTrips = 0;        // Trips during the current run
+        volatile uint32_t InjectedOverrunUs = 0;
+        uint32_t CatchUpPending = 0;
+        volatile bool IsDegraded = false;
+        uint32_t DegradedPhase = 0;
+        uint32_t CleanRuns = 0;
+        volatile bool IsRecovering = false;
+        uint32_t RecoveryStartUs = 0;
+        TimerOverrunPolicy RecoveryPolicy = TimerOverrunPolicy::SkipNext;
+        volatile uint32_t MissedReleases = 0;
+        volatile uint32_t SkippedReleases = 0;
+        volatile uint32_t CaughtUpReleases = 0;
+        volatile uint32_t DegradedEntries = 0;
+        volatile uint32_t WatchdogTrips = 0;
+        volatile uint32_t CycleRestarts = 0;
+        CycleHistogram OverrunDuration;
+        CycleHistogram Recovery[TIMER_OVERRUN_POLICY_COUNT];
+
         TaskHandle_t CyclicTaskHandle = NULL;
         TaskHandle_t WatchdogTaskHandle = NULL;
-        
-        // Notification objects
-        BaseType_t xHigherPriorityTaskWokenFalse = pdFALSE;
-        BaseType_t xHigherPriorityTaskWokenTrue = pdTRUE;
 
+        // Multi-rate scheduler. An entry is complete before ScheduledCount counts it,
+        // after that CyclicISR owns Countdown and the task owns the run fields.
+        struct ScheduledTask
+        {
+            TimerTaskConfig Config;
+            TaskHandle_t Handle;
+            UBaseType_t Priority;
+            uint32_t Countdown;                 // Periods until the next release
+            volatile uint32_t StartUs;
+            volatile bool IsRunning;
+            volatile bool IsReleasePending;     // Notified, not started yet
+            volatile bool IsWatchdogTripped;    // For the current run
+            volatile uint32_t Releases;
+            volatile uint32_t Runs;
+            volatile uint32_t DeadlineMisses;
+            volatile uint32_t BudgetOverruns;
+            volatile uint32_t WatchdogTrips;
+            CycleHistogram Execution;
+        };
+        ScheduledTask Scheduled[TIMER_MAX_SCHEDULED_TASKS]{};
+        volatile uint8_t ScheduledCount = 0;
+        uint32_t PlannedPeakLoadUs = 0;
+        portMUX_TYPE ScheduleLock = portMUX_INITIALIZER_UNLOCKED;
+        uint32_t PlanPhase(const TimerTaskConfig& Config, uint32_t& PeakLoadUs) const;
+        void RankPriorities();
+        
         void (*UserTask)(void*) = nullptr;
         
-        float CycleTimeMs = 0;
-        float WatchdogTimeMs = 0;
+        volatile uint32_t CyclePeriodUs = 0;
+        volatile uint32_t WatchdogPeriodUs = 0;
+
+        // Period change, staged under ScheduleLock and applied by CyclicISR
+        volatile bool IsPeriodChangePending = false;
+        volatile uint32_t PeriodGeneration = 0;     // Counts applied changes
+        uint32_t PendingPeriodUs = 0;
+        uint32_t PendingWatchdogUs = 0;
+        uint64_t PendingAlarmTicks = 0;
+
+        // Auto-tuner, the window is written by CyclicTask and taken by AutoTuneCallback
+        esp_timer_handle_t AutoTuneTimer = nullptr;
+        volatile bool IsAutoTuneEnabled = false;
+        volatile bool IsTuneWindowReset = false;
+        volatile uint32_t TuneWindowMaxUs = 0;
+        volatile uint32_t TuneWindowCycles = 0;
+        uint32_t TuneWorstResponseUs = 0;
+        uint32_t TuneMarginPercent = 0;
+        uint32_t TuneMinPeriodUs = 0;
+        uint32_t TuneMaxPeriodUs = 0;
+        uint32_t TuneStableWindows = 0;
+        uint32_t TuneChanges = 0;
+
+        // Phase lock, the trim is staged by PhaseLockCallback in 1/256 ticks and CyclicISR adds whole
+        // ticks to the alarm, carrying the fraction, so a trim below one tick still averages out
+        static void PhaseLockCallback(void* arg);
+        void UpdatePhaseLock();
+        esp_timer_handle_t PhaseLockTimer = nullptr;
+        bool (* volatile PhaseReference)(int64_t, uint32_t&, uint32_t&) = nullptr;
+        volatile int32_t PhaseTrimQ8 = 0;
+        volatile uint64_t BaseAlarmTicks = 0;       // Alarm of the untrimmed period
+        int32_t TrimCarryQ8 = 0;                    // CyclicISR only
+        int32_t AppliedTrimTicks = 0;               // CyclicISR only
+        volatile TimerPhaseLockState PhaseState = TimerPhaseLockState::Off;
+        float RateTrimUs = 0.0f;                    // Per cycle
+        float PhaseTrimUs = 0.0f;
+        volatile int32_t PhaseErrorUs = 0;
+        uint32_t PhaseInWindow = 0;
+        uint32_t PhaseSequence = 0;                 // IsrSequence at the last update
+        uint32_t PhaseGeneration = 0;
+        uint32_t ReferencePeriodUs = 0;
+        volatile uint32_t PhaseUpdates = 0;
+        volatile uint32_t PhaseLocks = 0;
+        volatile uint32_t PhaseLockLosses = 0;
+        volatile uint32_t PhaseNoReference = 0;
+        volatile uint32_t PhasePeriodChanges = 0;
+        CycleHistogram PhaseError;
         uint16_t Prescalar = 1;
         bool IsWatchdogEnabled = true;
         uint8_t CoreToRunCyclicTask = 1;
@@ -0,0 +1,121 @@
+#include "CycleHistogram.h"
+#include "esp_attr.h"
+#include <cmath>
+
+// Author - Ben Sturdy
+// Durations below CYCLE_HISTOGRAM_SUB_BUCKETS us get a bucket each. Above that
+// the bucket is the exponent of the value plus its next CYCLE_HISTOGRAM_SUB_BITS
+// bits, which is just a count-leading-zeros and a shift on the writer's path.
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                  Buckets                                     //
+//                                                                              //
+//==============================================================================//
+
+size_t IRAM_ATTR CycleHistogram::BucketOf(uint32_t Us)
+{
+    if (Us < CYCLE_HISTOGRAM_SUB_BUCKETS) return Us;
+
+    const uint32_t Exponent = 31 - __builtin_clz(Us);
+    if (Exponent > CYCLE_HISTOGRAM_MAX_EXPONENT) return CYCLE_HISTOGRAM_BUCKETS - 1;
+
+    const uint32_t Sub = (Us >> (Exponent - CYCLE_HISTOGRAM_SUB_BITS)) & (CYCLE_HISTOGRAM_SUB_BUCKETS - 1);
+    return CYCLE_HISTOGRAM_SUB_BUCKETS + (Exponent - CYCLE_HISTOGRAM_SUB_BITS) * CYCLE_HISTOGRAM_SUB_BUCKETS + Sub;
+}
+
+
+
+uint32_t CycleHistogramSnapshot::BucketLowerUs(size_t Index)
+{
+    if (Index < CYCLE_HISTOGRAM_SUB_BUCKETS) return (uint32_t)Index;
+    if (Index >= CYCLE_HISTOGRAM_BUCKETS - 1) return 1u << (CYCLE_HISTOGRAM_MAX_EXPONENT + 1);
+
+    const uint32_t Step = (uint32_t)Index - CYCLE_HISTOGRAM_SUB_BUCKETS;
+    const uint32_t Exponent = Step / CYCLE_HISTOGRAM_SUB_BUCKETS + CYCLE_HISTOGRAM_SUB_BITS;
+    const uint32_t Sub = Step % CYCLE_HISTOGRAM_SUB_BUCKETS;
+    return (1u << Exponent) + Sub * (1u << (Exponent - CYCLE_HISTOGRAM_SUB_BITS));
+}
+
+
+
+uint32_t CycleHistogramSnapshot::PercentileUs(float Percentile) const
+{
+    if (Count == 0) return 0;
+
+    // Rank of the sample the percentile falls on, 1 based
+    uint32_t Rank = (uint32_t)ceilf(Percentile * (float)Count);
+    if (Rank < 1) Rank = 1;
+    if (Rank > Count) Rank = Count;
+
+    uint32_t Seen = 0;
+    for (size_t i = 0; i < CYCLE_HISTOGRAM_BUCKETS; i++)
+    {
+        Seen += Buckets[i];
+        if (Seen < Rank) continue;
+
+        if (i == CYCLE_HISTOGRAM_BUCKETS - 1) return MaxUs;
+        const uint32_t Upper = BucketLowerUs(i + 1) - 1;
+        return (Upper < MaxUs) ? Upper : MaxUs;
+    }
+
+    return MaxUs;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                              Writer / Reader                                 //
+//                                                                              //
+//==============================================================================//
+
+void IRAM_ATTR CycleHistogram::Record(uint32_t Us)
+{
+    if (IsExtremesResetPending)
+    {
+        MinUs = UINT32_MAX;
+        MaxUs = 0;
+        IsExtremesResetPending = false;
+    }
+
+    const size_t Index = BucketOf(Us);
+    Buckets[Index] = Buckets[Index] + 1;
+
+    if (Us < MinUs) MinUs = Us;
+    if (Us > MaxUs) MaxUs = Us;
+}
+
+
+
+CycleHistogramSnapshot CycleHistogram::Snapshot(bool ResetAfterRead)
+{
+    CycleHistogramSnapshot Copy{};
+
+    // Each bucket is one aligned word, a sample landing mid-copy is simply in
+    // this window or the next one, the count is taken from the buckets so it
+    // always matches them
+    for (size_t i = 0; i < CYCLE_HISTOGRAM_BUCKETS; i++)
+    {
+        const uint32_t Now = Buckets[i];
+        Copy.Buckets[i] = Now - Baseline[i];
+        Copy.Count += Copy.Buckets[i];
+        if (ResetAfterRead) Baseline[i] = Now;
+    }
+
+    // Min and max belong to the window since the writer last saw a reset request
+    const uint32_t Min = MinUs;
+    const uint32_t Max = MaxUs;
+    const bool IsWindowFresh = IsExtremesResetPending;
+    Copy.MinUs = (Copy.Count == 0 || IsWindowFresh || Min == UINT32_MAX) ? 0 : Min;
+    Copy.MaxUs = (Copy.Count == 0 || IsWindowFresh) ? 0 : Max;
+
+    if (ResetAfterRead) IsExtremesResetPending = true;
+    return Copy;
+}
@@ -1,24 +1,47 @@
 #include "TimerClass.h"
+#include "esp_rom_sys.h"
+#include <vector>
 
 // Hardware Config Macros
-#define CyclicTimerGroup        TIMER_GROUP_0 
-#define CyclicTimerIndex        TIMER_0
-#define WatchdogTimerGroup      TIMER_GROUP_1
-#define WatchdogTimerIndex      TIMER_0
 #define CyclicPeriodInUs        CONFIG_ESP_CYCLIC_TASK_PERIOD
 #define WatchdogPeriodInUs      CONFIG_ESP_WATCHDOG_TASK_PERIOD
 #define Prescaler               CONFIG_ESP_TIMER_PRESCALER
+#define OverrunPolicyDefault    CONFIG_ESP_OVERRUN_POLICY
+#define RestartAfterTrips       CONFIG_ESP_OVERRUN_RESTART_TRIPS
+#define AutoTuneMarginPercent   CONFIG_ESP_CYCLIC_AUTOTUNE_MARGIN
+#define AutoTuneMinPeriodUs     CONFIG_ESP_CYCLIC_AUTOTUNE_MIN_PERIOD
 #define TAG                     "Timer Class"
 
 #ifndef CONFIG_ESP_CYCLIC_TASK_PERIOD
 #define CONFIG_ESP_CYCLIC_TASK_PERIOD 1000 // default example
 #endif
 
+#ifndef CONFIG_ESP_OVERRUN_POLICY
+#define CONFIG_ESP_OVERRUN_POLICY 0
+#endif
+
+#ifndef CONFIG_ESP_OVERRUN_RESTART_TRIPS
+#define CONFIG_ESP_OVERRUN_RESTART_TRIPS 3
+#endif
+
+#ifndef CONFIG_ESP_CYCLIC_AUTOTUNE_MARGIN
+#define CONFIG_ESP_CYCLIC_AUTOTUNE_MARGIN 50
+#endif
+
+#ifndef CONFIG_ESP_CYCLIC_AUTOTUNE_MIN_PERIOD
+#define CONFIG_ESP_CYCLIC_AUTOTUNE_MIN_PERIOD 100
+#endif
+
 #define TAG "TimerClass"
 
 // Initialize the static ISR pointer
 TimerClass* TimerClass::isr_instance = nullptr;
 
+// Stands in for a user ISR function while the jitter benchmark runs
+static void IRAM_ATTR IsrProbe(void* arg)
+{
+}
+
 
 
 
@@ -41,9 +64,10 @@ TimerClass::TimerClass()
     isr_instance = this;
     
     // Default initialization
-    CycleTimeMs = CyclicPeriodInUs / 1000.0; 
-    WatchdogTimeMs = WatchdogPeriodInUs / 1000.0;
+    CyclePeriodUs = CyclicPeriodInUs;
+    WatchdogPeriodUs = WatchdogPeriodInUs;
     Prescalar = Prescaler;     // Default
+    OverrunPolicy = (TimerOverrunPolicy)OverrunPolicyDefault;
 }
 
 TimerClass::~TimerClass()
@@ -53,35 +77,145 @@ TimerClass::~TimerClass()
 
 
 
-bool IRAM_ATTR TimerClass::CyclicISR(void* arg) 
+bool IRAM_ATTR TimerClass::CyclicISR(gptimer_handle_t Timer, const gptimer_alarm_event_data_t* Event, void* arg) 
 {
     // Do not access if instance is gone
     if (isr_instance == nullptr) return false;
+    BaseType_t HigherPriorityTaskWoken = pdFALSE;
 
     // Access instance members via the pointer
+    const uint32_t NowUs = (uint32_t)esp_timer_get_time();
     isr_instance->CyclicIsrCounter++;
+    isr_instance->IsrTimestampUs = NowUs;
+    isr_instance->IsrSequence++;
+
+    // ISR mode, nothing between the alarm and the user function
+    if (isr_instance->IsrTask != nullptr) isr_instance->RunIsrTask(NowUs);
+
+    // Release the scheduled tasks due this period, a task still busy from its last release skips this one
+    portENTER_CRITICAL_ISR(&isr_instance->ScheduleLock);
+    for (uint8_t i = 0; i < isr_instance->ScheduledCount; i++)
+    {
+        ScheduledTask& Task = isr_instance->Scheduled[i];
+
+        if (Task.IsRunning && !Task.IsWatchdogTripped && Task.Config.WatchdogUs != 0 &&
+            NowUs - Task.StartUs > Task.Config.WatchdogUs)
+        {
+            Task.IsWatchdogTripped = true;
+            Task.WatchdogTrips = Task.WatchdogTrips + 1;
+        }
+
+        if (Task.Countdown != 0)
+        {
+            Task.Countdown--;
+            continue;
+        }
+        Task.Countdown = Task.Config.RateDivider - 1;
+        Task.Releases = Task.Releases + 1;
+
+        if (Task.IsRunning || Task.IsReleasePending)
+        {
+            Task.DeadlineMisses = Task.DeadlineMisses + 1;
+            continue;
+        }
+        Task.IsReleasePending = true;
+        vTaskNotifyGiveFromISR(Task.Handle, &HigherPriorityTaskWoken);
+    }
+    portEXIT_CRITICAL_ISR(&isr_instance->ScheduleLock);
     
-    // Notify Task
-    if (isr_instance->CyclicTaskHandle != NULL) {
-        vTaskNotifyGiveFromISR(isr_instance->CyclicTaskHandle, &isr_instance->xHigherPriorityTaskWokenFalse);
+    // A period change lands on this boundary. The counter has only just reloaded, so the
+    // new alarm is still ahead of it and the next cycle is one new period from now.
+    portENTER_CRITICAL_ISR(&isr_instance->ScheduleLock);
+    if (isr_instance->IsPeriodChangePending)
+    {
+        gptimer_alarm_config_t Alarm = {};
+        Alarm.alarm_count = isr_instance->PendingAlarmTicks;
+        Alarm.reload_count = 0;
+        Alarm.flags.auto_reload_on_alarm = true;
+        gptimer_set_alarm_action(Timer, &Alarm);
+
+        isr_instance->CyclePeriodUs = isr_instance->PendingPeriodUs;
+        isr_instance->WatchdogPeriodUs = isr_instance->PendingWatchdogUs;
+        isr_instance->PeriodGeneration = isr_instance->PeriodGeneration + 1;
+        isr_instance->IsPeriodChangePending = false;
+        isr_instance->BaseAlarmTicks = isr_instance->PendingAlarmTicks;
+        isr_instance->PhaseTrimQ8 = 0;
+        isr_instance->TrimCarryQ8 = 0;
+        isr_instance->AppliedTrimTicks = 0;
     }
+    portEXIT_CRITICAL_ISR(&isr_instance->ScheduleLock);
 
-    portYIELD_FROM_ISR(isr_instance->xHigherPriorityTaskWokenFalse);  
-    return true;
+    // Phase lock trim for the cycle that has just started, the alarm is only touched when the whole ticks change
+    const int32_t TrimQ8 = isr_instance->PhaseTrimQ8;
+    if (TrimQ8 != 0 || isr_instance->AppliedTrimTicks != 0)
+    {
+        isr_instance->TrimCarryQ8 += TrimQ8;
+        int32_t Ticks = isr_instance->TrimCarryQ8 / 256;
+        if (isr_instance->TrimCarryQ8 < Ticks * 256) Ticks--;
+        isr_instance->TrimCarryQ8 -= Ticks * 256;
+
+        if (Ticks != isr_instance->AppliedTrimTicks)
+        {
+            gptimer_alarm_config_t Alarm = {};
+            Alarm.alarm_count = (uint64_t)((int64_t)isr_instance->BaseAlarmTicks + Ticks);
+            Alarm.reload_count = 0;
+            Alarm.flags.auto_reload_on_alarm = true;
+            gptimer_set_alarm_action(Timer, &Alarm);
+            isr_instance->AppliedTrimTicks = Ticks;
+        }
+    }
+
+    // Notify Task, there is none to wake when only the ISR function runs
+    if (isr_instance->CyclicTaskHandle != NULL && isr_instance->UserTask != nullptr) {
+        vTaskNotifyGiveFromISR(isr_instance->CyclicTaskHandle, &HigherPriorityTaskWoken);
+    }
+
+    // The driver yields on return
+    return HigherPriorityTaskWoken == pdTRUE;
 }
 
-bool IRAM_ATTR TimerClass::WatchdogISR(void* arg) 
+void IRAM_ATTR TimerClass::RunIsrTask(uint32_t FiredUs)
+{
+    // Start to start deviation, the ISR mode counterpart of the task's wake jitter
+    if (IsrTaskSequence != 0 && IsrSequence == IsrTaskSequence + 1 && PeriodGeneration == IsrTaskGeneration)
+    {
+        const int32_t Deviation = (int32_t)(FiredUs - LastIsrTaskUs - CyclePeriodUs);
+        IsrStartJitter.Record((uint32_t)(Deviation < 0 ? -Deviation : Deviation));
+    }
+    LastIsrTaskUs = FiredUs;
+    IsrTaskSequence = IsrSequence;
+    IsrTaskGeneration = PeriodGeneration;
+
+    IsrTask(NULL);
+    const uint32_t ElapsedUs = (uint32_t)esp_timer_get_time() - FiredUs;
+    IsrExecution.Record(ElapsedUs);
+
+    // Nothing can preempt an ISR, so a function that keeps running over budget is taken out
+    if (ElapsedUs <= IsrBudgetUs)
+    {
+        IsrBudgetStrikes = 0;
+        return;
+    }
+    IsrBudgetOverruns = IsrBudgetOverruns + 1;
+    if (++IsrBudgetStrikes >= TIMER_ISR_BUDGET_STRIKES)
+    {
+        IsrTask = nullptr;
+        IsIsrTaskDisabled = true;
+    }
+}
+
+bool IRAM_ATTR TimerClass::WatchdogISR(gptimer_handle_t Timer, const gptimer_alarm_event_data_t* Event, void* arg) 
 { 
     if (isr_instance == nullptr) return false;
+    BaseType_t HigherPriorityTaskWoken = pdFALSE;
 
     isr_instance->WatchdogISRCounter++;
 
     if (isr_instance->WatchdogTaskHandle != NULL) {
-        vTaskNotifyGiveFromISR(isr_instance->WatchdogTaskHandle, &isr_instance->xHigherPriorityTaskWokenTrue);
+        vTaskNotifyGiveFromISR(isr_instance->WatchdogTaskHandle, &HigherPriorityTaskWoken);
     }
 
-    portYIELD_FROM_ISR(isr_instance->xHigherPriorityTaskWokenTrue); 
-    return true;
+    return HigherPriorityTaskWoken == pdTRUE;
 }
 
 void TimerClass::CyclicTask(void* pvParameters) 
@@ -91,24 +225,166 @@ void TimerClass::CyclicTask(void* pvParameters)
 
     while (true) 
     {
-        // Block until notified by ISR
-        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // A release missed during an overrun runs at once under CatchUp, otherwise block until notified by ISR
+        const bool IsCatchUp = self->CatchUpPending > 0;
+        if (IsCatchUp) self->CatchUpPending--;
+        else ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        const uint32_t WokeUs = (uint32_t)esp_timer_get_time();
+        const uint32_t FiredUs = self->IsrTimestampUs;
+        const uint32_t Sequence = self->IsrSequence;
+        const uint32_t Generation = self->PeriodGeneration;
 
         // esp_rom_printf("Woke\n"); 
 
-        if (self->AreTimersInitated && self->UserTask != nullptr)
+        // Degraded mode runs one release in TIMER_DEGRADED_DIVIDER
+        bool IsSkipped = false;
+        if (!IsCatchUp && self->IsDegraded)
         {
-            // Reset and start watchdog
-            timer_set_counter_value(WatchdogTimerGroup, WatchdogTimerIndex, 0);
-            timer_start(WatchdogTimerGroup, WatchdogTimerIndex);
+            self->DegradedPhase = (self->DegradedPhase + 1) % TIMER_DEGRADED_DIVIDER;
+            IsSkipped = self->DegradedPhase != 0;
+        }
+
+        if (self->AreTimersInitated && self->UserTask != nullptr && !IsSkipped)
+        {
+            const uint32_t PeriodUs = self->CyclePeriodUs;
+            const uint32_t DeadlineUs = FiredUs + (self->IsDegraded ? PeriodUs * TIMER_DEGRADED_DIVIDER : PeriodUs);
+
+            if (!IsCatchUp)
+            {
+                self->WakeLatency.Record(WokeUs - FiredUs);
+
+                // Interval jitter only between back to back cycles, a missed cycle is an overrun, not jitter
+                if (self->LastIsrSequence != 0 && Sequence == self->LastIsrSequence + 1 && Generation == self->LastGeneration)
+                {
+                    const int32_t Deviation = (int32_t)(FiredUs - self->LastIsrTimestampUs - PeriodUs);
+                    self->PeriodJitter.Record((uint32_t)(Deviation < 0 ? -Deviation : Deviation));
+                    const int32_t WakeDeviation = (int32_t)(WokeUs - self->LastWokeUs - PeriodUs);
+                    self->WakeJitter.Record((uint32_t)(WakeDeviation < 0 ? -WakeDeviation : WakeDeviation));
+                }
+            }
+
+            // Reset and start watchdog, with the new timeout if the period just changed
+            if (Generation != self->ArmedGeneration)
+            {
+                self->ArmedGeneration = Generation;
+                self->ArmWatchdog();
+            }
+            self->RunDeadlineUs = DeadlineUs;
+            self->RunWatchdogTrips = 0;
+            gptimer_set_raw_count(self->WatchdogTimer, 0);
+            gptimer_start(self->WatchdogTimer);
             
-            // Run user task
+            // Run user task, an injected stall counts as part of it
+            const uint32_t StartUs = (uint32_t)esp_timer_get_time();
             self->UserTask(NULL);
+            const uint32_t StallUs = self->InjectedOverrunUs;
+            if (StallUs != 0)
+            {
+                self->InjectedOverrunUs = 0;     // Taken first, a restart must not stall the new task too
+                esp_rom_delay_us(StallUs);
+            }
+            const uint32_t EndUs = (uint32_t)esp_timer_get_time();
             self->CyclicTaskCounter++;
 
             // Pause watchdog
-            timer_pause(WatchdogTimerGroup, WatchdogTimerIndex);
+            gptimer_stop(self->WatchdogTimer);
+
+            self->Execution.Record(EndUs - StartUs);
+
+            // Alarm to end of cycle, what the auto-tuner sizes the period from
+            if (self->IsTuneWindowReset)
+            {
+                self->TuneWindowMaxUs = 0;
+                self->TuneWindowCycles = 0;
+                self->IsTuneWindowReset = false;
+            }
+            if (!IsCatchUp && EndUs - FiredUs > self->TuneWindowMaxUs) self->TuneWindowMaxUs = EndUs - FiredUs;
+            self->TuneWindowCycles = self->TuneWindowCycles + 1;
+
+            // A catch-up cycle has no release of its own, so no slack
+            if (!IsCatchUp)
+            {
+                const int32_t SlackUs = (int32_t)(DeadlineUs - EndUs);
+                if (SlackUs < 0) self->HandleOverrun(DeadlineUs, EndUs);
+                else self->NoteOnTime(EndUs, EndUs - StartUs, PeriodUs);
+                self->Slack.Record(SlackUs > 0 ? (uint32_t)SlackUs : 0);
+            }
         }
+
+        self->LastIsrTimestampUs = FiredUs;
+        self->LastIsrSequence = Sequence;
+        self->LastWokeUs = WokeUs;
+        self->LastGeneration = Generation;
+    }
+}
+
+void TimerClass::HandleOverrun(uint32_t DeadlineUs, uint32_t EndUs)
+{
+    CycleOverruns = CycleOverruns + 1;
+    OverrunDuration.Record(EndUs - DeadlineUs);
+    CleanRuns = 0;
+
+    // Recovery is timed from the first deadline missed, further overruns on the way extend it
+    if (!IsRecovering)
+    {
+        RecoveryStartUs = DeadlineUs;
+        RecoveryPolicy = OverrunPolicy;
+        IsRecovering = true;
+    }
+
+    // Every release that came in during the overrun, taken here so none of them wakes the task late
+    const uint32_t Missed = ulTaskNotifyTake(pdTRUE, 0);
+    MissedReleases = MissedReleases + Missed;
+
+    switch (OverrunPolicy)
+    {
+        case TimerOverrunPolicy::CatchUp:
+        {
+            const uint32_t Runs = (Missed < TIMER_CATCH_UP_LIMIT) ? Missed : TIMER_CATCH_UP_LIMIT;
+            CatchUpPending = Runs;
+            CaughtUpReleases = CaughtUpReleases + Runs;
+            SkippedReleases = SkippedReleases + (Missed - Runs);
+            break;
+        }
+
+        case TimerOverrunPolicy::Degraded:
+            if (!IsDegraded)
+            {
+                DegradedPhase = 0;
+                IsDegraded = true;
+                DegradedEntries = DegradedEntries + 1;
+                ESP_LOGW(TAG, "Cyclic task overran by %lu us, running at 1/%lu rate",
+                         (unsigned long)(EndUs - DeadlineUs), (unsigned long)TIMER_DEGRADED_DIVIDER);
+            }
+            SkippedReleases = SkippedReleases + Missed;
+            break;
+
+        case TimerOverrunPolicy::SkipNext:
+        case TimerOverrunPolicy::Restart:
+        default:
+            SkippedReleases = SkippedReleases + Missed;
+            break;
+    }
+}
+
+void TimerClass::NoteOnTime(uint32_t EndUs, uint32_t ElapsedUs, uint32_t PeriodUs)
+{
+    if (IsDegraded)
+    {
+        // Back to the full rate once the task has fit a full period long enough
+        CleanRuns = (ElapsedUs <= PeriodUs) ? CleanRuns + 1 : 0;
+        if (CleanRuns < TIMER_DEGRADED_CLEAN_CYCLES) return;
+
+        CleanRuns = 0;
+        IsDegraded = false;
+        ESP_LOGI(TAG, "Cyclic task back to full rate");
+        return;
+    }
+
+    if (IsRecovering && CatchUpPending == 0)
+    {
+        Recovery[(uint8_t)RecoveryPolicy].Record(EndUs - RecoveryStartUs);
+        IsRecovering = false;
     }
 }
 
@@ -122,9 +398,21 @@ void TimerClass::WatchdogTask(void* pvParameters)
 
         if (self->AreTimersInitated)
         {
+            const uint32_t TripUs = (uint32_t)esp_timer_get_time();
+            self->WatchdogTrips = self->WatchdogTrips + 1;
+            self->RunWatchdogTrips = self->RunWatchdogTrips + 1;
+
+            // Still running but not yet hung, let the cycle finish and leave it to the overrun policy
+            if (self->OverrunPolicy != TimerOverrunPolicy::Restart && self->RunWatchdogTrips < RestartAfterTrips)
+            {
+                self->ArmWatchdog();
+                self->WatchdogTaskCounter++;
+                continue;
+            }
+
             ESP_LOGE(TAG, "Watchdog Triggered! Resetting Cyclic Task.");
 
-            timer_pause(WatchdogTimerGroup, WatchdogTimerIndex);
+            gptimer_stop(self->WatchdogTimer);
 
             // Re-create cyclic task
             if (self->CyclicTaskHandle != NULL) {
@@ -132,6 +420,18 @@ void TimerClass::WatchdogTask(void* pvParameters)
                 self->CyclicTaskHandle = NULL;
             }
 
+            // The cyclic task is gone, so its overrun records are ours until it is back
+            self->CycleOverruns = self->CycleOverruns + 1;
+            self->CycleRestarts = self->CycleRestarts + 1;
+            self->OverrunDuration.Record(TripUs - self->RunDeadlineUs);
+            self->CatchUpPending = 0;
+            if (!self->IsRecovering)
+            {
+                self->RecoveryStartUs = self->RunDeadlineUs;
+                self->RecoveryPolicy = self->OverrunPolicy;
+                self->IsRecovering = true;
+            }
+
             self->CyclicTaskHandle = xTaskCreateStaticPinnedToCore
             (
                 CyclicTask,                
@@ -144,13 +444,293 @@ void TimerClass::WatchdogTask(void* pvParameters)
                 self->CoreToRunCyclicTask
             );
 
-            timer_set_counter_value(WatchdogTimerGroup, WatchdogTimerIndex, 0);
+            self->ArmWatchdog();
+            self->WatchdogTaskCounter++;
+        }
+    }
+}
+
+void TimerClass::ArmWatchdog()
+{
+    // A one shot alarm is spent once it fires, so it is set again every time
+    gptimer_alarm_config_t Alarm = {};
+    Alarm.alarm_count = TicksFromUs(WatchdogPeriodUs);
+    gptimer_set_raw_count(WatchdogTimer, 0);
+    gptimer_set_alarm_action(WatchdogTimer, IsWatchdogEnabled ? &Alarm : NULL);
+}
+
+void TimerClass::AutoTuneCallback(void* arg)
+{
+    TimerClass* self = (TimerClass*)arg;
+
+    // Take the window and start the next one, the cyclic task clears it on its next cycle
+    const uint32_t WorstUs = self->TuneWindowMaxUs;
+    const uint32_t Cycles = self->TuneWindowCycles;
+    self->IsTuneWindowReset = true;
+    self->TuneWorstResponseUs = WorstUs;
+    if (!self->IsAutoTuneEnabled || Cycles < TIMER_AUTOTUNE_MIN_CYCLES || self->IsPeriodChangePending) return;
+
+    // Worst alarm to end time plus the margin, on a coarse grid so noise does not move it every window
+    uint64_t TargetUs = (uint64_t)WorstUs * (100 + self->TuneMarginPercent) / 100;
+    TargetUs = (TargetUs + TIMER_AUTOTUNE_STEP_US - 1) / TIMER_AUTOTUNE_STEP_US * TIMER_AUTOTUNE_STEP_US;
+    if (TargetUs < self->TuneMinPeriodUs) TargetUs = self->TuneMinPeriodUs;
+    if (TargetUs > self->TuneMaxPeriodUs) TargetUs = self->TuneMaxPeriodUs;
+
+    // Slow down at once, speed up only after TIMER_AUTOTUNE_STABLE_WINDOWS agree, and by a quarter at most
+    const uint32_t PeriodUs = self->CyclePeriodUs;
+    uint32_t NextUs = PeriodUs;
+    if (TargetUs > PeriodUs)
+    {
+        NextUs = (uint32_t)TargetUs;
+        self->TuneStableWindows = 0;
+    }
+    else if (TargetUs < PeriodUs && ++self->TuneStableWindows >= TIMER_AUTOTUNE_STABLE_WINDOWS)
+    {
+        const uint32_t FloorUs = PeriodUs - PeriodUs / 4;
+        NextUs = (TargetUs > FloorUs) ? (uint32_t)TargetUs : FloorUs;
+        self->TuneStableWindows = 0;
+    }
+    else if (TargetUs == PeriodUs)
+    {
+        self->TuneStableWindows = 0;
+    }
+    if (NextUs == PeriodUs) return;
+
+    // The watchdog keeps its configured ratio to the period
+    const uint32_t WatchdogUs = (uint32_t)((uint64_t)NextUs * WatchdogPeriodInUs / CyclicPeriodInUs);
+    if (self->SetCyclePeriod(NextUs, WatchdogUs))
+    {
+        self->TuneChanges = self->TuneChanges + 1;
+        ESP_LOGI(TAG, "Auto-tune: worst response %lu us, period %lu -> %lu us",
+                 (unsigned long)WorstUs, (unsigned long)PeriodUs, (unsigned long)NextUs);
+    }
+}
+
+void TimerClass::PhaseLockCallback(void* arg)
+{
+    TimerClass* self = (TimerClass*)arg;
+    self->UpdatePhaseLock();
+}
+
+void TimerClass::UpdatePhaseLock()
+{
+    bool (*Reference)(int64_t, uint32_t&, uint32_t&) = PhaseReference;
+    if (Reference == nullptr || !AreTimersInitated) return;
+
+    // One measurement per alarm, a period longer than the update interval leaves some updates with nothing new
+    const uint32_t Sequence = IsrSequence;
+    const uint32_t FiredUs = IsrTimestampUs;
+    if (Sequence == PhaseSequence) return;
+    PhaseSequence = Sequence;
+    PhaseUpdates = PhaseUpdates + 1;
+
+    // The ISR only keeps the low 32 bits of the alarm time
+    const int64_t NowUs = esp_timer_get_time();
+    const int64_t AlarmUs = NowUs - (int64_t)(uint32_t)((uint32_t)NowUs - FiredUs);
+
+    uint32_t PeriodUs = 0, PhaseUs = 0;
+    if (!Reference(AlarmUs, PeriodUs, PhaseUs) || PeriodUs < TIMER_MIN_PERIOD_US)
+    {
+        // Keep the rate, drop the phase pull, it was steering towards a boundary we can no longer see
+        PhaseNoReference = PhaseNoReference + 1;
+        if (PhaseState == TimerPhaseLockState::Locked)
+        {
+            PhaseLockLosses = PhaseLockLosses + 1;
+            ESP_LOGW(TAG, "Phase lock lost, no reference, holding the rate trim");
+        }
+        if (PhaseState != TimerPhaseLockState::Off) PhaseState = TimerPhaseLockState::Holdover;
+        PhaseInWindow = 0;
+        PhaseTrimUs = RateTrimUs;
+        PhaseTrimQ8 = (int32_t)(PhaseTrimUs * (float)GetTimerFrequency() / 1000000.0f * 256.0f);
+        return;
+    }
+    ReferencePeriodUs = PeriodUs;
+
+    // The reference sets the period, the change lands on a cycle boundary and the loop starts over on it
+    if (PeriodUs != CyclePeriodUs)
+    {
+        const uint32_t WatchdogUs = (uint32_t)((uint64_t)PeriodUs * WatchdogPeriodUs / CyclePeriodUs);
+        if (!IsPeriodChangePending && SetCyclePeriod(PeriodUs, WatchdogUs))
+        {
+            PhasePeriodChanges = PhasePeriodChanges + 1;
+            ESP_LOGI(TAG, "Phase lock: period %lu -> %lu us from the reference", (unsigned long)CyclePeriodUs, (unsigned long)PeriodUs);
+        }
+        return;
+    }
+    if (PhaseGeneration != PeriodGeneration)
+    {
+        PhaseGeneration = PeriodGeneration;
+        RateTrimUs = 0.0f;
+        PhaseInWindow = 0;
+        if (PhaseState == TimerPhaseLockState::Locked) PhaseLockLosses = PhaseLockLosses + 1;
+        PhaseState = TimerPhaseLockState::Acquiring;
+    }
+
+    // Nearest boundary, positive if the alarm came after it
+    int32_t ErrorUs = (int32_t)PhaseUs;
+    if (PhaseUs > PeriodUs / 2) ErrorUs -= (int32_t)PeriodUs;
+    PhaseErrorUs = ErrorUs;
+
+    // Late alarms shorten the cycles ahead. The trim is spread over the cycles until the next update.
+    const uint32_t CyclesPerUpdate = (uint32_t)((uint64_t)TIMER_PHASE_LOCK_UPDATE_MS * 1000 / PeriodUs);
+    const float Spread = (float)(CyclesPerUpdate > 0 ? CyclesPerUpdate : 1);
+    const float MaxRateUs = (float)PeriodUs * TIMER_PHASE_LOCK_MAX_PPM / 1000000.0f;
+    const float MaxTrimUs = (float)(PeriodUs / TIMER_PHASE_LOCK_MAX_TRIM_DIVIDER);
+    RateTrimUs -= TIMER_PHASE_LOCK_KI * (float)ErrorUs / Spread;
+    if (RateTrimUs > MaxRateUs) RateTrimUs = MaxRateUs;
+    if (RateTrimUs < -MaxRateUs) RateTrimUs = -MaxRateUs;
+
+    float TrimUs = RateTrimUs - TIMER_PHASE_LOCK_KP * (float)ErrorUs / Spread;
+    if (TrimUs > MaxTrimUs) TrimUs = MaxTrimUs;
+    if (TrimUs < -MaxTrimUs) TrimUs = -MaxTrimUs;
+    PhaseTrimUs = TrimUs;
+
+    float TrimQ8 = TrimUs * (float)GetTimerFrequency() / 1000000.0f * 256.0f;
+    if (TrimQ8 > (float)(INT32_MAX / 2)) TrimQ8 = (float)(INT32_MAX / 2);
+    if (TrimQ8 < (float)(INT32_MIN / 2)) TrimQ8 = (float)(INT32_MIN / 2);
+    PhaseTrimQ8 = (int32_t)TrimQ8;
+
+    // Lock needs a run of updates inside the window, one update far outside loses it
+    const uint32_t Magnitude = (uint32_t)(ErrorUs < 0 ? -ErrorUs : ErrorUs);
+    if (PhaseState == TimerPhaseLockState::Locked)
+    {
+        PhaseError.Record(Magnitude);
+        if (Magnitude > TIMER_PHASE_UNLOCK_US)
+        {
+            PhaseState = TimerPhaseLockState::Acquiring;
+            PhaseInWindow = 0;
+            PhaseLockLosses = PhaseLockLosses + 1;
+            ESP_LOGW(TAG, "Phase lock lost, error %ld us", (long)ErrorUs);
+        }
+        return;
+    }
+
+    PhaseState = TimerPhaseLockState::Acquiring;
+    PhaseInWindow = (Magnitude <= TIMER_PHASE_LOCK_WINDOW_US) ? PhaseInWindow + 1 : 0;
+    if (PhaseInWindow >= TIMER_PHASE_LOCK_COUNT)
+    {
+        PhaseState = TimerPhaseLockState::Locked;
+        PhaseLocks = PhaseLocks + 1;
+        ESP_LOGI(TAG, "Phase locked, error %ld us, rate trim %.1f ppm", (long)ErrorUs, RateTrimUs * 1000000.0f / (float)PeriodUs);
+    }
+}
+
+void TimerClass::ScheduledTaskLoop(void* pvParameters)
+{
+    ScheduledTask* Task = (ScheduledTask*)pvParameters;
+
+    while (true)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // Running is set before pending clears, so CyclicISR never sees an idle task mid run
+        Task->IsWatchdogTripped = false;
+        Task->StartUs = (uint32_t)esp_timer_get_time();
+        Task->IsRunning = true;
+        Task->IsReleasePending = false;
+
+        Task->Config.Function(Task->Config.Argument);
+
+        const uint32_t ElapsedUs = (uint32_t)esp_timer_get_time() - Task->StartUs;
+        Task->IsRunning = false;
+        Task->Runs = Task->Runs + 1;
+        Task->Execution.Record(ElapsedUs);
+
+        if (Task->Config.BudgetUs != 0 && ElapsedUs > Task->Config.BudgetUs)
+        {
+            Task->BudgetOverruns = Task->BudgetOverruns + 1;
+        }
+        if (Task->IsWatchdogTripped)
+        {
+            ESP_LOGW(TAG, "Scheduled task %s ran %lu us, watchdog is %lu us",
+                     Task->Config.Name, (unsigned long)ElapsedUs, (unsigned long)Task->Config.WatchdogUs);
+        }
+    }
+}
+
+uint32_t TimerClass::PlanPhase(const TimerTaskConfig& Config, uint32_t& PeakLoadUs) const
+{
+    // Harmonic rates line up again after the largest divider, so one hyperperiod covers every alignment.
+    // An unbudgeted task weighs 1 us, enough to keep such tasks apart.
+    auto Weight = [](const TimerTaskConfig& Task) { return Task.BudgetUs != 0 ? Task.BudgetUs : 1u; };
+
+    uint32_t Hyperperiod = Config.RateDivider;
+    for (uint8_t i = 0; i < ScheduledCount; i++)
+    {
+        if (Scheduled[i].Config.RateDivider > Hyperperiod) Hyperperiod = Scheduled[i].Config.RateDivider;
+    }
 
-            if (self->IsWatchdogEnabled)
+    std::vector<uint32_t> Load(Hyperperiod, 0);
+    for (uint8_t i = 0; i < ScheduledCount; i++)
+    {
+        for (uint32_t t = Scheduled[i].Config.Phase; t < Hyperperiod; t += Scheduled[i].Config.RateDivider)
+        {
+            Load[t] += Weight(Scheduled[i].Config);
+        }
+    }
+
+    // Lowest peak wins, then the least total load under the task, then the earliest phase
+    const bool IsAuto = Config.Phase == TIMER_PHASE_AUTO;
+    const uint32_t First = IsAuto ? 0 : Config.Phase;
+    const uint32_t Last = IsAuto ? Config.RateDivider - 1 : Config.Phase;
+    uint32_t BestPhase = First;
+    uint32_t BestPeak = UINT32_MAX;
+    uint64_t BestSum = UINT64_MAX;
+
+    for (uint32_t Phase = First; Phase <= Last; Phase++)
+    {
+        uint32_t Peak = 0;
+        uint64_t Sum = 0;
+        for (uint32_t t = Phase; t < Hyperperiod; t += Config.RateDivider)
+        {
+            if (Load[t] + Weight(Config) > Peak) Peak = Load[t] + Weight(Config);
+            Sum += Load[t];
+        }
+
+        if (Peak < BestPeak || (Peak == BestPeak && Sum < BestSum))
+        {
+            BestPhase = Phase;
+            BestPeak = Peak;
+            BestSum = Sum;
+        }
+    }
+
+    // Periods the new task does not run in can still hold the peak
+    PeakLoadUs = BestPeak;
+    for (uint32_t t = 0; t < Hyperperiod; t++)
+    {
+        if (Load[t] > PeakLoadUs) PeakLoadUs = Load[t];
+    }
+    return BestPhase;
+}
+
+void TimerClass::RankPriorities()
+{
+    // Rate monotonic, one priority step below the top per distinct faster rate
+    for (uint8_t i = 0; i < ScheduledCount; i++)
+    {
+        ScheduledTask& Task = Scheduled[i];
+        if (Task.Config.Priority != 0) continue;
+
+        UBaseType_t Rank = 0;
+        for (uint8_t j = 0; j < ScheduledCount; j++)
+        {
+            const uint32_t Divider = Scheduled[j].Config.RateDivider;
+            if (Divider >= Task.Config.RateDivider) continue;
+
+            bool IsCounted = false;
+            for (uint8_t k = 0; k < j; k++)
             {
-                timer_set_alarm(WatchdogTimerGroup, WatchdogTimerIndex, TIMER_ALARM_EN);
+                if (Scheduled[k].Config.RateDivider == Divider) IsCounted = true;
             }
-            self->WatchdogTaskCounter++;
+            if (!IsCounted) Rank++;
+        }
+
+        const UBaseType_t Priority = (Rank < TIMER_SCHEDULED_TOP_PRIORITY) ? TIMER_SCHEDULED_TOP_PRIORITY - Rank : 1;
+        if (Priority != Task.Priority)
+        {
+            Task.Priority = Priority;
+            vTaskPrioritySet(Task.Handle, Priority);
         }
     }
 }
@@ -200,18 +780,18 @@ bool TimerClass::SetupCyclicTask(void (*TaskToRun)(void*), uint8_t CoreToUse)
     );
 
     // Call internal setup
-    bool Success = SetupTimer(CycleTimeMs, WatchdogTimeMs, Prescalar);
+    bool Success = SetupTimer(CyclePeriodUs, WatchdogPeriodUs, Prescalar);
 
     if (Success) this->IsSetupDone = true;
     return Success;
 }
 
-bool TimerClass::SetupTimer(float CycleTimeInMs, float WatchdogTime, uint16_t Prescalar)
+bool TimerClass::SetupTimer(uint32_t PeriodUs, uint32_t WatchdogUs, uint16_t Prescalar)
 {
     ESP_LOGI(TAG, "SetupTimer Executed!");
 
-    this->CycleTimeMs = CycleTimeInMs;
-    this->WatchdogTimeMs = WatchdogTime;
+    this->CyclePeriodUs = PeriodUs;
+    this->WatchdogPeriodUs = WatchdogUs;
     this->Prescalar = Prescalar;
 
     // Ensure task exists before starting timer
@@ -220,67 +800,425 @@ bool TimerClass::SetupTimer(float CycleTimeInMs, float WatchdogTime, uint16_t Pr
         return false;
     }
 
+    // Both timers tick at the APB clock over the prescaler
+    gptimer_config_t TimerConfig = {};
+    TimerConfig.clk_src = GPTIMER_CLK_SRC_DEFAULT;
+    TimerConfig.direction = GPTIMER_COUNT_UP;
+    TimerConfig.resolution_hz = 80000000 / this->Prescalar;
+
     // Configure Cyclic Timer
-    timer_config_t CyclicConfig = {
-        .alarm_en = TIMER_ALARM_DIS,       // Alarm is enabled later
-        .counter_en = TIMER_START,
-        .intr_type = TIMER_INTR_LEVEL,
-        .counter_dir = TIMER_COUNT_UP,
-        .auto_reload = TIMER_AUTORELOAD_EN,
-        .clk_src = TIMER_SRC_CLK_APB,
-        .divider = (uint32_t)this->Prescalar // Cast to ensure correct type
-    };
-
-    ESP_ERROR_CHECK(timer_init(CyclicTimerGroup, CyclicTimerIndex, &CyclicConfig));
-    
+    ESP_ERROR_CHECK(gptimer_new_timer(&TimerConfig, &this->CyclicTimer));
+
     // Calculate alarm value (ticks)
-    uint64_t alarm_val = (80000000.0 / this->Prescalar) * (this->CycleTimeMs / 1000.0);
-    ESP_ERROR_CHECK(timer_set_alarm_value(CyclicTimerGroup, CyclicTimerIndex, alarm_val));
-    
-    // Enable Interrupts
-    ESP_ERROR_CHECK(timer_enable_intr(CyclicTimerGroup, CyclicTimerIndex));
-    
+    uint64_t alarm_val = TicksFromUs(this->CyclePeriodUs);
+    gptimer_alarm_config_t CyclicAlarm = {};
+    CyclicAlarm.alarm_count = alarm_val;
+    CyclicAlarm.reload_count = 0;
+    CyclicAlarm.flags.auto_reload_on_alarm = true;
+    ESP_ERROR_CHECK(gptimer_set_alarm_action(this->CyclicTimer, &CyclicAlarm));
+    this->BaseAlarmTicks = alarm_val;
+
     // Link ISR
-    ESP_ERROR_CHECK(timer_isr_callback_add(CyclicTimerGroup, CyclicTimerIndex, CyclicISR, NULL, ESP_INTR_FLAG_IRAM));
-    
-    // Start Timer
-    ESP_ERROR_CHECK(timer_start(CyclicTimerGroup, CyclicTimerIndex));
-    
-    // Enable Alarm Action
-    ESP_ERROR_CHECK(timer_set_alarm(CyclicTimerGroup, CyclicTimerIndex, TIMER_ALARM_EN));
-
-    // Configure Watchdog Timer
-    timer_config_t WatchdogConfig = {
-        .alarm_en = TIMER_ALARM_EN,
-        .counter_en = TIMER_PAUSE,         // Starts paused
-        .intr_type = TIMER_INTR_LEVEL,
-        .counter_dir = TIMER_COUNT_UP,
-        .auto_reload = TIMER_AUTORELOAD_DIS,
-        .clk_src = TIMER_SRC_CLK_APB,
-        .divider = (uint32_t)this->Prescalar
-    };
-
-    ESP_ERROR_CHECK(timer_init(WatchdogTimerGroup, WatchdogTimerIndex, &WatchdogConfig));
-    
-    uint64_t wd_alarm_val = (80000000.0 / this->Prescalar) * (this->WatchdogTimeMs / 1000.0);
-    ESP_ERROR_CHECK(timer_set_alarm_value(WatchdogTimerGroup, WatchdogTimerIndex, wd_alarm_val));
-    
-    ESP_ERROR_CHECK(timer_enable_intr(WatchdogTimerGroup, WatchdogTimerIndex));
-    ESP_ERROR_CHECK(timer_isr_callback_add(WatchdogTimerGroup, WatchdogTimerIndex, WatchdogISR, NULL, ESP_INTR_FLAG_IRAM));
+    gptimer_event_callbacks_t CyclicCallbacks = {};
+    CyclicCallbacks.on_alarm = CyclicISR;
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(this->CyclicTimer, &CyclicCallbacks, NULL));
+    ESP_ERROR_CHECK(gptimer_enable(this->CyclicTimer));
+
+    // Configure Watchdog Timer, one shot and paused until a cycle starts it
+    ESP_ERROR_CHECK(gptimer_new_timer(&TimerConfig, &this->WatchdogTimer));
+
+    gptimer_event_callbacks_t WatchdogCallbacks = {};
+    WatchdogCallbacks.on_alarm = WatchdogISR;
+    ESP_ERROR_CHECK(gptimer_register_event_callbacks(this->WatchdogTimer, &WatchdogCallbacks, NULL));
+    ESP_ERROR_CHECK(gptimer_enable(this->WatchdogTimer));
+    ArmWatchdog();
 
     // Mark as ready so the task loop can proceed
     this->AreTimersInitated = true;
 
+    // Start Timer
+    ESP_ERROR_CHECK(gptimer_start(this->CyclicTimer));
+
+#ifdef CONFIG_ESP_CYCLIC_AUTOTUNE
+    SetAutoTune(true, AutoTuneMarginPercent, AutoTuneMinPeriodUs, CyclicPeriodInUs);
+#endif
+
     ESP_LOGI(TAG, "SetupTimer Successful! Alarm Value: %llu", alarm_val);
     return true;
 }
 
+void TimerClass::GetCycleStats(TimerCycleStats& Stats, bool ResetAfterRead)
+{
+    Stats.WakeLatency = WakeLatency.Snapshot(ResetAfterRead);
+    Stats.Execution = Execution.Snapshot(ResetAfterRead);
+    Stats.Slack = Slack.Snapshot(ResetAfterRead);
+    Stats.PeriodJitter = PeriodJitter.Snapshot(ResetAfterRead);
+    Stats.WakeJitter = WakeJitter.Snapshot(ResetAfterRead);
+    Stats.Overruns = CycleOverruns;
+    Stats.PeriodUs = CyclePeriodUs;
+    Stats.WatchdogTimeoutUs = WatchdogPeriodUs;
+}
+
+bool TimerClass::RegisterTask(const TimerTaskConfig& Config)
+{
+    const uint8_t Index = ScheduledCount;
+
+    if (Config.Function == nullptr || Config.RateDivider == 0 || Config.RateDivider > TIMER_MAX_RATE_DIVIDER)
+    {
+        ESP_LOGE(TAG, "RegisterTask needs a function and a divider of 1 to %lu", (unsigned long)TIMER_MAX_RATE_DIVIDER);
+        return false;
+    }
+    if (Config.Phase != TIMER_PHASE_AUTO && Config.Phase >= Config.RateDivider)
+    {
+        ESP_LOGE(TAG, "RegisterTask phase %lu is outside divider %lu", (unsigned long)Config.Phase, (unsigned long)Config.RateDivider);
+        return false;
+    }
+    if (Index >= TIMER_MAX_SCHEDULED_TASKS)
+    {
+        ESP_LOGE(TAG, "RegisterTask table full (%u tasks)", TIMER_MAX_SCHEDULED_TASKS);
+        return false;
+    }
+    for (uint8_t i = 0; i < Index; i++)
+    {
+        const uint32_t Other = Scheduled[i].Config.RateDivider;
+        if (Other % Config.RateDivider != 0 && Config.RateDivider % Other != 0)
+        {
+            ESP_LOGE(TAG, "RegisterTask divider %lu is not harmonic with %s (%lu)",
+                     (unsigned long)Config.RateDivider, Scheduled[i].Config.Name, (unsigned long)Other);
+            return false;
+        }
+    }
+
+    uint32_t PeakLoadUs = 0;
+    ScheduledTask& Task = Scheduled[Index];
+    Task.Config = Config;
+    Task.Config.Phase = PlanPhase(Config, PeakLoadUs);
+    if (Task.Config.Name == nullptr) Task.Config.Name = "Scheduled Task";
+    if (Task.Config.StackSize == 0) Task.Config.StackSize = TIMER_SCHEDULED_STACK_SIZE;
+    Task.Priority = (Config.Priority == 0 || Config.Priority > TIMER_SCHEDULED_TOP_PRIORITY) ? TIMER_SCHEDULED_TOP_PRIORITY : Config.Priority;
+
+    // Pinned with the cyclic task, blocks until its first release
+    if (xTaskCreatePinnedToCore(&TimerClass::ScheduledTaskLoop, Task.Config.Name, Task.Config.StackSize,
+                                &Task, Task.Priority, &Task.Handle, CoreToRunCyclicTask) != pdPASS)
+    {
+        ESP_LOGE(TAG, "RegisterTask could not create %s", Task.Config.Name);
+        Task.Handle = NULL;
+        return false;
+    }
+
+    // First release at the next period congruent to the phase, counted from the ISR sequence
+    portENTER_CRITICAL(&ScheduleLock);
+    const uint32_t NextSequence = IsrSequence + 1;
+    Task.Countdown = (Task.Config.Phase + Task.Config.RateDivider - NextSequence % Task.Config.RateDivider) % Task.Config.RateDivider;
+    ScheduledCount = Index + 1;
+    portEXIT_CRITICAL(&ScheduleLock);
+
+    RankPriorities();
+    PlannedPeakLoadUs = PeakLoadUs;
+
+    ESP_LOGI(TAG, "Scheduled %s every %lu periods, phase %lu, priority %u, planned peak %lu us",
+             Task.Config.Name, (unsigned long)Task.Config.RateDivider, (unsigned long)Task.Config.Phase,
+             (unsigned)Task.Priority, (unsigned long)PeakLoadUs);
+    return true;
+}
+
+bool TimerClass::GetScheduledTaskStats(uint8_t Index, TimerTaskStats& Stats, bool ResetAfterRead)
+{
+    if (Index >= ScheduledCount) return false;
+
+    ScheduledTask& Task = Scheduled[Index];
+    Stats.Name = Task.Config.Name;
+    Stats.RateDivider = Task.Config.RateDivider;
+    Stats.Phase = Task.Config.Phase;
+    Stats.Priority = Task.Priority;
+    Stats.BudgetUs = Task.Config.BudgetUs;
+    Stats.Execution = Task.Execution.Snapshot(ResetAfterRead);
+    Stats.Releases = Task.Releases;
+    Stats.Runs = Task.Runs;
+    Stats.DeadlineMisses = Task.DeadlineMisses;
+    Stats.BudgetOverruns = Task.BudgetOverruns;
+    Stats.WatchdogTrips = Task.WatchdogTrips;
+    return true;
+}
+
+bool TimerClass::SetCyclePeriod(uint32_t PeriodUs, uint32_t WatchdogUs)
+{
+    if (PeriodUs < TIMER_MIN_PERIOD_US || WatchdogUs == 0 || (IsrTask != nullptr && IsrBudgetUs >= PeriodUs))
+    {
+        ESP_LOGE(TAG, "SetCyclePeriod rejected %lu us, watchdog %lu us", (unsigned long)PeriodUs, (unsigned long)WatchdogUs);
+        return false;
+    }
+
+    // Before the timer runs there is no boundary to wait for
+    if (!AreTimersInitated)
+    {
+        CyclePeriodUs = PeriodUs;
+        WatchdogPeriodUs = WatchdogUs;
+        return true;
+    }
+
+    // CyclicISR swaps all of it in at the next alarm, a second call before then replaces the first
+    portENTER_CRITICAL(&ScheduleLock);
+    PendingPeriodUs = PeriodUs;
+    PendingWatchdogUs = WatchdogUs;
+    PendingAlarmTicks = TicksFromUs(PeriodUs);
+    IsPeriodChangePending = true;
+    portEXIT_CRITICAL(&ScheduleLock);
+    return true;
+}
+
+bool TimerClass::SetAutoTune(bool Enabled, uint32_t MarginPercent, uint32_t MinPeriodUs, uint32_t MaxPeriodUs)
+{
+    if (Enabled && PhaseReference != nullptr)
+    {
+        ESP_LOGE(TAG, "SetAutoTune: the phase reference owns the period, remove it first");
+        return false;
+    }
+
+    TuneMarginPercent = MarginPercent;
+    TuneMinPeriodUs = (MinPeriodUs < TIMER_MIN_PERIOD_US) ? TIMER_MIN_PERIOD_US : MinPeriodUs;
+    TuneMaxPeriodUs = (MaxPeriodUs < TuneMinPeriodUs) ? TuneMinPeriodUs : MaxPeriodUs;
+    TuneStableWindows = 0;
+    IsAutoTuneEnabled = Enabled;
+
+    if (Enabled && AutoTuneTimer == nullptr)
+    {
+        esp_timer_create_args_t Args = {};
+        Args.callback = &TimerClass::AutoTuneCallback;
+        Args.arg = this;
+        Args.name = "CycleAutoTune";
+        if (esp_timer_create(&Args, &AutoTuneTimer) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Auto-tune timer could not be created");
+            IsAutoTuneEnabled = false;
+            return false;
+        }
+        esp_timer_start_periodic(AutoTuneTimer, (uint64_t)TIMER_AUTOTUNE_WINDOW_MS * 1000);
+    }
+    ESP_LOGI(TAG, "Auto-tune %s, margin %lu%%, period %lu to %lu us", Enabled ? "on" : "off",
+             (unsigned long)MarginPercent, (unsigned long)TuneMinPeriodUs, (unsigned long)TuneMaxPeriodUs);
+    return true;
+}
+
+void TimerClass::GetAutoTuneStats(TimerAutoTuneStats& Stats) const
+{
+    Stats.IsEnabled = IsAutoTuneEnabled;
+    Stats.PeriodUs = CyclePeriodUs;
+    Stats.WatchdogUs = WatchdogPeriodUs;
+    Stats.WorstResponseUs = TuneWorstResponseUs;
+    Stats.MinPeriodUs = TuneMinPeriodUs;
+    Stats.MaxPeriodUs = TuneMaxPeriodUs;
+    Stats.Changes = TuneChanges;
+}
+
+bool TimerClass::SetPhaseReference(bool (*Reference)(int64_t LocalUs, uint32_t& PeriodUs, uint32_t& PhaseUs))
+{
+    if (Reference != nullptr && IsAutoTuneEnabled)
+    {
+        ESP_LOGE(TAG, "SetPhaseReference: the auto-tuner owns the period, turn it off first");
+        return false;
+    }
+
+    if (Reference != nullptr && PhaseLockTimer == nullptr)
+    {
+        esp_timer_create_args_t Args = {};
+        Args.callback = &TimerClass::PhaseLockCallback;
+        Args.arg = this;
+        Args.name = "CyclePhaseLock";
+        if (esp_timer_create(&Args, &PhaseLockTimer) != ESP_OK)
+        {
+            ESP_LOGE(TAG, "Phase lock timer could not be created");
+            return false;
+        }
+        esp_timer_start_periodic(PhaseLockTimer, (uint64_t)TIMER_PHASE_LOCK_UPDATE_MS * 1000);
+    }
+
+    // The callback reads the reference once per update, the trim goes back to the bare period without one
+    PhaseReference = Reference;
+    PhaseTrimQ8 = 0;
+    RateTrimUs = 0.0f;
+    PhaseTrimUs = 0.0f;
+    PhaseInWindow = 0;
+    PhaseGeneration = PeriodGeneration;
+    PhaseSequence = IsrSequence;
+    PhaseState = (Reference != nullptr) ? TimerPhaseLockState::Acquiring : TimerPhaseLockState::Off;
+    ESP_LOGI(TAG, "Phase lock %s", (Reference != nullptr) ? "on" : "off");
+    return true;
+}
+
+void TimerClass::GetPhaseLockStats(TimerPhaseLockStats& Stats, bool ResetAfterRead)
+{
+    Stats.State = PhaseState;
+    Stats.PhaseErrorUs = PhaseErrorUs;
+    Stats.PhaseError = PhaseError.Snapshot(ResetAfterRead);
+    Stats.RateTrimPpm = (CyclePeriodUs != 0) ? RateTrimUs * 1000000.0f / (float)CyclePeriodUs : 0.0f;
+    Stats.TrimUs = PhaseTrimUs;
+    Stats.ReferencePeriodUs = ReferencePeriodUs;
+    Stats.Updates = PhaseUpdates;
+    Stats.Locks = PhaseLocks;
+    Stats.LockLosses = PhaseLockLosses;
+    Stats.NoReference = PhaseNoReference;
+    Stats.PeriodChanges = PhasePeriodChanges;
+}
+
+int64_t TimerClass::GetCycleStartUs() const
+{
+    // The ISR only keeps the low 32 bits, the alarm was less than 71 minutes ago
+    const int64_t NowUs = esp_timer_get_time();
+    return NowUs - (int64_t)(uint32_t)((uint32_t)NowUs - IsrTimestampUs);
+}
+
+bool TimerClass::SetupCyclicIsr(void (*IsrFunction)(void*), uint32_t BudgetUs)
+{
+    if (IsrFunction == nullptr || BudgetUs == 0 || BudgetUs >= CyclePeriodUs)
+    {
+        ESP_LOGE(TAG, "SetupCyclicIsr needs a function and a budget below the %lu us period", (unsigned long)CyclePeriodUs);
+        return false;
+    }
+
+    // The function pointer goes last, CyclicISR calls it from the next alarm on
+    IsrBudgetUs = BudgetUs;
+    IsrBudgetStrikes = 0;
+    IsIsrTaskDisabled = false;
+    IsrTask = IsrFunction;
+    ESP_LOGI(TAG, "ISR mode function installed, budget %lu us", (unsigned long)BudgetUs);
+    return true;
+}
+
+void TimerClass::GetIsrStats(TimerIsrStats& Stats, bool ResetAfterRead)
+{
+    Stats.Execution = IsrExecution.Snapshot(ResetAfterRead);
+    Stats.StartJitter = IsrStartJitter.Snapshot(ResetAfterRead);
+    Stats.BudgetUs = IsrBudgetUs;
+    Stats.BudgetOverruns = IsrBudgetOverruns;
+    Stats.IsInstalled = IsrTask != nullptr;
+    Stats.IsDisabled = IsIsrTaskDisabled;
+}
+
+bool TimerClass::BenchmarkIsrJitter(const uint32_t* PeriodsUs, uint8_t Count, uint32_t DurationMs, TimerJitterBenchmark* Results)
+{
+    if (!AreTimersInitated || UserTask == nullptr) return false;
+
+    // Both modes run off the same alarms, the probe only stands in if no ISR function is installed
+    const uint32_t SavedPeriodUs = CyclePeriodUs;
+    const uint32_t SavedWatchdogUs = WatchdogPeriodUs;
+    const uint32_t SavedBudgetUs = IsrBudgetUs;
+    const bool IsProbing = IsrTask == nullptr;
+    const bool WasAutoTuned = IsAutoTuneEnabled;
+    IsAutoTuneEnabled = false;
+    bool (*SavedReference)(int64_t, uint32_t&, uint32_t&) = PhaseReference;
+    if (SavedReference != nullptr) SetPhaseReference(nullptr);
+    if (IsProbing)
+    {
+        IsrBudgetUs = TIMER_MIN_PERIOD_US / 2;
+        IsrTask = IsrProbe;
+    }
+
+    for (uint8_t i = 0; i < Count; i++)
+    {
+        Results[i] = {};
+        Results[i].PeriodUs = PeriodsUs[i];
+        if (!SetCyclePeriod(PeriodsUs[i], SavedWatchdogUs)) continue;
+        vTaskDelay(pdMS_TO_TICKS(20));          // Let the change land and the first cycles pass
+
+        IsrStartJitter.Snapshot(true);
+        WakeJitter.Snapshot(true);
+        const uint32_t OverrunsBefore = CycleOverruns;
+        vTaskDelay(pdMS_TO_TICKS(DurationMs));
+
+        const CycleHistogramSnapshot Isr = IsrStartJitter.Snapshot(false);
+        const CycleHistogramSnapshot Task = WakeJitter.Snapshot(false);
+        Results[i].IsrJitterP999Us = Isr.PercentileUs(0.999f);
+        Results[i].IsrJitterMaxUs = Isr.MaxUs;
+        Results[i].TaskJitterP999Us = Task.PercentileUs(0.999f);
+        Results[i].TaskJitterMaxUs = Task.MaxUs;
+        Results[i].TaskOverruns = CycleOverruns - OverrunsBefore;
+        ESP_LOGI(TAG, "%lu us period: ISR jitter p99.9 %lu us max %lu us, task jitter p99.9 %lu us max %lu us, %lu task overruns",
+                 (unsigned long)PeriodsUs[i], (unsigned long)Results[i].IsrJitterP999Us, (unsigned long)Results[i].IsrJitterMaxUs,
+                 (unsigned long)Results[i].TaskJitterP999Us, (unsigned long)Results[i].TaskJitterMaxUs,
+                 (unsigned long)Results[i].TaskOverruns);
+    }
+
+    SetCyclePeriod(SavedPeriodUs, SavedWatchdogUs);
+    if (IsProbing)
+    {
+        IsrTask = nullptr;
+        IsrBudgetUs = SavedBudgetUs;
+    }
+    IsAutoTuneEnabled = WasAutoTuned;
+    if (SavedReference != nullptr) SetPhaseReference(SavedReference);
+    return true;
+}
+
+void TimerClass::GetOverrunStats(TimerOverrunStats& Stats, bool ResetAfterRead)
+{
+    Stats.Policy = OverrunPolicy;
+    Stats.IsDegraded = IsDegraded;
+    Stats.MissedReleases = MissedReleases;
+    Stats.SkippedReleases = SkippedReleases;
+    Stats.CaughtUpReleases = CaughtUpReleases;
+    Stats.DegradedEntries = DegradedEntries;
+    Stats.WatchdogTrips = WatchdogTrips;
+    Stats.Restarts = CycleRestarts;
+    Stats.Duration = OverrunDuration.Snapshot(ResetAfterRead);
+    for (uint8_t i = 0; i < TIMER_OVERRUN_POLICY_COUNT; i++)
+    {
+        Stats.Recovery[i] = Recovery[i].Snapshot(ResetAfterRead);
+    }
+}
+
+bool TimerClass::BenchmarkOverrunPolicies(uint32_t OverrunUs, uint8_t Repeats, TimerOverrunBenchmark (&Results)[TIMER_OVERRUN_POLICY_COUNT])
+{
+    if (!AreTimersInitated || UserTask == nullptr) return false;
+
+    const TimerOverrunPolicy Saved = OverrunPolicy;
+    const uint32_t PeriodUs = CyclePeriodUs;
+    const uint32_t WatchdogUs = WatchdogPeriodUs;
+    const TickType_t Timeout = pdMS_TO_TICKS(2000);
+
+    for (uint8_t p = 0; p < TIMER_OVERRUN_POLICY_COUNT; p++)
+    {
+        const TimerOverrunPolicy Policy = (TimerOverrunPolicy)p;
+        OverrunPolicy = Policy;
+        Recovery[p].Snapshot(true);
+
+        // Restart only acts on a hung task, so that policy gets a stall past the watchdog
+        uint32_t StallUs = (OverrunUs > PeriodUs) ? OverrunUs : PeriodUs + 1;
+        if (Policy == TimerOverrunPolicy::Restart && StallUs <= WatchdogUs) StallUs = WatchdogUs + PeriodUs;
+
+        for (uint8_t r = 0; r < Repeats; r++)
+        {
+            // Start each stall from a settled loop
+            TickType_t Start = xTaskGetTickCount();
+            while ((IsRecovering || IsDegraded) && xTaskGetTickCount() - Start < Timeout) vTaskDelay(pdMS_TO_TICKS(10));
+
+            const uint32_t Before = Recovery[p].Snapshot(false).Count;
+            InjectedOverrunUs = StallUs;
+
+            Start = xTaskGetTickCount();
+            while (Recovery[p].Snapshot(false).Count == Before && xTaskGetTickCount() - Start < Timeout) vTaskDelay(pdMS_TO_TICKS(10));
+        }
+
+        const CycleHistogramSnapshot Window = Recovery[p].Snapshot(false);
+        Results[p].Policy = Policy;
+        Results[p].Samples = Window.Count;
+        Results[p].MedianUs = Window.PercentileUs(0.5f);
+        Results[p].MaxUs = Window.MaxUs;
+        ESP_LOGI(TAG, "Overrun policy %u: %lu recoveries from a %lu us stall, median %lu us, max %lu us",
+                 p, (unsigned long)Window.Count, (unsigned long)StallUs,
+                 (unsigned long)Results[p].MedianUs, (unsigned long)Results[p].MaxUs);
+    }
+
+    OverrunPolicy = Saved;
+    return true;
+}
+
 void TimerClass::SetWatchdogOnOff(bool Enabled)
 {
     this->IsWatchdogEnabled = Enabled;
-    if (this->IsWatchdogEnabled) {
-        timer_set_alarm(WatchdogTimerGroup, WatchdogTimerIndex, TIMER_ALARM_EN);
-    } else {
-        timer_set_alarm(WatchdogTimerGroup, WatchdogTimerIndex, TIMER_ALARM_DIS);
-    }
+    if (this->WatchdogTimer == nullptr) return;
+
+    gptimer_alarm_config_t Alarm = {};
+    Alarm.alarm_count = TicksFromUs(WatchdogPeriodUs);
+    gptimer_set_alarm_action(WatchdogTimer, this->IsWatchdogEnabled ? &Alarm : NULL);
 }
\ No newline at end of file
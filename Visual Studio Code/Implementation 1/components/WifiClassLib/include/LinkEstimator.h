@@ -0,0 +1,178 @@
+#ifndef LinkEstimator_H
+#define LinkEstimator_H
+
+// Author - Ben Sturdy
+// Per-neighbour link quality for the mesh. One entry per live link (parent and
+// children), fed by per-link sequence gaps, echo round trips and RSSI, and
+// smoothed with an EWMA. Expected transmission count (ETX) combines the loss
+// in both directions, so a link that only fails one way still scores badly.
+
+#include "freertos/FreeRTOS.h"
+#include <cstddef>
+#include <cstdint>
+
+static const size_t LINK_TABLE_SIZE = 12;          // Parent + the SoftAP station limit, with a spare
+static const float LINK_EWMA_ALPHA = 0.125f;       // Weight of a new sample
+static const float LINK_ETX_MAX = 100.0f;          // Reported for a link that delivers nothing
+static const uint16_t LINK_MAX_SEQUENCE_GAP = 64;  // Larger gaps are a neighbour reboot, not loss
+static const int64_t LINK_MAX_DELIVERY_US = 1000000; // Longer is a sender without mesh time, not a slow link
+
+
+
+// Payload of a heartbeat, and the same pair in the header of every other packet.
+// The ratio tells the neighbour how much of its own packet stream reaches us,
+// which is its forward delivery ratio.
+#pragma pack(push, 1)
+struct MeshHeartbeatPayload
+{
+    uint16_t Sequence;            // Per link, counts packets actually sent
+    uint8_t  RxRatioQ8;           // Our delivery ratio of the receiver's packets, 255 = 100%
+};
+
+struct MeshEchoPayload
+{
+    uint64_t SentUs;              // Sender's clock, returned unchanged in the reply
+};
+#pragma pack(pop)
+
+
+
+struct LinkQuality
+{
+    uint32_t Ip;                  // Neighbour IPv4, network order
+    uint64_t Uid;                 // Learned from its heartbeats, 0 until the first one
+    uint8_t  Mac[6];              // Parent BSSID or child STA MAC
+    bool     IsParent;
+
+    float    Etx;                 // 1 / (forward * reverse delivery), 1.0 is a perfect link
+    float    LossRate;            // Reverse direction, from link sequence gaps
+    float    ForwardDelivery;     // As reported back by the neighbour
+    float    RttUs;               // Echo round trip
+    float    DeliveryUs;          // Child's data, its mesh time stamp to our receive, grows with contention and MAC retries
+    uint32_t MaxDeliveryUs;
+    float    RssiDbm;
+
+    uint32_t HeartbeatsReceived;  // Heartbeats and sequenced data alike
+    uint32_t HeartbeatsMissed;
+    uint32_t EchoesSent;
+    uint32_t EchoesAnswered;
+    int64_t  LastUpdateUs;
+
+    // Internal
+    bool     IsActive;
+    bool     HasRxSequence;
+    bool     HasRtt;
+    bool     HasRssi;
+    bool     HasDelivery;
+    uint16_t LastRxSequence;
+    uint16_t TxSequence;
+    float    ReverseDelivery;
+};
+
+
+
+class LinkEstimator
+{
+    private:
+        LinkQuality Links[LINK_TABLE_SIZE]{};
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+
+        int FindByIp(uint32_t Ip) const;
+        int FindByMac(const uint8_t Mac[6]) const;
+        static void UpdateEtx(LinkQuality& Link);
+        static bool OnSequence(LinkQuality& Link, const MeshHeartbeatPayload& Payload);
+
+
+
+    public:
+
+        /**
+         * @brief Start tracking a link. An existing entry for the same IP or MAC is reset.
+         * @param Ip Neighbour IPv4 in network order.
+         * @param Mac Parent BSSID or child STA MAC.
+         * @param IsParent True for the upstream link.
+         * @return void.
+         */
+        void AddLink(uint32_t Ip, const uint8_t Mac[6], bool IsParent);
+
+
+
+        /**
+         * @brief Stop tracking a link.
+         */
+        void RemoveLinkByMac(const uint8_t Mac[6]);
+        void RemoveParent();
+
+
+
+        /**
+         * @brief Fill in the heartbeat for one link: the next sequence number and our delivery ratio of the neighbour's packets.
+         *        Also used to stamp the header of any other packet sent on the link, they share one sequence.
+         * @param Ip Destination IPv4 in network order.
+         * @param Payload Heartbeat to fill in.
+         * @return bool: False if the link is not tracked, the payload is then filled with defaults.
+         */
+        bool PrepareHeartbeat(uint32_t Ip, MeshHeartbeatPayload& Payload);
+
+
+
+        /**
+         * @brief Feed a heartbeat received on a link. Sequence gaps count as lost heartbeats.
+         */
+        void OnHeartbeat(uint32_t Ip, uint64_t Uid, const MeshHeartbeatPayload& Payload);
+
+
+
+        /**
+         * @brief Feed the link sequence from the header of any other packet, so a link busy enough to
+         *        suppress its heartbeats keeps its loss and ETX estimates moving. The UID is not learned,
+         *        a forwarded packet carries its originator's.
+         */
+        void OnLinkSequence(uint32_t Ip, const MeshHeartbeatPayload& Sample);
+
+
+
+        /**
+         * @brief Record an echo request sent on a link, and the reply when it comes back.
+         */
+        void OnEchoSent(uint32_t Ip);
+        void OnEchoReply(uint32_t Ip, int64_t RttUs);
+
+
+
+        /**
+         * @brief Feed the one hop delivery time of a packet the neighbour sent, both ends on mesh time.
+         * @param Ip Neighbour IPv4 in network order.
+         * @param DelayUs Our mesh time at receive minus the packet's senderTimestampUs. Out of range samples are ignored.
+         * @return void.
+         */
+        void OnDelivery(uint32_t Ip, int64_t DelayUs);
+
+
+
+        /**
+         * @brief Feed an RSSI sample (scan result, vendor IE or SoftAP station list).
+         */
+        void OnRssi(const uint8_t Mac[6], int8_t Rssi);
+
+
+
+        /**
+         * @brief Copy out the link to a neighbour by UID, or the parent link.
+         * @return bool: True if the link was found.
+         */
+        bool GetLinkByUid(uint64_t Uid, LinkQuality& Out) const;
+        bool GetParentLink(LinkQuality& Out) const;
+
+
+
+        /**
+         * @brief Copy out all tracked links.
+         * @param Out Buffer for the links.
+         * @param MaxLinks Number of entries Out can hold.
+         * @return size_t: The number of links written.
+         */
+        size_t GetLinks(LinkQuality* Out, size_t MaxLinks) const;
+};
+
+#endif
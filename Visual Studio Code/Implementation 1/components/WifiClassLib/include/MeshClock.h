@@ -0,0 +1,231 @@
+#ifndef MeshClock_H
+#define MeshClock_H
+
+// Author - Ben Sturdy
+// Mesh-wide time, synchronised hop by hop from the master. Each node runs a
+// two-way exchange with its parent (NTP style: four timestamps, offset and
+// path delay from one round trip), keeps the lowest-delay sample of the last
+// few, and steers a local model of offset and drift with a PI loop. Mesh time
+// is the master's clock in microseconds, so every node, and the master's PLC,
+// share one time base. A node answers its children from its own model, so the
+// error of each hop adds to the one above it and is measured per hop.
+//
+// The master also sends cycle markers down the mesh, giving its cycle as a
+// grid on mesh time. From them a node knows which master cycle any local time
+// falls in and where in it, which is what the cyclic timer locks its phase to.
+
+#include "freertos/FreeRTOS.h"
+#include <cstddef>
+#include <cstdint>
+
+static const size_t MESH_CLOCK_FILTER_SAMPLES = 8;     // Exchanges the minimum-delay filter picks from
+static const uint8_t MESH_CLOCK_STRATUM_NONE = 255;    // Not synchronised, the reply is not to be used
+static const uint32_t MESH_CLOCK_STEP_US = 1000;       // A larger residual steps the clock instead of slewing it
+static const float MESH_CLOCK_KP = 0.5f;               // Share of a residual taken out at once
+static const float MESH_CLOCK_KI = 0.1f;               // Share of a residual's rate added to the drift
+static const float MESH_CLOCK_MAX_DRIFT_PPM = 200.0f;  // Crystal tolerance of both ends, with margin
+static const float MESH_CLOCK_JITTER_ALPHA = 0.125f;   // Weight of a new residual in the jitter estimate
+static const uint32_t MESH_CLOCK_HOLDOVER_MS = 10000;  // Without a usable sample for this long the node stops claiming sync
+static const uint32_t MESH_CYCLE_MARKER_TIMEOUT_MS = 10000; // Without a marker for this long the master's cycle is not known
+
+
+
+// Payload of a time sync request and its reply. The requester fills in
+// RequestSentUs from its local clock, the responder the rest from mesh time.
+#pragma pack(push, 1)
+struct MeshTimeSyncPayload
+{
+    uint64_t RequestSentUs;       // T1, requester's local clock, returned unchanged
+    uint64_t RequestReceivedUs;   // T2, responder's mesh time
+    uint64_t ReplySentUs;         // T3, responder's mesh time
+    uint8_t  Stratum;             // Responder's hops below the master, MESH_CLOCK_STRATUM_NONE if not synchronised
+    uint8_t  Reserved;
+    uint16_t ErrorUs;             // Responder's own estimated error against the master, saturates
+};
+#pragma pack(pop)
+
+
+
+// Payload of a cycle marker. The master's cycle N starts at mesh time
+// CycleStartUs + (N - CycleNumber) * PeriodUs, for any N.
+#pragma pack(push, 1)
+struct MeshCycleMarker
+{
+    uint64_t CycleNumber;
+    uint64_t CycleStartUs;        // Mesh time CycleNumber started at
+    uint32_t PeriodUs;
+};
+#pragma pack(pop)
+
+
+
+struct MeshClockStats
+{
+    bool     IsSynced;
+    uint8_t  Stratum;             // 1 below the master, MESH_CLOCK_STRATUM_NONE if not synchronised
+    int64_t  OffsetUs;            // Mesh time - local time, at the last update
+    float    DriftPpm;            // Local clock rate error, positive if it runs slow
+
+    uint32_t LastDelayUs;         // Round trip minus the responder's hold time
+    uint32_t MinDelayUs;          // Of the filter window
+    int32_t  LastResidualUs;      // Measured offset against the model, the per hop sync error
+    uint32_t JitterUs;            // EWMA of |residual|
+    uint32_t MaxResidualUs;       // Largest slewed residual, steps excluded
+    uint32_t AsymmetryBoundUs;    // Half the minimum delay, worst case for an asymmetric path
+    uint32_t UpstreamErrorUs;     // As reported by the parent
+    uint32_t ErrorUs;             // Upstream error + this hop's jitter, what we report to our children
+
+    uint32_t RequestsSent;
+    uint32_t RepliesReceived;
+    uint32_t RepliesRejected;     // Stale, unsynchronised responder or negative delay
+    uint32_t SamplesApplied;      // Picked by the filter and fed to the loop
+    uint32_t Steps;
+    int64_t  LastSyncUs;          // Local time of the last applied sample, 0 if never
+
+    uint32_t CyclePeriodUs;       // Master's cycle from the last marker, 0 before the first
+    uint32_t CycleMarkers;
+    uint32_t CycleMarkersRejected; // Zero period
+};
+
+
+
+class MeshClock
+{
+    private:
+
+        struct Sample
+        {
+            int64_t  LocalUs;     // T4
+            int64_t  OffsetUs;
+            uint32_t DelayUs;
+        };
+
+        // Offset and drift model, mesh = local + OffsetUs + DriftPpm * (local - AnchorUs)
+        int64_t OffsetUs = 0;
+        int64_t AnchorUs = 0;
+        float DriftPpm = 0.0f;
+        bool HasModel = false;
+
+        Sample Window[MESH_CLOCK_FILTER_SAMPLES]{};
+        size_t WindowCount = 0;
+        size_t WindowNext = 0;
+        int64_t LastUsedUs = 0;    // T4 of the last applied sample, the filter never goes back in time
+
+        uint64_t PendingRequestUs = 0;
+        float Jitter = 0.0f;
+
+        MeshCycleMarker Marker{};
+        int64_t MarkerLocalUs = 0;  // When the last marker arrived, 0 if never
+
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+        MeshClockStats Stats{};
+
+        int64_t ModelOffsetUs(int64_t LocalUs) const;
+        bool IsSyncedAt(int64_t LocalUs) const;
+        void Apply(const Sample& Selected);
+
+
+
+    public:
+
+        /**
+         * @brief Convert a local esp_timer time to mesh time. Before the first sync mesh time is local time.
+         * @param LocalUs Local time in microseconds, from esp_timer_get_time().
+         * @return int64_t: Mesh time in microseconds.
+         */
+        int64_t MeshFromLocalUs(int64_t LocalUs) const;
+
+
+
+        /**
+         * @brief Convert a mesh time to the local esp_timer time it will happen at, for timers that must fire at a mesh time.
+         * @param MeshUs Mesh time in microseconds.
+         * @return int64_t: Local time in microseconds.
+         */
+        int64_t LocalFromMeshUs(int64_t MeshUs) const;
+
+
+
+        /**
+         * @brief Check if the clock follows a synchronised parent and its last sample is within MESH_CLOCK_HOLDOVER_MS.
+         * @return bool: True if mesh time can be used to align with other nodes.
+         */
+        bool IsSynced() const;
+
+
+
+        /**
+         * @brief Get the current mesh time.
+         * @return int64_t: The master's clock in microseconds, as estimated on this node.
+         */
+        int64_t GetMeshTimeUs() const;
+
+
+
+        /**
+         * @brief Fill in a request to the parent and remember it, only the reply to the latest request is used.
+         * @param Request Payload to send.
+         * @return void.
+         */
+        void PrepareRequest(MeshTimeSyncPayload& Request);
+
+
+
+        /**
+         * @brief Answer a child's request from this node's clock.
+         * @param Request Payload as received.
+         * @param ReceivedLocalUs Local time the request arrived.
+         * @param Reply Filled with the answer, ReplySentUs is taken last so it is as close to the send as possible.
+         * @return void.
+         */
+        void PrepareReply(const MeshTimeSyncPayload& Request, int64_t ReceivedLocalUs, MeshTimeSyncPayload& Reply) const;
+
+
+
+        /**
+         * @brief Feed the parent's reply into the filter and steer the clock if it picks a new sample.
+         * @param Reply Payload as received.
+         * @param ReceivedLocalUs Local time the reply arrived (T4).
+         * @return bool: True if the reply was accepted into the filter.
+         */
+        bool OnReply(const MeshTimeSyncPayload& Reply, int64_t ReceivedLocalUs);
+
+
+
+        /**
+         * @brief Take the master's cycle grid from a marker, the newest one replaces the last.
+         * @param NewMarker Payload as received.
+         * @return bool: False if the period is zero.
+         */
+        bool OnCycleMarker(const MeshCycleMarker& NewMarker);
+
+
+
+        /**
+         * @brief Find the master's cycle a local time falls in.
+         * @param LocalUs Local time in microseconds.
+         * @param Cycle Master's cycle number.
+         * @param PhaseUs Time since that cycle started, 0 to PeriodUs - 1.
+         * @param PeriodUs Master's cycle period.
+         * @return bool: False if the clock is not synchronised or no marker came in the last MESH_CYCLE_MARKER_TIMEOUT_MS.
+         */
+        bool GetCycleAt(int64_t LocalUs, uint64_t& Cycle, uint32_t& PhaseUs, uint32_t& PeriodUs) const;
+
+
+
+        /**
+         * @brief Forget the filter window after a parent change, the new path has a different delay. The model is kept.
+         * @return void.
+         */
+        void OnParentChanged();
+
+
+
+        /**
+         * @brief Get the offset, drift, per hop error and exchange counters.
+         * @return MeshClockStats: A copy of the statistics.
+         */
+        MeshClockStats GetStats() const;
+};
+
+#endif
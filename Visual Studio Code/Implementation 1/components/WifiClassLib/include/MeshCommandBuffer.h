@@ -0,0 +1,105 @@
+#ifndef MeshCommandBuffer_H
+#define MeshCommandBuffer_H
+
+// Author - Ben Sturdy
+// Time-triggered actuation. A command from the master can name the master
+// cycle it is to take effect in, instead of whenever it happens to arrive.
+// Each node holds such commands here, in order of that cycle, and the cyclic
+// task takes them out in exactly that cycle. Commands to several nodes then
+// act together whatever each node's hop distance, as long as the master's
+// lead covers the slowest path. Only the low 32 bits of the cycle number go
+// on the wire; comparisons are wrap-aware, so the lead must stay well under
+// 2^31 cycles.
+
+#include "freertos/FreeRTOS.h"
+#include <cstddef>
+#include <cstdint>
+
+static const size_t MESH_COMMAND_BUFFER_DEPTH = 8;       // Commands waiting for their cycle, past this the one furthest ahead is dropped
+static const size_t MESH_COMMAND_MAX_PAYLOAD = 256;      // UDP_PACKET_SIZE, a larger command is refused
+static const uint32_t MESH_COMMAND_MAX_LEAD_CYCLES = 6000; // A minute at the default 10 ms period, further ahead is taken as a stale number
+static const uint32_t MESH_COMMAND_IMMEDIATE = 0;        // Apply cycle of a command that acts on arrival
+
+
+
+struct MeshCommand
+{
+    uint32_t ApplyCycle;                  // Low 32 bits of the master's cycle
+    uint8_t  PacketType;
+    bool     IsLate;                      // Handed out after its cycle, it arrived too late or the cyclic task missed the cycle
+    bool     IsUnscheduled;               // Handed out without a known master cycle, at once
+    uint16_t Length;
+    uint8_t  Data[MESH_COMMAND_MAX_PAYLOAD];
+};
+
+
+
+struct MeshCommandStats
+{
+    uint32_t Held;
+    uint32_t Applied;                     // In the cycle they named
+    uint32_t AppliedLate;
+    uint32_t Unscheduled;                 // Released at once, this node did not know the master's cycle
+    uint32_t ArrivedLate;                 // Their cycle had already started on arrival
+    uint32_t TooEarly;                    // More than MESH_COMMAND_MAX_LEAD_CYCLES ahead, refused
+    uint32_t Overflows;                   // Buffer full, the command furthest ahead was refused
+    uint32_t Oversized;
+
+    uint8_t  Depth;
+    uint8_t  MaxDepth;
+    int32_t  LastLeadCycles;              // Cycles to spare on arrival, negative if late
+    int32_t  MinLeadCycles;               // The master's lead must stay above the worst path, this is how close it came
+};
+
+
+
+class MeshCommandBuffer
+{
+    private:
+
+        MeshCommand Entries[MESH_COMMAND_BUFFER_DEPTH]{};
+        bool IsUsed[MESH_COMMAND_BUFFER_DEPTH]{};
+        uint8_t Order[MESH_COMMAND_BUFFER_DEPTH]{};     // Indices of the used entries, earliest apply cycle first
+        uint8_t Count = 0;
+        bool HasLead = false;                          // MinLeadCycles is valid
+
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+        MeshCommandStats Stats{};
+
+
+
+    public:
+
+        /**
+         * @brief Hold a command until its cycle. Commands for the same cycle keep their arrival order.
+         * @param ApplyCycle Low 32 bits of the master's cycle to act in, not MESH_COMMAND_IMMEDIATE.
+         * @param PacketType Packet type from the header.
+         * @param Payload Command payload, after the header.
+         * @param Length Number of bytes in Payload.
+         * @param IsCycleKnown False if this node does not know the master's cycle yet, the lead is then not checked.
+         * @param NowCycle Low 32 bits of the master's cycle now.
+         * @return bool: False if the command is too large, too far ahead or the buffer is full.
+         */
+        bool Hold(uint32_t ApplyCycle, uint8_t PacketType, const uint8_t* Payload, size_t Length, bool IsCycleKnown, uint32_t NowCycle);
+
+
+
+        /**
+         * @brief Take the earliest command whose cycle has come. Call once per cycle until it returns false.
+         * @param IsCycleKnown False if this node does not know the master's cycle, every command is then released at once.
+         * @param NowCycle Low 32 bits of the master's cycle the cyclic task is running.
+         * @param Out Filled with the command.
+         * @return bool: True if a command was taken.
+         */
+        bool TakeDue(bool IsCycleKnown, uint32_t NowCycle, MeshCommand& Out);
+
+
+
+        /**
+         * @brief Get the hold, release and lateness counters and the lead the commands arrived with.
+         * @return MeshCommandStats: A copy of the statistics.
+         */
+        MeshCommandStats GetStats() const;
+};
+
+#endif
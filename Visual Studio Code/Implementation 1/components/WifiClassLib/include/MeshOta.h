@@ -0,0 +1,198 @@
+#ifndef MeshOta_H
+#define MeshOta_H
+
+// Author - Ben Sturdy
+// Firmware update through the mesh. The image is streamed down the tree as
+// CRC-checked chunks, once per link (every relay writes a chunk to its own
+// inactive OTA partition and passes the same packet to its children), so the
+// transfer time does not grow with the number of nodes. A bitmap of received
+// chunks survives link loss and reboots; the sender polls the bitmaps and
+// resends only the chunks some node is still missing.
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+#include "esp_partition.h"
+#include <cstddef>
+#include <cstdint>
+
+static const uint16_t MESH_OTA_CHUNK_SIZE = 1024;          // Largest chunk, keeps a chunk packet inside one UDP datagram and one SLIP frame
+static const uint16_t MESH_OTA_MAX_CHUNKS = 1024;          // 1 MB image, one app slot of the two OTA partition table
+static const size_t MESH_OTA_BITMAP_SIZE = MESH_OTA_MAX_CHUNKS / 8;
+static const size_t MESH_OTA_QUEUE_LENGTH = 8;             // Chunks waiting for flash, more are dropped and repaired later
+static const uint16_t MESH_OTA_SAVE_INTERVAL = 32;         // Chunks between saves of the bitmap to NVS
+static const uint32_t MESH_OTA_STATUS_PERIOD_MS = 10000;   // Unsolicited status while a transfer is incomplete
+static const uint32_t MESH_OTA_STATUS_SPREAD_MS = 2000;    // Replies to a poll are spread by UID over this window
+static const uint32_t MESH_OTA_MAGIC = 0x4D4F5432;         // "MOT2", bump when MeshOtaResume changes
+
+
+
+// Payloads, the PacketHeader in front of them carries the packet type
+#pragma pack(push, 1)
+struct MeshOtaBegin
+{
+    uint32_t ImageId;             // Identifies the transfer, the sender uses the image CRC
+    uint32_t ImageSize;
+    uint32_t ImageCrc;            // CRC32 (zlib) of the whole image
+    uint16_t ChunkSize;
+    uint16_t ChunkCount;
+};
+
+struct MeshOtaChunkHeader
+{
+    uint32_t ImageId;
+    uint16_t Index;
+    uint16_t Length;
+    uint32_t Crc;                 // CRC32 (zlib) of the chunk data that follows
+};
+
+struct MeshOtaCommit
+{
+    uint32_t ImageId;
+    uint16_t RestartDelayMs;      // Time to pass the commit on before restarting
+};
+
+struct MeshOtaStatusHeader
+{
+    uint32_t ImageId;
+    uint16_t ChunkCount;
+    uint16_t ReceivedCount;
+    uint8_t  State;               // MeshOtaState
+};                                // Followed by (ChunkCount + 7) / 8 bitmap bytes, bit set = chunk stored
+#pragma pack(pop)
+
+
+
+enum class MeshOtaState : uint8_t
+{
+    Idle = 0,
+    Erasing = 1,
+    Receiving = 2,
+    Complete = 3,                 // Every chunk stored and the image CRC matches
+    Committed = 4,                // Boot partition switched, restarting
+    Installed = 5,                // Running this image already
+    Disabled = 6                  // Root gateway, forwards the image but keeps its own firmware
+};
+
+
+
+struct MeshOtaStats
+{
+    MeshOtaState State;
+    uint32_t ImageId;
+    uint16_t ChunkCount;
+    uint16_t ReceivedCount;
+    uint32_t ChunksDropped;       // Queue full, left for the repair round
+    uint32_t CrcFailures;
+    uint32_t WriteFailures;
+    uint32_t VerifyFailures;      // Whole image CRC mismatch, the transfer restarts
+    uint32_t StatusSent;
+};
+
+
+
+class MeshOta
+{
+    private:
+
+        enum class ItemType : uint8_t
+        {
+            Begin,
+            Chunk,
+            Commit
+        };
+
+        struct QueueItem
+        {
+            ItemType Type;
+            uint16_t Length;
+            uint8_t Data[sizeof(MeshOtaChunkHeader) + MESH_OTA_CHUNK_SIZE];
+        };
+
+        // Persisted as one NVS blob, so a reboot mid-transfer resumes instead of starting over
+        struct MeshOtaResume
+        {
+            uint32_t Magic;
+            MeshOtaBegin Begin;
+            uint16_t ReceivedCount;
+            uint8_t Bitmap[MESH_OTA_BITMAP_SIZE];
+        };
+
+        static void OtaTask(void* pvParameters);
+        TaskHandle_t OtaTaskHandle = nullptr;
+        QueueHandle_t ItemQueue = nullptr;
+        QueueItem StagingItem{};  // Filled by the one receive task that feeds the queue, keeps 1 KB off its stack
+
+        bool (*StatusSender)(const uint8_t* Payload, size_t Length) = nullptr;
+        void (*BeforeRestart)() = nullptr;
+
+        const esp_partition_t* UpdatePartition = nullptr;
+        MeshOtaResume Transfer{};
+        uint32_t InstalledImageId = 0;
+        uint16_t ChunksSinceSave = 0;
+        uint64_t NodeUid = 0;
+        int64_t NextStatusUs = 0;
+        bool IsEnabled = true;
+        bool IsRuntimeLoggingEnabled = false;
+
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+        MeshOtaStats Stats{};
+
+        bool Enqueue(ItemType Type, const uint8_t* Data, size_t Length);
+        void HandleBegin(const MeshOtaBegin& Begin);
+        void HandleChunk(const uint8_t* Data, size_t Length);
+        void HandleCommit(const MeshOtaCommit& Commit);
+        bool EraseForTransfer();
+        bool VerifyImage();
+        void SendStatus();
+        void ScheduleStatus(uint32_t WithinMs);
+        void SetState(MeshOtaState State);
+        void LoadResume();
+        void SaveResume();
+
+
+
+    public:
+
+        /**
+         * @brief Start the flash writer task and resume an interrupted transfer from NVS.
+         * @param CoreToUse Core for the writer task.
+         * @param Uid This node's UID, spreads status replies.
+         * @param Sender Sends a status payload upstream wrapped in a PACKET_TYPE_OTA_STATUS packet.
+         * @param OnRestart Called just before the restart into the new image, may be nullptr.
+         * @param EnableRuntimeLogging Log progress.
+         * @return bool: True if the task is running.
+         */
+        bool Start(uint8_t CoreToUse, uint64_t Uid, bool (*Sender)(const uint8_t* Payload, size_t Length),
+                   void (*OnRestart)(), bool EnableRuntimeLogging);
+
+
+
+        /**
+         * @brief Forward the image but never install it. Used on the root gateway, which is wired to the host and flashed there.
+         * @return void.
+         */
+        void Disable();
+
+
+
+        /**
+         * @brief Queue an OTA packet payload for the writer task. Called from the receive path, never blocks.
+         * @param Data Payload of the packet.
+         * @param Length Number of bytes in Data.
+         * @return bool: False if the payload is malformed or the queue is full.
+         */
+        bool OnBegin(const uint8_t* Data, size_t Length) { return Enqueue(ItemType::Begin, Data, Length); }
+        bool OnChunk(const uint8_t* Data, size_t Length) { return Enqueue(ItemType::Chunk, Data, Length); }
+        bool OnCommit(const uint8_t* Data, size_t Length) { return Enqueue(ItemType::Commit, Data, Length); }
+
+
+
+        /**
+         * @brief Get the progress of the current transfer.
+         * @return MeshOtaStats: A copy of the statistics.
+         */
+        MeshOtaStats GetStats() const;
+};
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef MeshTdma_H
+#define MeshTdma_H
+
+// Author - Ben Sturdy
+// Slotted transmission for cyclic data. The cycle is cut into equal slots in
+// mesh time and each node sends its own packets only inside its slot, so
+// neighbours on one channel stop contending for the air every time their
+// cycles fire together. Slots are given from tree position and UID: deeper
+// hops go first, so a packet relayed towards the master reaches each parent
+// before that parent's own slot, and the UID spreads siblings across the
+// slots of their hop. Without a synchronised clock a slot cannot be found,
+// packets then go out at once as before.
+
+#include "freertos/FreeRTOS.h"
+#include "esp_timer.h"
+#include "MeshClock.h"
+#include <cstddef>
+#include <cstdint>
+
+static const size_t MESH_TDMA_MAX_PACKET = 320;        // Header + UDP_PACKET_SIZE payload + end delimiter, with margin
+static const size_t MESH_TDMA_QUEUE_DEPTH = 4;         // Packets held for the next slot, the oldest is dropped beyond this
+static const uint8_t MESH_TDMA_MAX_SLOTS = 64;
+static const uint8_t MESH_TDMA_HOP_GROUPS = 4;         // Slot groups by hop count, hop 4 and deeper share the first
+static const uint32_t MESH_TDMA_MIN_GUARD_US = 20;     // Guard at each end of a slot, grows with the clock error
+static const uint32_t MESH_TDMA_MIN_LEAD_US = 50;      // A slot closer than this is left for the next cycle
+static const int MESH_TDMA_AUTO_SLOT = -1;
+
+
+
+struct MeshTdmaStats
+{
+    bool     IsEnabled;
+    bool     IsAutoSlot;              // From tree position and UID, not pinned
+    uint8_t  Slot;
+    uint8_t  SlotCount;
+    uint32_t CycleUs;
+    uint32_t SlotUs;
+    uint32_t GuardUs;
+
+    // Slotted sends
+    uint32_t Held;                    // Packets queued for a slot
+    uint32_t Sent;
+    uint32_t SendFailures;            // The stack refused the packet, the driver queue was full
+    uint32_t DroppedOldest;           // Queue full, a newer packet took the place
+    uint32_t LateSlots;               // Woken after the slot closed, the packets waited another cycle
+    uint32_t LastHoldUs;              // Queued to sent, at most one cycle plus the slot
+    uint32_t MaxHoldUs;
+    float    MeanHoldUs;              // EWMA
+    int32_t  LastSlotErrorUs;         // Mesh time of the send minus the start of the slot's usable window
+    uint32_t MaxSlotErrorUs;
+
+    // Free-for-all sends, slotting off or the clock not synchronised
+    uint32_t FreeSent;
+    uint32_t FreeSendFailures;
+    uint32_t Unsynced;                // Of FreeSent, would have been slotted but the clock was not synchronised
+};
+
+
+
+class MeshTdma
+{
+    private:
+
+        struct Entry
+        {
+            int64_t  HeldUs;
+            uint16_t Length;
+            uint8_t  Data[MESH_TDMA_MAX_PACKET];
+        };
+
+        Entry Queue[MESH_TDMA_QUEUE_DEPTH]{};
+        size_t QueueHead = 0;
+        size_t QueueCount = 0;
+        Entry Sending{};                     // Copied out of the queue, sent outside the critical section
+
+        const MeshClock* Clock = nullptr;
+        bool (*Sender)(const uint8_t* Data, size_t Length) = nullptr;
+        esp_timer_handle_t SlotTimer = nullptr;
+        bool IsArmed = false;
+        int64_t SlotStartMeshUs = 0;         // Start of the slot the timer is armed for
+
+        bool IsEnabled = false;
+        int FixedSlot = MESH_TDMA_AUTO_SLOT;
+        uint64_t Uid = 0;
+        uint8_t HopCount = 255;
+
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+        MeshTdmaStats Stats{};
+
+        static void SlotTimerCallback(void* arg);
+        void OnSlot();
+        void ArmNextSlot(int64_t NowLocalUs);
+        void UpdateSlot();
+
+
+
+    public:
+
+        /**
+         * @brief Start slotting. Every node of the mesh must use the same cycle and slot count. Calling it again changes both.
+         * @param CycleUs Length of one cycle, the master's cyclic period.
+         * @param SlotCount Number of slots per cycle, 1 to MESH_TDMA_MAX_SLOTS.
+         * @param MeshTime Clock the slots are aligned to.
+         * @param PacketSender Sends one framed packet upstream, returns false if the stack refused it.
+         * @return bool: False if the arguments are out of range or the timer could not be created.
+         */
+        bool Enable(uint32_t CycleUs, uint8_t SlotCount, const MeshClock* MeshTime,
+                    bool (*PacketSender)(const uint8_t* Data, size_t Length));
+
+
+
+        /**
+         * @brief Stop slotting. Held packets are dropped, they are at most one cycle old.
+         * @return void.
+         */
+        void Disable();
+
+
+
+        /**
+         * @brief Give the node's place in the tree, the automatic slot follows it.
+         * @param NodeUid This node's UID.
+         * @param Hop This node's hop count, 255 without a route.
+         * @return void.
+         */
+        void SetPosition(uint64_t NodeUid, uint8_t Hop);
+
+
+
+        /**
+         * @brief Pin the slot, for a plan made by the master or the application.
+         * @param Slot Slot index below the slot count, MESH_TDMA_AUTO_SLOT to go back to the tree position.
+         * @return bool: False if the slot is out of range.
+         */
+        bool SetFixedSlot(int Slot);
+
+
+
+        /**
+         * @brief Queue a framed packet for this node's next slot.
+         * @param Packet Complete packet, header to end delimiter.
+         * @param Length Number of bytes in Packet.
+         * @return bool: False if slotting is off, the clock is not synchronised or the packet is too large; send it at once instead.
+         */
+        bool Hold(const uint8_t* Packet, size_t Length);
+
+
+
+        /**
+         * @brief Count a packet sent at once, the free-for-all baseline the slotted sends are compared against.
+         * @param IsSent The result of the send.
+         * @return void.
+         */
+        void NoteFreeSend(bool IsSent);
+
+
+
+        /**
+         * @brief Get the slot, the hold times and the send counters of both modes.
+         * @return MeshTdmaStats: A copy of the statistics.
+         */
+        MeshTdmaStats GetStats() const;
+};
+
+#endif
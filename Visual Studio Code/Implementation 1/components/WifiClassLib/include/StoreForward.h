@@ -0,0 +1,131 @@
+#ifndef StoreForward_H
+#define StoreForward_H
+
+// Author - Ben Sturdy
+// Store-and-forward buffer for upstream data. Packets that cannot be sent while
+// the route to the master is down are kept, oldest dropped first when full, and
+// sent again after reconnect through a token bucket. Backfill is capped at a
+// fixed byte rate, while fresh packets are sent at once and never wait behind
+// the backlog, so cyclic data is not delayed by the catch-up.
+
+#include "freertos/FreeRTOS.h"
+#include <cstddef>
+#include <cstdint>
+
+static const size_t STORE_FORWARD_MAX_PACKET = 1500;        // One UDP datagram / SLIP frame
+static const uint32_t STORE_FORWARD_BURST_MS = 100;         // Bucket depth, in time at the configured rate
+static const uint8_t STORE_FORWARD_MAX_PER_DRAIN = 8;       // Packets per Backfill() call, bounds the time spent in the caller
+
+
+
+struct StoreForwardStats
+{
+    size_t CapacityBytes;             // 0 if the buffer could not be allocated
+    size_t UsedBytes;                 // Packets and record headers currently held
+    size_t PeakUsedBytes;
+    uint32_t StoredPackets;           // Currently held
+    uint32_t TotalStored;
+    uint32_t DroppedOldest;           // Evicted to make room for newer data
+    uint32_t DroppedTooLarge;
+    uint32_t Backfilled;              // Sent after reconnect
+    uint32_t BackfillFailures;        // Send failed, the packet stays at the head
+    uint32_t BackfillRateBytesPerS;   // Configured limit
+    uint32_t MeasuredBackfillBytesPerS; // Over the last full second
+    int64_t OldestAgeUs;              // Age of the oldest packet held, 0 if empty
+    bool IsInPsram;
+};
+
+
+
+class StoreForward
+{
+    private:
+
+        // Each packet is kept contiguous behind one of these, a record that does
+        // not fit before the end of the ring starts again at offset 0
+        struct Record
+        {
+            int64_t StoredUs;
+            uint32_t Sequence;
+            uint16_t Length;
+            uint16_t Reserved;
+        };
+
+        uint8_t* Ring = nullptr;
+        size_t Capacity = 0;
+        size_t Head = 0;              // Next write
+        size_t Tail = 0;              // Oldest record
+        size_t End = 0;               // Where the reader wraps to 0, the ring size unless the writer wrapped early
+        size_t UsedBytes = 0;
+        uint32_t Count = 0;
+        uint32_t NextSequence = 0;
+
+        bool (*Sender)(const uint8_t* Data, size_t Length) = nullptr;
+        uint8_t Staging[STORE_FORWARD_MAX_PACKET]{};  // Packet being backfilled, sent outside the critical section
+
+        uint32_t RateBytesPerS = 0;
+        uint32_t BurstBytes = 0;
+        uint32_t Tokens = 0;
+        int64_t LastRefillUs = 0;
+        uint32_t WindowBytes = 0;
+        int64_t WindowStartUs = 0;
+
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+        StoreForwardStats Stats{};
+
+        static size_t RecordSize(size_t Length);
+        bool MakeRoom(size_t Size, size_t& Offset);
+        void DropOldest();
+        void RefillTokens(int64_t Now);
+
+
+
+    public:
+
+        /**
+         * @brief Allocate the ring and set the backfill rate. Calling it again does nothing.
+         * @param CapacityBytes Size of the ring, 0 leaves the buffer disabled.
+         * @param BackfillBytesPerS Rate at which held packets are sent after reconnect.
+         * @param PreferPsram Allocate from PSRAM if there is any, internal RAM otherwise.
+         * @param BackfillSender Sends one held packet upstream, returns false if it could not.
+         * @return bool: True if the buffer is usable.
+         */
+        bool Init(size_t CapacityBytes, uint32_t BackfillBytesPerS, bool PreferPsram,
+                  bool (*BackfillSender)(const uint8_t* Data, size_t Length));
+
+
+
+        /**
+         * @brief Keep a framed packet that could not be sent. The oldest packets are dropped to make room.
+         * @param Packet Complete packet, header to end delimiter. PACKET_FLAG_STORED is set in the copy.
+         * @param Length Number of bytes in Packet.
+         * @return bool: False if the buffer is disabled or the packet is larger than the ring.
+         */
+        bool Store(const uint8_t* Packet, size_t Length);
+
+
+
+        /**
+         * @brief Send held packets, oldest first, as far as the token bucket allows. Call periodically while connected.
+         * @return size_t: The number of packets sent.
+         */
+        size_t Backfill();
+
+
+
+        /**
+         * @brief Check if any packet is waiting to be backfilled.
+         * @return bool: True if the buffer is empty.
+         */
+        bool IsEmpty() const { return Count == 0; }
+
+
+
+        /**
+         * @brief Get the occupancy, drop and backfill counters.
+         * @return StoreForwardStats: A copy of the statistics.
+         */
+        StoreForwardStats GetStats() const;
+};
+
+#endif
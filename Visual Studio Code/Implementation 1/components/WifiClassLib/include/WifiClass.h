@@ -11,6 +11,7 @@
 #include "esp_wifi_types_generic.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
 #include "esp_mac.h"
 #include "esp_private/wifi.h"
@@ -19,6 +20,12 @@
 #include "esp_event.h"
 #include "esp_log.h"
 #include "esp_timer.h" 
+#include "LinkEstimator.h"
+#include "MeshClock.h"
+#include "MeshCommandBuffer.h"
+#include "MeshTdma.h"
+#include "MeshOta.h"
+#include "StoreForward.h"
 #include "esp_now.h"
 #include <cstddef>
 #include <cstdint>
@@ -41,6 +48,68 @@ static constexpr size_t UDP_PACKET_SIZE = 256;
 static const uint8_t MESH_OUI_0 = 0xB5;
 static const uint8_t MESH_OUI_1 = 0x79;
 static const uint8_t MESH_OUI_2 = 0x5B;
+static const uint8_t MESH_OUI_TYPE = 0x01;
+static const uint8_t MESH_IE_VERSION = 2;
+static const uint8_t MESH_NETWORK_ID = 1;
+static const size_t MESH_IE_CACHE_SIZE = 20;
+static const uint16_t MESH_PATH_COST_INFINITE = 0xFFFF;
+static const uint32_t MESH_UPLINK_CAPACITY_BYTES_PER_S = 250000; // Usable UDP throughput of one STA link
+static const uint32_t MESH_HEARTBEAT_PERIOD_MS = 500;         // A link idle for this long gets an explicit keepalive
+static const uint8_t MESH_HEARTBEAT_MISS_LIMIT = 3;             // K, missed periods before a neighbour is declared lost. Keep >= 3, an idle-only link can go two periods between packets
+static const uint32_t MESH_LIVENESS_CHECK_PERIOD_MS = 100;      // Detection bound is K * period + this
+static const uint32_t MESH_SCAN_PERIOD_MS = 2000;
+static const uint32_t MESH_BEACON_REFRESH_PERIOD_MS = 5000;
+static const size_t MESH_EVENT_QUEUE_LENGTH = 16;
+static const uint32_t MESH_LEAF_SCAN_PERIOD_MS = 10000;        // Leaf only, looks for neighbours that need it to become a relay
+static const uint32_t MESH_PROMOTED_IDLE_MS = 300000;           // A relay promoted from a leaf that has had no children this long goes back to being a leaf
+static const uint32_t MESH_ECHO_PERIOD_MS = 2000;               // RTT probe and child RSSI sample on every link
+static const uint32_t MESH_TIME_SYNC_PERIOD_MS = 1000;           // Two-way time exchange with the parent, or the master at hop 1
+static const uint32_t MESH_BACKFILL_PERIOD_MS = 20;             // Store-and-forward drain while packets are held, MESH_HEARTBEAT_PERIOD_MS when empty
+static const uint32_t MESH_NEIGHBOUR_REPORT_PERIOD_MS = 10000;  // Neighbour list sent to the master, same rate as the leaf scan that refreshes it
+static const uint8_t MESH_NEIGHBOUR_REPORT_MAX = 16;             // Strongest neighbours per report, keeps a report inside UDP_PACKET_SIZE
+static const size_t MESH_MAX_DESCENDANTS = 32;                  // Nodes below the children that downstream unicast can be routed to
+static const uint32_t MESH_DESCENDANT_TIMEOUT_MS = 30000;       // Three neighbour reports, every node sends one upstream at least that often
+static const uint32_t MESH_PREFERRED_PARENT_MAX_HOLD_MS = 3600000; // Upper bound on how long the master can pin a parent
+static const uint32_t MESH_ROOT_ANNOUNCE_PERIOD_MS = 1000;      // Root gateway only, announce to the master, which acks it
+static const uint32_t MESH_ROOT_HOST_TIMEOUT_MS = 5000;         // Host link silent this long and the root withdraws its route
+static const uint16_t MESH_ROOT_LOAD_COST = 5;                  // Path cost a root adds per 10% of host link load, spreads nodes across gateways
+
+static const char* MESH_NVS_NAMESPACE = "mesh";
+static const char* MESH_NVS_PARENT_KEY = "parent";
+static const char* MESH_NVS_ROLE_KEY = "role";
+static const char* MESH_NVS_PROMOTED_KEY = "promoted";          // Set with the role by a promotion, the relay reverts once it is not needed
+static const char* MESH_NVS_UID_KEY = "uid";
+static const char* MESH_NVS_OTA_KEY = "ota";                    // Transfer in progress, MeshOta resume state
+static const char* MESH_NVS_OTA_DONE_KEY = "ota_done";          // ImageId of the last image installed through the mesh
+static const uint32_t MESH_PARENT_CACHE_MAGIC = 0x4D504332; // "MPC2", bump when MeshParentCache changes
+
+static const uint8_t PACKET_TYPE_HEARTBEAT = 0xFF;
+static const uint8_t PACKET_TYPE_ROUTE_WITHDRAWN = 0xFE;        // Sent to children when this node loses its upstream
+static const uint8_t PACKET_TYPE_PROMOTE = 0xFD;                // Asks a leaf to restart as a relay, from its parent by UID only
+static const uint8_t PACKET_TYPE_ECHO_REQUEST = 0xFC;           // Payload is a MeshEchoPayload, returned unchanged
+static const uint8_t PACKET_TYPE_ECHO_REPLY = 0xFB;
+static const uint8_t PACKET_TYPE_OTA_BEGIN = 0xFA;              // MeshOtaBegin, also polls every node for its chunk bitmap
+static const uint8_t PACKET_TYPE_OTA_CHUNK = 0xF9;              // MeshOtaChunkHeader + chunk data
+static const uint8_t PACKET_TYPE_OTA_COMMIT = 0xF8;             // MeshOtaCommit, switch to the new image and restart
+static const uint8_t PACKET_TYPE_OTA_STATUS = 0xF7;             // MeshOtaStatusHeader + bitmap, upstream to the sender
+static const uint8_t PACKET_TYPE_NEIGHBOUR_REPORT = 0xF6;       // MeshNeighbourReportHeader + entries, upstream to the master's topology optimizer
+static const uint8_t PACKET_TYPE_PREFERRED_PARENT = 0xF5;       // MeshPreferredParent, routed down to the node named in destinationUid
+static const uint8_t PACKET_TYPE_ROOT_ANNOUNCE = 0xF4;          // MeshRootAnnounce, root gateway to the master's root registry; the master acks with the same type
+static const uint8_t PACKET_TYPE_TIME_SYNC_REQUEST = 0xF3;      // MeshTimeSyncPayload, to the parent or the master, one hop only
+static const uint8_t PACKET_TYPE_TIME_SYNC_REPLY = 0xF2;        // MeshTimeSyncPayload with the responder's mesh time filled in
+static const uint8_t PACKET_TYPE_CYCLE_MARKER = 0xF1;           // MeshCycleMarker, subtree broadcast from the master, its cycle on mesh time
+
+static const uint8_t MESH_FORWARD_DOWNSTREAM = 1;               // ForwardingMode, down the route to the node named in destinationUid
+static const uint8_t MESH_FORWARD_SUBTREE = 3;                  // ForwardingMode, every node below the sender, one copy per link
+
+static const uint8_t PACKET_FLAG_LINK_SEQUENCE = 0x01;          // Header flags bit, linkSequence and linkRxRatioQ8 were stamped by the last hop
+static const uint8_t PACKET_FLAG_STORED = 0x02;                 // Header flags bit, held through an outage and backfilled, senderTimestampUs is when it was made
+
+static const uint8_t MESH_IE_FLAG_SEEKING_PARENT = 0x01;        // IE flags bit, no route and no usable parent in the last scan
+
+static const uint8_t MESH_REPORT_FLAG_LEAF = 0x01;              // Neighbour report flags bit, the sender takes no children
+static const uint8_t MESH_REPORT_FLAG_ROOT = 0x02;              // Sender is a root gateway and never moves
+static const uint8_t MESH_REPORT_FLAG_PREFERENCE = 0x04;        // Sender is following a preferred parent from the master
 
 constexpr uint16_t PACKET_START_DELIMITER   = 0xB502;
 constexpr size_t   PACKET_HEADER_SIZE       = 48;
@@ -49,12 +118,38 @@ constexpr uint16_t PACKET_END_DELIMITER     = 0x035B;
 static const char* PARENT_SSID = "SturdyAP";
 static const char* PARENT_PASS = "SturdyAP79";
 
+#ifndef CONFIG_ESP_MAX_STA_CONN
+#define CONFIG_ESP_MAX_STA_CONN 4
+#endif
+
 static const char* MY_PASS = "12345678";
-static const uint8_t MAX_STA_CONN = 1;
+static const uint8_t MESH_MAX_CHILDREN = 10; // SoftAP station limit of the WiFi driver, sizes the child table
+static const uint8_t MAX_STA_CONN = (CONFIG_ESP_MAX_STA_CONN > MESH_MAX_CHILDREN) ? MESH_MAX_CHILDREN : CONFIG_ESP_MAX_STA_CONN;
+#ifndef CONFIG_ESP_STORE_FORWARD_SIZE
+#define CONFIG_ESP_STORE_FORWARD_SIZE 32
+#endif
+#ifndef CONFIG_ESP_BACKFILL_RATE
+#define CONFIG_ESP_BACKFILL_RATE 25000
+#endif
+#ifdef CONFIG_ESP_STORE_FORWARD_PSRAM
+static const bool MESH_STORE_FORWARD_IN_PSRAM = true;
+#else
+static const bool MESH_STORE_FORWARD_IN_PSRAM = false;
+#endif
+static const size_t MESH_STORE_FORWARD_BYTES = (size_t)CONFIG_ESP_STORE_FORWARD_SIZE * 1024; // 0 disables store-and-forward
+static const uint32_t MESH_BACKFILL_BYTES_PER_S = CONFIG_ESP_BACKFILL_RATE;
+static const uint8_t MESH_ADMISSION_LOAD_LIMIT = 80; // Uplink load (%) above which no new children are admitted
+static const uint8_t MESH_OVERLOAD_LOAD_LIMIT = 95;  // Uplink load (%) above which a marginal child is steered away
+static const uint32_t MESH_ADMISSION_QUEUE_LIMIT = 8; // Uplink packets held or refused per beacon period before admission closes, twice this sheds a child
+static const float MESH_OVERLOAD_ETX = 3.0f;         // Parent link ETX from which the subtree is shed
+static const int8_t MESH_STEER_MIN_RSSI = -75;       // A child is only steered to a parent it hears at least this well
+static const uint32_t MESH_STEER_HOLD_MS = 60000;    // How long a steered child keeps to its new parent
+static const uint32_t MESH_STEER_HOLDOFF_MS = 15000; // Between two steers, so the load can settle first
 static const bool ENABLE_MASTER_CONNECTION = true;
 
 struct WifiDevice
 {
+    bool IsActive;                // Slot in use (child table only)
     uint64_t TimeOfConnection;
     uint64_t UID;
     uint8_t MacId[6];
@@ -62,7 +157,23 @@ struct WifiDevice
     char IpAddress[16];
     uint8_t HopCount;
     uint8_t ChildrenCount;
-    uint64_t LastHeartbeatUs;
+    uint64_t LastHeartbeatUs;     // Last valid packet of any type received from this device
+    uint64_t LastTxUs;            // Last packet of any type sent to this device
+    int8_t Rssi;
+    uint16_t PathCost;
+    uint64_t AncestorDigest;
+    uint32_t RxPackets;           // Valid mesh packets received from this device
+    uint64_t AlternativeUid;      // Best other parent in the child's last neighbour report, 0 = the master's router
+    int8_t AlternativeRssi;       // 0 if the child reported no usable alternative
+};
+
+
+// A node further down than our children, and the child its upstream traffic came through
+struct MeshDescendant
+{
+    uint64_t Uid;                 // 0 = unused entry
+    uint8_t ChildMac[6];          // Matched against the child table, a slot can be reused by another child
+    int64_t LastSeenUs;
 };
 
 
@@ -71,13 +182,15 @@ struct PacketHeader
 {
     uint16_t startDelimiter;      // 0x02B5
     uint16_t payloadSize;         // bytes after header
-    uint32_t reserved0;
+    uint32_t meshCycle;           // Master's cycle, low 32 bits: a command acts in it, cyclic data was sampled in it. 0 for neither
 
     uint64_t slaveUid;
     uint64_t destinationUid;
     uint64_t senderTimestampUs;
 
-    uint32_t prevCycleTimeUs;
+    uint16_t linkSequence;        // Per hop, restamped on every send except a heartbeat, which carries it in its payload
+    uint8_t  linkRxRatioQ8;       // Last hop's delivery ratio of the receiver's packets, 255 = 100%
+    uint8_t  reserved;
 
     uint8_t  chainedSlaveCount;
     uint8_t  PacketType;
@@ -105,18 +218,251 @@ struct UdpPacket
     uint8_t Data[UDP_PACKET_SIZE];
 };
 
+// Payload of the mesh vendor IE, carried after OUI + OUI type in beacons and probe responses.
+// Everything a neighbour needs to pick a parent is in here, so no IP traffic is needed to choose.
+#pragma pack(push, 1)
+struct MeshIePayload
+{
+    uint8_t  Version;             // MESH_IE_VERSION
+    uint8_t  NetworkId;           // Nodes ignore IEs from other mesh networks
+    uint64_t Uid;                 // CONFIG_ESP_NODE_UID of the advertising node
+    uint8_t  HopCount;            // 255 = no route to the root
+    uint16_t PathCost;            // Sum of link costs to the root, MESH_PATH_COST_INFINITE = no route
+    uint8_t  UplinkLoad;          // Uplink utilisation in percent, quantised to 10% steps
+    uint8_t  FreeChildSlots;      // Children this node will still accept
+    uint8_t  ChildCount;          // Children currently connected
+    uint8_t  Flags;               // MESH_IE_FLAG_*
+    uint64_t AncestorDigest;      // Bloom filter of UIDs on the path to the root, including this node
+    uint64_t RootUid;             // Root gateway this node's path ends at, 0 = the master's router
+};
+#pragma pack(pop)
+static_assert(sizeof(MeshIePayload) == 33, "MeshIePayload must be 33 bytes");
+
+
+// Payloads of the topology packets. The master collects the reports, plans a
+// tree and names a parent per node; the node still connects through its normal
+// scan, so a preferred parent that cannot be reached is simply not chosen.
+#pragma pack(push, 1)
+struct MeshNeighbourReportHeader
+{
+    uint64_t ParentUid;           // 0 when the parent is the master's router, or there is none
+    uint8_t  HopCount;            // 255 = no route
+    uint8_t  MaxChildren;         // Child slots this node has, 0 on a leaf
+    uint8_t  Flags;               // MESH_REPORT_FLAG_*
+    int8_t   MasterRssi;          // RSSI of the master's router in the last scan, 0 if it was not heard
+    uint8_t  NeighbourCount;      // MeshNeighbourEntry records that follow
+};
+
+struct MeshNeighbourEntry
+{
+    uint64_t Uid;
+    int8_t   Rssi;
+    uint8_t  HopCount;            // As advertised in the neighbour's IE
+    uint8_t  FreeChildSlots;
+    uint8_t  Flags;               // MESH_IE_FLAG_* of the neighbour
+    uint16_t EtxQ8;               // Measured ETX * 256 on a parent or child link, 0 if the link is not in use
+};
+
+struct MeshPreferredParent
+{
+    uint64_t ParentUid;           // 0 = the master's router
+    uint32_t HoldMs;              // How long the preference holds, 0 clears it
+};
+
+// Sent by every root gateway so the master knows which host link reaches it.
+// The master answers each one, the answers are how a root tells that its host
+// link still works; the root UID is the header's slaveUid.
+struct MeshRootAnnounce
+{
+    uint16_t PathCost;            // What the root advertises, load penalty included
+    uint8_t  UplinkLoad;          // Host link utilisation in percent
+    uint8_t  ChildCount;
+    uint32_t FramesToHost;        // Running count, lets the master spot a stalled gateway
+};
+#pragma pack(pop)
+static_assert(sizeof(MeshNeighbourReportHeader) + MESH_NEIGHBOUR_REPORT_MAX * sizeof(MeshNeighbourEntry) <= UDP_PACKET_SIZE,
+              "A full neighbour report must fit in one SendPacket payload");
+
+
+struct MeshTopologyStats
+{
+    uint32_t ReportsSent;
+    uint32_t PreferencesReceived;
+    uint32_t PreferredRoams;          // Parent changes made to follow the master
+    uint64_t PreferredParentUid;      // 0 = the master's router
+    int64_t  PreferenceRemainingMs;   // 0 when no preference is active
+};
+
+
+struct MeshAdmissionStats
+{
+    uint8_t  ChildLimit;              // Children admitted now, at most MAX_STA_CONN
+    uint8_t  ApMaxConnection;         // Limit in the soft-AP config
+    uint8_t  UplinkLoad;              // Percent, as advertised
+    uint32_t UplinkRefused;           // Upstream sends the stack refused in the last period
+    uint32_t UplinkHeld;              // Packets in the store-and-forward buffer
+    float    UplinkEtx;               // 1.0 on a root
+    uint32_t LimitChanges;
+    uint32_t JoinsRejected;           // Children turned away for joining above the limit
+    uint32_t ChildrenSteered;         // Marginal children sent to another parent
+};
+
+
+struct MeshFailoverStats
+{
+    uint32_t ParentLossCount;         // Upstream losses from any cause
+    uint32_t HeartbeatTimeouts;       // Of those, detected by missed heartbeats
+    uint32_t RouteWithdrawalsSent;
+    uint32_t RouteWithdrawalsReceived;
+    uint32_t ChildTimeouts;           // Children dropped for missing heartbeats
+    uint32_t FailoverCount;           // Losses followed by a new route
+    int64_t  LastDetectionUs;         // Last heartbeat heard -> loss declared
+    int64_t  LastFailoverUs;          // Loss declared -> IP acquired on the new route
+    int64_t  WorstFailoverUs;
+};
+
+
+struct MeshKeepaliveStats
+{
+    uint32_t UpstreamSent;            // Explicit keepalives sent to the parent / master
+    uint32_t UpstreamSuppressed;      // Keepalives not needed because traffic already went upstream
+    uint32_t DownstreamSent;
+    uint32_t DownstreamSuppressed;
+    uint64_t UpstreamBytesSaved;      // Upstream bytes a fixed 500 ms heartbeat would have cost
+};
+
+
+// Last parent that gave us an IP, kept in NVS so a restarted node can connect without scanning.
+// The DHCP lease itself is restored by lwIP (CONFIG_LWIP_DHCP_RESTORE_LAST_IP).
+struct MeshParentCache
+{
+    uint32_t Magic;
+    char     Ssid[33];
+    uint8_t  Bssid[6];
+    uint8_t  Channel;
+    int8_t   Rssi;
+    bool     IsMaster;
+    uint8_t  HopCount;                // Parent's hop count
+    uint16_t PathCost;                // Parent's path cost
+    uint64_t AncestorDigest;          // Parent's ancestor digest
+    uint64_t RootUid;                 // Root the parent's path ends at
+};
+
+
+struct MeshBootStats
+{
+    bool     IsWarmStart;             // Connected from the cached parent instead of a scan
+    int64_t  SetupDoneUs;             // All times are since boot
+    int64_t  FirstConnectUs;
+    int64_t  FirstIpUs;
+    int64_t  FirstPacketUs;           // First packet sent upstream
+};
+
+
+struct MeshGatewayStats
+{
+    uint32_t FramesToHost;            // Upstream packets terminated on the host link
+    uint32_t FramesFromHost;
+    uint32_t HostFramesDropped;       // Bad framing, or no child route for the destination UID
+    uint32_t HostSendFailures;        // Host link could not take the frame
+    uint32_t AnnouncesSent;
+    uint32_t AnnounceAcks;
+    uint32_t HostLossCount;           // Route withdrawn because the host link went silent
+    bool     IsHostAlive;             // False until the first host frame, and while withdrawn
+};
+
+
+// Every change to mesh state goes through the mesh task as one of these. WiFi / IP
+// events and the receive task post them, esp_timer one-shots post the deadlines.
+// The leaf runs its own task on the same events, the ones it has use for.
+enum class MeshEventType : uint8_t
+{
+    StaStart,
+    ScanDone,
+    StaConnected,
+    StaDisconnected,
+    GotIp,
+    LostIp,
+    ChildJoined,
+    ChildLeft,
+    ChildIpAssigned,
+    RouteWithdrawn,
+    ScanDeadline,
+    BeaconDeadline,
+    KeepaliveDeadline,
+    LivenessDeadline,
+    EchoDeadline,
+    BackfillDeadline,
+    ReportDeadline,
+    PreferredParent,
+    RootAnnounceDeadline,
+    TimeSyncDeadline,
+    PromoteDeadline,              // Leaf only, its promotion backoff has run out
+    Count
+};
+
+
+struct MeshEvent
+{
+    MeshEventType Type;
+    int64_t PostedUs;
+    union
+    {
+        wifi_event_sta_connected_t StaConnected;
+        wifi_event_sta_disconnected_t StaDisconnected;
+        wifi_event_ap_staconnected_t ChildJoined;
+        wifi_event_ap_stadisconnected_t ChildLeft;
+        ip_event_got_ip_t GotIp;
+        ip_event_ap_staipassigned_t ChildIpAssigned;
+        MeshPreferredParent PreferredParent;
+    } Data;
+};
+
+
+struct MeshEventLatency
+{
+    uint32_t Count;
+    uint32_t LastUs;                  // Posted -> fully handled by the mesh task
+    uint32_t MaxUs;
+    uint64_t TotalUs;
+};
+
+
 struct MeshMetadata
 {
     uint8_t MacId[6];
+    uint64_t Uid;
     uint8_t HopCount;
+    uint16_t PathCost;
+    uint8_t UplinkLoad;
+    uint8_t FreeChildSlots;
     uint8_t ChildCount;
+    uint8_t Flags;
+    uint64_t AncestorDigest;
+    uint64_t RootUid;
+    int8_t Rssi;
     bool IsValid;
 };
 
 
 
+// Which class app_main creates. A leaf is STA only and never takes children.
+// A root is an AccessPointStation with a host link in place of a parent.
+enum class MeshRole : uint8_t
+{
+    Relay = 0,
+    Leaf = 1,
+    Root = 2
+};
+
+
+
 class Station // Singleton
 {
+    // Leaf node. STA only: no AP netif, no DHCP server, no beacons and no mesh or
+    // forwarding tasks. Speaks the same PacketHeader protocol to its parent and
+    // restarts as a relay when a neighbour needs it as a parent.
+
     private:
 
         // Factory creation only
@@ -131,11 +477,38 @@ class Station // Singleton
         
         static void IpEventHandler(void* arg, esp_event_base_t event_base,
                                     int32_t event_id, void* event_data);
+
+        static void WifiVendorIeCb(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], 
+                                    const vendor_ie_data_t *vnd_ie, int rssi);
                             
         static void UdpRxTask(void* pvParameters); 
         TaskHandle_t UdpRxTaskHandle = nullptr;
 
 
+        // Every change to leaf state runs on the leaf task. The WiFi / IP handlers, the
+        // receive task and the timers only post events, the same ones the relay uses.
+        static void LeafTask(void* pvParameters);
+        TaskHandle_t LeafTaskHandle = nullptr;
+        QueueHandle_t LeafEventQueue = nullptr;
+        uint32_t DroppedLeafEvents = 0;
+        bool PostLeafEvent(MeshEventType Type, const void* Data = nullptr, size_t Length = 0);
+        void HandleLeafEvent(const MeshEvent& Event);
+
+
+        // Keepalive, liveness and the periodic scan share one timer
+        static void LinkTimerCallback(void* arg);
+        esp_timer_handle_t LinkTimer = nullptr;
+        uint32_t LinkTicks = 0;
+        void OnLinkTick();
+
+
+        // Store-and-forward, drains on its own one-shot timer that runs faster while packets are held
+        static void BackfillTimerCallback(void* arg);
+        static bool BackfillSender(const uint8_t* Data, size_t Length);
+        esp_timer_handle_t BackfillTimer = nullptr;
+        StoreForward Backlog;
+
+
         // Wifi Configuration
         esp_err_t Error;
         wifi_init_config_t WifiDriverConfig = WIFI_INIT_CONFIG_DEFAULT();
@@ -145,10 +518,10 @@ class Station // Singleton
         
 
         // Critical section for data access
-        portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
+        mutable portMUX_TYPE CriticalSection = portMUX_INITIALIZER_UNLOCKED;
 
 
-        // UDP Buffer
+        // UDP Buffer, holds the last packet addressed to this node
         uint8_t RxData[1024]{};
         uint16_t LastPositionWritten = 0;
 
@@ -156,6 +529,49 @@ class Station // Singleton
         // UDP helper functions
         bool StartUdp(uint16_t Port, uint8_t Core);
         bool StopUdp();
+        void ProcessPacket(const uint8_t* Data, int Length, const sockaddr_in& SourceAddress);
+        bool GetUpstreamAddress(sockaddr_in& DestinationAddress) const;
+        void SendKeepalive(bool OnlyIfIdle);
+        int SendLinkControl(const sockaddr_in& Destination, uint8_t PacketType, const void* Payload, size_t PayloadLength);
+        void SendEchoRequest();
+        void SendTimeSyncRequest();
+        bool SendUpstream(const uint8_t* Data, size_t Length);
+
+
+        // Firmware updates, the leaf is always the end of a subtree broadcast
+        MeshOta Ota;
+        static bool OtaStatusSender(const uint8_t* Payload, size_t Length);
+        static void OtaBeforeRestart();
+
+
+        // Parent selection, same IE and scoring as a relay
+        MeshMetadata CallbackIeData[MESH_IE_CACHE_SIZE]{};
+        wifi_ap_record_t ParentWifiRecord{};
+        bool InitiateScan();
+        void ParseScanResults();
+        void ConnectToParent();
+        void Promote(const char* Reason);
+
+
+        // Promotion for a seeking neighbour waits out a backoff, nearest the root first and
+        // then by UID, and a fresh scan must still see the neighbour seeking afterwards.
+        // Only one of the leaves that can hear it should become its parent.
+        static void PromoteTimerCallback(void* arg);
+        esp_timer_handle_t PromoteTimer = nullptr;
+        bool IsPromotionPending = false;
+        bool IsPromotionRecheck = false;
+        uint32_t GetPromoteBackoffMs() const;
+
+
+        // Topology reports for the master, and the parent it asked us to use. Written
+        // on the leaf task, read by the stats getters, guarded by CriticalSection.
+        MeshMetadata ScanNeighbours[MESH_IE_CACHE_SIZE]{};
+        int8_t ScanMasterRssi = 0;
+        uint64_t PreferredParentUid = 0;
+        int64_t PreferredParentUntilUs = 0;
+        MeshTopologyStats TopologyStats{};
+        void SendNeighbourReport();
+        void SetPreferredParent(const MeshPreferredParent& Preferred);
 
 
         // Internal data
@@ -165,28 +581,216 @@ class Station // Singleton
         bool SystemInitialized = false;
         bool UdpStarted = false;
         bool IsConnected = false;
+        bool IsConnecting = false;
+        bool IsScanning = false;
+        bool IsMasterParent = false;
         bool ApIpAcquired = false;
         bool IsRuntimeLoggingEnabled = false;
         int UdpSocket = -1;
-        char MyIpAddress[16];
+        char MyIpAddress[16]{};
+        uint8_t MyHopCount = 255;
+        uint8_t SeekingNeighbourScans = 0;
+        int64_t LastTxUs = 0;
         WifiDevice ApWifiDevice{};  
+        MeshKeepaliveStats KeepaliveStats{};
+        LinkEstimator LinkTable;
+        MeshClock Clock;
+        MeshTdma Slots;
+        MeshCommandBuffer Commands;
 
 
 
     public:
 
+        /**
+         * @brief Bring up the WiFi driver in STA mode, start scanning for a mesh parent and start the keepalive timer. Steps run back to back; a failing step returns false and is retried on the next call.
+         * @return bool: True once setup has completed.
+         */
         bool SetupWifi();                                             
-        size_t SendUdpPacket(const char* DataToSend, const char* DestinationIP, uint16_t DestinationPort);  
+
+
+
+        /**
+         * @brief Wrap a payload in a PacketHeader and send it upstream. The packet is marked for upstream forwarding, so every relay on the way passes it on towards the master. Without a route the packet is kept in the store-and-forward buffer and backfilled after reconnect. With slotted transmission the packet waits for this node's slot. The header carries the master cycle the data belongs to, so the master can line up every node's data of one cycle.
+         * @param Payload Data to send.
+         * @param PayloadLength Number of bytes in Payload.
+         * @param PacketType Packet type written to the header, must not be 0.
+         * @param SampledUs Local time the data was sampled, GetCycleStartUs() from the cyclic task. 0 stamps the master cycle the packet is built in.
+         * @return size_t: The number of bytes sent, 0 if it was stored or dropped. A packet held for its slot counts as sent.
+         */
+        size_t SendPacket(const uint8_t* Payload, size_t PayloadLength, uint8_t PacketType, int64_t SampledUs = 0);
+
+
+
+        /**
+         * @brief Send fresh packets only inside this node's slot of the cycle, aligned to mesh time. Every node of the mesh must use the same cycle and slot count. Until the clock is synchronised packets go out at once.
+         * @param CycleUs Length of one cycle, the cyclic task period shared by the mesh.
+         * @param SlotCount Slots per cycle, 1 to MESH_TDMA_MAX_SLOTS.
+         * @return bool: False if the slot would be too short or the slot timer could not be created.
+         */
+        bool EnableSlottedTx(uint32_t CycleUs, uint8_t SlotCount);
+
+
+
+        /**
+         * @brief Pin the transmit slot, for a plan made by the master. By default it follows the hop count and UID.
+         * @param Slot Slot index, MESH_TDMA_AUTO_SLOT to go back to the automatic slot.
+         * @return bool: False if the slot is out of range.
+         */
+        bool SetTransmitSlot(int Slot) { return Slots.SetFixedSlot(Slot); }
+
+
+
+        /**
+         * @brief Get the slot, the time packets waited for it and the send counters, slotted and free-for-all.
+         * @return MeshTdmaStats: A copy of the statistics.
+         */
+        MeshTdmaStats GetSlotStats() const { return Slots.GetStats(); }
+
+
+
+        /**
+         * @brief Copy the last packet addressed to this node out of the receive buffer and clear it.
+         * @param IsDataAvailable Set to true if a packet was copied.
+         * @param DataToReceive Buffer of at least 1024 bytes.
+         * @return size_t: The length of the copied packet, 0 if none was waiting.
+         */
         size_t GetDataFromBuffer(bool* IsDataAvailable, uint8_t* DataToReceive);
 
+
+
+        /**
+         * @brief Check if the leaf is connected to a parent and has an IP address.
+         * @return bool: True if connected with an IP address, false otherwise.
+         */
         bool IsConnectedToHost() const { return IsConnected && ApIpAcquired; }
+
+
+
+        /**
+         * @brief Get the IP address of the parent (the gateway of the STA interface).
+         * @return const char*: The parent IP address, or an empty string if not connected.
+         */
         const char* GetGatewayIpAddress() const { return ApWifiDevice.IpAddress; }
+
+
+
+        /**
+         * @brief Get the IP address assigned to this node by its parent.
+         * @return const char*: The IP address, or an empty string if not connected.
+         */
         const char* GetMyIpAddress() const { return MyIpAddress; }
+
+
+
+        /**
+         * @brief Get the number of hops between this node and the root, 255 if there is no route.
+         * @return uint8_t: The current hop count.
+         */
+        uint8_t GetHopCount() const { return MyHopCount; }
+
+
+
+        /**
+         * @brief Get the keepalive statistics. A leaf has no children, so only the upstream counters move.
+         * @return MeshKeepaliveStats: A copy of the current statistics.
+         */
+        MeshKeepaliveStats GetKeepaliveStats() const { return KeepaliveStats; }
+
+
+
+        /**
+         * @brief Get the measured quality of the link to the parent: ETX, loss, RTT and RSSI.
+         * @param Out Filled with a copy of the link.
+         * @return bool: True if connected to a parent.
+         */
+        bool GetParentLinkQuality(LinkQuality& Out) const { return LinkTable.GetParentLink(Out); }
+
+
+
+        /**
+         * @brief Get the mesh time, the master's clock as followed through the parent. Local time until the first sync.
+         * @return int64_t: Mesh time in microseconds.
+         */
+        int64_t GetMeshTimeUs() const { return Clock.GetMeshTimeUs(); }
+
+
+
+        /**
+         * @brief Get the clock offset, drift and the sync error measured on the link to the parent.
+         * @return MeshClockStats: A copy of the statistics.
+         */
+        MeshClockStats GetClockStats() const { return Clock.GetStats(); }
+
+
+
+        /**
+         * @brief Find the master's cycle a local time falls in, from the last cycle marker and the mesh clock.
+         * @param LocalUs Local time in microseconds, from esp_timer_get_time().
+         * @param Cycle Master's cycle number.
+         * @param PhaseUs Time since that cycle started.
+         * @param PeriodUs Master's cycle period.
+         * @return bool: False while the clock is not synchronised or no marker has come in lately.
+         */
+        bool GetMasterCycle(int64_t LocalUs, uint64_t& Cycle, uint32_t& PhaseUs, uint32_t& PeriodUs) const { return Clock.GetCycleAt(LocalUs, Cycle, PhaseUs, PeriodUs); }
+
+
+
+        /**
+         * @brief Take the next command from the master that is due in the current cycle. Call from the cyclic task until it returns false.
+         * @param CycleStartUs Local time the current cycle started, the master cycle is the one nearest to it.
+         * @param Out Filled with the command, late or unscheduled if it could not be kept to its cycle.
+         * @return bool: True if a command was taken.
+         */
+        bool TakeDueCommand(int64_t CycleStartUs, MeshCommand& Out);
+
+
+
+        /**
+         * @brief Get the counters of the commands held for their cycle and the lead they arrived with.
+         * @return MeshCommandStats: A copy of the statistics.
+         */
+        MeshCommandStats GetCommandStats() const { return Commands.GetStats(); }
+
+
+
+        /**
+         * @brief Get the progress of a firmware update received through the mesh.
+         * @return MeshOtaStats: A copy of the statistics.
+         */
+        MeshOtaStats GetOtaStats() const { return Ota.GetStats(); }
+
+
+
+        /**
+         * @brief Get the occupancy, drop and backfill counters of the store-and-forward buffer.
+         * @return StoreForwardStats: A copy of the statistics.
+         */
+        StoreForwardStats GetBacklogStats() const { return Backlog.GetStats(); }
+
+
+
+        /**
+         * @brief Get the neighbour report counters and the parent the master currently prefers for this node.
+         * @return MeshTopologyStats: A copy of the statistics.
+         */
+        MeshTopologyStats GetTopologyStats() const;
+
+
+
+        /**
+         * @brief Enable or disable runtime logging for this class.
+         * @param EnableRuntimeLogging: Set to true to enable logging, or false to disable logging.
+         * @return void.
+         */
         void SetRuntimeLogging(bool EnableRuntimeLogging) { IsRuntimeLoggingEnabled = EnableRuntimeLogging; }
 };
 
 
 
+
+
+
 class AccessPointStation // Singleton
 {
     private:
@@ -197,123 +801,421 @@ class AccessPointStation // Singleton
 
 
         /**
-         * @brief Constructor for AccessPointStation class. Never used manually, always created through the factory.
-         * @param CoreToUse The core to use for UDP operations.
-         * @param Port The port to use for UDP operations.
-         * @param EnableRuntimeLogging Whether to enable runtime logging.
-         * @return None.
+         * @brief Constructor for AccessPointStation class. Never used manually, always created through the factory.
+         * @param CoreToUse The core to use for UDP operations.
+         * @param Port The port to use for UDP operations.
+         * @param EnableRuntimeLogging Whether to enable runtime logging.
+         * @return None.
+         */
+        AccessPointStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging);
+
+
+
+        /**
+         * @brief Destructor for AccessPointStation class. Cleans up resources, stops UDP if running, and resets the singleton instance pointer.
+         * @return None.
+         */
+        ~AccessPointStation();
+
+
+
+        /**
+         * @brief Event handler for WiFi events related to the Access Point interface. 
+            Posts station connection and disconnection events to the mesh task, which updates the child table and beacon metadata.
+         * @return Void.
+         */
+        static void ApWifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+
+
+
+        /**
+         * @brief Event handler for WiFi events related to the Station interface. 
+             Posts start, scan done, connection and disconnection events to the mesh task.
+         * @return Void.
+         */
+        static void StaWifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);       
+                                    
+                                    
+
+        /**
+         * @brief Event handler for IP events. 
+             Posts IP acquisition and loss on the Station interface, and leases handed to children on the AP interface, to the mesh task.
+         * @return Void.
+         */
+        static void IpEventHandler(void* arg, esp_event_base_t event_base,int32_t event_id, void* event_data);
+                            
+
+
+        /**
+         * @brief Receive task for handling incoming UDP packets. This function runs in a FreeRTOS task and processes received data, 
+             storing it in an internal buffer for later retrieval.
+         * @param pvParameters 
+         * @return Void.
+         */
+        static void ReceiveTask(void* pvParameters);
+        TaskHandle_t ReceiveTaskHandle = nullptr;
+
+
+
+        /**
+         * @brief Transmit task for sending UDP packets. This function runs in a FreeRTOS task and checks for prepared packets to send, 
+             transmitting them to the appropriate destination based on the current connection status.
+         * @param pvParameters 
+         * @return Void.
+         */
+        static void TransmitTask(void* pvParameters);
+        TaskHandle_t TransmitTaskHandle = nullptr;
+
+
+
+        /**
+         * @brief Mesh task, the single owner of the mesh control plane. It blocks on the mesh event queue and handles each event as soon as it is posted; periodic work (scan, beacon refresh, keepalives, liveness) arrives as esp_timer deadline events that re-arm themselves. The reaction latency of every event type is recorded.
+         * 
+         * @param pvParameters 
+         */
+        static void MeshTask(void* pvParameters); 
+        TaskHandle_t MeshTaskHandle = nullptr;
+        QueueHandle_t MeshEventQueue = nullptr;
+
+
+
+        /**
+         * @brief Handles one mesh event. Only ever called from the mesh task, so the state it touches has one writer.
+         * @param Event The event to handle.
+         * @return Void.
+         */
+        void HandleMeshEvent(const MeshEvent& Event);
+
+
+
+        /**
+         * @brief Stamps an event with the current time and posts it to the mesh task. Never blocks; a full queue drops the event and counts it.
+         * @param Type The event type.
+         * @param Data Event data to copy into the event, may be nullptr.
+         * @param Length Length of Data, truncated to the size of the event data union.
+         * @return bool: True if the event was queued, false otherwise.
+         */
+        bool PostMeshEvent(MeshEventType Type, const void* Data = nullptr, size_t Length = 0);
+
+
+
+        /**
+         * @brief esp_timer callback shared by all deadline timers. The timer argument is the event type to post.
+         * @param arg The MeshEventType, cast to a pointer.
+         * @return Void.
+         */
+        static void DeadlineTimerCallback(void* arg);
+
+
+
+        /**
+         * @brief Creates the one-shot esp_timer that posts the given deadline event.
+         * @param Type The deadline event type.
+         * @param Name Timer name, for esp_timer_dump.
+         * @return bool: True if the timer was created, false otherwise.
+         */
+        bool CreateDeadlineTimer(MeshEventType Type, const char* Name);
+
+
+
+        /**
+         * @brief (Re)arms the one-shot timer for a deadline event.
+         * @param Type The deadline event type.
+         * @param DelayMs Time until the event is posted.
+         * @return Void.
+         */
+        void ArmDeadline(MeshEventType Type, uint32_t DelayMs);
+
+
+
+        /**
+         * @brief   Callback function for handling vendor-specific Information Elements (IEs) received during WiFi scanning. This function processes the IEs to extract mesh-related metadata such as hop count and child count, and updates an internal cache for use in AP selection logic.
+         * @param ctx Context pointer (not used in this implementation).
+         * @param type The type of the vendor IE (e.g., beacon, probe response).
+         * @param sa The source MAC address of the device that sent the IE.
+         * @param vnd_ie Pointer to the vendor IE data structure containing the OUI and payload.
+         * @param rssi The RSSI value of the received IE, which can be used for logging or decision-making.
+         * @return Void.
+         */
+        static void WifiVendorIeCb(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi);
+
+
+
+        /**
+         * @brief Checks the heartbeat deadline of the parent and of every child. A mesh parent that has missed MESH_HEARTBEAT_MISS_LIMIT heartbeats is declared lost and the STA link is dropped; a silent child is deauthenticated so its slot frees up.
+         * @return Void.
+         */
+        void CheckLiveness();
+
+
+
+        /**
+         * @brief A relay that was promoted from a leaf only stays one while it is needed. Once it has had no children for MESH_PROMOTED_IDLE_MS it stores the leaf role and restarts as a leaf.
+         * @return Void.
+         */
+        void CheckPromotedRole();
+
+
+
+        /**
+         * @brief Sends an explicit keepalive on every link (upstream to the parent or master, downstream to each child) that has carried no traffic for MESH_HEARTBEAT_PERIOD_MS. Busy links are skipped, since any packet already counts as a heartbeat at the receiver. Called once per heartbeat period.
+         * @return Void.
+         */
+        void SendIdleKeepalives();
+
+
+
+        /**
+         * @brief Builds a link control packet (heartbeat, echo) and sends it to one neighbour.
+         * @param Destination The neighbour's address.
+         * @param PacketType One of the link control packet types.
+         * @param Payload Payload of at most 16 bytes.
+         * @param PayloadLength Number of bytes in Payload.
+         * @return int: The result of sendto.
+         */
+        int SendLinkControl(const sockaddr_in& Destination, uint8_t PacketType, const void* Payload, size_t PayloadLength);
+
+
+
+        /**
+         * @brief Sends a heartbeat carrying the next sequence number of the link and our delivery ratio of the neighbour's heartbeats.
+         * @param Destination The neighbour's address.
+         * @return int: The result of sendto.
+         */
+        int SendHeartbeat(const sockaddr_in& Destination);
+
+
+
+        /**
+         * @brief Sends an echo request to the parent (not the master, which does not answer) and to every child, and samples child RSSI from the SoftAP station list. Called every MESH_ECHO_PERIOD_MS.
+         * @return Void.
+         */
+        void SendEchoRequests();
+
+
+
+        /**
+         * @brief Sends a time sync request upstream: to the parent, to the master at hop 1, or over the host link on a root gateway. Called every MESH_TIME_SYNC_PERIOD_MS.
+         * @return Void.
+         */
+        void SendTimeSyncRequest();
+
+
+
+        /**
+         * @brief Checks if a packet came from above this node: the parent, or the master when connected to its router.
+         * @param SourceAddress Sender of the packet.
+         * @return bool: True for the parent or master address.
+         */
+        bool IsFromUpstream(const sockaddr_in& SourceAddress) const;
+
+
+
+        /**
+         * @brief Hands a firmware update packet to MeshOta. Forwarding to the children is done by the caller, before the flash write.
+         * @param PacketType One of the PACKET_TYPE_OTA_* types sent downstream.
+         * @param Payload Payload of the packet.
+         * @param PayloadSize Number of bytes in Payload.
+         * @return Void.
+         */
+        void HandleOtaPacket(uint8_t PacketType, const uint8_t* Payload, uint16_t PayloadSize);
+
+
+
+        /**
+         * @brief MeshOta callbacks. Status reports go upstream like any other packet (to the host on a root), and the role is written to NVS before restarting so the new image starts in the same role.
+         */
+        static bool OtaStatusSender(const uint8_t* Payload, size_t Length);
+        static void OtaBeforeRestart();
+
+
+
+        /**
+         * @brief Sends a framed packet towards the master: to the host link on a root, to the parent or the master's router otherwise.
+         * @param Data Framed packet.
+         * @param Length Number of bytes in Data.
+         * @return bool: True if the packet was handed to the socket or the host link.
+         */
+        bool SendUpstream(const uint8_t* Data, size_t Length);
+
+
+
+        /**
+         * @brief Store-and-forward callback, sends one held packet with SendUpstream.
+         */
+        static bool BackfillSender(const uint8_t* Data, size_t Length);
+
+
+
+        /**
+         * @brief Sends the neighbours seen in the last scan, with the measured ETX of the linked ones, upstream to the master's topology optimizer. Not stored when there is no route, the next report replaces it.
+         * @return Void.
+         */
+        void SendNeighbourReport();
+
+
+
+        /**
+         * @brief Root gateway only. Sends a root announce to the master through the host link and refreshes the advertised path cost, which grows with the host link load so new nodes favour the less loaded gateway.
+         * @return Void.
+         */
+        void SendRootAnnounce();
+
+
+
+        /**
+         * @brief Root gateway only. Withdraws the route when no frame has come from the host for MESH_ROOT_HOST_TIMEOUT_MS, so the subtree moves to another root, and restores hop 0 once frames arrive again.
+         * @return Void.
+         */
+        void CheckHostLink();
+
+
+
+        /**
+         * @brief Records a transmission on a mesh link. Upstream sends feed the uplink load and the upstream idle timer, sends to a child refresh that child's idle timer.
+         * @param Destination The address the packet was sent to.
+         * @param Bytes The number of bytes sent, ignored if not positive.
+         * @return Void.
+         */
+        void NoteLinkTx(const sockaddr_in& Destination, int Bytes);
+
+
+
+        /**
+         * @brief Fills in the upstream destination: the master when connected to its router, otherwise the parent node.
+         * @param DestinationAddress Populated with the upstream address and UDP port.
+         * @return bool: True if an upstream address is known, false otherwise.
+         */
+        bool GetUpstreamAddress(sockaddr_in& DestinationAddress) const;
+
+
+
+        /**
+         * @brief Sends a packet to every child that has been given an IP.
+         * @param Data The complete packet to send.
+         * @param Length Length of the packet.
+         * @return Void.
+         */
+        void SendToChildren(const uint8_t* Data, size_t Length);
+
+
+
+        /**
+         * @brief Poisons this node's route, refreshes the beacon and sends a route withdrawn packet to the children, so the subtree reacts without waiting for beacons or its own timeouts. Only acts once per loss, later calls until the next IP are ignored.
+         * @param Reason Text for the runtime log.
+         * @return Void.
+         */
+        void DeclareParentLost(const char* Reason);
+
+
+
+        /**
+         * @brief Reads the cached parent from NVS into ParentCache.
+         * @return bool: True if a valid cache entry was found, false otherwise.
          */
-        AccessPointStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging);
+        bool LoadParentCache();
 
 
 
         /**
-         * @brief Destructor for AccessPointStation class. Cleans up resources, stops UDP if running, and resets the singleton instance pointer.
-         * @return None.
+         * @brief Writes the current parent to NVS. Skipped when it matches what is already stored, so flash is only written when the parent changes.
+         * @return Void.
          */
-        ~AccessPointStation();
+        void SaveParentCache();
 
 
 
         /**
-         * @brief Event handler for WiFi events related to the Access Point interface. 
-            Handles station connection and disconnection events, updates internal state, manages child device list, and updates beacon metadata accordingly.
+         * @brief Removes the cached parent from NVS, used when a warm reconnect fails.
          * @return Void.
          */
-        static void ApWifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);
+        void EraseParentCache();
 
 
 
         /**
-         * @brief Event handler for WiFi events related to the Station interface. 
-             Handles connection and disconnection events, updates internal state, manages mesh hop count, and starts/stops UDP accordingly.
-         * @return Void.
+         * @brief Connects straight to the cached parent without scanning. A failure falls back to the normal scan and clears the cache.
+         * @return bool: True if a connection attempt was started, false otherwise.
          */
-        static void StaWifiEventHandler(void* arg, esp_event_base_t event_base, int32_t event_id, void* event_data);       
-                                    
-                                    
+        bool WarmReconnect();
+
+
 
         /**
-         * @brief Event handler for IP events related to the Station interface. 
-             Handles IP acquisition and loss, updates internal state, manages mesh hop count, and starts/stops UDP accordingly.
-         * @return Void.
+         * @brief Initiates a mesh scan to discover nearby mesh nodes.
+         * @return bool: True if the scan was successfully initiated, false otherwise. The scan is non-blocking, and results will be processed in the event handler when the scan completes.
          */
-        static void IpEventHandler(void* arg, esp_event_base_t event_base,int32_t event_id, void* event_data);
-                            
+        bool InitiateMeshScan();
+
 
 
         /**
-         * @brief Receive task for handling incoming UDP packets. This function runs in a FreeRTOS task and processes received data, 
-             storing it in an internal buffer for later retrieval.
-         * @param pvParameters 
+         * @brief Encodes the current mesh state (UID, network ID, hop count, path cost, uplink load, free child slots and ancestor digest) into the versioned mesh vendor IE and sets it for both beacon and probe response frames. The driver is only touched when the encoded IE differs from the one already installed, so this can be called as often as needed.
          * @return Void.
          */
-        static void ReceiveTask(void* pvParameters);
-        TaskHandle_t ReceiveTaskHandle = nullptr;
+        void UpdateBeaconMetadata();
 
 
 
         /**
-         * @brief Transmit task for sending UDP packets. This function runs in a FreeRTOS task and checks for prepared packets to send, 
-             transmitting them to the appropriate destination based on the current connection status.
-         * @param pvParameters 
+         * @brief Measures the bytes sent upstream since the last call and converts them into the uplink load advertised in the mesh IE. Called from the mesh task before each beacon refresh.
          * @return Void.
          */
-        static void TransmitTask(void* pvParameters);
-        TaskHandle_t TransmitTaskHandle = nullptr;
+        void UpdateUplinkLoad();
 
 
 
         /**
-         * @brief Mesh task for handling mesh-specific operations such as scanning for parent nodes, managing hop counts, and updating beacon metadata. 
-             This function runs in a FreeRTOS task and performs periodic checks and updates related to the mesh network.
-         * 
-         * @param pvParameters 
+         * @brief Sets how many children this node admits from the uplink load, the upstream packets held or refused and the parent link ETX. A lossy uplink carries proportionally fewer children, a loaded one admits no more, and an overloaded one lowers the limit below the current children and steers the most marginal one away. The limit opens one slot per period and closes at once. Called from the mesh task after UpdateUplinkLoad.
+         * @return Void.
          */
-        static void MeshTask(void* pvParameters); 
-        TaskHandle_t MeshTaskHandle = nullptr;
+        void UpdateChildLimit();
 
 
 
         /**
-         * @brief   Callback function for handling vendor-specific Information Elements (IEs) received during WiFi scanning. This function processes the IEs to extract mesh-related metadata such as hop count and child count, and updates an internal cache for use in AP selection logic.
-         * @param ctx Context pointer (not used in this implementation).
-         * @param type The type of the vendor IE (e.g., beacon, probe response).
-         * @param sa The source MAC address of the device that sent the IE.
-         * @param vnd_ie Pointer to the vendor IE data structure containing the OUI and payload.
-         * @param rssi The RSSI value of the received IE, which can be used for logging or decision-making.
+         * @brief Brings the soft-AP max_connection in line with the child limit. Reconfiguring a running soft-AP restarts it and drops every child, so this only happens while no child is connected; until then joins above the limit are turned away when they arrive.
          * @return Void.
          */
-        static void WifiVendorIeCb(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi);
+        void ApplyApMaxConnection();
 
 
 
         /**
-         * @brief Initiates a mesh scan to discover nearby mesh nodes.
-         * @return bool: True if the scan was successfully initiated, false otherwise. The scan is non-blocking, and results will be processed in the event handler when the scan completes.
+         * @brief Sends the child with the worst link, among those whose last neighbour report named another parent with a free slot, a preferred parent packet for that parent. At most one child per MESH_STEER_HOLDOFF_MS.
+         * @return bool: True if a child was steered.
          */
-        bool InitiateMeshScan();
+        bool SteerMarginalChild();
 
 
 
         /**
-         * @brief Updates the beacon metadata with the current hop count and child count. This function constructs a vendor-specific IE with the mesh information and sets it for both beacon and probe response frames. This allows other devices scanning for WiFi networks to receive up-to-date information about this node's position in the mesh network.
-         * @param Hop 
-         * @param Children 
+         * @brief Takes the best alternative parent out of a neighbour report sent by a direct child: a node no deeper than this one, with a free slot and heard at MESH_STEER_MIN_RSSI or better, or the master's router.
+         * @param Slot Child table index of the sender.
+         * @param Payload Report payload, MeshNeighbourReportHeader and entries.
+         * @param PayloadSize Number of bytes in Payload.
          * @return Void.
          */
-        void UpdateBeaconMetadata(uint8_t Hop, uint8_t Children);
+        void NoteChildAlternative(int Slot, const uint8_t* Payload, uint16_t PayloadSize);
 
 
 
         /**
-         * @brief Parses the results of a WiFi scan to identify potential parent nodes for the mesh network. This function processes the list of scanned APs, checks for the presence of the custom mesh IE, and extracts metadata such as hop count and child count. Based on this information, it determines if there is a better parent node to connect to and updates internal state accordingly.
+         * @brief Parses the results of a WiFi scan to identify potential parent nodes for the mesh network. This function processes the list of scanned APs, checks for the presence of the custom mesh IE, and extracts metadata such as hop count and child count. Based on this information, it determines if there is a better parent node to connect to and updates internal state accordingly. Candidates whose ancestor digest already contains this node are descendants and are never chosen; if the current parent turns out to be one, the link is dropped.
          * @return Void.
          */
         void ParseScanResults();
 
 
 
+        /**
+         * @brief Copies the current scan candidate (record, hop count, path cost and ancestor digest) into the parent state ahead of a connection attempt.
+         * @return Void.
+         */
+        void AdoptCandidateAsParent();
+
+
+
         /**
          * @brief Connects to the best available parent AP based on the results of the WiFi scan and the extracted mesh metadata. This function evaluates potential parent nodes, compares their hop counts and child counts, and initiates a connection to the most suitable parent AP to optimize the mesh network topology.
          * @return Void.
@@ -340,12 +1242,51 @@ class AccessPointStation // Singleton
 
 
         /**
-         * @brief Processes received data from the UDP buffer, extracting complete packets and handling them according to their type. This function is called by the receive task when new data is available, and it manages the internal state of received packets, ensuring that they are properly parsed and processed.
+         * @brief Processes received data from the UDP buffer, extracting complete packets and handling them according to their type. This function is called by the receive task when new data is available, and it manages the internal state of received packets, ensuring that they are properly parsed and processed. Link control packets from a child's IP teach the child table that child's UID, they are never forwarded so the UID is the child's own. Upstream traffic a child forwards teaches the descendant table which child each deeper node is behind. Downstream routing relies on both.
          * @param data 
          * @param length 
+         * @param SourceAddress The address the packet was received from.
+         * @return Void.
+         */
+        void ProcessData(uint8_t* data, int length, const sockaddr_in& SourceAddress);
+
+
+
+        /**
+         * @brief Finds the child table slot holding the given station MAC. Must be called inside CriticalSection.
+         * @param Mac The station MAC address of the child.
+         * @return int: The slot index, or -1 if no active child has this MAC.
+         */
+        int FindChildByMac(const uint8_t Mac[6]) const;
+
+
+
+        /**
+         * @brief Recounts the active slots of the child table into ActiveChildren. Must be called inside CriticalSection.
+         * @return Void.
+         */
+        void RecountChildren();
+
+
+
+        /**
+         * @brief Remembers that a node's upstream traffic came through a child, so downstream unicast to it goes the same way. Must be called inside CriticalSection.
+         * @param Uid UID of the node that made the packet.
+         * @param ChildSlot Child table slot the packet arrived from.
+         * @param Now Local time in microseconds.
          * @return Void.
          */
-        void ProcessData(uint8_t* data, int length);
+        void NoteDescendant(uint64_t Uid, int ChildSlot, int64_t Now);
+
+
+
+        /**
+         * @brief Finds the child that leads to a UID, the child itself or the one a descendant was last heard through. Must be called inside CriticalSection.
+         * @param Uid UID of the destination.
+         * @param Now Local time in microseconds, descendants not heard for MESH_DESCENDANT_TIMEOUT_MS are not used.
+         * @return int: The child table slot, or -1 if no child leads to the UID.
+         */
+        int FindChildForUid(uint64_t Uid, int64_t Now) const;
 
 
 
@@ -407,19 +1348,84 @@ class AccessPointStation // Singleton
 
 
 
-        MeshMetadata CallbackIeData[20]{};
+        MeshMetadata CallbackIeData[MESH_IE_CACHE_SIZE]{};
         uint8_t MyHopCount = 255; // Default to 'Infinity' until connected
+        uint16_t MyPathCost = MESH_PATH_COST_INFINITE;
+        uint64_t MyAncestorDigest = 0;
+        uint64_t MyRootUid = 0;
+        uint8_t MyUplinkLoad = 0;
+        volatile uint32_t UplinkTxBytes = 0;
+        volatile int64_t LastUplinkTxUs = 0;
+        MeshKeepaliveStats KeepaliveStats{};
+        LinkEstimator LinkTable;
+        MeshClock Clock;
+        MeshTdma Slots;
+        MeshCommandBuffer Commands;
+        MeshOta Ota;
+        StoreForward Backlog;
+        int64_t UplinkLoadWindowStartUs = 0;
+
+        MeshIePayload InstalledIe{};
+        bool IsIeInstalled = false;
+        uint32_t IeDriverUpdates = 0;
 
         wifi_ap_record_t CandidateWifiRecord{};
         wifi_ap_record_t ParentWifiRecord{};
         bool IsCandidateValid = false;
         bool IsCandidateMaster = false;
-        bool RoamRequested = false;
+        bool PendingRoam = false;
         uint8_t CandidateHop = 0;
         uint8_t CandidateChildren = 0;
+        uint16_t CandidatePathCost = MESH_PATH_COST_INFINITE;
+        uint64_t CandidateDigest = 0;
+        uint64_t CandidateUid = 0;
+        uint64_t CandidateRootUid = 0;
+        uint32_t LoopCandidatesRejected = 0;
+        uint32_t ParentLoopsUncorroborated = 0;
         bool IsMasterFound = false;
         bool IsScanning = false;
         bool IsConnecting = false;
+        bool IsRouteWithdrawn = false;
+        int64_t ParentLostAtUs = 0;
+        MeshFailoverStats FailoverStats{};
+
+
+        // Topology reports for the master, and the parent it asked this node to use
+        MeshMetadata ScanNeighbours[MESH_IE_CACHE_SIZE]{};
+        int8_t ScanMasterRssi = 0;
+        uint64_t PreferredParentUid = 0;
+        int64_t PreferredParentUntilUs = 0;
+        MeshTopologyStats TopologyStats{};
+
+
+        // Promoted from a leaf, read from NVS at setup. LastChildUs is the last time the relay was needed.
+        bool IsPromoted = false;
+        int64_t LastChildUs = 0;
+
+
+        // Admission control, children accepted as the uplink allows
+        uint8_t ChildLimit = MAX_STA_CONN;
+        uint8_t ApMaxConnection = MAX_STA_CONN;
+        volatile uint32_t UplinkTxFailures = 0;
+        int64_t LastSteerUs = 0;
+        MeshAdmissionStats AdmissionStats{};
+
+
+        // Root gateway, upstream traffic ends on the host link instead of a parent
+        bool IsRootGateway = false;
+        bool (*HostUplink)(const uint8_t* Data, size_t Length) = nullptr;
+        uint32_t UplinkCapacityBytesPerS = MESH_UPLINK_CAPACITY_BYTES_PER_S;
+        MeshGatewayStats GatewayStats{};
+        volatile int64_t LastHostRxUs = 0;
+        bool ForwardToHost(const uint8_t* Data, int Length);
+        MeshParentCache ParentCache{};
+        bool IsParentCacheValid = false;
+        bool IsWarmConnecting = false;
+        MeshBootStats BootStats{};
+
+        esp_timer_handle_t DeadlineTimers[(size_t)MeshEventType::Count]{};
+        MeshEventLatency EventLatency[(size_t)MeshEventType::Count]{};
+        uint32_t DroppedMeshEvents = 0;
         
         
         
@@ -470,16 +1476,17 @@ class AccessPointStation // Singleton
         int UdpSocket = -1;
         char MyStaIpAddress[16]; // IP given by parent
         char MyApIpAddress[16]; // IP of this AP
-        volatile int64_t LastHeartbeatUs = 0;
         WifiDevice ParentDevice{};  
-        std::vector<WifiDevice> ChildDevices{};
+        WifiDevice ChildDevices[MESH_MAX_CHILDREN]{}; // Fixed table, slots are matched by MAC and guarded by CriticalSection
+        MeshDescendant Descendants[MESH_MAX_DESCENDANTS]{}; // Learned from forwarded upstream traffic, guarded by CriticalSection
+        volatile uint8_t ActiveChildren = 0;
 
 
 
     public:
 
         /**
-         * @brief Setup the WiFi system as an Access Point + Station (Mesh Node). This function initializes the WiFi driver, configures the device as both an AP and a STA, registers event handlers, and starts the necessary FreeRTOS tasks for handling WiFi events, UDP communication, and mesh operations.
+         * @brief Setup the WiFi system as an Access Point + Station (Mesh Node). This function initializes the WiFi driver, configures the device as both an AP and a STA, registers event handlers, and starts the necessary FreeRTOS tasks for handling WiFi events, UDP communication, and mesh operations. The setup steps run back to back in one call; a failed step returns false and is retried from where it stopped on the next call. If a parent is cached in NVS the node reconnects to it without scanning.
          * @return bool: True if setup was successful, false otherwise. Note that this function may return true even if the device is not currently connected to a parent AP, as it may still be in the process of scanning and connecting.
          */
         bool SetupWifi();     
@@ -518,7 +1525,7 @@ class AccessPointStation // Singleton
          * @brief Check if the device is currently connected to a parent AP (host) and has acquired an IP address. This indicates that the device is successfully part of the mesh network and can communicate with other nodes.
          * @return bool: True if the device is connected to a parent and has an IP address, false otherwise.
          */
-        bool IsConnectedToHost() const { return IsConnectedToParent && ApIpAcquired; }
+        bool IsConnectedToHost() const { return IsRootGateway ? SystemInitialized : (IsConnectedToParent && ApIpAcquired); }
         
         
         
@@ -542,7 +1549,283 @@ class AccessPointStation // Singleton
          * @brief Get the number of child devices currently connected to this device's AP. This indicates how many other devices are currently connected to this node as their parent in the mesh network.
          * @return size_t: The number of child devices currently connected, or 0 if no devices are connected.
          */
-        size_t GetNumChildren() const { return ChildDevices.size(); }
+        size_t GetNumChildren() const { return ActiveChildren; }
+
+
+
+        /**
+         * @brief Copy the active entries of the child table (MAC, IP, learned UID, packet count) into a caller buffer. The copy is taken under the critical section, so it is consistent even while children join and leave.
+         * @param DevicesOut Buffer to receive the child entries.
+         * @param MaxDevices Number of entries DevicesOut can hold.
+         * @return size_t: The number of entries written.
+         */
+        size_t GetChildDevices(WifiDevice* DevicesOut, size_t MaxDevices);
+
+
+
+        /**
+         * @brief Get the path cost to the root that this node advertises in its mesh IE. MESH_PATH_COST_INFINITE indicates that the node has no route to the root.
+         * @return uint16_t: The current path cost.
+         */
+        uint16_t GetPathCost() const { return MyPathCost; }
+
+
+
+        /**
+         * @brief Get the number of times the mesh vendor IE has actually been pushed to the WiFi driver. Calls to UpdateBeaconMetadata that do not change the IE are not counted.
+         * @return uint32_t: The number of driver updates since boot.
+         */
+        uint32_t GetIeDriverUpdateCount() const { return IeDriverUpdates; }
+
+
+
+        /**
+         * @brief Get the number of scan candidates rejected because their path to the root already passes through this node.
+         * @return uint32_t: The number of rejected candidates since boot.
+         */
+        uint32_t GetLoopRejectCount() const { return LoopCandidatesRejected; }
+
+
+
+        /**
+         * @brief Get the number of scans where the parent's digest covered this node but its hop count showed it cannot route through us, a Bloom false positive the parent was kept through.
+         * @return uint32_t: The number of such scans since boot.
+         */
+        uint32_t GetParentLoopSuspectCount() const { return ParentLoopsUncorroborated; }
+
+
+
+        /**
+         * @brief Get the reaction latency of one mesh event type, measured from the moment the event is posted until the mesh task has finished handling it.
+         * @param Type The event type.
+         * @return MeshEventLatency: A copy of the latency statistics, all zero for an invalid type.
+         */
+        MeshEventLatency GetEventLatency(MeshEventType Type) const 
+        { 
+            return (Type < MeshEventType::Count) ? EventLatency[(size_t)Type] : MeshEventLatency{}; 
+        }
+
+
+
+        /**
+         * @brief Get the number of mesh events dropped because the event queue was full.
+         * @return uint32_t: The number of dropped events since boot.
+         */
+        uint32_t GetDroppedEventCount() const { return DroppedMeshEvents; }
+
+
+
+        /**
+         * @brief Get the parent loss and failover statistics. Failover time runs from the moment the loss is declared (heartbeat timeout, route withdrawn or WiFi disconnect) until an IP is acquired on the new route.
+         * @return MeshFailoverStats: A copy of the current statistics.
+         */
+        MeshFailoverStats GetFailoverStats() const { return FailoverStats; }
+
+
+
+        /**
+         * @brief Get the keepalive statistics. Suppressed keepalives are the ones a fixed heartbeat schedule would have sent but that ordinary traffic made unnecessary; on hop 1 nodes UpstreamBytesSaved is the airtime saved at the root.
+         * @return MeshKeepaliveStats: A copy of the current statistics.
+         */
+        MeshKeepaliveStats GetKeepaliveStats() const { return KeepaliveStats; }
+
+
+
+        /**
+         * @brief Get the boot timing of this node: setup complete, first link to a parent, first IP and first packet sent upstream, all measured from boot, and whether the cached parent was used.
+         * @return MeshBootStats: A copy of the boot timings, 0 for steps not reached yet.
+         */
+        MeshBootStats GetBootStats() const { return BootStats; }
+
+
+
+        /**
+         * @brief Get the measured quality of every link (parent and children): ETX from heartbeat loss in both directions, loss rate, echo RTT and RSSI, all EWMA smoothed.
+         * @param Out Buffer for the links.
+         * @param MaxLinks Number of entries Out can hold, LINK_TABLE_SIZE covers every link.
+         * @return size_t: The number of links written.
+         */
+        size_t GetLinkQualities(LinkQuality* Out, size_t MaxLinks) const { return LinkTable.GetLinks(Out, MaxLinks); }
+
+
+
+        /**
+         * @brief Get the measured quality of the link to one neighbour. The UID is learned from the neighbour's heartbeats.
+         * @param Uid The neighbour's UID.
+         * @param Out Filled with a copy of the link.
+         * @return bool: True if the neighbour is a parent or child of this node.
+         */
+        bool GetLinkQuality(uint64_t Uid, LinkQuality& Out) const { return LinkTable.GetLinkByUid(Uid, Out); }
+
+
+
+        /**
+         * @brief Get the measured quality of the link to the parent.
+         * @param Out Filled with a copy of the link.
+         * @return bool: True if connected to a parent.
+         */
+        bool GetParentLinkQuality(LinkQuality& Out) const { return LinkTable.GetParentLink(Out); }
+
+
+
+        /**
+         * @brief Get the mesh time, the master's clock as followed hop by hop from the root. Children are answered from the same clock. Local time until the first sync.
+         * @return int64_t: Mesh time in microseconds.
+         */
+        int64_t GetMeshTimeUs() const { return Clock.GetMeshTimeUs(); }
+
+
+
+        /**
+         * @brief Get the clock offset and drift, the sync error measured on the hop to the parent and the accumulated error reported to the children.
+         * @return MeshClockStats: A copy of the statistics.
+         */
+        MeshClockStats GetClockStats() const { return Clock.GetStats(); }
+
+
+
+        /**
+         * @brief Find the master's cycle a local time falls in, from the last cycle marker and the mesh clock.
+         * @param LocalUs Local time in microseconds, from esp_timer_get_time().
+         * @param Cycle Master's cycle number.
+         * @param PhaseUs Time since that cycle started.
+         * @param PeriodUs Master's cycle period.
+         * @return bool: False while the clock is not synchronised or no marker has come in lately.
+         */
+        bool GetMasterCycle(int64_t LocalUs, uint64_t& Cycle, uint32_t& PhaseUs, uint32_t& PeriodUs) const { return Clock.GetCycleAt(LocalUs, Cycle, PhaseUs, PeriodUs); }
+
+
+
+        /**
+         * @brief Take the next command from the master that is due in the current cycle. Call from the cyclic task until it returns false.
+         * @param CycleStartUs Local time the current cycle started, the master cycle is the one nearest to it.
+         * @param Out Filled with the command, late or unscheduled if it could not be kept to its cycle.
+         * @return bool: True if a command was taken.
+         */
+        bool TakeDueCommand(int64_t CycleStartUs, MeshCommand& Out);
+
+
+
+        /**
+         * @brief Get the counters of the commands held for their cycle and the lead they arrived with.
+         * @return MeshCommandStats: A copy of the statistics.
+         */
+        MeshCommandStats GetCommandStats() const { return Commands.GetStats(); }
+
+
+
+        /**
+         * @brief Get the progress of a firmware update received through the mesh.
+         * @return MeshOtaStats: A copy of the statistics.
+         */
+        MeshOtaStats GetOtaStats() const { return Ota.GetStats(); }
+
+
+
+        /**
+         * @brief Wrap a payload in a PacketHeader and send it towards the master (upstream forwarding mode). Without a route the packet is kept in the store-and-forward buffer and backfilled after reconnect, at MESH_BACKFILL_BYTES_PER_S so fresh packets keep the link. With slotted transmission the packet waits for this node's slot. The header carries the master cycle the data belongs to, so the master can line up every node's data of one cycle.
+         * @param Payload Data to send.
+         * @param PayloadLength Number of bytes in Payload.
+         * @param PacketType Packet type written to the header, must not be 0.
+         * @param SampledUs Local time the data was sampled, GetCycleStartUs() from the cyclic task. 0 stamps the master cycle the packet is built in.
+         * @return size_t: The number of bytes sent, 0 if it was stored or dropped. A packet held for its slot counts as sent.
+         */
+        size_t SendPacket(const uint8_t* Payload, size_t PayloadLength, uint8_t PacketType, int64_t SampledUs = 0);
+
+
+
+        /**
+         * @brief Send fresh packets only inside this node's slot of the cycle, aligned to mesh time. Every node of the mesh must use the same cycle and slot count. Until the clock is synchronised packets go out at once. A root gateway sends over its host link and is never slotted.
+         * @param CycleUs Length of one cycle, the cyclic task period shared by the mesh.
+         * @param SlotCount Slots per cycle, 1 to MESH_TDMA_MAX_SLOTS.
+         * @return bool: False if the slot would be too short or the slot timer could not be created.
+         */
+        bool EnableSlottedTx(uint32_t CycleUs, uint8_t SlotCount);
+
+
+
+        /**
+         * @brief Pin the transmit slot, for a plan made by the master. By default it follows the hop count and UID.
+         * @param Slot Slot index, MESH_TDMA_AUTO_SLOT to go back to the automatic slot.
+         * @return bool: False if the slot is out of range.
+         */
+        bool SetTransmitSlot(int Slot) { return Slots.SetFixedSlot(Slot); }
+
+
+
+        /**
+         * @brief Get the slot, the time packets waited for it and the send counters, slotted and free-for-all.
+         * @return MeshTdmaStats: A copy of the statistics.
+         */
+        MeshTdmaStats GetSlotStats() const { return Slots.GetStats(); }
+
+
+
+        /**
+         * @brief Get the occupancy, drop and backfill counters of the store-and-forward buffer.
+         * @return StoreForwardStats: A copy of the statistics.
+         */
+        StoreForwardStats GetBacklogStats() const { return Backlog.GetStats(); }
+
+
+
+        /**
+         * @brief Get the neighbour report counters and the parent the master currently prefers for this node. While a preference holds, the node roams to that parent as soon as a scan sees it with a route and a free slot, and stays there even if a shallower parent appears.
+         * @return MeshTopologyStats: A copy of the statistics.
+         */
+        MeshTopologyStats GetTopologyStats() const;
+
+
+
+        /**
+         * @brief Get the current child limit, the uplink figures it was set from and the admission and steering counters.
+         * @return MeshAdmissionStats: A copy of the statistics.
+         */
+        MeshAdmissionStats GetAdmissionStats() const;
+
+
+
+        /**
+         * @brief Run this node as a root of the mesh. A root does not scan or join a parent; it advertises hop 0 and hands every upstream packet to HostUplink (a serial link to the master) instead of a router. Several roots, and the master's router, can serve one network ID; every node joins the one with the lowest path cost. Must be called before SetupWifi.
+         * @param Uplink Called with each framed packet bound for the master, returns false if the link could not take it.
+         * @param CapacityBytesPerS Throughput of the host link, used for the uplink load advertised in the IE.
+         * @return void.
+         */
+        void EnableRootGateway(bool (*Uplink)(const uint8_t* Data, size_t Length), uint32_t CapacityBytesPerS);
+
+
+
+        /**
+         * @brief Pass a packet from the master into the mesh. Downstream packets are sent to the child that owns the destination UID, packets with ForwardingMode 0 are for this node. Every frame counts as proof that the host link is alive; root announce acks end here. Only valid on a root gateway.
+         * @param Data Framed packet as received from the host link.
+         * @param Length Number of bytes in Data.
+         * @return bool: True if the packet was accepted.
+         */
+        bool InjectFromHost(const uint8_t* Data, size_t Length);
+
+
+
+        /**
+         * @brief Check whether this node runs as the root gateway.
+         * @return bool: True on a root gateway.
+         */
+        bool IsRoot() const { return IsRootGateway; }
+
+
+
+        /**
+         * @brief Get the root gateway this node's path ends at, as advertised by its parent.
+         * @return uint64_t: The root's UID, this node's own UID on a root gateway, 0 behind the master's router.
+         */
+        uint64_t GetRootUid() const { return MyRootUid; }
+
+
+
+        /**
+         * @brief Get the host link statistics of a root gateway. All zero on other nodes.
+         * @return MeshGatewayStats: A copy of the current statistics.
+         */
+        MeshGatewayStats GetGatewayStats() const { return GatewayStats; }
 
 
 
@@ -577,6 +1860,40 @@ class WifiFactory
         static Station* CreateStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging);
         // static AccessPoint* CreateAccessPoint(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging);
         static AccessPointStation* CreateAccessPointStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging);
+
+
+
+        /**
+         * @brief Get the role this node should start in. A role stored in NVS (written by a promotion, a reverted promotion or an update) overrides the build-time default from CONFIG_ESP_LEAF_NODE.
+         * @return MeshRole: Leaf to create a Station, Relay to create an AccessPointStation.
+         */
+        static MeshRole GetConfiguredRole();
+
+
+
+        /**
+         * @brief Store the role to start in on the next boot.
+         * @param Role The role to store.
+         * @param IsPromotion True if a leaf stores the relay role to serve a neighbour, the relay then reverts once it is not needed.
+         * @return bool: True if the role was written to NVS.
+         */
+        static bool SetConfiguredRole(MeshRole Role, bool IsPromotion = false);
+
+
+
+        /**
+         * @brief Check if the stored role was written by a promotion.
+         * @return bool: True if this node is a relay only because a neighbour needed it.
+         */
+        static bool IsPromotedRole();
+
+
+
+        /**
+         * @brief Get this node's UID. A build with a non-zero CONFIG_ESP_NODE_UID owns that UID and stores it in NVS; a build with UID 0 (one image for every node, as sent through the mesh) keeps the UID the node has stored, or derives one from the MAC if there is none.
+         * @return uint64_t: The UID used in every packet and beacon.
+         */
+        static uint64_t GetNodeUid();
 };
 
 
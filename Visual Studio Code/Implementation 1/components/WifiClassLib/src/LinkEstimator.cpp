@@ -0,0 +1,290 @@
+#include "LinkEstimator.h"
+#include "esp_timer.h"
+#include <cstring>
+
+// Author - Ben Sturdy
+// Per-neighbour link quality for the mesh. One entry per live link (parent and
+// children), fed by per-link sequence gaps on heartbeats and data, echo round
+// trips and RSSI, and smoothed with an EWMA.
+
+
+
+
+
+int LinkEstimator::FindByIp(uint32_t Ip) const
+{
+    for (int i = 0; i < (int)LINK_TABLE_SIZE; i++)
+    {
+        if (Links[i].IsActive && Links[i].Ip == Ip) return i;
+    }
+    return -1;
+}
+
+
+
+int LinkEstimator::FindByMac(const uint8_t Mac[6]) const
+{
+    for (int i = 0; i < (int)LINK_TABLE_SIZE; i++)
+    {
+        if (Links[i].IsActive && memcmp(Links[i].Mac, Mac, 6) == 0) return i;
+    }
+    return -1;
+}
+
+
+
+void LinkEstimator::UpdateEtx(LinkQuality& Link)
+{
+    const float Delivery = Link.ForwardDelivery * Link.ReverseDelivery;
+    Link.Etx = (Delivery > 1.0f / LINK_ETX_MAX) ? 1.0f / Delivery : LINK_ETX_MAX;
+    Link.LossRate = 1.0f - Link.ReverseDelivery;
+}
+
+
+
+void LinkEstimator::AddLink(uint32_t Ip, const uint8_t Mac[6], bool IsParent)
+{
+    portENTER_CRITICAL(&CriticalSection);
+
+    int Slot = FindByIp(Ip);
+    if (Slot < 0) Slot = FindByMac(Mac);
+    for (int i = 0; Slot < 0 && i < (int)LINK_TABLE_SIZE; i++)
+    {
+        if (!Links[i].IsActive) Slot = i;
+    }
+
+    if (Slot >= 0)
+    {
+        // Optimistic start, one lost heartbeat should not make a new link look dead
+        LinkQuality& Link = Links[Slot];
+        memset(&Link, 0, sizeof(LinkQuality));
+        Link.IsActive = true;
+        Link.Ip = Ip;
+        Link.IsParent = IsParent;
+        memcpy(Link.Mac, Mac, 6);
+        Link.ForwardDelivery = 1.0f;
+        Link.ReverseDelivery = 1.0f;
+        Link.LastUpdateUs = esp_timer_get_time();
+        UpdateEtx(Link);
+    }
+
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::RemoveLinkByMac(const uint8_t Mac[6])
+{
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByMac(Mac);
+    if (Slot >= 0) Links[Slot].IsActive = false;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::RemoveParent()
+{
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)LINK_TABLE_SIZE; i++)
+    {
+        if (Links[i].IsParent) Links[i].IsActive = false;
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+bool LinkEstimator::PrepareHeartbeat(uint32_t Ip, MeshHeartbeatPayload& Payload)
+{
+    Payload.Sequence = 0;
+    Payload.RxRatioQ8 = 255;
+
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByIp(Ip);
+    if (Slot >= 0)
+    {
+        LinkQuality& Link = Links[Slot];
+        Payload.Sequence = ++Link.TxSequence;
+        Payload.RxRatioQ8 = (uint8_t)(Link.ReverseDelivery * 255.0f + 0.5f);
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Slot >= 0;
+}
+
+
+
+bool LinkEstimator::OnSequence(LinkQuality& Link, const MeshHeartbeatPayload& Payload)
+{
+    // Every missing sequence number is one packet that never arrived
+    uint16_t Missed = 0;
+    if (Link.HasRxSequence)
+    {
+        const uint16_t Gap = (uint16_t)(Payload.Sequence - Link.LastRxSequence);
+        if (Gap == 0) return false; // Duplicate
+        if (Gap <= LINK_MAX_SEQUENCE_GAP) Missed = Gap - 1;
+    }
+
+    for (uint16_t i = 0; i < Missed; i++) Link.ReverseDelivery *= (1.0f - LINK_EWMA_ALPHA);
+    Link.ReverseDelivery = Link.ReverseDelivery * (1.0f - LINK_EWMA_ALPHA) + LINK_EWMA_ALPHA;
+
+    Link.ForwardDelivery = Link.ForwardDelivery * (1.0f - LINK_EWMA_ALPHA) + 
+                           ((float)Payload.RxRatioQ8 / 255.0f) * LINK_EWMA_ALPHA;
+
+    Link.HasRxSequence = true;
+    Link.LastRxSequence = Payload.Sequence;
+    Link.HeartbeatsReceived++;
+    Link.HeartbeatsMissed += Missed;
+    Link.LastUpdateUs = esp_timer_get_time();
+    UpdateEtx(Link);
+    return true;
+}
+
+
+
+void LinkEstimator::OnHeartbeat(uint32_t Ip, uint64_t Uid, const MeshHeartbeatPayload& Payload)
+{
+    portENTER_CRITICAL(&CriticalSection);
+
+    int Slot = FindByIp(Ip);
+    if (Slot >= 0)
+    {
+        Links[Slot].Uid = Uid;
+        OnSequence(Links[Slot], Payload);
+    }
+
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::OnLinkSequence(uint32_t Ip, const MeshHeartbeatPayload& Sample)
+{
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByIp(Ip);
+    if (Slot >= 0) OnSequence(Links[Slot], Sample);
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::OnEchoSent(uint32_t Ip)
+{
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByIp(Ip);
+    if (Slot >= 0) Links[Slot].EchoesSent++;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::OnEchoReply(uint32_t Ip, int64_t RttUs)
+{
+    if (RttUs < 0) return;
+
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByIp(Ip);
+    if (Slot >= 0)
+    {
+        LinkQuality& Link = Links[Slot];
+        Link.RttUs = Link.HasRtt ? Link.RttUs * (1.0f - LINK_EWMA_ALPHA) + (float)RttUs * LINK_EWMA_ALPHA : (float)RttUs;
+        Link.HasRtt = true;
+        Link.EchoesAnswered++;
+        Link.LastUpdateUs = esp_timer_get_time();
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::OnDelivery(uint32_t Ip, int64_t DelayUs)
+{
+    if (DelayUs < 0 || DelayUs > LINK_MAX_DELIVERY_US) return;
+
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByIp(Ip);
+    if (Slot >= 0)
+    {
+        LinkQuality& Link = Links[Slot];
+        Link.DeliveryUs = Link.HasDelivery ? Link.DeliveryUs * (1.0f - LINK_EWMA_ALPHA) + (float)DelayUs * LINK_EWMA_ALPHA : (float)DelayUs;
+        if ((uint32_t)DelayUs > Link.MaxDeliveryUs) Link.MaxDeliveryUs = (uint32_t)DelayUs;
+        Link.HasDelivery = true;
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void LinkEstimator::OnRssi(const uint8_t Mac[6], int8_t Rssi)
+{
+    portENTER_CRITICAL(&CriticalSection);
+    int Slot = FindByMac(Mac);
+    if (Slot >= 0)
+    {
+        LinkQuality& Link = Links[Slot];
+        Link.RssiDbm = Link.HasRssi ? Link.RssiDbm * (1.0f - LINK_EWMA_ALPHA) + (float)Rssi * LINK_EWMA_ALPHA : (float)Rssi;
+        Link.HasRssi = true;
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+bool LinkEstimator::GetLinkByUid(uint64_t Uid, LinkQuality& Out) const
+{
+    bool IsFound = false;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)LINK_TABLE_SIZE && Uid != 0; i++)
+    {
+        if (Links[i].IsActive && Links[i].Uid == Uid)
+        {
+            Out = Links[i];
+            IsFound = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return IsFound;
+}
+
+
+
+bool LinkEstimator::GetParentLink(LinkQuality& Out) const
+{
+    bool IsFound = false;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)LINK_TABLE_SIZE; i++)
+    {
+        if (Links[i].IsActive && Links[i].IsParent)
+        {
+            Out = Links[i];
+            IsFound = true;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return IsFound;
+}
+
+
+
+size_t LinkEstimator::GetLinks(LinkQuality* Out, size_t MaxLinks) const
+{
+    if (Out == nullptr) return 0;
+
+    size_t Count = 0;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)LINK_TABLE_SIZE && Count < MaxLinks; i++)
+    {
+        if (Links[i].IsActive) Out[Count++] = Links[i];
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Count;
+}
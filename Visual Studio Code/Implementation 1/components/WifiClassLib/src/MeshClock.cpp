@@ -0,0 +1,270 @@
+#include "MeshClock.h"
+#include "esp_timer.h"
+#include <cstdlib>
+
+// Author - Ben Sturdy
+// Mesh-wide time, synchronised hop by hop from the master with a two-way
+// exchange, a minimum-delay filter and a PI loop on offset and drift.
+
+
+
+
+
+int64_t MeshClock::ModelOffsetUs(int64_t LocalUs) const
+{
+    if (!HasModel) return 0;
+    return OffsetUs + (int64_t)(DriftPpm * (float)(LocalUs - AnchorUs) / 1000000.0f);
+}
+
+
+
+bool MeshClock::IsSyncedAt(int64_t LocalUs) const
+{
+    return HasModel && Stats.LastSyncUs != 0 && Stats.Stratum != MESH_CLOCK_STRATUM_NONE &&
+           LocalUs - Stats.LastSyncUs <= (int64_t)MESH_CLOCK_HOLDOVER_MS * 1000;
+}
+
+
+
+int64_t MeshClock::MeshFromLocalUs(int64_t LocalUs) const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    const int64_t Offset = ModelOffsetUs(LocalUs);
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return LocalUs + Offset;
+}
+
+
+
+int64_t MeshClock::LocalFromMeshUs(int64_t MeshUs) const
+{
+    // The offset changes by ppm over the gap, one refinement is well inside a microsecond
+    portENTER_CRITICAL(&CriticalSection);
+    const int64_t Guess = MeshUs - ModelOffsetUs(MeshUs - OffsetUs);
+    const int64_t Offset = ModelOffsetUs(Guess);
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return MeshUs - Offset;
+}
+
+
+
+bool MeshClock::IsSynced() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    const bool Synced = IsSyncedAt(esp_timer_get_time());
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Synced;
+}
+
+
+
+int64_t MeshClock::GetMeshTimeUs() const
+{
+    return MeshFromLocalUs(esp_timer_get_time());
+}
+
+
+
+void MeshClock::PrepareRequest(MeshTimeSyncPayload& Request)
+{
+    Request = MeshTimeSyncPayload{};
+    Request.RequestSentUs = (uint64_t)esp_timer_get_time();
+
+    portENTER_CRITICAL(&CriticalSection);
+    PendingRequestUs = Request.RequestSentUs;
+    Stats.RequestsSent++;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void MeshClock::PrepareReply(const MeshTimeSyncPayload& Request, int64_t ReceivedLocalUs, MeshTimeSyncPayload& Reply) const
+{
+    Reply = MeshTimeSyncPayload{};
+    Reply.RequestSentUs = Request.RequestSentUs;
+
+    portENTER_CRITICAL(&CriticalSection);
+    const bool IsSynced = IsSyncedAt(ReceivedLocalUs);
+    Reply.Stratum = IsSynced ? Stats.Stratum : MESH_CLOCK_STRATUM_NONE;
+    Reply.ErrorUs = (uint16_t)(Stats.ErrorUs > UINT16_MAX ? UINT16_MAX : Stats.ErrorUs);
+    Reply.RequestReceivedUs = (uint64_t)(ReceivedLocalUs + ModelOffsetUs(ReceivedLocalUs));
+    portEXIT_CRITICAL(&CriticalSection);
+
+    Reply.ReplySentUs = (uint64_t)MeshFromLocalUs(esp_timer_get_time());
+}
+
+
+
+bool MeshClock::OnReply(const MeshTimeSyncPayload& Reply, int64_t ReceivedLocalUs)
+{
+    // T1 and T4 are local, T2 and T3 mesh time, so the offset comes out as mesh - local
+    const int64_t T1 = (int64_t)Reply.RequestSentUs;
+    const int64_t T2 = (int64_t)Reply.RequestReceivedUs;
+    const int64_t T3 = (int64_t)Reply.ReplySentUs;
+    const int64_t T4 = ReceivedLocalUs;
+    const int64_t DelayUs = (T4 - T1) - (T3 - T2);
+
+    portENTER_CRITICAL(&CriticalSection);
+
+    Stats.RepliesReceived++;
+
+    // Only the answer to the latest request, a late reply has sat in a queue and its delay says nothing about the path
+    if (Reply.RequestSentUs == 0 || Reply.RequestSentUs != PendingRequestUs ||
+        Reply.Stratum == MESH_CLOCK_STRATUM_NONE || DelayUs < 0 || DelayUs > UINT32_MAX)
+    {
+        Stats.RepliesRejected++;
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+    PendingRequestUs = 0;
+
+
+    Sample& New = Window[WindowNext];
+    New.LocalUs = T4;
+    New.OffsetUs = ((T2 - T1) + (T3 - T4)) / 2;
+    New.DelayUs = (uint32_t)DelayUs;
+    WindowNext = (WindowNext + 1) % MESH_CLOCK_FILTER_SAMPLES;
+    if (WindowCount < MESH_CLOCK_FILTER_SAMPLES) WindowCount++;
+
+    Stats.LastDelayUs = New.DelayUs;
+    Stats.UpstreamErrorUs = Reply.ErrorUs;
+    Stats.Stratum = (Reply.Stratum >= MESH_CLOCK_STRATUM_NONE - 1) ? MESH_CLOCK_STRATUM_NONE : (uint8_t)(Reply.Stratum + 1);
+
+
+    // The exchange that queued least is the one whose offset is least skewed by the path,
+    // it is used once, and only if it is newer than the last one used
+    size_t Best = 0;
+    for (size_t i = 1; i < WindowCount; i++)
+    {
+        if (Window[i].DelayUs < Window[Best].DelayUs) Best = i;
+    }
+
+    Stats.MinDelayUs = Window[Best].DelayUs;
+    Stats.AsymmetryBoundUs = Window[Best].DelayUs / 2;
+
+    if (Window[Best].LocalUs > LastUsedUs)
+    {
+        LastUsedUs = Window[Best].LocalUs;
+        Apply(Window[Best]);
+    }
+
+    portEXIT_CRITICAL(&CriticalSection);
+    return true;
+}
+
+
+
+void MeshClock::Apply(const Sample& Selected)
+{
+    Stats.SamplesApplied++;
+    Stats.LastSyncUs = Selected.LocalUs;
+
+    const int64_t Predicted = ModelOffsetUs(Selected.LocalUs);
+    const int64_t Residual = Selected.OffsetUs - Predicted;
+    const int64_t Elapsed = Selected.LocalUs - AnchorUs;
+
+    if (!HasModel || llabs(Residual) > (int64_t)MESH_CLOCK_STEP_US)
+    {
+        // First sync, a parent on another time base or a long outage, slewing would take minutes
+        OffsetUs = Selected.OffsetUs;
+        HasModel = true;
+        Stats.Steps++;
+        Stats.LastResidualUs = 0;
+    }
+    else
+    {
+        OffsetUs = Predicted + (int64_t)(MESH_CLOCK_KP * (float)Residual);
+
+        if (Elapsed > 0) DriftPpm += MESH_CLOCK_KI * (float)Residual * 1000000.0f / (float)Elapsed;
+        if (DriftPpm > MESH_CLOCK_MAX_DRIFT_PPM) DriftPpm = MESH_CLOCK_MAX_DRIFT_PPM;
+        if (DriftPpm < -MESH_CLOCK_MAX_DRIFT_PPM) DriftPpm = -MESH_CLOCK_MAX_DRIFT_PPM;
+
+        const uint32_t Magnitude = (uint32_t)llabs(Residual);
+        Jitter = Jitter * (1.0f - MESH_CLOCK_JITTER_ALPHA) + (float)Magnitude * MESH_CLOCK_JITTER_ALPHA;
+        if (Magnitude > Stats.MaxResidualUs) Stats.MaxResidualUs = Magnitude;
+        Stats.LastResidualUs = (int32_t)Residual;
+    }
+
+    AnchorUs = Selected.LocalUs;
+
+    Stats.OffsetUs = OffsetUs;
+    Stats.DriftPpm = DriftPpm;
+    Stats.JitterUs = (uint32_t)Jitter;
+    Stats.ErrorUs = Stats.UpstreamErrorUs + Stats.JitterUs;
+}
+
+
+
+bool MeshClock::OnCycleMarker(const MeshCycleMarker& NewMarker)
+{
+    portENTER_CRITICAL(&CriticalSection);
+
+    if (NewMarker.PeriodUs == 0)
+    {
+        Stats.CycleMarkersRejected++;
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+
+    Marker = NewMarker;
+    MarkerLocalUs = esp_timer_get_time();
+    Stats.CyclePeriodUs = NewMarker.PeriodUs;
+    Stats.CycleMarkers++;
+
+    portEXIT_CRITICAL(&CriticalSection);
+    return true;
+}
+
+
+
+bool MeshClock::GetCycleAt(int64_t LocalUs, uint64_t& Cycle, uint32_t& PhaseUs, uint32_t& PeriodUs) const
+{
+    const int64_t NowUs = esp_timer_get_time();
+
+    portENTER_CRITICAL(&CriticalSection);
+    const bool IsKnown = IsSyncedAt(NowUs) && MarkerLocalUs != 0 &&
+                         NowUs - MarkerLocalUs <= (int64_t)MESH_CYCLE_MARKER_TIMEOUT_MS * 1000;
+    const MeshCycleMarker Grid = Marker;
+    const int64_t MeshUs = LocalUs + ModelOffsetUs(LocalUs);
+    portEXIT_CRITICAL(&CriticalSection);
+
+    if (!IsKnown) return false;
+
+    // Floor division, a time before the marked cycle belongs to an earlier one
+    const int64_t Period = Grid.PeriodUs;
+    const int64_t Elapsed = MeshUs - (int64_t)Grid.CycleStartUs;
+    int64_t Cycles = Elapsed / Period;
+    if (Elapsed % Period < 0) Cycles--;
+
+    Cycle = Grid.CycleNumber + (uint64_t)Cycles;
+    PhaseUs = (uint32_t)(Elapsed - Cycles * Period);
+    PeriodUs = Grid.PeriodUs;
+    return true;
+}
+
+
+
+void MeshClock::OnParentChanged()
+{
+    portENTER_CRITICAL(&CriticalSection);
+    WindowCount = 0;
+    WindowNext = 0;
+    PendingRequestUs = 0;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+MeshClockStats MeshClock::GetStats() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    MeshClockStats Out = Stats;
+    Out.IsSynced = IsSyncedAt(esp_timer_get_time());
+    if (!Out.IsSynced) Out.Stratum = MESH_CLOCK_STRATUM_NONE;
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Out;
+}
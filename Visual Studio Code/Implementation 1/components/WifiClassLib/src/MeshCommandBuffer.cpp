@@ -0,0 +1,124 @@
+#include "MeshCommandBuffer.h"
+#include <cstring>
+
+// Author - Ben Sturdy
+// Commands from the master held in order of the cycle they are to act in.
+
+// Wrap-aware, positive if cycle A is after cycle B
+static int32_t CyclesAfter(uint32_t A, uint32_t B)
+{
+    return (int32_t)(A - B);
+}
+
+
+
+
+
+bool MeshCommandBuffer::Hold(uint32_t ApplyCycle, uint8_t PacketType, const uint8_t* Payload, size_t Length, bool IsCycleKnown, uint32_t NowCycle)
+{
+    if (Payload == nullptr && Length > 0) return false;
+
+    portENTER_CRITICAL(&CriticalSection);
+
+    if (Length > MESH_COMMAND_MAX_PAYLOAD)
+    {
+        Stats.Oversized++;
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+
+    if (IsCycleKnown)
+    {
+        const int32_t Lead = CyclesAfter(ApplyCycle, NowCycle);
+        if (Lead > (int32_t)MESH_COMMAND_MAX_LEAD_CYCLES)
+        {
+            Stats.TooEarly++;
+            portEXIT_CRITICAL(&CriticalSection);
+            return false;
+        }
+
+        Stats.LastLeadCycles = Lead;
+        if (!HasLead || Lead < Stats.MinLeadCycles) Stats.MinLeadCycles = Lead;
+        HasLead = true;
+        if (Lead < 0) Stats.ArrivedLate++;
+    }
+
+
+    // Insert after every command for the same cycle or an earlier one
+    uint8_t Position = Count;
+    while (Position > 0 && CyclesAfter(Entries[Order[Position - 1]].ApplyCycle, ApplyCycle) > 0) Position--;
+
+    if (Count == MESH_COMMAND_BUFFER_DEPTH)
+    {
+        // The command furthest ahead has the most time to be sent again
+        Stats.Overflows++;
+        if (Position == Count)
+        {
+            portEXIT_CRITICAL(&CriticalSection);
+            return false;
+        }
+        Count--;
+        IsUsed[Order[Count]] = false;
+    }
+
+    uint8_t Free = 0;
+    while (IsUsed[Free]) Free++;
+    IsUsed[Free] = true;
+    for (uint8_t i = Count; i > Position; i--) Order[i] = Order[i - 1];
+    Order[Position] = Free;
+    Count++;
+
+    MeshCommand& New = Entries[Free];
+    New.ApplyCycle = ApplyCycle;
+    New.PacketType = PacketType;
+    New.IsLate = false;
+    New.IsUnscheduled = false;
+    New.Length = (uint16_t)Length;
+    if (Length > 0) memcpy(New.Data, Payload, Length);
+
+    Stats.Held++;
+    Stats.Depth = Count;
+    if (Count > Stats.MaxDepth) Stats.MaxDepth = Count;
+
+    portEXIT_CRITICAL(&CriticalSection);
+    return true;
+}
+
+
+
+bool MeshCommandBuffer::TakeDue(bool IsCycleKnown, uint32_t NowCycle, MeshCommand& Out)
+{
+    portENTER_CRITICAL(&CriticalSection);
+
+    const bool IsDue = Count > 0 && (!IsCycleKnown || CyclesAfter(Entries[Order[0]].ApplyCycle, NowCycle) <= 0);
+    if (IsDue)
+    {
+        const uint8_t Head = Order[0];
+        Out = Entries[Head];
+        Out.IsUnscheduled = !IsCycleKnown;
+        Out.IsLate = IsCycleKnown && CyclesAfter(NowCycle, Out.ApplyCycle) > 0;
+
+        IsUsed[Head] = false;
+        for (uint8_t i = 0; i + 1 < Count; i++) Order[i] = Order[i + 1];
+        Count--;
+
+        if (Out.IsUnscheduled) Stats.Unscheduled++;
+        else if (Out.IsLate) Stats.AppliedLate++;
+        else Stats.Applied++;
+        Stats.Depth = Count;
+    }
+
+    portEXIT_CRITICAL(&CriticalSection);
+    return IsDue;
+}
+
+
+
+MeshCommandStats MeshCommandBuffer::GetStats() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    MeshCommandStats Out = Stats;
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Out;
+}
@@ -0,0 +1,468 @@
+#include "MeshOta.h"
+#include "WifiClass.h"
+#include "esp_ota_ops.h"
+#include "esp_rom_crc.h"
+#include "esp_system.h"
+#include "nvs.h"
+#include <cstring>
+
+// Author - Ben Sturdy
+// Firmware update through the mesh. Packets are consumed in the receive path
+// and queued; one low priority task does all erasing, writing and verifying, so
+// a slow flash operation never holds up forwarding to the children.
+
+static const char* OTA_TAG = "MESH_OTA";
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                   Setup                                      //
+//                                                                              //
+//==============================================================================//
+
+bool MeshOta::Start(uint8_t CoreToUse, uint64_t Uid, bool (*Sender)(const uint8_t* Payload, size_t Length),
+                    void (*OnRestart)(), bool EnableRuntimeLogging)
+{
+    if (OtaTaskHandle != nullptr) return true;
+    if (Sender == nullptr) return false;
+
+    NodeUid = Uid;
+    StatusSender = Sender;
+    BeforeRestart = OnRestart;
+    IsRuntimeLoggingEnabled = EnableRuntimeLogging;
+
+    // Needs a partition table with two OTA slots, a single app table has nowhere to write
+    UpdatePartition = esp_ota_get_next_update_partition(nullptr);
+    if (UpdatePartition == nullptr)
+    {
+        ESP_LOGE(OTA_TAG, "No OTA partition, mesh updates disabled");
+        return false;
+    }
+
+    ItemQueue = xQueueCreate(MESH_OTA_QUEUE_LENGTH, sizeof(QueueItem));
+    if (ItemQueue == nullptr) return false;
+
+    LoadResume();
+
+    if (xTaskCreatePinnedToCore(&MeshOta::OtaTask, "MeshOta", 6144, this, 3, &OtaTaskHandle, CoreToUse) != pdPASS)
+    {
+        vQueueDelete(ItemQueue);
+        ItemQueue = nullptr;
+        return false;
+    }
+
+    return true;
+}
+
+
+
+void MeshOta::Disable()
+{
+    IsEnabled = false;
+    SetState(MeshOtaState::Disabled);
+}
+
+
+
+MeshOtaStats MeshOta::GetStats() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    MeshOtaStats Copy = Stats;
+    portEXIT_CRITICAL(&CriticalSection);
+    return Copy;
+}
+
+
+
+void MeshOta::SetState(MeshOtaState State)
+{
+    portENTER_CRITICAL(&CriticalSection);
+    Stats.State = State;
+    Stats.ImageId = Transfer.Begin.ImageId;
+    Stats.ChunkCount = Transfer.Begin.ChunkCount;
+    Stats.ReceivedCount = Transfer.ReceivedCount;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                Receive Path                                  //
+//                                                                              //
+//==============================================================================//
+
+bool MeshOta::Enqueue(ItemType Type, const uint8_t* Data, size_t Length)
+{
+    if (!IsEnabled || ItemQueue == nullptr || Data == nullptr) return false;
+    if (Length > sizeof(QueueItem::Data)) return false;
+
+    StagingItem.Type = Type;
+    StagingItem.Length = (uint16_t)Length;
+    memcpy(StagingItem.Data, Data, Length);
+
+    // Never wait, a dropped chunk shows up in the bitmap and is sent again
+    if (xQueueSend(ItemQueue, &StagingItem, 0) != pdTRUE)
+    {
+        portENTER_CRITICAL(&CriticalSection);
+        Stats.ChunksDropped++;
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+    return true;
+}
+
+
+
+void MeshOta::OtaTask(void* pvParameters)
+{
+    MeshOta* Instance = static_cast<MeshOta*>(pvParameters);
+    QueueItem Item;
+
+    // A transfer that was complete when the node went down only needs its final check
+    if (Instance->Transfer.Magic == MESH_OTA_MAGIC &&
+        Instance->Transfer.ReceivedCount == Instance->Transfer.Begin.ChunkCount)
+    {
+        Instance->SetState(Instance->VerifyImage() ? MeshOtaState::Complete : MeshOtaState::Receiving);
+    }
+
+    while (true)
+    {
+        TickType_t Wait = portMAX_DELAY;
+        if (Instance->NextStatusUs != 0)
+        {
+            const int64_t RemainingUs = Instance->NextStatusUs - esp_timer_get_time();
+            Wait = (RemainingUs > 0) ? pdMS_TO_TICKS(RemainingUs / 1000) + 1 : 0;
+        }
+
+        if (xQueueReceive(Instance->ItemQueue, &Item, Wait) == pdTRUE)
+        {
+            switch (Item.Type)
+            {
+                case ItemType::Begin:
+                {
+                    if (Item.Length < sizeof(MeshOtaBegin)) break;
+                    MeshOtaBegin Begin;
+                    memcpy(&Begin, Item.Data, sizeof(Begin));
+                    Instance->HandleBegin(Begin);
+                    break;
+                }
+
+                case ItemType::Chunk:
+                    Instance->HandleChunk(Item.Data, Item.Length);
+                    break;
+
+                case ItemType::Commit:
+                {
+                    if (Item.Length < sizeof(MeshOtaCommit)) break;
+                    MeshOtaCommit Commit;
+                    memcpy(&Commit, Item.Data, sizeof(Commit));
+                    Instance->HandleCommit(Commit);
+                    break;
+                }
+            }
+        }
+
+        if (Instance->NextStatusUs != 0 && esp_timer_get_time() >= Instance->NextStatusUs) Instance->SendStatus();
+    }
+}
+
+
+
+void MeshOta::HandleBegin(const MeshOtaBegin& Begin)
+{
+    if (Begin.ChunkSize == 0 || Begin.ChunkSize > MESH_OTA_CHUNK_SIZE) return;
+    if (Begin.ChunkCount == 0 || Begin.ChunkCount > MESH_OTA_MAX_CHUNKS) return;
+    if (Begin.ImageSize <= (uint32_t)(Begin.ChunkCount - 1) * Begin.ChunkSize) return;
+    if (Begin.ImageSize > (uint32_t)Begin.ChunkCount * Begin.ChunkSize) return;
+
+
+    // A repeated begin is the sender polling for bitmaps
+    const bool IsCurrent = Transfer.Magic == MESH_OTA_MAGIC && Transfer.Begin.ImageId == Begin.ImageId;
+
+    if (!IsEnabled || Begin.ImageId == InstalledImageId || IsCurrent)
+    {
+        if (!IsCurrent)
+        {
+            memset(&Transfer, 0, sizeof(Transfer));
+            Transfer.Begin = Begin;
+            SetState(IsEnabled ? MeshOtaState::Installed : MeshOtaState::Disabled);
+        }
+        ScheduleStatus(MESH_OTA_STATUS_SPREAD_MS);
+        return;
+    }
+
+    if (Begin.ImageSize > UpdatePartition->size)
+    {
+        ESP_LOGE(OTA_TAG, "Image of %lu bytes does not fit the %lu byte partition",
+                 (unsigned long)Begin.ImageSize, (unsigned long)UpdatePartition->size);
+        return;
+    }
+
+
+    // New image, anything half received before is abandoned
+    memset(&Transfer, 0, sizeof(Transfer));
+    Transfer.Magic = MESH_OTA_MAGIC;
+    Transfer.Begin = Begin;
+
+    if (IsRuntimeLoggingEnabled)
+    {
+        ESP_LOGW(OTA_TAG, "Image %08lx: %lu bytes in %u chunks, erasing %s", (unsigned long)Begin.ImageId,
+                 (unsigned long)Begin.ImageSize, Begin.ChunkCount, UpdatePartition->label);
+    }
+
+    if (!EraseForTransfer())
+    {
+        Transfer.Magic = 0;
+        return;
+    }
+
+    SaveResume();
+    ScheduleStatus(MESH_OTA_STATUS_SPREAD_MS);
+}
+
+
+
+void MeshOta::HandleChunk(const uint8_t* Data, size_t Length)
+{
+    if (Length < sizeof(MeshOtaChunkHeader)) return;
+
+    MeshOtaChunkHeader Chunk;
+    memcpy(&Chunk, Data, sizeof(Chunk));
+
+    const MeshOtaBegin& Begin = Transfer.Begin;
+    if (Stats.State != MeshOtaState::Receiving || Chunk.ImageId != Begin.ImageId) return;
+    if (Chunk.Index >= Begin.ChunkCount) return;
+
+    const uint32_t Offset = (uint32_t)Chunk.Index * Begin.ChunkSize;
+    const uint32_t ExpectedLength = (Chunk.Index == Begin.ChunkCount - 1) ? Begin.ImageSize - Offset : Begin.ChunkSize;
+    if (Chunk.Length != ExpectedLength || Length < sizeof(Chunk) + Chunk.Length) return;
+
+    // Repair rounds resend chunks other nodes are missing
+    const uint8_t Mask = (uint8_t)(1u << (Chunk.Index % 8));
+    if (Transfer.Bitmap[Chunk.Index / 8] & Mask) return;
+
+    const uint8_t* ChunkData = Data + sizeof(Chunk);
+    if (esp_rom_crc32_le(0, ChunkData, Chunk.Length) != Chunk.Crc)
+    {
+        Stats.CrcFailures++;
+        return;
+    }
+
+    if (esp_partition_write(UpdatePartition, Offset, ChunkData, Chunk.Length) != ESP_OK)
+    {
+        Stats.WriteFailures++;
+        return;
+    }
+
+    Transfer.Bitmap[Chunk.Index / 8] |= Mask;
+    Transfer.ReceivedCount++;
+    SetState(MeshOtaState::Receiving);
+
+    if (++ChunksSinceSave >= MESH_OTA_SAVE_INTERVAL) SaveResume();
+    if (Transfer.ReceivedCount < Begin.ChunkCount) return;
+
+
+    // Last chunk in, check the whole image before telling the sender
+    if (VerifyImage())
+    {
+        SetState(MeshOtaState::Complete);
+        if (IsRuntimeLoggingEnabled) ESP_LOGW(OTA_TAG, "Image %08lx complete and verified", (unsigned long)Begin.ImageId);
+    }
+    else
+    {
+        Stats.VerifyFailures++;
+        ESP_LOGE(OTA_TAG, "Image %08lx failed its CRC, starting over", (unsigned long)Begin.ImageId);
+        EraseForTransfer();
+    }
+
+    SaveResume();
+    ScheduleStatus(MESH_OTA_STATUS_SPREAD_MS);
+}
+
+
+
+void MeshOta::HandleCommit(const MeshOtaCommit& Commit)
+{
+    if (Stats.State != MeshOtaState::Complete || Commit.ImageId != Transfer.Begin.ImageId) return;
+
+    // Checks the image header and segments as well, a bad image never becomes the boot partition
+    esp_err_t Error = esp_ota_set_boot_partition(UpdatePartition);
+    if (Error != ESP_OK)
+    {
+        Stats.VerifyFailures++;
+        ESP_LOGE(OTA_TAG, "Image %08lx rejected: %s", (unsigned long)Commit.ImageId, esp_err_to_name(Error));
+        return;
+    }
+
+    InstalledImageId = Commit.ImageId;
+
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READWRITE, &Handle) == ESP_OK)
+    {
+        nvs_set_u32(Handle, MESH_NVS_OTA_DONE_KEY, InstalledImageId);
+        nvs_erase_key(Handle, MESH_NVS_OTA_KEY);
+        nvs_commit(Handle);
+        nvs_close(Handle);
+    }
+
+    SetState(MeshOtaState::Committed);
+    SendStatus();
+
+    if (BeforeRestart != nullptr) BeforeRestart();
+
+    // The commit has already been passed to the children, staggering keeps a
+    // whole branch from dropping off the air in the same instant
+    const uint32_t DelayMs = Commit.RestartDelayMs + (uint32_t)(NodeUid % 8) * 100;
+    ESP_LOGW(OTA_TAG, "Image %08lx installed, restarting in %lu ms", (unsigned long)Commit.ImageId, (unsigned long)DelayMs);
+    vTaskDelay(pdMS_TO_TICKS(DelayMs));
+    esp_restart();
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                   Flash                                      //
+//                                                                              //
+//==============================================================================//
+
+bool MeshOta::EraseForTransfer()
+{
+    SetState(MeshOtaState::Erasing);
+
+    // Erase is by whole 4 KB sectors and takes a few seconds for a full image
+    const size_t EraseSize = (Transfer.Begin.ImageSize + 4095) & ~(size_t)4095;
+    if (esp_partition_erase_range(UpdatePartition, 0, EraseSize) != ESP_OK)
+    {
+        Stats.WriteFailures++;
+        SetState(MeshOtaState::Idle);
+        return false;
+    }
+
+    memset(Transfer.Bitmap, 0, sizeof(Transfer.Bitmap));
+    Transfer.ReceivedCount = 0;
+    SetState(MeshOtaState::Receiving);
+    return true;
+}
+
+
+
+bool MeshOta::VerifyImage()
+{
+    uint8_t Block[512];
+    uint32_t Crc = 0;
+
+    for (uint32_t Offset = 0; Offset < Transfer.Begin.ImageSize; Offset += sizeof(Block))
+    {
+        const uint32_t Length = (Transfer.Begin.ImageSize - Offset < sizeof(Block)) ? Transfer.Begin.ImageSize - Offset : sizeof(Block);
+        if (esp_partition_read(UpdatePartition, Offset, Block, Length) != ESP_OK) return false;
+        Crc = esp_rom_crc32_le(Crc, Block, Length);
+    }
+
+    return Crc == Transfer.Begin.ImageCrc;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                  Status                                      //
+//                                                                              //
+//==============================================================================//
+
+void MeshOta::ScheduleStatus(uint32_t WithinMs)
+{
+    // Every node hears the same poll, spreading by UID keeps the replies from colliding at the root
+    const int64_t OffsetUs = (WithinMs == 0) ? 0 : (int64_t)((NodeUid * 37) % WithinMs) * 1000;
+    const int64_t DueUs = esp_timer_get_time() + OffsetUs;
+
+    if (NextStatusUs == 0 || DueUs < NextStatusUs) NextStatusUs = DueUs;
+}
+
+
+
+void MeshOta::SendStatus()
+{
+    uint8_t Payload[sizeof(MeshOtaStatusHeader) + MESH_OTA_BITMAP_SIZE];
+
+    MeshOtaStatusHeader Header{};
+    Header.ImageId = Transfer.Begin.ImageId;
+    Header.State = (uint8_t)Stats.State;
+
+    // Only a transfer in progress has a bitmap worth sending
+    size_t BitmapLength = 0;
+    if (Stats.State == MeshOtaState::Receiving || Stats.State == MeshOtaState::Complete || Stats.State == MeshOtaState::Committed)
+    {
+        Header.ChunkCount = Transfer.Begin.ChunkCount;
+        Header.ReceivedCount = Transfer.ReceivedCount;
+        BitmapLength = (Transfer.Begin.ChunkCount + 7) / 8;
+        memcpy(Payload + sizeof(Header), Transfer.Bitmap, BitmapLength);
+    }
+    memcpy(Payload, &Header, sizeof(Header));
+
+    if (StatusSender(Payload, sizeof(Header) + BitmapLength)) Stats.StatusSent++;
+
+    // Keep reminding the sender while chunks are missing, in case its polls are lost
+    NextStatusUs = (Stats.State == MeshOtaState::Receiving) ? esp_timer_get_time() + (int64_t)MESH_OTA_STATUS_PERIOD_MS * 1000 : 0;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                 Persistence                                  //
+//                                                                              //
+//==============================================================================//
+
+void MeshOta::LoadResume()
+{
+    if (!IsEnabled) return;
+
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READONLY, &Handle) != ESP_OK) return;
+
+    nvs_get_u32(Handle, MESH_NVS_OTA_DONE_KEY, &InstalledImageId);
+
+    size_t Length = sizeof(Transfer);
+    const bool IsLoaded = nvs_get_blob(Handle, MESH_NVS_OTA_KEY, &Transfer, &Length) == ESP_OK &&
+                          Length == sizeof(Transfer) && Transfer.Magic == MESH_OTA_MAGIC &&
+                          Transfer.Begin.ChunkCount <= MESH_OTA_MAX_CHUNKS &&
+                          Transfer.Begin.ImageId != InstalledImageId;
+    nvs_close(Handle);
+
+    // The partition still holds what was written before the reboot, so keep the bitmap
+    if (!IsLoaded) memset(&Transfer, 0, sizeof(Transfer));
+    SetState(IsLoaded ? MeshOtaState::Receiving : MeshOtaState::Idle);
+
+    if (IsLoaded)
+    {
+        ScheduleStatus(MESH_OTA_STATUS_SPREAD_MS);
+        ESP_LOGW(OTA_TAG, "Resuming image %08lx, %u of %u chunks stored", (unsigned long)Transfer.Begin.ImageId,
+                 Transfer.ReceivedCount, Transfer.Begin.ChunkCount);
+    }
+}
+
+
+
+void MeshOta::SaveResume()
+{
+    ChunksSinceSave = 0;
+
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READWRITE, &Handle) != ESP_OK) return;
+
+    if (nvs_set_blob(Handle, MESH_NVS_OTA_KEY, &Transfer, sizeof(Transfer)) == ESP_OK) nvs_commit(Handle);
+    nvs_close(Handle);
+}
@@ -0,0 +1,278 @@
+#include "MeshTdma.h"
+#include <cstring>
+
+// Author - Ben Sturdy
+// Slotted transmission for cyclic data, one slot per node in each cycle,
+// aligned to mesh time.
+
+static const float MESH_TDMA_HOLD_ALPHA = 0.125f;   // Weight of a new hold time in the mean
+
+
+
+
+
+bool MeshTdma::Enable(uint32_t CycleUs, uint8_t SlotCount, const MeshClock* MeshTime,
+                      bool (*PacketSender)(const uint8_t* Data, size_t Length))
+{
+    if (SlotCount == 0 || SlotCount > MESH_TDMA_MAX_SLOTS || MeshTime == nullptr || PacketSender == nullptr) return false;
+    if (CycleUs / SlotCount < 4 * MESH_TDMA_MIN_GUARD_US) return false;
+
+    if (SlotTimer == nullptr)
+    {
+        esp_timer_create_args_t Args{};
+        Args.callback = &MeshTdma::SlotTimerCallback;
+        Args.arg = this;
+        Args.dispatch_method = ESP_TIMER_TASK;
+        Args.name = "MeshTdma";
+        if (esp_timer_create(&Args, &SlotTimer) != ESP_OK) return false;
+    }
+
+    portENTER_CRITICAL(&CriticalSection);
+    Clock = MeshTime;
+    Sender = PacketSender;
+    Stats.CycleUs = CycleUs;
+    Stats.SlotCount = SlotCount;
+    Stats.SlotUs = CycleUs / SlotCount;
+    if (FixedSlot >= (int)SlotCount) FixedSlot = MESH_TDMA_AUTO_SLOT;
+    UpdateSlot();
+    IsEnabled = true;
+    Stats.IsEnabled = true;
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return true;
+}
+
+
+
+void MeshTdma::Disable()
+{
+    if (SlotTimer != nullptr) esp_timer_stop(SlotTimer);
+
+    portENTER_CRITICAL(&CriticalSection);
+    IsEnabled = false;
+    IsArmed = false;
+    QueueCount = 0;
+    Stats.IsEnabled = false;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void MeshTdma::SetPosition(uint64_t NodeUid, uint8_t Hop)
+{
+    portENTER_CRITICAL(&CriticalSection);
+    Uid = NodeUid;
+    HopCount = Hop;
+    UpdateSlot();
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+bool MeshTdma::SetFixedSlot(int Slot)
+{
+    if (Slot != MESH_TDMA_AUTO_SLOT && (Slot < 0 || Slot >= (int)MESH_TDMA_MAX_SLOTS)) return false;
+
+    portENTER_CRITICAL(&CriticalSection);
+    const bool IsInRange = Slot == MESH_TDMA_AUTO_SLOT || Stats.SlotCount == 0 || Slot < (int)Stats.SlotCount;
+    if (IsInRange)
+    {
+        FixedSlot = Slot;
+        UpdateSlot();
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return IsInRange;
+}
+
+
+
+void MeshTdma::UpdateSlot()
+{
+    Stats.IsAutoSlot = FixedSlot == MESH_TDMA_AUTO_SLOT;
+    if (!Stats.IsAutoSlot)
+    {
+        Stats.Slot = (uint8_t)FixedSlot;
+        return;
+    }
+    if (Stats.SlotCount == 0) return;
+
+    // Deepest group first, a relayed packet then reaches each parent before the parent's own slot
+    const uint8_t Groups = (Stats.SlotCount >= MESH_TDMA_HOP_GROUPS) ? MESH_TDMA_HOP_GROUPS : 1;
+    const uint8_t PerGroup = Stats.SlotCount / Groups;
+    const uint8_t Depth = (HopCount == 0 || HopCount == 255) ? 0 :
+                          ((HopCount - 1 < Groups - 1) ? (uint8_t)(HopCount - 1) : (uint8_t)(Groups - 1));
+    const uint8_t Group = (uint8_t)(Groups - 1 - Depth);
+
+    // Fibonacci hash, consecutive UIDs land far apart
+    const uint32_t Spread = (uint32_t)((Uid * 0x9E3779B97F4A7C15ull) >> 32) % PerGroup;
+    Stats.Slot = (uint8_t)(Group * PerGroup + Spread);
+}
+
+
+
+bool MeshTdma::Hold(const uint8_t* Packet, size_t Length)
+{
+    if (Packet == nullptr || Length == 0 || Length > MESH_TDMA_MAX_PACKET || !IsEnabled) return false;
+
+    if (Clock == nullptr || !Clock->IsSynced())
+    {
+        portENTER_CRITICAL(&CriticalSection);
+        Stats.Unsynced++;
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+
+    const int64_t Now = esp_timer_get_time();
+
+    portENTER_CRITICAL(&CriticalSection);
+
+    if (QueueCount == MESH_TDMA_QUEUE_DEPTH)
+    {
+        QueueHead = (QueueHead + 1) % MESH_TDMA_QUEUE_DEPTH;
+        QueueCount--;
+        Stats.DroppedOldest++;
+    }
+
+    Entry& New = Queue[(QueueHead + QueueCount) % MESH_TDMA_QUEUE_DEPTH];
+    memcpy(New.Data, Packet, Length);
+    New.Length = (uint16_t)Length;
+    New.HeldUs = Now;
+    QueueCount++;
+    Stats.Held++;
+
+    // Only the first packet arms the timer, the slot handler re-arms while packets are left
+    const bool ShouldArm = !IsArmed;
+    IsArmed = true;
+
+    portEXIT_CRITICAL(&CriticalSection);
+
+    if (ShouldArm) ArmNextSlot(Now);
+    return true;
+}
+
+
+
+void MeshTdma::ArmNextSlot(int64_t NowLocalUs)
+{
+    const MeshClockStats ClockStats = Clock->GetStats();
+    const int64_t NowMesh = Clock->MeshFromLocalUs(NowLocalUs);
+
+    portENTER_CRITICAL(&CriticalSection);
+
+    // The guard covers the error of both ends, ours and the neighbour's in the next slot
+    uint32_t Guard = ClockStats.ErrorUs * 2;
+    if (Guard < MESH_TDMA_MIN_GUARD_US) Guard = MESH_TDMA_MIN_GUARD_US;
+    if (Guard > Stats.SlotUs / 4) Guard = Stats.SlotUs / 4;
+    Stats.GuardUs = Guard;
+
+    const int64_t Cycle = Stats.CycleUs;
+    int64_t Start = NowMesh - (NowMesh % Cycle) + (int64_t)Stats.Slot * Stats.SlotUs + Guard;
+    while (Start < NowMesh + (int64_t)MESH_TDMA_MIN_LEAD_US) Start += Cycle;
+    SlotStartMeshUs = Start;
+
+    portEXIT_CRITICAL(&CriticalSection);
+
+    int64_t DelayUs = Clock->LocalFromMeshUs(Start) - NowLocalUs;
+    if (DelayUs < 1) DelayUs = 1;
+
+    if (esp_timer_start_once(SlotTimer, (uint64_t)DelayUs) != ESP_OK)
+    {
+        // Already running or stopped by Disable, the next Hold tries again
+        portENTER_CRITICAL(&CriticalSection);
+        IsArmed = false;
+        portEXIT_CRITICAL(&CriticalSection);
+    }
+}
+
+
+
+void MeshTdma::SlotTimerCallback(void* arg)
+{
+    MeshTdma* Instance = static_cast<MeshTdma*>(arg);
+    if (Instance != nullptr) Instance->OnSlot();
+}
+
+
+
+void MeshTdma::OnSlot()
+{
+    int64_t NowLocal = esp_timer_get_time();
+    int64_t NowMesh = Clock->MeshFromLocalUs(NowLocal);
+
+    portENTER_CRITICAL(&CriticalSection);
+    const int64_t WindowStart = SlotStartMeshUs;
+    const int64_t WindowEnd = SlotStartMeshUs + Stats.SlotUs - 2 * (int64_t)Stats.GuardUs;
+    const bool IsLate = NowMesh > WindowEnd;
+    if (IsLate) Stats.LateSlots++;
+    else
+    {
+        Stats.LastSlotErrorUs = (int32_t)(NowMesh - WindowStart);
+        const uint32_t Magnitude = (uint32_t)(Stats.LastSlotErrorUs < 0 ? -Stats.LastSlotErrorUs : Stats.LastSlotErrorUs);
+        if (Magnitude > Stats.MaxSlotErrorUs) Stats.MaxSlotErrorUs = Magnitude;
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+
+    // Past the window the neighbour owns the air, the packets wait for the next cycle
+    while (!IsLate && NowMesh <= WindowEnd)
+    {
+        portENTER_CRITICAL(&CriticalSection);
+        const bool HasPacket = IsEnabled && QueueCount > 0;
+        if (HasPacket)
+        {
+            const Entry& Head = Queue[QueueHead];
+            Sending.HeldUs = Head.HeldUs;
+            Sending.Length = Head.Length;
+            memcpy(Sending.Data, Head.Data, Head.Length);
+            QueueHead = (QueueHead + 1) % MESH_TDMA_QUEUE_DEPTH;
+            QueueCount--;
+        }
+        portEXIT_CRITICAL(&CriticalSection);
+
+        if (!HasPacket) break;
+
+        const bool IsSent = Sender(Sending.Data, Sending.Length);
+        NowLocal = esp_timer_get_time();
+        NowMesh = Clock->MeshFromLocalUs(NowLocal);
+        const uint32_t HoldUs = (uint32_t)(NowLocal - Sending.HeldUs);
+
+        portENTER_CRITICAL(&CriticalSection);
+        if (IsSent) Stats.Sent++;
+        else Stats.SendFailures++;
+        Stats.LastHoldUs = HoldUs;
+        if (HoldUs > Stats.MaxHoldUs) Stats.MaxHoldUs = HoldUs;
+        Stats.MeanHoldUs = (Stats.Sent + Stats.SendFailures == 1) ? (float)HoldUs :
+                           Stats.MeanHoldUs * (1.0f - MESH_TDMA_HOLD_ALPHA) + (float)HoldUs * MESH_TDMA_HOLD_ALPHA;
+        portEXIT_CRITICAL(&CriticalSection);
+    }
+
+
+    portENTER_CRITICAL(&CriticalSection);
+    const bool ShouldArm = IsEnabled && QueueCount > 0;
+    IsArmed = ShouldArm;
+    portEXIT_CRITICAL(&CriticalSection);
+
+    if (ShouldArm) ArmNextSlot(esp_timer_get_time());
+}
+
+
+
+void MeshTdma::NoteFreeSend(bool IsSent)
+{
+    portENTER_CRITICAL(&CriticalSection);
+    if (IsSent) Stats.FreeSent++;
+    else Stats.FreeSendFailures++;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+MeshTdmaStats MeshTdma::GetStats() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    MeshTdmaStats Out = Stats;
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Out;
+}
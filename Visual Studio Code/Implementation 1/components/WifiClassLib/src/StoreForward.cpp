@@ -0,0 +1,314 @@
+#include "StoreForward.h"
+#include "WifiClass.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
+#include <algorithm>
+#include <cstring>
+
+// Author - Ben Sturdy
+// Byte ring of variable length records. Store() and Backfill() can run on
+// different tasks; the ring is only touched inside the critical section and the
+// packet being backfilled is copied out first, so the send itself never holds
+// the lock.
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                   Setup                                      //
+//                                                                              //
+//==============================================================================//
+
+bool StoreForward::Init(size_t CapacityBytes, uint32_t BackfillBytesPerS, bool PreferPsram,
+                        bool (*BackfillSender)(const uint8_t* Data, size_t Length))
+{
+    if (Ring != nullptr) return true;
+    if (CapacityBytes == 0 || BackfillBytesPerS == 0 || BackfillSender == nullptr) return false;
+
+    Capacity = CapacityBytes & ~(size_t)7;
+    End = Capacity;
+
+    if (PreferPsram)
+    {
+        Ring = (uint8_t*)heap_caps_malloc(Capacity, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+        Stats.IsInPsram = Ring != nullptr;
+    }
+    if (Ring == nullptr) Ring = (uint8_t*)heap_caps_malloc(Capacity, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+
+    if (Ring == nullptr)
+    {
+        Capacity = 0;
+        return false;
+    }
+
+    Sender = BackfillSender;
+    RateBytesPerS = BackfillBytesPerS;
+    BurstBytes = std::max<uint32_t>(RateBytesPerS * STORE_FORWARD_BURST_MS / 1000, STORE_FORWARD_MAX_PACKET + sizeof(Record));
+    Tokens = 0;
+    LastRefillUs = esp_timer_get_time();
+    WindowStartUs = LastRefillUs;
+
+    Stats.CapacityBytes = Capacity;
+    Stats.BackfillRateBytesPerS = RateBytesPerS;
+    return true;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                    Ring                                      //
+//                                                                              //
+//==============================================================================//
+
+size_t StoreForward::RecordSize(size_t Length)
+{
+    return (sizeof(Record) + Length + 7) & ~(size_t)7;
+}
+
+
+
+bool StoreForward::MakeRoom(size_t Size, size_t& Offset)
+{
+    if (Size > Capacity) return false;
+
+    while (true)
+    {
+        if (Count == 0)
+        {
+            Head = 0;
+            Tail = 0;
+            End = Capacity;
+            Offset = 0;
+            return true;
+        }
+
+        if (Head > Tail)
+        {
+            if (Capacity - Head >= Size)
+            {
+                Offset = Head;
+                return true;
+            }
+
+            // Not enough room before the end, the reader wraps at the current head
+            if (Tail >= Size)
+            {
+                End = Head;
+                Offset = 0;
+                return true;
+            }
+        }
+
+        else if (Head < Tail && Tail - Head >= Size)
+        {
+            Offset = Head;
+            return true;
+        }
+
+        // Head == Tail with records held is a full ring
+        DropOldest();
+        Stats.DroppedOldest++;
+    }
+}
+
+
+
+void StoreForward::DropOldest()
+{
+    if (Count == 0) return;
+
+    Record Oldest;
+    memcpy(&Oldest, Ring + Tail, sizeof(Oldest));
+
+    const size_t Size = RecordSize(Oldest.Length);
+    Tail += Size;
+    UsedBytes -= Size;
+    Count--;
+
+    if (Count == 0)
+    {
+        Head = 0;
+        Tail = 0;
+        End = Capacity;
+    }
+
+    else if (Tail >= End)
+    {
+        Tail = 0;
+        End = Capacity;
+    }
+}
+
+
+
+bool StoreForward::Store(const uint8_t* Packet, size_t Length)
+{
+    if (Ring == nullptr || Packet == nullptr || Length < PACKET_HEADER_SIZE) return false;
+
+    const size_t Size = RecordSize(Length);
+
+    portENTER_CRITICAL(&CriticalSection);
+
+    size_t Offset = 0;
+    if (Length > STORE_FORWARD_MAX_PACKET || !MakeRoom(Size, Offset))
+    {
+        Stats.DroppedTooLarge++;
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+
+    Record Entry{};
+    Entry.StoredUs = esp_timer_get_time();
+    Entry.Sequence = NextSequence++;
+    Entry.Length = (uint16_t)Length;
+
+    memcpy(Ring + Offset, &Entry, sizeof(Entry));
+    memcpy(Ring + Offset + sizeof(Entry), Packet, Length);
+
+    // The original senderTimestampUs stays, the flag tells the master this sample is late
+    Ring[Offset + sizeof(Entry) + offsetof(PacketHeader, flags)] |= PACKET_FLAG_STORED;
+
+    Head = Offset + Size;
+    UsedBytes += Size;
+    Count++;
+
+    Stats.TotalStored++;
+    if (UsedBytes > Stats.PeakUsedBytes) Stats.PeakUsedBytes = UsedBytes;
+
+    portEXIT_CRITICAL(&CriticalSection);
+    return true;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                  Backfill                                    //
+//                                                                              //
+//==============================================================================//
+
+void StoreForward::RefillTokens(int64_t Now)
+{
+    const int64_t ElapsedUs = Now - LastRefillUs;
+    if (ElapsedUs <= 0) return;
+
+    const uint64_t Added = (uint64_t)ElapsedUs * RateBytesPerS / 1000000ULL;
+    if (Added == 0) return; // Keep the fraction for the next call
+
+    if (Tokens + Added >= BurstBytes)
+    {
+        Tokens = BurstBytes;
+        LastRefillUs = Now;
+        return;
+    }
+
+    Tokens += (uint32_t)Added;
+    LastRefillUs += (int64_t)(Added * 1000000ULL / RateBytesPerS);
+}
+
+
+
+size_t StoreForward::Backfill()
+{
+    if (Ring == nullptr) return 0;
+
+    size_t Sent = 0;
+
+    const int64_t Now = esp_timer_get_time();
+    portENTER_CRITICAL(&CriticalSection);
+    if (Now - WindowStartUs >= 1000000)
+    {
+        Stats.MeasuredBackfillBytesPerS = (uint32_t)((uint64_t)WindowBytes * 1000000ULL / (uint64_t)(Now - WindowStartUs));
+        WindowBytes = 0;
+        WindowStartUs = Now;
+    }
+
+    // An empty bucket would otherwise fill up while there is nothing to send
+    if (Count == 0) LastRefillUs = Now;
+    portEXIT_CRITICAL(&CriticalSection);
+
+
+    while (Sent < STORE_FORWARD_MAX_PER_DRAIN)
+    {
+        portENTER_CRITICAL(&CriticalSection);
+        if (Count == 0)
+        {
+            portEXIT_CRITICAL(&CriticalSection);
+            break;
+        }
+
+        RefillTokens(esp_timer_get_time());
+
+        Record Oldest;
+        memcpy(&Oldest, Ring + Tail, sizeof(Oldest));
+        if (Tokens < Oldest.Length)
+        {
+            portEXIT_CRITICAL(&CriticalSection);
+            break;
+        }
+
+        memcpy(Staging, Ring + Tail + sizeof(Oldest), Oldest.Length);
+        portEXIT_CRITICAL(&CriticalSection);
+
+
+        const bool IsSent = Sender(Staging, Oldest.Length);
+
+
+        portENTER_CRITICAL(&CriticalSection);
+        if (!IsSent)
+        {
+            Stats.BackfillFailures++;
+            portEXIT_CRITICAL(&CriticalSection);
+            break;
+        }
+
+        Tokens -= Oldest.Length;
+        WindowBytes += Oldest.Length;
+        Stats.Backfilled++;
+
+        // Store() may have evicted it while it was being sent
+        Record Current;
+        memcpy(&Current, Ring + Tail, sizeof(Current));
+        if (Count > 0 && Current.Sequence == Oldest.Sequence) DropOldest();
+        portEXIT_CRITICAL(&CriticalSection);
+
+        Sent++;
+    }
+
+    return Sent;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                  Getters                                     //
+//                                                                              //
+//==============================================================================//
+
+StoreForwardStats StoreForward::GetStats() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    StoreForwardStats Copy = Stats;
+    Copy.UsedBytes = UsedBytes;
+    Copy.StoredPackets = Count;
+
+    if (Count > 0)
+    {
+        Record Oldest;
+        memcpy(&Oldest, Ring + Tail, sizeof(Oldest));
+        Copy.OldestAgeUs = esp_timer_get_time() - Oldest.StoredUs;
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Copy;
+}
@@ -29,9 +29,332 @@
 
 static AccessPointStation* ApStaClassInstance;
 
+
+
+// Two bits per UID in a 64-bit Bloom filter. A false positive can only make a
+// path look like it contains a node when it does not, never the other way round.
+static uint64_t MeshDigestBitsForUid(uint64_t Uid)
+{
+    uint64_t Hash = Uid * 0x9E3779B97F4A7C15ULL;
+    Hash ^= Hash >> 29;
+    return (1ULL << (Hash & 63)) | (1ULL << ((Hash >> 6) & 63));
+}
+
+
+
+// Cost of one hop. A strong link costs 10, every 5 dB below -60 dBm adds 5.
+static uint16_t MeshLinkCostFromRssi(int8_t Rssi)
+{
+    if (Rssi >= -60) return 10;
+    return 10 + (((-60 - Rssi) / 5) + 1) * 5;
+}
+
+
+
+static uint16_t MeshAddPathCost(uint16_t PathCost, uint16_t LinkCost)
+{
+    if (PathCost == MESH_PATH_COST_INFINITE) return MESH_PATH_COST_INFINITE;
+    uint32_t Total = (uint32_t)PathCost + LinkCost;
+    return (Total >= MESH_PATH_COST_INFINITE) ? MESH_PATH_COST_INFINITE - 1 : (uint16_t)Total;
+}
+
+
+
+// Lower is better. Path cost (including our own link) dominates, so shallow
+// branches win; load and fan-out only separate parents of similar depth.
+static uint32_t MeshParentScore(const MeshMetadata& Entry)
+{
+    uint32_t Score = MeshAddPathCost(Entry.PathCost, MeshLinkCostFromRssi(Entry.Rssi));
+    Score += Entry.UplinkLoad / 10;
+    Score += Entry.ChildCount;
+    return Score;
+}
+
+
+
+// Checks start bytes, payload size and end bytes against the layout the master
+// uses (02 B5 | big-endian size | ... | 5B 03).
+static bool MeshValidateFraming(const uint8_t* Data, int Length, uint16_t* PayloadSizeOut)
+{
+    if (Data == nullptr || Length < (int)PACKET_HEADER_SIZE + 2) return false;
+    if (memcmp(Data, &PACKET_START_DELIMITER, 2) != 0) return false;
+
+    const uint16_t PayloadSize = (static_cast<uint16_t>(Data[2]) << 8) | static_cast<uint16_t>(Data[3]);
+    const int TerminatorIndex = PACKET_HEADER_SIZE + PayloadSize;
+
+    if (Length < TerminatorIndex + 2) return false;
+    if (memcmp(Data + TerminatorIndex, &PACKET_END_DELIMITER, 2) != 0) return false;
+
+    if (PayloadSizeOut) *PayloadSizeOut = PayloadSize;
+    return true;
+}
+
+
+
+// Packets that only mean something on one hop. Consumed by the receiver and
+// never forwarded or handed to the host.
+static bool MeshIsLinkControl(uint8_t PacketType)
+{
+    return PacketType == PACKET_TYPE_HEARTBEAT ||
+           PacketType == PACKET_TYPE_ROUTE_WITHDRAWN ||
+           PacketType == PACKET_TYPE_ECHO_REQUEST ||
+           PacketType == PACKET_TYPE_ECHO_REPLY ||
+           PacketType == PACKET_TYPE_TIME_SYNC_REQUEST ||
+           PacketType == PACKET_TYPE_TIME_SYNC_REPLY;
+}
+
+
+
+// Clock of whichever node class was created, packets are stamped with mesh time
+// so any receiver on mesh time can tell how long a packet took
+static const MeshClock* MeshTimeSource = nullptr;
+
+
+
+// Header + payload + end delimiter, shared by the relay and the leaf so both
+// put exactly the same bytes on the wire
+static size_t MeshBuildPacket(const uint8_t* DataToInclude, size_t DataLength, uint8_t PacketType, 
+                              uint8_t ForwardingMode, uint8_t* PacketOut, size_t OutputBufferSize, uint32_t MeshCycle = 0)
+{
+    if (!DataToInclude) return 0;
+    if (!PacketOut) return 0;
+    if (DataLength > 65535) return 0;
+    if (PacketType == 0) return 0;
+    if (OutputBufferSize < DataLength + 48 + 2) return 0;
+
+    PacketHeader TempHeader{};
+
+    TempHeader.startDelimiter = PACKET_START_DELIMITER;
+    TempHeader.payloadSize = htons((uint16_t)DataLength); // Big-endian on the wire, as read by the master
+    TempHeader.meshCycle = MeshCycle;
+    TempHeader.slaveUid = WifiFactory::GetNodeUid();
+    //TempHeader.messageCounter = 0;
+    TempHeader.senderTimestampUs = (uint64_t)(MeshTimeSource ? MeshTimeSource->GetMeshTimeUs() : esp_timer_get_time());
+    TempHeader.linkSequence = 0; // Stamped per hop as it is sent
+    TempHeader.linkRxRatioQ8 = 0;
+    TempHeader.chainedSlaveCount = 0;
+    TempHeader.PacketType = PacketType;
+    TempHeader.flags = 0;
+    TempHeader.headerVersion = 1;
+    TempHeader.networkId = MESH_NETWORK_ID;
+    TempHeader.chainDistance = 0;
+    TempHeader.ttl = 10;
+    TempHeader.ForwardingMode = ForwardingMode;
+    TempHeader.crc32 = 0;
+
+    uint8_t* p = PacketOut;
+
+    memcpy(p, &TempHeader, sizeof(PacketHeader));
+    memcpy(p + sizeof(PacketHeader), DataToInclude, DataLength);
+    memcpy(p + sizeof(PacketHeader) + DataLength, &PACKET_END_DELIMITER, 2);
+
+    return PACKET_HEADER_SIZE + DataLength + sizeof(PACKET_END_DELIMITER);
+}
+
+
+
+// Low 32 bits of the master's cycle a local time falls in. A cycle start from the cyclic
+// task is rounded to the nearest boundary, on a phase-locked node it falls a few us either side.
+static bool MeshCycleAt(const MeshClock& Clock, int64_t LocalUs, bool IsRounded, uint32_t& Cycle)
+{
+    uint64_t Number = 0;
+    uint32_t PhaseUs = 0, PeriodUs = 0;
+    if (!Clock.GetCycleAt(LocalUs, Number, PhaseUs, PeriodUs)) return false;
+
+    if (IsRounded && PhaseUs >= PeriodUs / 2) Number++;
+    Cycle = (uint32_t)Number;
+    return true;
+}
+
+
+
+// Sends with this hop's link sequence in a copy of the header, the caller's buffer is left alone
+// so one packet can go to several neighbours. Heartbeats carry the sequence in their payload.
+// Every packet on a link counts towards its loss and ETX, not only the probes an idle link sends.
+static int MeshSendOnLink(int Socket, LinkEstimator& Links, const uint8_t* Data, size_t Length, const sockaddr_in& Destination)
+{
+    if (Length < PACKET_HEADER_SIZE || Data[offsetof(PacketHeader, PacketType)] == PACKET_TYPE_HEARTBEAT)
+    {
+        return sendto(Socket, Data, Length, 0, (const sockaddr*)&Destination, sizeof(Destination));
+    }
+
+    PacketHeader Header;
+    memcpy(&Header, Data, sizeof(Header));
+
+    MeshHeartbeatPayload Sample{};
+    if (Links.PrepareHeartbeat(Destination.sin_addr.s_addr, Sample))
+    {
+        Header.linkSequence = Sample.Sequence;
+        Header.linkRxRatioQ8 = Sample.RxRatioQ8;
+        Header.flags |= PACKET_FLAG_LINK_SEQUENCE;
+    }
+    else Header.flags &= ~PACKET_FLAG_LINK_SEQUENCE; // Not a tracked link, the previous hop's stamp means nothing here
+
+    iovec Parts[2];
+    Parts[0].iov_base = &Header;
+    Parts[0].iov_len  = sizeof(Header);
+    Parts[1].iov_base = (void*)(Data + sizeof(Header));
+    Parts[1].iov_len  = Length - sizeof(Header);
+
+    msghdr Message{};
+    Message.msg_name    = (void*)&Destination;
+    Message.msg_namelen = sizeof(Destination);
+    Message.msg_iov     = Parts;
+    Message.msg_iovlen  = 2;
+
+    return sendmsg(Socket, &Message, 0);
+}
+
+
+
+// Feeds the sequence the last hop stamped into a packet's header to the link it came in on
+static void MeshNoteLinkSequence(LinkEstimator& Links, const uint8_t* Data, const sockaddr_in& SourceAddress)
+{
+    if (Data[offsetof(PacketHeader, PacketType)] == PACKET_TYPE_HEARTBEAT) return;
+    if (!(Data[offsetof(PacketHeader, flags)] & PACKET_FLAG_LINK_SEQUENCE)) return;
+
+    MeshHeartbeatPayload Sample{};
+    memcpy(&Sample.Sequence, Data + offsetof(PacketHeader, linkSequence), sizeof(Sample.Sequence));
+    Sample.RxRatioQ8 = Data[offsetof(PacketHeader, linkRxRatioQ8)];
+    Links.OnLinkSequence(SourceAddress.sin_addr.s_addr, Sample);
+}
+
+
+
+// A command naming a master cycle waits in the buffer for it, the rest act on arrival as before.
+// True if the packet was scheduled, held or refused, so the caller must not act on it now.
+static bool MeshHoldCommand(MeshCommandBuffer& Commands, const MeshClock& Clock, const uint8_t* Packet, uint16_t PayloadSize)
+{
+    uint32_t ApplyCycle = MESH_COMMAND_IMMEDIATE;
+    memcpy(&ApplyCycle, Packet + offsetof(PacketHeader, meshCycle), sizeof(ApplyCycle));
+    if (ApplyCycle == MESH_COMMAND_IMMEDIATE) return false;
+
+    uint32_t NowCycle = 0;
+    const bool IsCycleKnown = MeshCycleAt(Clock, esp_timer_get_time(), false, NowCycle);
+    Commands.Hold(ApplyCycle, Packet[37], Packet + PACKET_HEADER_SIZE, PayloadSize, IsCycleKnown, NowCycle);
+    return true;
+}
+
+
+
+// Stores one received mesh IE in a cache, refreshing the entry for the same MAC
+static void MeshCacheIe(MeshMetadata* Cache, const uint8_t Mac[6], const MeshIePayload& Payload, int Rssi)
+{
+    int Slot = -1;
+    for (int i = 0; i < (int)MESH_IE_CACHE_SIZE; i++)
+    {
+        MeshMetadata& Entry = Cache[i];
+
+        if (Entry.IsValid && memcmp(Entry.MacId, Mac, 6) == 0)
+        {
+            Slot = i;
+            break;
+        }
+
+        if (!Entry.IsValid && Slot < 0) Slot = i;
+    }
+
+    if (Slot < 0) return;
+
+    MeshMetadata& Entry = Cache[Slot];
+    memcpy(Entry.MacId, Mac, 6);
+    Entry.Uid = Payload.Uid;
+    Entry.HopCount = Payload.HopCount;
+    Entry.PathCost = Payload.PathCost;
+    Entry.UplinkLoad = Payload.UplinkLoad;
+    Entry.FreeChildSlots = Payload.FreeChildSlots;
+    Entry.ChildCount = Payload.ChildCount;
+    Entry.Flags = Payload.Flags;
+    Entry.AncestorDigest = Payload.AncestorDigest;
+    Entry.RootUid = Payload.RootUid;
+    Entry.Rssi = (int8_t)Rssi;
+    Entry.IsValid = true;
+}
+
+
+
+// True while the master's preferred parent holds and names this candidate (UID 0 = the master's router)
+static bool MeshIsPreferredParent(uint64_t PreferredUid, int64_t PreferredUntilUs, bool IsMaster, uint64_t Uid)
+{
+    if (PreferredUntilUs <= esp_timer_get_time()) return false;
+    return IsMaster ? PreferredUid == 0 : (Uid != 0 && Uid == PreferredUid);
+}
+
+
+
+// The master's router is one root among the gateways, at path cost 0 plus the link to it.
+// A preference from the master still wins; while it names a node the router only backs that node up.
+static uint32_t MeshRouterScore(uint64_t PreferredUid, int64_t PreferredUntilUs, int8_t Rssi)
+{
+    if (PreferredUntilUs > esp_timer_get_time()) return (PreferredUid == 0) ? 0 : 1;
+    return MeshLinkCostFromRssi(Rssi);
+}
+
+
+
+// Report header + the strongest neighbours of the last scan. Links this node
+// uses (parent, children) carry their measured ETX, the rest only RSSI.
+static size_t MeshBuildNeighbourReport(const MeshMetadata* Neighbours, const LinkEstimator& Links,
+                                       MeshNeighbourReportHeader Header, uint8_t* PayloadOut, size_t OutputBufferSize)
+{
+    const MeshMetadata* Sorted[MESH_IE_CACHE_SIZE];
+    size_t Count = 0;
+    for (size_t i = 0; i < MESH_IE_CACHE_SIZE; i++)
+    {
+        if (Neighbours[i].IsValid && Neighbours[i].Uid != 0) Sorted[Count++] = &Neighbours[i];
+    }
+
+    std::sort(Sorted, Sorted + Count, [](const MeshMetadata* A, const MeshMetadata* B) { return A->Rssi > B->Rssi; });
+    Count = std::min<size_t>(Count, MESH_NEIGHBOUR_REPORT_MAX);
+
+    const size_t Length = sizeof(Header) + Count * sizeof(MeshNeighbourEntry);
+    if (PayloadOut == nullptr || OutputBufferSize < Length) return 0;
+
+    Header.NeighbourCount = (uint8_t)Count;
+    memcpy(PayloadOut, &Header, sizeof(Header));
+
+    for (size_t i = 0; i < Count; i++)
+    {
+        MeshNeighbourEntry Entry{};
+        Entry.Uid = Sorted[i]->Uid;
+        Entry.Rssi = Sorted[i]->Rssi;
+        Entry.HopCount = Sorted[i]->HopCount;
+        Entry.FreeChildSlots = Sorted[i]->FreeChildSlots;
+        Entry.Flags = Sorted[i]->Flags;
+
+        LinkQuality Link{};
+        if (Links.GetLinkByUid(Entry.Uid, Link)) Entry.EtxQ8 = (uint16_t)std::min(Link.Etx * 256.0f, 65535.0f);
+
+        memcpy(PayloadOut + sizeof(Header) + i * sizeof(Entry), &Entry, sizeof(Entry));
+    }
+
+    return Length;
+}
+
+
+
+// Parses a vendor IE from the driver callback, false if it is not a mesh IE of this network
+static bool MeshParseIe(const vendor_ie_data_t* Data, MeshIePayload& Payload)
+{
+    if (Data == nullptr) return false;
+
+    if (Data->vendor_oui[0] != MESH_OUI_0 || 
+        Data->vendor_oui[1] != MESH_OUI_1 || 
+        Data->vendor_oui[2] != MESH_OUI_2) return false;
+    if (Data->vendor_oui_type != MESH_OUI_TYPE) return false;
+    if (Data->length < 4 + sizeof(MeshIePayload)) return false;
+
+    memcpy(&Payload, Data->payload, sizeof(MeshIePayload));
+
+    return Payload.Version == MESH_IE_VERSION && Payload.NetworkId == MESH_NETWORK_ID;
+}
+
+
+
 AccessPointStation::AccessPointStation(uint8_t CoreToUse, uint16_t Port, bool EnableRuntimeLogging)
 {
     ApStaClassInstance = this;
+    MeshTimeSource = &Clock;
     UdpCore = CoreToUse;
     UdpPort = Port;
     IsRuntimeLoggingEnabled = EnableRuntimeLogging;
@@ -41,6 +364,9 @@ AccessPointStation::AccessPointStation(uint8_t CoreToUse, uint16_t Port, bool En
     IsConnectedToParent = false;
     ApIpAcquired = false;
     MyHopCount = 255; // Default to 'Infinity' until scan/connect
+    MyPathCost = MESH_PATH_COST_INFINITE;
+    MyAncestorDigest = MeshDigestBitsForUid(WifiFactory::GetNodeUid());
+    IsRouteWithdrawn = true; // No route to withdraw until the first IP
 }
 
 
@@ -54,975 +380,3840 @@ AccessPointStation::~AccessPointStation()
 
 
 
-void AccessPointStation::ApWifiEventHandler(void* arg, esp_event_base_t event_base,
-                                           int32_t event_id, void* event_data)
+void AccessPointStation::ApWifiEventHandler(void* arg, esp_event_base_t event_base,
+                                           int32_t event_id, void* event_data)
+{
+    if (ApStaClassInstance == nullptr || event_base != WIFI_EVENT) return;
+
+    if (event_id == WIFI_EVENT_AP_STACONNECTED) 
+    {
+        ApStaClassInstance->PostMeshEvent(MeshEventType::ChildJoined, event_data, sizeof(wifi_event_ap_staconnected_t));
+    } 
+
+    else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) 
+    {
+        ApStaClassInstance->PostMeshEvent(MeshEventType::ChildLeft, event_data, sizeof(wifi_event_ap_stadisconnected_t));
+    }
+}
+
+
+
+int AccessPointStation::FindChildByMac(const uint8_t Mac[6]) const
+{
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        if (ChildDevices[i].IsActive && memcmp(ChildDevices[i].MacId, Mac, 6) == 0) return i;
+    }
+    return -1;
+}
+
+
+
+void AccessPointStation::RecountChildren()
+{
+    uint8_t Count = 0;
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        if (ChildDevices[i].IsActive) Count++;
+    }
+    ActiveChildren = Count;
+}
+
+
+
+void AccessPointStation::NoteDescendant(uint64_t Uid, int ChildSlot, int64_t Now)
+{
+    // Its own entry if it has one, it may have moved to another child
+    int Entry = -1;
+    for (int i = 0; Entry < 0 && i < (int)MESH_MAX_DESCENDANTS; i++)
+    {
+        if (Descendants[i].Uid == Uid) Entry = i;
+    }
+
+    // Else a free entry, or the one heard from longest ago
+    if (Entry < 0)
+    {
+        Entry = 0;
+        for (int i = 1; i < (int)MESH_MAX_DESCENDANTS && Descendants[Entry].Uid != 0; i++)
+        {
+            if (Descendants[i].Uid == 0 || Descendants[i].LastSeenUs < Descendants[Entry].LastSeenUs) Entry = i;
+        }
+    }
+
+    Descendants[Entry].Uid = Uid;
+    memcpy(Descendants[Entry].ChildMac, ChildDevices[ChildSlot].MacId, 6);
+    Descendants[Entry].LastSeenUs = Now;
+}
+
+
+
+int AccessPointStation::FindChildForUid(uint64_t Uid, int64_t Now) const
+{
+    if (Uid == 0) return -1;
+
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        if (ChildDevices[i].IsActive && ChildDevices[i].UID == Uid) return i;
+    }
+
+    for (int i = 0; i < (int)MESH_MAX_DESCENDANTS; i++)
+    {
+        if (Descendants[i].Uid != Uid) continue;
+        if (Now - Descendants[i].LastSeenUs > (int64_t)MESH_DESCENDANT_TIMEOUT_MS * 1000) return -1;
+        return FindChildByMac(Descendants[i].ChildMac);
+    }
+
+    return -1;
+}
+
+
+
+size_t AccessPointStation::GetChildDevices(WifiDevice* DevicesOut, size_t MaxDevices)
+{
+    if (DevicesOut == nullptr) return 0;
+
+    size_t Count = 0;
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN && Count < MaxDevices; i++)
+    {
+        if (ChildDevices[i].IsActive) DevicesOut[Count++] = ChildDevices[i];
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    return Count;
+}
+
+void AccessPointStation::StaWifiEventHandler(void* arg, esp_event_base_t event_base,
+                                            int32_t event_id, void* event_data)
+{
+    if (ApStaClassInstance == nullptr || event_base != WIFI_EVENT) return;
+
+    switch (event_id) 
+    {
+        case WIFI_EVENT_STA_START:
+            ApStaClassInstance->PostMeshEvent(MeshEventType::StaStart);
+            break;
+
+        case WIFI_EVENT_SCAN_DONE:
+            ApStaClassInstance->PostMeshEvent(MeshEventType::ScanDone);
+            break;
+
+        case WIFI_EVENT_STA_CONNECTED: 
+            ApStaClassInstance->PostMeshEvent(MeshEventType::StaConnected, event_data, sizeof(wifi_event_sta_connected_t));
+            break;
+
+        case WIFI_EVENT_STA_DISCONNECTED:
+            ApStaClassInstance->PostMeshEvent(MeshEventType::StaDisconnected, event_data, sizeof(wifi_event_sta_disconnected_t));
+            break;
+    }
+}
+
+void AccessPointStation::IpEventHandler(void* arg, esp_event_base_t event_base,
+                                         int32_t event_id, void* event_data)
+{
+    if (ApStaClassInstance == nullptr || event_base != IP_EVENT) return;
+
+    switch (event_id)
+    {
+        case IP_EVENT_STA_GOT_IP:
+            ApStaClassInstance->PostMeshEvent(MeshEventType::GotIp, event_data, sizeof(ip_event_got_ip_t));
+            break;
+
+        case IP_EVENT_AP_STAIPASSIGNED:
+            ApStaClassInstance->PostMeshEvent(MeshEventType::ChildIpAssigned, event_data, sizeof(ip_event_ap_staipassigned_t));
+            break;
+
+        case IP_EVENT_STA_LOST_IP:
+            ApStaClassInstance->PostMeshEvent(MeshEventType::LostIp);
+            break;
+    }
+}
+
+
+
+bool AccessPointStation::PostMeshEvent(MeshEventType Type, const void* Data, size_t Length)
+{
+    if (MeshEventQueue == nullptr) return false;
+
+    MeshEvent Event{};
+    Event.Type = Type;
+    Event.PostedUs = esp_timer_get_time();
+    if (Data != nullptr) memcpy(&Event.Data, Data, std::min(Length, sizeof(Event.Data)));
+
+    if (xQueueSend(MeshEventQueue, &Event, 0) != pdTRUE)
+    {
+        DroppedMeshEvents++;
+        return false;
+    }
+    return true;
+}
+
+
+
+void AccessPointStation::DeadlineTimerCallback(void* arg)
+{
+    if (ApStaClassInstance == nullptr) return;
+    ApStaClassInstance->PostMeshEvent(static_cast<MeshEventType>(reinterpret_cast<uintptr_t>(arg)));
+}
+
+
+
+bool AccessPointStation::CreateDeadlineTimer(MeshEventType Type, const char* Name)
+{
+    esp_timer_create_args_t TimerArgs = {};
+    TimerArgs.callback = &AccessPointStation::DeadlineTimerCallback;
+    TimerArgs.arg = reinterpret_cast<void*>(static_cast<uintptr_t>(Type));
+    TimerArgs.dispatch_method = ESP_TIMER_TASK;
+    TimerArgs.name = Name;
+
+    return esp_timer_create(&TimerArgs, &DeadlineTimers[(size_t)Type]) == ESP_OK;
+}
+
+
+
+void AccessPointStation::ArmDeadline(MeshEventType Type, uint32_t DelayMs)
+{
+    esp_timer_handle_t Timer = DeadlineTimers[(size_t)Type];
+    if (Timer == nullptr) return;
+
+    esp_timer_stop(Timer); // Not running is fine
+    esp_timer_start_once(Timer, (uint64_t)DelayMs * 1000);
+}
+
+
+
+void AccessPointStation::HandleMeshEvent(const MeshEvent& Event)
+{
+    switch (Event.Type)
+    {
+        case MeshEventType::StaStart:
+            IsConnectedToParent = false;
+            ApIpAcquired = false;
+            StopUdp();
+            WarmReconnect();
+            break;
+
+
+
+        case MeshEventType::ScanDone:
+        {
+            if (IsRuntimeLoggingEnabled) {
+                ESP_LOGI(STA_TAG, "WiFi Scan Complete. Parsing results...");
+            }
+            ParseScanResults();
+            IsScanning = false;
+            UpdateBeaconMetadata(); // Seeking flag follows the scan result
+
+            // The master's plan overrides the hop rule: move to its parent, and stay there
+            const bool IsParentPreferred = MeshIsPreferredParent(PreferredParentUid, PreferredParentUntilUs, IsMasterFound, ParentDevice.UID);
+            const bool IsCandidatePreferred = MeshIsPreferredParent(PreferredParentUid, PreferredParentUntilUs, IsCandidateMaster, CandidateUid);
+
+            // Connect straight away instead of on the next scan period
+            if (!IsConnectedToParent && !IsConnecting && ParentWifiRecord.ssid[0] != '\0')
+            {
+                IsConnecting = true;
+                ConnectToBestAp();
+            }
+
+            else if (IsConnectedToParent && ApIpAcquired && IsCandidateValid && !PendingRoam && !IsParentPreferred &&
+                     (IsCandidatePreferred || CandidateHop < ParentDevice.HopCount))
+            {
+                if (IsRuntimeLoggingEnabled) 
+                {
+                    ESP_LOGW(STA_TAG, "Roam requested: current hop %u -> candidate hop %u%s",
+                            ParentDevice.HopCount, CandidateHop, IsCandidatePreferred ? " (preferred by master)" : "");
+                }
+
+                if (IsCandidatePreferred) TopologyStats.PreferredRoams++;
+
+                // The connect happens in StaDisconnected, once the old link is down
+                PendingRoam = true;
+                esp_wifi_disconnect();
+            }
+            break;
+        }
+
+
+
+        case MeshEventType::StaConnected: 
+            IsConnecting = false;
+            IsConnectedToParent = true;
+            
+            ParentDevice.TimeOfConnection = esp_timer_get_time();
+            if (BootStats.FirstConnectUs == 0) BootStats.FirstConnectUs = ParentDevice.TimeOfConnection;
+            ParentDevice.aid = Event.Data.StaConnected.aid;
+            memcpy(ParentDevice.MacId, Event.Data.StaConnected.bssid, 6);
+
+            if (IsRuntimeLoggingEnabled) {
+                ESP_LOGW(STA_TAG, "Hardware Link to Parent Established");
+            }
+            break;
+
+
+
+        case MeshEventType::StaDisconnected:
+        {
+            // A planned roam is not a lost route. The old hop, cost and ancestry stay in the beacon
+            // until GotIp replaces them, so the subtree neither sees a poisoned route nor a withdrawal.
+            // If the new parent refuses us, that disconnect comes without PendingRoam and withdraws.
+            const bool IsRoaming = PendingRoam;
+
+            // Poison the route and tell the children, before UDP goes down
+            if (!IsRoaming) DeclareParentLost("WiFi disconnect");
+
+            // Precise State Reset
+            IsConnecting = false;
+            IsConnectedToParent = false;
+            ApIpAcquired = false;
+            LinkTable.RemoveParent();
+            
+            StopUdp();
+
+            if (IsRoaming)
+            {
+                PendingRoam = false;
+                AdoptCandidateAsParent();
+
+                ESP_LOGW(STA_TAG, "Roaming now to %s (hop %u)", (char*)ParentWifiRecord.ssid, ParentDevice.HopCount);
+
+                IsConnecting = true;
+                ConnectToBestAp();
+                break;
+            }
+
+            ParentDevice.HopCount = 255;
+            IsMasterFound = false;
+            ParentWifiRecord.ssid[0] = '\0';
+
+            // Cached parent is gone, do not try it again on the next boot
+            if (IsWarmConnecting)
+            {
+                IsWarmConnecting = false;
+                EraseParentCache();
+                if (IsRuntimeLoggingEnabled) ESP_LOGW(STA_TAG, "Warm reconnect failed, falling back to scan");
+            }
+
+            if (IsRuntimeLoggingEnabled) {
+                 ESP_LOGE(STA_TAG, "Parent Lost (Reason: %d). Re-scanning now...", Event.Data.StaDisconnected.reason);
+            }
+
+            if (!IsScanning) InitiateMeshScan();
+            break;
+        }
+
+
+
+        case MeshEventType::GotIp:
+        {
+            const ip_event_got_ip_t* IpEvent = &Event.Data.GotIp;
+
+            // 1. Convert IP addresses to strings
+            char GwStr[16] = {0};
+            esp_ip4addr_ntoa(&IpEvent->ip_info.gw, GwStr, sizeof(GwStr));
+            char MyStr[16] = {0};
+            esp_ip4addr_ntoa(&IpEvent->ip_info.ip, MyStr, sizeof(MyStr));
+
+            // 2. Store internal station data
+            strncpy(ParentDevice.IpAddress, GwStr, 15);
+            strncpy(MyStaIpAddress, MyStr, 15);
+            
+            // 3. Update State Flags
+            ApIpAcquired = true;
+            IsConnectedToParent = true;
+
+            // 4. MESH LOGIC: Path Validation
+            // If connected to a Mesh node, increment. 
+            // If connected to a standard router (255), we assume it's the Root (0) and we become 1.
+            if (ParentDevice.HopCount != 255) 
+            {
+                MyHopCount = ParentDevice.HopCount + 1;
+            }
+            else 
+            {
+                 MyHopCount = 1; 
+                 ParentDevice.HopCount = 0; 
+                 ParentDevice.PathCost = 0;
+                 ParentDevice.AncestorDigest = 0;
+            }
+
+            // Path cost and ancestry are the parent's plus our own link / UID
+            MyPathCost = MeshAddPathCost(ParentDevice.PathCost, MeshLinkCostFromRssi(ParentDevice.Rssi));
+            MyAncestorDigest = ParentDevice.AncestorDigest | MeshDigestBitsForUid(WifiFactory::GetNodeUid());
+
+            // 5. Route is live again, restart the parent deadline and close the failover measurement
+            const int64_t Now = esp_timer_get_time();
+            if (BootStats.FirstIpUs == 0) BootStats.FirstIpUs = Now;
+            IsWarmConnecting = false;
+            SaveParentCache();
+
+            ParentDevice.LastHeartbeatUs = Now;
+            IsRouteWithdrawn = false;
+
+            // Fresh link statistics for the new parent, keyed by the address our heartbeats go to
+            sockaddr_in Upstream{};
+            if (GetUpstreamAddress(Upstream)) LinkTable.AddLink(Upstream.sin_addr.s_addr, ParentDevice.MacId, true);
+            Clock.OnParentChanged();
+
+            if (ParentLostAtUs != 0)
+            {
+                FailoverStats.LastFailoverUs = Now - ParentLostAtUs;
+                if (FailoverStats.LastFailoverUs > FailoverStats.WorstFailoverUs) FailoverStats.WorstFailoverUs = FailoverStats.LastFailoverUs;
+                FailoverStats.FailoverCount++;
+                ParentLostAtUs = 0;
+
+                if (IsRuntimeLoggingEnabled)
+                {
+                    ESP_LOGW(STA_TAG, "Failover complete in %lld ms (worst %lld ms)", 
+                             FailoverStats.LastFailoverUs / 1000, FailoverStats.WorstFailoverUs / 1000);
+                }
+            }
+
+            // 6. Broadcast our new status (Host + 1)
+            UpdateBeaconMetadata();
+
+            // 7. Start UDP, and announce ourselves at once rather than on the next keepalive period
+            bool UdpStartedOk = StartUdp(UdpPort, UdpCore);
+            if (UdpStartedOk) SendIdleKeepalives();
+            if (UdpStartedOk && !Backlog.IsEmpty()) PostMeshEvent(MeshEventType::BackfillDeadline);
+
+            // 8. Simple Runtime Logging
+            if (IsRuntimeLoggingEnabled)
+            {
+                ESP_LOGI(STA_TAG, "STA Connected. IP: %s, GW: %s, My Hop: %d", MyStr, GwStr, MyHopCount);
+                if (!UdpStartedOk) ESP_LOGE(STA_TAG, "UDP failed to start on port %d", UdpPort);
+            }
+            break;
+        }
+
+
+
+        case MeshEventType::LostIp:
+            ApIpAcquired = false;
+            memset(MyStaIpAddress, 0, 16);
+
+            // MESH LOGIC: Poison the route
+            DeclareParentLost("Lost IP");
+
+            StopUdp();
+            
+            if (IsRuntimeLoggingEnabled) ESP_LOGE(STA_TAG, "STA lost IP");
+            break;
+
+
+
+        case MeshEventType::ChildJoined:
+        {
+            const wifi_event_ap_staconnected_t* ApEvent = &Event.Data.ChildJoined;
+            
+            portENTER_CRITICAL(&CriticalSection);
+
+            // A child that reconnects keeps its slot, otherwise take the first free one
+            int Slot = FindChildByMac(ApEvent->mac);
+            const bool IsRejoin = Slot >= 0;
+            for (int i = 0; Slot < 0 && i < (int)MESH_MAX_CHILDREN; i++)
+            {
+                if (!ChildDevices[i].IsActive) Slot = i;
+            }
+
+            if (Slot >= 0)
+            {
+                WifiDevice& Child = ChildDevices[Slot];
+                memset(&Child, 0, sizeof(WifiDevice)); // Precise: Clear memory for string safety
+                Child.IsActive = true;
+                Child.TimeOfConnection = esp_timer_get_time();
+                Child.aid = ApEvent->aid;
+                Child.HopCount = 255; // Initialized as unknown
+                Child.LastHeartbeatUs = Child.TimeOfConnection;
+                Child.PathCost = MESH_PATH_COST_INFINITE;
+                memcpy(Child.MacId, ApEvent->mac, 6);
+            }
+
+            RecountChildren();
+            const bool IsAboveLimit = !IsRejoin && ActiveChildren > ChildLimit;
+            portEXIT_CRITICAL(&CriticalSection);
+
+            // The soft-AP limit only follows ChildLimit while it is empty, so a newcomer above it is sent away here
+            if (IsAboveLimit)
+            {
+                AdmissionStats.JoinsRejected++;
+                esp_wifi_deauth_sta(ApEvent->aid);
+
+                if (IsRuntimeLoggingEnabled)
+                {
+                    ESP_LOGW("MESH_AP", "Child Rejected | MAC: " MACSTR " | Limit: %u", MAC2STR(ApEvent->mac), ChildLimit);
+                }
+                break;
+            }
+
+            if (IsRuntimeLoggingEnabled) 
+            {
+                if (Slot >= 0)
+                {
+                    ESP_LOGW("MESH_AP", "Child Joined | MAC: " MACSTR " | AID: %d | Slot: %d | Children: %u/%u", 
+                             MAC2STR(ApEvent->mac), ApEvent->aid, Slot, ActiveChildren, MAX_STA_CONN);
+                }
+                else
+                {
+                    ESP_LOGE("MESH_AP", "Child Joined but child table is full | MAC: " MACSTR, MAC2STR(ApEvent->mac));
+                }
+            }
+
+            UpdateBeaconMetadata();
+            break;
+        }
+
+
+
+        case MeshEventType::ChildLeft:
+        {
+            const wifi_event_ap_stadisconnected_t* ApEvent = &Event.Data.ChildLeft;
+            
+            portENTER_CRITICAL(&CriticalSection);
+            int Slot = FindChildByMac(ApEvent->mac);
+            if (Slot >= 0) memset(&ChildDevices[Slot], 0, sizeof(WifiDevice));
+            RecountChildren();
+            portEXIT_CRITICAL(&CriticalSection);
+
+            LinkTable.RemoveLinkByMac(ApEvent->mac);
+
+            if (IsRuntimeLoggingEnabled) {
+                ESP_LOGE("MESH_AP", "Child Left | MAC: " MACSTR " | Children: %u/%u", 
+                         MAC2STR(ApEvent->mac), ActiveChildren, MAX_STA_CONN);
+            }
+
+            UpdateBeaconMetadata();
+            break;
+        }
+
+
+
+        case MeshEventType::ChildIpAssigned:
+        {
+            const ip_event_ap_staipassigned_t* IpEvent = &Event.Data.ChildIpAssigned;
+            
+            char AssignedIp[16];
+            esp_ip4addr_ntoa(&IpEvent->ip, AssignedIp, sizeof(AssignedIp));
+
+
+            // The event carries the MAC of the station that got the lease, so several
+            // children joining at once cannot be mixed up
+            portENTER_CRITICAL(&CriticalSection);
+            int Slot = FindChildByMac(IpEvent->mac);
+            if (Slot >= 0)
+            {
+                WifiDevice& Child = ChildDevices[Slot];
+                strncpy(Child.IpAddress, AssignedIp, sizeof(Child.IpAddress) - 1);
+                Child.IpAddress[sizeof(Child.IpAddress) - 1] = '\0';
+                Child.LastHeartbeatUs = esp_timer_get_time(); // Deadline starts once the child can send
+            }
+            portEXIT_CRITICAL(&CriticalSection);
+
+            if (Slot >= 0) LinkTable.AddLink(IpEvent->ip.addr, IpEvent->mac, false);
+
+            if (IsRuntimeLoggingEnabled) 
+            {
+                if (Slot >= 0) ESP_LOGW("MESH_AP", "Linked IP %s to Child MAC " MACSTR, AssignedIp, MAC2STR(IpEvent->mac));
+                else ESP_LOGE("MESH_AP", "Received IP assignment %s for unknown MAC " MACSTR, AssignedIp, MAC2STR(IpEvent->mac));
+            }
+
+            // A root never gets an STA IP, its socket comes up with the first child
+            if (IsRootGateway && !StartUdp(UdpPort, UdpCore) && IsRuntimeLoggingEnabled)
+            {
+                ESP_LOGE("UDP", "UDP failed to start on port %d", UdpPort);
+            }
+            break;
+        }
+
+
+
+        case MeshEventType::RouteWithdrawn:
+            if (!IsConnectedToParent) break;
+            FailoverStats.RouteWithdrawalsReceived++;
+            DeclareParentLost("Parent withdrew its route");
+            esp_wifi_disconnect(); // Rescan now, the parent's beacon will read hop 255
+            break;
+
+
+
+        case MeshEventType::ScanDeadline:
+            if (!IsScanning && !IsConnecting) InitiateMeshScan();
+            ArmDeadline(MeshEventType::ScanDeadline, MESH_SCAN_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::BeaconDeadline:
+            UpdateUplinkLoad();
+            UpdateChildLimit();
+            UpdateBeaconMetadata();
+            ArmDeadline(MeshEventType::BeaconDeadline, MESH_BEACON_REFRESH_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::KeepaliveDeadline:
+            // Keepalives only go out on links that were idle for the whole period
+            SendIdleKeepalives();
+            ArmDeadline(MeshEventType::KeepaliveDeadline, MESH_HEARTBEAT_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::LivenessDeadline:
+            CheckLiveness();
+            CheckPromotedRole();
+            ArmDeadline(MeshEventType::LivenessDeadline, MESH_LIVENESS_CHECK_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::EchoDeadline:
+            SendEchoRequests();
+            ArmDeadline(MeshEventType::EchoDeadline, MESH_ECHO_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::TimeSyncDeadline:
+            SendTimeSyncRequest();
+            ArmDeadline(MeshEventType::TimeSyncDeadline, MESH_TIME_SYNC_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::BackfillDeadline:
+            // Held packets only take the uplink while forwarded traffic leaves room for them
+            if (IsConnectedToHost() && MyUplinkLoad < MESH_ADMISSION_LOAD_LIMIT) Backlog.Backfill();
+            ArmDeadline(MeshEventType::BackfillDeadline, Backlog.IsEmpty() ? MESH_HEARTBEAT_PERIOD_MS : MESH_BACKFILL_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::ReportDeadline:
+            SendNeighbourReport();
+            ArmDeadline(MeshEventType::ReportDeadline, MESH_NEIGHBOUR_REPORT_PERIOD_MS);
+            break;
+
+
+
+        case MeshEventType::PreferredParent:
+        {
+            // A root has no parent to change
+            if (IsRootGateway) break;
+
+            const uint32_t HoldMs = std::min(Event.Data.PreferredParent.HoldMs, MESH_PREFERRED_PARENT_MAX_HOLD_MS);
+            PreferredParentUid = Event.Data.PreferredParent.ParentUid;
+            PreferredParentUntilUs = (HoldMs == 0) ? 0 : Event.PostedUs + (int64_t)HoldMs * 1000;
+            TopologyStats.PreferencesReceived++;
+
+            if (IsRuntimeLoggingEnabled)
+            {
+                ESP_LOGW(STA_TAG, "Preferred parent UID %llu for %lu ms", PreferredParentUid, (unsigned long)HoldMs);
+            }
+
+            // The roam itself happens in ScanDone, once the preferred parent has been seen
+            if (HoldMs > 0 && !IsScanning && !IsConnecting) InitiateMeshScan();
+            break;
+        }
+
+
+
+        case MeshEventType::RootAnnounceDeadline:
+            CheckHostLink();
+            SendRootAnnounce();
+            ArmDeadline(MeshEventType::RootAnnounceDeadline, MESH_ROOT_ANNOUNCE_PERIOD_MS);
+            break;
+
+
+
+        default:
+            break;
+    }
+}
+
+
+
+
+
+void AccessPointStation::WifiVendorIeCb(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi) 
+{
+    MeshIePayload Payload;
+    if (ApStaClassInstance == nullptr || !MeshParseIe(vnd_ie, Payload)) return;
+
+    if (ApStaClassInstance->IsRuntimeLoggingEnabled) 
+    {
+        ESP_LOGW(STA_TAG, "IE Detected from " MACSTR " | UID: %llu | Hops %d | Cost %u | Load %u%% | Free %u | Children %d", 
+                MAC2STR(sa), Payload.Uid, Payload.HopCount, Payload.PathCost,
+                Payload.UplinkLoad, Payload.FreeChildSlots, Payload.ChildCount);
+    }
+
+    portENTER_CRITICAL(&ApStaClassInstance->CriticalSection);
+    MeshCacheIe(ApStaClassInstance->CallbackIeData, sa, Payload, rssi);
+    portEXIT_CRITICAL(&ApStaClassInstance->CriticalSection);
+
+    ApStaClassInstance->LinkTable.OnRssi(sa, (int8_t)rssi);
+}
+
+
+
+bool AccessPointStation::LoadParentCache()
+{
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READONLY, &Handle) != ESP_OK) return false;
+
+    MeshParentCache Cache{};
+    size_t Length = sizeof(Cache);
+    esp_err_t Result = nvs_get_blob(Handle, MESH_NVS_PARENT_KEY, &Cache, &Length);
+    nvs_close(Handle);
+
+    if (Result != ESP_OK || Length != sizeof(Cache) || Cache.Magic != MESH_PARENT_CACHE_MAGIC) return false;
+
+    ParentCache = Cache;
+    IsParentCacheValid = true;
+    return true;
+}
+
+
+
+void AccessPointStation::SaveParentCache()
+{
+    MeshParentCache Cache{};
+    Cache.Magic = MESH_PARENT_CACHE_MAGIC;
+    memcpy(Cache.Ssid, ParentWifiRecord.ssid, sizeof(Cache.Ssid));
+    Cache.Ssid[sizeof(Cache.Ssid) - 1] = '\0';
+    memcpy(Cache.Bssid, ParentWifiRecord.bssid, 6);
+    Cache.Channel = ParentWifiRecord.primary;
+    Cache.Rssi = ParentWifiRecord.rssi;
+    Cache.IsMaster = IsMasterFound;
+    Cache.HopCount = ParentDevice.HopCount;
+    Cache.PathCost = ParentDevice.PathCost;
+    Cache.AncestorDigest = ParentDevice.AncestorDigest;
+    Cache.RootUid = MyRootUid;
+
+    // Only the link identity decides whether flash is written, hop and cost are refreshed by the first scan anyway
+    if (IsParentCacheValid && memcmp(Cache.Bssid, ParentCache.Bssid, 6) == 0 && 
+        Cache.Channel == ParentCache.Channel && Cache.IsMaster == ParentCache.IsMaster) return;
+
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READWRITE, &Handle) != ESP_OK) return;
+
+    if (nvs_set_blob(Handle, MESH_NVS_PARENT_KEY, &Cache, sizeof(Cache)) == ESP_OK && nvs_commit(Handle) == ESP_OK)
+    {
+        ParentCache = Cache;
+        IsParentCacheValid = true;
+    }
+    nvs_close(Handle);
+}
+
+
+
+void AccessPointStation::EraseParentCache()
+{
+    IsParentCacheValid = false;
+
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READWRITE, &Handle) != ESP_OK) return;
+    nvs_erase_key(Handle, MESH_NVS_PARENT_KEY);
+    nvs_commit(Handle);
+    nvs_close(Handle);
+}
+
+
+
+bool AccessPointStation::WarmReconnect()
+{
+    if (!IsParentCacheValid || IsConnecting || IsConnectedToParent) return false;
+
+    memset(&ParentWifiRecord, 0, sizeof(ParentWifiRecord));
+    memcpy(ParentWifiRecord.ssid, ParentCache.Ssid, sizeof(ParentCache.Ssid));
+    memcpy(ParentWifiRecord.bssid, ParentCache.Bssid, 6);
+    ParentWifiRecord.primary = ParentCache.Channel;
+    ParentWifiRecord.rssi = ParentCache.Rssi;
+
+    IsMasterFound = ParentCache.IsMaster;
+    ParentDevice.HopCount = ParentCache.HopCount;
+    ParentDevice.PathCost = ParentCache.PathCost;
+    ParentDevice.AncestorDigest = ParentCache.AncestorDigest;
+    ParentDevice.Rssi = ParentCache.Rssi;
+    MyRootUid = ParentCache.RootUid;
+
+    if (IsRuntimeLoggingEnabled) 
+    {
+        ESP_LOGW(STA_TAG, "Warm reconnect to cached parent %s (" MACSTR ", channel %u, hop %u)",
+                 ParentCache.Ssid, MAC2STR(ParentCache.Bssid), ParentCache.Channel, ParentCache.HopCount);
+    }
+
+    IsWarmConnecting = true;
+    BootStats.IsWarmStart = true;
+    IsConnecting = true;
+    ConnectToBestAp();
+    return true;
+}
+
+
+
+bool AccessPointStation::InitiateMeshScan()
+{
+    wifi_scan_config_t scan_config = {};
+    scan_config.show_hidden = false;
+    scan_config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
+    
+    // Non-blocking scan start
+    if (esp_wifi_scan_start(&scan_config, false) == ESP_OK)
+    {
+        IsScanning = true; 
+        return true;
+    }
+    return false;
+}
+
+void AccessPointStation::UpdateBeaconMetadata()
+{
+    // Define the structure exactly as expected by the hardware
+    typedef struct 
+    {
+        vendor_ie_data_t header;
+        MeshIePayload payload;
+    } __attribute__((packed)) mesh_vendor_ie_t;
+
+
+    const size_t Children = ActiveChildren;
+
+    // Admission: only the slots the uplink can carry are offered, so new children
+    // spread to less loaded branches instead of queueing behind a choke point
+    const uint8_t FreeSlots = (Children >= ChildLimit) ? 0 : (uint8_t)(ChildLimit - Children);
+
+    MeshIePayload Payload{};
+    Payload.Version = MESH_IE_VERSION;
+    Payload.NetworkId = MESH_NETWORK_ID;
+    Payload.Uid = WifiFactory::GetNodeUid();
+    Payload.HopCount = MyHopCount;
+    Payload.PathCost = (MyHopCount == 255) ? MESH_PATH_COST_INFINITE : MyPathCost;
+    Payload.UplinkLoad = MyUplinkLoad;
+    Payload.FreeChildSlots = FreeSlots;
+    Payload.ChildCount = (uint8_t)Children;
+    Payload.AncestorDigest = MyAncestorDigest;
+    Payload.RootUid = MyRootUid;
+
+    // No route and nothing usable in the last scan, a leaf in range can promote itself to take us
+    Payload.Flags = (MyHopCount == 255 && !IsCandidateValid) ? MESH_IE_FLAG_SEEKING_PARENT : 0;
+
+
+    // Same IE already in the driver, nothing to do
+    if (IsIeInstalled && memcmp(&Payload, &InstalledIe, sizeof(MeshIePayload)) == 0) return;
+
+
+    mesh_vendor_ie_t my_ie;
+    my_ie.header.element_id = 0xDD;
+    my_ie.header.length = 4 + sizeof(MeshIePayload); // 3 (OUI) + 1 (OUI Type) + Payload
+    my_ie.header.vendor_oui[0] = MESH_OUI_0;
+    my_ie.header.vendor_oui[1] = MESH_OUI_1;
+    my_ie.header.vendor_oui[2] = MESH_OUI_2;
+    my_ie.header.vendor_oui_type = MESH_OUI_TYPE;
+    my_ie.payload = Payload;
+
+    esp_wifi_set_vendor_ie(false, WIFI_VND_IE_TYPE_BEACON, WIFI_VND_IE_ID_0, nullptr);
+    esp_wifi_set_vendor_ie(false, WIFI_VND_IE_TYPE_PROBE_RESP, WIFI_VND_IE_ID_1, nullptr);
+
+    esp_err_t res_bcn = esp_wifi_set_vendor_ie(true, WIFI_VND_IE_TYPE_BEACON, WIFI_VND_IE_ID_0, (vendor_ie_data_t*)&my_ie);
+    esp_err_t res_prb = esp_wifi_set_vendor_ie(true, WIFI_VND_IE_TYPE_PROBE_RESP, WIFI_VND_IE_ID_1, (vendor_ie_data_t*)&my_ie);
+
+    // Only remember the IE once the driver has it, so a failed update is retried next call
+    IsIeInstalled = (res_bcn == ESP_OK && res_prb == ESP_OK);
+    if (IsIeInstalled)
+    {
+        InstalledIe = Payload;
+        IeDriverUpdates++;
+    }
+
+    if (IsRuntimeLoggingEnabled) 
+    {
+        if (IsIeInstalled) 
+        {
+            ESP_LOGW(STA_TAG, "Mesh IE Broadcast Updated: Hop %d, Cost %u, Load %u%%, Free %u, Children %d", 
+                     Payload.HopCount, Payload.PathCost, Payload.UplinkLoad, Payload.FreeChildSlots, Payload.ChildCount);
+        } 
+        else 
+        {
+            ESP_LOGE(STA_TAG, "IE Update Deferred (Driver Busy): 0x%x", res_bcn);
+        }
+    }
+}
+
+
+
+void AccessPointStation::UpdateUplinkLoad()
+{
+    const int64_t Now = esp_timer_get_time();
+    const int64_t WindowUs = Now - UplinkLoadWindowStartUs;
+
+    if (UplinkLoadWindowStartUs != 0 && WindowUs > 0)
+    {
+        uint64_t BytesPerSecond = ((uint64_t)UplinkTxBytes * 1000000ULL) / (uint64_t)WindowUs;
+        uint32_t Percent = (uint32_t)((BytesPerSecond * 100ULL) / UplinkCapacityBytesPerS);
+        if (Percent > 100) Percent = 100;
+
+        // 10% steps so small fluctuations do not change the IE
+        MyUplinkLoad = (uint8_t)(((Percent + 5) / 10) * 10);
+        if (MyUplinkLoad > 100) MyUplinkLoad = 100;
+    }
+
+    UplinkTxBytes = 0;
+    UplinkLoadWindowStartUs = Now;
+}
+
+
+
+void AccessPointStation::UpdateChildLimit()
+{
+    const uint32_t Refused = UplinkTxFailures;
+    UplinkTxFailures = 0;
+    const uint32_t Held = Backlog.GetStats().StoredPackets;
+
+    float Etx = 1.0f;
+    LinkQuality Parent{};
+    if (!IsRootGateway && LinkTable.GetParentLink(Parent) && Parent.Etx > 1.0f) Etx = Parent.Etx;
+
+    // Every packet from the subtree costs Etx transmissions on the uplink
+    uint8_t Limit = (uint8_t)std::max(1.0f, (float)MAX_STA_CONN / Etx);
+    const uint8_t Children = ActiveChildren;
+
+    // Held packets drain at the backfill rate, only refused sends say the uplink itself is saturated
+    const bool IsOverloaded = MyUplinkLoad >= MESH_OVERLOAD_LOAD_LIMIT || Refused >= 2 * MESH_ADMISSION_QUEUE_LIMIT || Etx >= MESH_OVERLOAD_ETX;
+    const bool IsLoaded = MyUplinkLoad >= MESH_ADMISSION_LOAD_LIMIT || Refused + Held >= MESH_ADMISSION_QUEUE_LIMIT;
+
+    if (IsOverloaded) Limit = std::min<uint8_t>(Limit, (Children > 0) ? Children - 1 : 0);
+    else if (IsLoaded) Limit = std::min(Limit, Children);
+
+    // Opens one slot per period so a recovering uplink is not flooded, closes at once
+    if (Limit > ChildLimit) Limit = ChildLimit + 1;
+
+    if (Limit != ChildLimit)
+    {
+        AdmissionStats.LimitChanges++;
+
+        if (IsRuntimeLoggingEnabled)
+        {
+            ESP_LOGW(STA_TAG, "Child limit %u -> %u | Load %u%% | Refused %lu | Held %lu | ETX %.2f",
+                     ChildLimit, Limit, MyUplinkLoad, (unsigned long)Refused, (unsigned long)Held, Etx);
+        }
+    }
+
+    ChildLimit = Limit;
+    AdmissionStats.UplinkLoad = MyUplinkLoad;
+    AdmissionStats.UplinkRefused = Refused;
+    AdmissionStats.UplinkHeld = Held;
+    AdmissionStats.UplinkEtx = Etx;
+
+    ApplyApMaxConnection();
+
+    if (IsOverloaded && Children > ChildLimit) SteerMarginalChild();
+}
+
+
+
+void AccessPointStation::ApplyApMaxConnection()
+{
+    // The driver does not take 0, a closed node relies on the IE and ChildJoined instead
+    const uint8_t Wanted = std::max<uint8_t>(ChildLimit, 1);
+    if (Wanted == ApMaxConnection || ActiveChildren > 0) return;
+
+    wifi_config_t Config{};
+    if (esp_wifi_get_config(WIFI_IF_AP, &Config) != ESP_OK) return;
+
+    Config.ap.max_connection = Wanted;
+    if (esp_wifi_set_config(WIFI_IF_AP, &Config) != ESP_OK) return;
+
+    ApMaxConnection = Wanted;
+}
+
+
+
+bool AccessPointStation::SteerMarginalChild()
+{
+    const int64_t Now = esp_timer_get_time();
+    if (LastSteerUs != 0 && Now - LastSteerUs < (int64_t)MESH_STEER_HOLDOFF_MS * 1000) return false;
+
+    // The child on the worst link that has somewhere else to go. Its UID is only
+    // learned from its own link control, so an unknown one is never steered.
+    int Marginal = -1;
+    uint64_t MarginalUid = 0;
+    float WorstEtx = 0.0f;
+
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        portENTER_CRITICAL(&CriticalSection);
+        const WifiDevice Child = ChildDevices[i];
+        portEXIT_CRITICAL(&CriticalSection);
+
+        if (!Child.IsActive || Child.UID == 0 || Child.IpAddress[0] == '\0' || Child.AlternativeRssi == 0) continue;
+
+        LinkQuality Link{};
+        const float Etx = LinkTable.GetLinkByUid(Child.UID, Link) ? Link.Etx : 1.0f;
+        if (Marginal < 0 || Etx > WorstEtx)
+        {
+            Marginal = i;
+            MarginalUid = Child.UID;
+            WorstEtx = Etx;
+        }
+    }
+
+    if (Marginal < 0) return false;
+
+
+    portENTER_CRITICAL(&CriticalSection);
+    WifiDevice& Target = ChildDevices[Marginal];
+    if (!Target.IsActive || Target.UID != MarginalUid)
+    {
+        // The slot changed hands since the scan above
+        portEXIT_CRITICAL(&CriticalSection);
+        return false;
+    }
+    const uint64_t ChildUid = Target.UID;
+    MeshPreferredParent Steer{};
+    Steer.ParentUid = Target.AlternativeUid;
+    Steer.HoldMs = MESH_STEER_HOLD_MS;
+    char ChildIp[16];
+    memcpy(ChildIp, Target.IpAddress, sizeof(ChildIp));
+
+    // One attempt per report, the next report says if it still has the option
+    Target.AlternativeRssi = 0;
+    portEXIT_CRITICAL(&CriticalSection);
+
+
+    // Same packet as a preferred parent from the master, unicast to the child by its own UID
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(MeshPreferredParent) + 2];
+    const size_t Length = MeshBuildPacket((const uint8_t*)&Steer, sizeof(Steer), PACKET_TYPE_PREFERRED_PARENT, MESH_FORWARD_DOWNSTREAM, TxBuffer, sizeof(TxBuffer));
+    if (Length == 0) return false;
+    memcpy(TxBuffer + offsetof(PacketHeader, destinationUid), &ChildUid, sizeof(ChildUid));
+
+    sockaddr_in Destination{};
+    Destination.sin_family = AF_INET;
+    Destination.sin_port   = htons(UdpPort);
+    if (inet_pton(AF_INET, ChildIp, &Destination.sin_addr) != 1) return false;
+
+    const size_t Sent = SendData(TxBuffer, (int)Length, Destination);
+    NoteLinkTx(Destination, (int)Sent);
+    if (Sent == 0) return false;
+
+    LastSteerUs = Now;
+    AdmissionStats.ChildrenSteered++;
+
+    if (IsRuntimeLoggingEnabled)
+    {
+        ESP_LOGW(STA_TAG, "Steered child UID %llu (ETX %.2f) to parent UID %llu", ChildUid, WorstEtx, Steer.ParentUid);
+    }
+    return true;
+}
+
+
+
+void AccessPointStation::NoteChildAlternative(int Slot, const uint8_t* Payload, uint16_t PayloadSize)
+{
+    MeshNeighbourReportHeader Header{};
+    if (Slot < 0 || Slot >= (int)MESH_MAX_CHILDREN || PayloadSize < sizeof(Header)) return;
+    memcpy(&Header, Payload, sizeof(Header));
+
+    // The caller has matched the sender to the child, the report must also name us as its parent
+    const uint64_t MyUid = WifiFactory::GetNodeUid();
+    if (Header.ParentUid != MyUid || Header.NeighbourCount > MESH_NEIGHBOUR_REPORT_MAX) return;
+    if (PayloadSize < sizeof(Header) + Header.NeighbourCount * sizeof(MeshNeighbourEntry)) return;
+
+    uint64_t BestUid = 0;
+    int8_t BestRssi = 0;
+
+    // The router takes any child with a route to spare, and puts it one hop above us
+    if (Header.MasterRssi != 0 && Header.MasterRssi >= MESH_STEER_MIN_RSSI && !IsRootGateway) BestRssi = Header.MasterRssi;
+
+    for (uint8_t i = 0; i < Header.NeighbourCount; i++)
+    {
+        MeshNeighbourEntry Entry{};
+        memcpy(&Entry, Payload + sizeof(Header) + i * sizeof(MeshNeighbourEntry), sizeof(Entry));
+
+        // No deeper than us, so the child's path does not get longer
+        if (Entry.Uid == MyUid || Entry.HopCount == 255 || Entry.HopCount > MyHopCount || Entry.FreeChildSlots == 0) continue;
+        if (Entry.Rssi < MESH_STEER_MIN_RSSI) continue;
+
+        if (BestRssi == 0 || Entry.Rssi > BestRssi)
+        {
+            BestUid = Entry.Uid;
+            BestRssi = Entry.Rssi;
+        }
+    }
+
+    portENTER_CRITICAL(&CriticalSection);
+    ChildDevices[Slot].AlternativeUid = BestUid;
+    ChildDevices[Slot].AlternativeRssi = BestRssi;
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+void AccessPointStation::ParseScanResults()
+{
+    uint16_t ApCount = 0;
+    uint8_t CurrentBestHop = 255; 
+    uint8_t CurrentBestChildren = 255;
+
+    
+    Error = esp_wifi_scan_get_ap_num(&ApCount);
+    if (ApCount == 0 || Error != ESP_OK) return;
+
+
+    std::vector<wifi_ap_record_t> ApList(ApCount);
+    Error = esp_wifi_scan_get_ap_records(&ApCount, ApList.data());
+    if (Error != ESP_OK) return;
+
+
+    wifi_ap_record_t* BestAp = nullptr;
+    bool MasterFound = false; 
+    uint16_t CurrentBestPathCost = MESH_PATH_COST_INFINITE;
+    uint64_t CurrentBestDigest = 0;
+    uint32_t CurrentBestScore = UINT32_MAX;
+    const uint64_t OwnDigestBits = MeshDigestBitsForUid(WifiFactory::GetNodeUid());
+    bool IsParentLooped = false;
+
+
+    // Work on a copy, the vendor IE callback keeps writing while we parse
+    MeshMetadata IeCache[MESH_IE_CACHE_SIZE];
+    portENTER_CRITICAL(&CriticalSection);
+    memcpy(IeCache, CallbackIeData, sizeof(IeCache));
+    memset(CallbackIeData, 0, sizeof(CallbackIeData));
+    portEXIT_CRITICAL(&CriticalSection);
+
+    // Everything heard is reported to the master, usable as a parent or not
+    memcpy(ScanNeighbours, IeCache, sizeof(ScanNeighbours));
+    ScanMasterRssi = 0;
+    uint64_t CurrentBestUid = 0;
+    uint64_t CurrentBestRootUid = 0;
+
+
+    for (int i = 0; i < ApCount; i++) 
+    {
+        if (IsRuntimeLoggingEnabled) 
+        {
+            ESP_LOGW(STA_TAG, "Scan Index [%d] SSID: %s | RSSI: %d | Channel: %d", 
+                    i, (char*)ApList[i].ssid, ApList[i].rssi, ApList[i].primary);
+        }
+
+
+        if (ENABLE_MASTER_CONNECTION == true && strcmp((char*)ApList[i].ssid, PARENT_SSID) == 0) 
+        {
+            ScanMasterRssi = ApList[i].rssi;
+
+            // Competes with the root gateways on path cost instead of winning outright
+            const uint32_t Score = MeshRouterScore(PreferredParentUid, PreferredParentUntilUs, ApList[i].rssi);
+            if (IsRuntimeLoggingEnabled) ESP_LOGW(STA_TAG, ">>> Master (SturdyAP) Found! Score: %lu", (unsigned long)Score);
+
+            if (Score < CurrentBestScore)
+            {
+                BestAp = &ApList[i];
+                CurrentBestScore = Score;
+                CurrentBestHop = 0;
+                CurrentBestChildren = 0; 
+                CurrentBestPathCost = 0;
+                CurrentBestDigest = 0;
+                CurrentBestUid = 0;
+                CurrentBestRootUid = 0;
+                MasterFound = true;
+            }
+            continue;
+        } 
+
+
+        else if (strstr((char*)ApList[i].ssid, "node") != nullptr) 
+        {
+            bool foundVendorData = false;
+            
+            for (int j = 0; j < (int)MESH_IE_CACHE_SIZE; j++) 
+            {
+                // if wifi record matches IE scan by BSSID
+                if (IeCache[j].IsValid && 
+                    memcmp(ApList[i].bssid, IeCache[j].MacId, 6) == 0) 
+                {
+
+                    // Hop count unset, device leads nowhere
+                    if (IeCache[j].HopCount == 255)
+                    {
+                        if (IsRuntimeLoggingEnabled) 
+                        {
+                            ESP_LOGW(STA_TAG, "  -- Ignoring node (Hop = 255)");
+                        }
+                        break;
+                    }
+
+
+                    // Path-vector check. Every node below us carries our UID bits in its
+                    // digest, so this rejects our own descendants even while their
+                    // beacons are stale. For another candidate a Bloom false positive
+                    // only costs that candidate. For the current parent it would cost
+                    // a healthy link on every scan, the hash never changes, so the
+                    // parent is only dropped if its hop count agrees: a parent that
+                    // routes through us cannot be closer to the root than we were.
+                    if ((IeCache[j].AncestorDigest & OwnDigestBits) == OwnDigestBits)
+                    {
+                        const bool IsCurrentParent = IsConnectedToParent && !IsMasterFound &&
+                                                     memcmp(ApList[i].bssid, ParentWifiRecord.bssid, 6) == 0;
+
+                        if (IsCurrentParent && IeCache[j].HopCount < MyHopCount)
+                        {
+                            ParentLoopsUncorroborated++;
+                            if (IsRuntimeLoggingEnabled) 
+                            {
+                                ESP_LOGW(STA_TAG, "  -- Parent digest covers this node but its hop %d is above ours (%d), taken as a false positive", 
+                                        IeCache[j].HopCount, MyHopCount);
+                            }
+                        }
+
+                        else
+                        {
+                            LoopCandidatesRejected++;
+
+                            // Our current parent now routes through us, the loop has already formed
+                            if (IsCurrentParent) IsParentLooped = true;
+
+                            if (IsRuntimeLoggingEnabled) 
+                            {
+                                ESP_LOGW(STA_TAG, "  -- Ignoring node (Path to root contains this node, UID %llu)", IeCache[j].Uid);
+                            }
+                            break;
+                        }
+                    }
+
+
+                    // Keep the current parent's hop, cost and ancestry fresh, a warm
+                    // start or a change further up only shows up here. Only once the
+                    // entry has passed the loop check, a parent that routes through
+                    // us must not hand us a hop and ancestry built on our own. Before
+                    // the slot check, our own association may be what filled it.
+                    if (IsConnectedToParent && ApIpAcquired && !IsMasterFound &&
+                        memcmp(ApList[i].bssid, ParentWifiRecord.bssid, 6) == 0)
+                    {
+                        ParentDevice.UID = IeCache[j].Uid;
+                        ParentDevice.HopCount = IeCache[j].HopCount;
+                        ParentDevice.PathCost = IeCache[j].PathCost;
+                        ParentDevice.AncestorDigest = IeCache[j].AncestorDigest;
+                        ParentDevice.Rssi = ApList[i].rssi;
+                        MyRootUid = IeCache[j].RootUid;
+                        MyHopCount = IeCache[j].HopCount + 1;
+                        MyPathCost = MeshAddPathCost(ParentDevice.PathCost, MeshLinkCostFromRssi(ParentDevice.Rssi));
+                        MyAncestorDigest = ParentDevice.AncestorDigest | OwnDigestBits;
+                    }
+
+
+                    // Parent is full or has closed admission because of uplink load
+                    if (IeCache[j].FreeChildSlots == 0) 
+                    {
+                        if (IsRuntimeLoggingEnabled) 
+                        {
+                            ESP_LOGW(STA_TAG, "  -- Ignoring node (No free slots, Children: %d, Load: %u%%)",
+                                    IeCache[j].ChildCount, IeCache[j].UplinkLoad);
+                        }
+                        break;
+                    }
+
+
+                    // A parent named by the master scores 0 and beats everything, the router included
+                    foundVendorData = true;
+                    const uint32_t Score = MeshIsPreferredParent(PreferredParentUid, PreferredParentUntilUs, false, IeCache[j].Uid) ? 
+                                           0 : MeshParentScore(IeCache[j]);
+                    if (IsRuntimeLoggingEnabled) 
+                    {
+                        ESP_LOGW(STA_TAG, "  -- Match Found in IE Cache! Hop: %d, Cost: %u, Load: %u%%, Children: %d, Score: %lu", 
+                                IeCache[j].HopCount, IeCache[j].PathCost, IeCache[j].UplinkLoad, 
+                                IeCache[j].ChildCount, (unsigned long)Score);
+                    }
+
+
+                    // Lower score wins, ties keep the earlier (stronger) scan entry
+                    if (Score < CurrentBestScore)
+                    {
+                        BestAp = &ApList[i];
+                        CurrentBestScore = Score;
+                        CurrentBestHop = IeCache[j].HopCount;
+                        CurrentBestChildren = IeCache[j].ChildCount;
+                        CurrentBestPathCost = IeCache[j].PathCost;
+                        CurrentBestDigest = IeCache[j].AncestorDigest;
+                        CurrentBestUid = IeCache[j].Uid;
+                        CurrentBestRootUid = IeCache[j].RootUid;
+                        MasterFound = false;
+
+                        if (IsRuntimeLoggingEnabled) 
+                        {
+                            ESP_LOGW(STA_TAG, "  -- New Best Match");
+                        }
+                    }
+                    
+                    break; 
+                }
+            }
+
+            if (!foundVendorData && IsRuntimeLoggingEnabled) 
+            {
+                ESP_LOGE(STA_TAG, "  -- Node found but no good Vendor IE data in cache.");
+            }
+        }
+    }
+
+
+    if (BestAp != nullptr)
+    {
+        IsCandidateValid = true;
+        IsCandidateMaster = MasterFound;
+        CandidateWifiRecord = *BestAp;
+        CandidateHop = CurrentBestHop;
+        CandidateChildren = CurrentBestChildren;
+        CandidatePathCost = CurrentBestPathCost;
+        CandidateDigest = CurrentBestDigest;
+        CandidateUid = MasterFound ? 0 : CurrentBestUid;
+        CandidateRootUid = MasterFound ? 0 : CurrentBestRootUid;
+
+        if (!IsConnectedToParent && !IsConnecting)
+        {
+            AdoptCandidateAsParent();
+        }
+    }
+
+    else
+    {
+        IsCandidateValid = false;
+    }
+
+    IsScanning = false;
+
+
+    if (IsParentLooped)
+    {
+        DeclareParentLost("Parent path contains this node");
+        esp_wifi_disconnect();
+    }
+}
+
+void AccessPointStation::AdoptCandidateAsParent()
+{
+    IsMasterFound = IsCandidateMaster;
+    ParentWifiRecord = CandidateWifiRecord;
+    ParentDevice.UID = CandidateUid;
+    ParentDevice.HopCount = CandidateHop;
+    ParentDevice.ChildrenCount = CandidateChildren;
+    ParentDevice.PathCost = CandidatePathCost;
+    ParentDevice.AncestorDigest = CandidateDigest;
+    ParentDevice.Rssi = CandidateWifiRecord.rssi;
+
+    MyHopCount = (CandidateHop == 255) ? 255 : (uint8_t)(CandidateHop + 1);
+    MyRootUid = CandidateRootUid;
+}
+
+void AccessPointStation::ConnectToBestAp()
+{
+    // Callers only connect once the STA is down, a disconnect here would post a stale StaDisconnected
+    wifi_config_t sta_config = {};
+    
+
+    if (IsMasterFound) 
+    {
+        ESP_LOGW(STA_TAG, "ConnectToBestAp: Root Master Found! Connecting to: %s | Pass: %s", PARENT_SSID, PARENT_PASS);
+        strncpy((char*)sta_config.sta.ssid, PARENT_SSID, sizeof(sta_config.sta.ssid));
+        strncpy((char*)sta_config.sta.password, PARENT_PASS, sizeof(sta_config.sta.password));
+    }
+
+
+    else 
+    {
+        ESP_LOGW(STA_TAG, "ConnectToBestAp: Master NOT found. Connecting to Mesh Parent SSID: %s | Pass: %s", (char*)ParentWifiRecord.ssid, MY_PASS);
+        memcpy(sta_config.sta.ssid, ParentWifiRecord.ssid, sizeof(sta_config.sta.ssid));
+        strncpy((char*)sta_config.sta.password, MY_PASS, sizeof(sta_config.sta.password));
+    }
+
+
+    sta_config.sta.bssid_set = true;
+    memcpy(sta_config.sta.bssid, ParentWifiRecord.bssid, 6);
+    sta_config.sta.channel = ParentWifiRecord.primary;
+
+
+    ESP_LOGW(STA_TAG, "Connection details: BSSID: " MACSTR " | Channel: %d", 
+             MAC2STR(sta_config.sta.bssid), sta_config.sta.channel);
+    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_config));
+
+
+    esp_wifi_connect();
+}
+
+void AccessPointStation::MeshTask(void* pvParameters)
+{
+    // Scan at once unless StaStart is about to try the cached parent (a root
+    // never scans), then every periodic job re-arms itself when it is handled
+    if (!ApStaClassInstance->IsRootGateway)
+    {
+        if (ApStaClassInstance->IsParentCacheValid) ApStaClassInstance->ArmDeadline(MeshEventType::ScanDeadline, MESH_SCAN_PERIOD_MS);
+        else ApStaClassInstance->PostMeshEvent(MeshEventType::ScanDeadline);
+    }
+    else ApStaClassInstance->PostMeshEvent(MeshEventType::RootAnnounceDeadline);
+    ApStaClassInstance->ArmDeadline(MeshEventType::BeaconDeadline, MESH_BEACON_REFRESH_PERIOD_MS);
+    ApStaClassInstance->ArmDeadline(MeshEventType::KeepaliveDeadline, MESH_HEARTBEAT_PERIOD_MS);
+    ApStaClassInstance->ArmDeadline(MeshEventType::LivenessDeadline, MESH_LIVENESS_CHECK_PERIOD_MS);
+    ApStaClassInstance->ArmDeadline(MeshEventType::EchoDeadline, MESH_ECHO_PERIOD_MS);
+    ApStaClassInstance->ArmDeadline(MeshEventType::TimeSyncDeadline, MESH_TIME_SYNC_PERIOD_MS);
+    ApStaClassInstance->ArmDeadline(MeshEventType::BackfillDeadline, MESH_HEARTBEAT_PERIOD_MS);
+    ApStaClassInstance->ArmDeadline(MeshEventType::ReportDeadline, MESH_NEIGHBOUR_REPORT_PERIOD_MS);
+
+    MeshEvent Event{};
+    
+    while (true)
+    {
+        if (xQueueReceive(ApStaClassInstance->MeshEventQueue, &Event, portMAX_DELAY) != pdTRUE) continue;
+        if (Event.Type >= MeshEventType::Count) continue;
+
+        ApStaClassInstance->HandleMeshEvent(Event);
+
+        // Reaction latency, posted -> handled
+        const uint32_t LatencyUs = (uint32_t)(esp_timer_get_time() - Event.PostedUs);
+        MeshEventLatency& Latency = ApStaClassInstance->EventLatency[(size_t)Event.Type];
+        Latency.Count++;
+        Latency.LastUs = LatencyUs;
+        Latency.TotalUs += LatencyUs;
+        if (LatencyUs > Latency.MaxUs) Latency.MaxUs = LatencyUs;
+    }
+
+    vTaskDelete(NULL);
+}
+
+
+
+
+
+void AccessPointStation::SendIdleKeepalives()
+{
+    if (UdpSocket < 0) return;
+
+    // Heartbeats carry a per-link sequence number, so each destination gets its own packet
+    const size_t Length = PACKET_HEADER_SIZE + sizeof(MeshHeartbeatPayload) + 2;
+
+    const int64_t Now = esp_timer_get_time();
+    const int64_t IdleUs = (int64_t)MESH_HEARTBEAT_PERIOD_MS * 1000;
+
+
+    // Upstream
+    sockaddr_in Destination{};
+    if (IsConnectedToParent && ApIpAcquired && GetUpstreamAddress(Destination))
+    {
+        if (Now - LastUplinkTxUs >= IdleUs)
+        {
+            int Sent = SendHeartbeat(Destination);
+            KeepaliveStats.UpstreamSent++;
+
+            if (Sent < 0 && IsRuntimeLoggingEnabled) ESP_LOGE(STA_TAG, "Heartbeat sendto failed (errno=%d)", errno);
+        }
+        else
+        {
+            KeepaliveStats.UpstreamSuppressed++;
+            KeepaliveStats.UpstreamBytesSaved += Length;
+        }
+    }
+
+
+    // Downstream, so children can run a deadline on us
+    char IdleChildIps[MESH_MAX_CHILDREN][16];
+    size_t IdleCount = 0;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        const WifiDevice& Child = ChildDevices[i];
+        if (!Child.IsActive || Child.IpAddress[0] == '\0') continue;
+
+        if (Now - (int64_t)Child.LastTxUs >= IdleUs) memcpy(IdleChildIps[IdleCount++], Child.IpAddress, 16);
+        else KeepaliveStats.DownstreamSuppressed++;
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    for (size_t i = 0; i < IdleCount; i++)
+    {
+        sockaddr_in ChildAddress{};
+        ChildAddress.sin_family = AF_INET;
+        ChildAddress.sin_port   = htons(UdpPort);
+        if (inet_pton(AF_INET, IdleChildIps[i], &ChildAddress.sin_addr) != 1) continue;
+
+        SendHeartbeat(ChildAddress);
+        KeepaliveStats.DownstreamSent++;
+    }
+}
+
+
+
+int AccessPointStation::SendLinkControl(const sockaddr_in& Destination, uint8_t PacketType, const void* Payload, size_t PayloadLength)
+{
+    if (UdpSocket < 0) return -1;
+
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(MeshTimeSyncPayload) + 2]{};  // Largest link control payload
+    size_t Length = CreatePacket((const uint8_t*)Payload, PayloadLength, PacketType, TxBuffer, sizeof(TxBuffer));
+    if (Length <= PACKET_HEADER_SIZE) return -1;
+
+    int Sent = MeshSendOnLink(UdpSocket, LinkTable, TxBuffer, Length, Destination);
+    NoteLinkTx(Destination, Sent);
+    return Sent;
+}
+
+
+
+int AccessPointStation::SendHeartbeat(const sockaddr_in& Destination)
+{
+    MeshHeartbeatPayload Heartbeat{};
+    LinkTable.PrepareHeartbeat(Destination.sin_addr.s_addr, Heartbeat);
+    return SendLinkControl(Destination, PACKET_TYPE_HEARTBEAT, &Heartbeat, sizeof(Heartbeat));
+}
+
+
+
+void AccessPointStation::SendEchoRequests()
+{
+    if (UdpSocket < 0) return;
+
+    MeshEchoPayload Echo{};
+
+    // The master is not a mesh node and never answers, so only probe a real parent
+    sockaddr_in Destination{};
+    if (IsConnectedToParent && ApIpAcquired && !IsMasterFound && GetUpstreamAddress(Destination))
+    {
+        Echo.SentUs = (uint64_t)esp_timer_get_time();
+        if (SendLinkControl(Destination, PACKET_TYPE_ECHO_REQUEST, &Echo, sizeof(Echo)) > 0) LinkTable.OnEchoSent(Destination.sin_addr.s_addr);
+    }
+
+
+    char ChildIps[MESH_MAX_CHILDREN][16];
+    size_t ChildCount = 0;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        const WifiDevice& Child = ChildDevices[i];
+        if (Child.IsActive && Child.IpAddress[0] != '\0') memcpy(ChildIps[ChildCount++], Child.IpAddress, 16);
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    for (size_t i = 0; i < ChildCount; i++)
+    {
+        sockaddr_in ChildAddress{};
+        ChildAddress.sin_family = AF_INET;
+        ChildAddress.sin_port   = htons(UdpPort);
+        if (inet_pton(AF_INET, ChildIps[i], &ChildAddress.sin_addr) != 1) continue;
+
+        Echo.SentUs = (uint64_t)esp_timer_get_time();
+        if (SendLinkControl(ChildAddress, PACKET_TYPE_ECHO_REQUEST, &Echo, sizeof(Echo)) > 0) LinkTable.OnEchoSent(ChildAddress.sin_addr.s_addr);
+    }
+
+
+    // Child RSSI is only visible from the SoftAP station list
+    wifi_sta_list_t StationList{};
+    if (ChildCount > 0 && esp_wifi_ap_get_sta_list(&StationList) == ESP_OK)
+    {
+        for (int i = 0; i < StationList.num; i++) LinkTable.OnRssi(StationList.sta[i].mac, StationList.sta[i].rssi);
+    }
+}
+
+
+
+void AccessPointStation::SendTimeSyncRequest()
+{
+    MeshTimeSyncPayload Request{};
+
+    // A root asks the master over its host link, which carries no other link control
+    if (IsRootGateway)
+    {
+        if (HostUplink == nullptr) return;
+
+        uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(Request) + 2];
+        Clock.PrepareRequest(Request);
+        const size_t Length = MeshBuildPacket((const uint8_t*)&Request, sizeof(Request), PACKET_TYPE_TIME_SYNC_REQUEST, 0, TxBuffer, sizeof(TxBuffer));
+        if (Length > 0 && !HostUplink(TxBuffer, Length)) GatewayStats.HostSendFailures++;
+        return;
+    }
+
+    // Unlike the echo, the master answers this one, it is where mesh time comes from
+    sockaddr_in Destination{};
+    if (UdpSocket < 0 || !IsConnectedToParent || !ApIpAcquired || !GetUpstreamAddress(Destination)) return;
+
+    Clock.PrepareRequest(Request);
+    SendLinkControl(Destination, PACKET_TYPE_TIME_SYNC_REQUEST, &Request, sizeof(Request));
+}
+
+
+
+bool AccessPointStation::GetUpstreamAddress(sockaddr_in& DestinationAddress) const
+{
+    sockaddr_in Destination{};
+    Destination.sin_family = AF_INET;
+    Destination.sin_port   = htons(UdpPort);
+
+    const char* UpstreamIp = IsMasterFound ? "192.168.0.254" : ParentDevice.IpAddress;
+    if (UpstreamIp[0] == '\0' || inet_pton(AF_INET, UpstreamIp, &Destination.sin_addr) != 1) return false;
+
+    DestinationAddress = Destination;
+    return true;
+}
+
+
+
+void AccessPointStation::NoteLinkTx(const sockaddr_in& Destination, int Bytes)
+{
+    const int64_t Now = esp_timer_get_time();
+
+    sockaddr_in Upstream{};
+    const bool IsUplink = GetUpstreamAddress(Upstream) && Upstream.sin_addr.s_addr == Destination.sin_addr.s_addr;
+
+    // A refused send towards the parent means the stack's queue for the uplink is full
+    if (Bytes <= 0)
+    {
+        if (IsUplink) UplinkTxFailures++;
+        return;
+    }
+
+    if (IsUplink)
+    {
+        UplinkTxBytes += Bytes;
+        LastUplinkTxUs = Now;
+        if (BootStats.FirstPacketUs == 0) BootStats.FirstPacketUs = Now;
+        return;
+    }
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        WifiDevice& Child = ChildDevices[i];
+        if (!Child.IsActive || Child.IpAddress[0] == '\0') continue;
+
+        in_addr ChildIp{};
+        if (inet_pton(AF_INET, Child.IpAddress, &ChildIp) == 1 && ChildIp.s_addr == Destination.sin_addr.s_addr)
+        {
+            Child.LastTxUs = Now;
+            break;
+        }
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+}
+
+
+
+void AccessPointStation::SendToChildren(const uint8_t* Data, size_t Length)
+{
+    if (Data == nullptr || UdpSocket < 0) return;
+
+    char ChildIps[MESH_MAX_CHILDREN][16];
+    size_t ChildCount = 0;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        if (!ChildDevices[i].IsActive || ChildDevices[i].IpAddress[0] == '\0') continue;
+        memcpy(ChildIps[ChildCount++], ChildDevices[i].IpAddress, 16);
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    for (size_t i = 0; i < ChildCount; i++)
+    {
+        sockaddr_in Destination{};
+        Destination.sin_family = AF_INET;
+        Destination.sin_port   = htons(UdpPort);
+        if (inet_pton(AF_INET, ChildIps[i], &Destination.sin_addr) != 1) continue;
+
+        int Sent = MeshSendOnLink(UdpSocket, LinkTable, Data, Length, Destination);
+        NoteLinkTx(Destination, Sent);
+    }
+}
+
+
+
+void AccessPointStation::DeclareParentLost(const char* Reason)
+{
+    // Disconnect events, the liveness check and a received withdrawal can all
+    // report the same loss, only the first one counts
+    if (IsRouteWithdrawn) return;
+    IsRouteWithdrawn = true;
+
+    const int64_t Now = esp_timer_get_time();
+    ParentLostAtUs = Now;
+    FailoverStats.ParentLossCount++;
+    FailoverStats.LastDetectionUs = (ParentDevice.LastHeartbeatUs != 0) ? Now - (int64_t)ParentDevice.LastHeartbeatUs : 0;
+
+
+    // Poison the route
+    MyHopCount = 255;
+    MyPathCost = MESH_PATH_COST_INFINITE;
+    MyAncestorDigest = MeshDigestBitsForUid(WifiFactory::GetNodeUid());
+    UpdateBeaconMetadata();
+
+
+    // Tell the subtree now rather than letting every child time out on its own
+    uint8_t TxBuffer[64]{};
+    uint8_t WithdrawnHop = MyHopCount;
+    size_t Length = CreatePacket(&WithdrawnHop, 1, PACKET_TYPE_ROUTE_WITHDRAWN, TxBuffer, sizeof(TxBuffer));
+
+    if (Length > PACKET_HEADER_SIZE && ActiveChildren > 0 && UdpSocket >= 0)
+    {
+        SendToChildren(TxBuffer, Length);
+        FailoverStats.RouteWithdrawalsSent++;
+    }
+
+    if (IsRuntimeLoggingEnabled)
+    {
+        ESP_LOGE(STA_TAG, "Route withdrawn (%s) | %lld ms since last parent heartbeat", 
+                 Reason, FailoverStats.LastDetectionUs / 1000);
+    }
+}
+
+
+
+void AccessPointStation::CheckLiveness()
+{
+    const int64_t Now = esp_timer_get_time();
+    const int64_t DeadlineUs = (int64_t)MESH_HEARTBEAT_MISS_LIMIT * MESH_HEARTBEAT_PERIOD_MS * 1000;
+
+
+    // Parent. The master's router does not send heartbeats, so a hop 1 node relies on WiFi events
+    if (IsConnectedToParent && ApIpAcquired && !IsMasterFound && !IsRouteWithdrawn &&
+        Now - (int64_t)ParentDevice.LastHeartbeatUs > DeadlineUs)
+    {
+        FailoverStats.HeartbeatTimeouts++;
+        DeclareParentLost("Parent missed heartbeats");
+        esp_wifi_disconnect();
+    }
+
+
+    // Children
+    uint16_t SilentAids[MESH_MAX_CHILDREN];
+    size_t SilentCount = 0;
+
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        WifiDevice& Child = ChildDevices[i];
+        if (!Child.IsActive || Child.IpAddress[0] == '\0') continue;
+
+        if (Now - (int64_t)Child.LastHeartbeatUs > DeadlineUs)
+        {
+            SilentAids[SilentCount++] = Child.aid;
+            Child.LastHeartbeatUs = Now; // Re-arm, the deauth event clears the slot
+        }
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    for (size_t i = 0; i < SilentCount; i++)
+    {
+        FailoverStats.ChildTimeouts++;
+        esp_wifi_deauth_sta(SilentAids[i]);
+        if (IsRuntimeLoggingEnabled) ESP_LOGE("MESH_AP", "Child AID %u missed heartbeats, deauthenticated", SilentAids[i]);
+    }
+}
+
+
+
+void AccessPointStation::CheckPromotedRole()
+{
+    if (!IsPromoted) return;
+
+    // The clock starts at the first check, the neighbour we were promoted for gets a full period to join
+    const int64_t Now = esp_timer_get_time();
+    if (ActiveChildren > 0 || LastChildUs == 0)
+    {
+        LastChildUs = Now;
+        return;
+    }
+
+    if (Now - LastChildUs < (int64_t)MESH_PROMOTED_IDLE_MS * 1000) return;
+
+    // Found another parent, or never came. A node the mesh has no use for as a relay goes back to being a leaf.
+    if (!WifiFactory::SetConfiguredRole(MeshRole::Leaf))
+    {
+        LastChildUs = Now; // Try again after another idle period rather than on every check
+        return;
+    }
+
+    ESP_LOGW(STA_TAG, "No children for %lu s since promotion, restarting as a leaf", (unsigned long)(MESH_PROMOTED_IDLE_MS / 1000));
+    esp_restart();
+}
+
+
+
+
+
+size_t AccessPointStation::CreatePacket(const uint8_t* DataToInclude,
+                    size_t DataLength,
+                    uint8_t PacketType,
+                    uint8_t* PacketOut,
+                    size_t OutputBufferSize)
+{
+    return MeshBuildPacket(DataToInclude, DataLength, PacketType, 0, PacketOut, OutputBufferSize);
+}
+
+
+void AccessPointStation::ProcessData(uint8_t* data, int length, const sockaddr_in& SourceAddress)
+{
+    uint16_t PayloadSize = 0;
+    if (!MeshValidateFraming(data, length, &PayloadSize)) return;
+
+    uint8_t PacketType = data[37];
+    const int64_t Now = esp_timer_get_time();
+
+    in_addr ParentIp{};
+    const bool IsFromParent = ParentDevice.IpAddress[0] != '\0' &&
+                              inet_pton(AF_INET, ParentDevice.IpAddress, &ParentIp) == 1 &&
+                              ParentIp.s_addr == SourceAddress.sin_addr.s_addr;
+
+
+    // Learn the UID of the child behind this IP. Children only get an IP from
+    // DHCP, so their first heartbeat is the first time we see their UID. Only
+    // link control is one hop for sure, anything else may be a descendant's
+    // packet the child forwards, which teaches the descendant table instead.
+    uint64_t SenderUid = 0;
+    memcpy(&SenderUid, data + 8, sizeof(SenderUid));
+    const bool IsLinkControl = MeshIsLinkControl(PacketType);
+
+    int ChildSlot = -1;
+    portENTER_CRITICAL(&CriticalSection);
+    for (int i = 0; i < (int)MESH_MAX_CHILDREN; i++)
+    {
+        WifiDevice& Child = ChildDevices[i];
+        if (!Child.IsActive || Child.IpAddress[0] == '\0') continue;
+
+        in_addr ChildIp{};
+        if (inet_pton(AF_INET, Child.IpAddress, &ChildIp) != 1) continue;
+        if (ChildIp.s_addr != SourceAddress.sin_addr.s_addr) continue;
+
+        if (IsLinkControl) Child.UID = SenderUid;
+        Child.RxPackets++;
+        Child.LastHeartbeatUs = Now; // Any valid packet proves the link is alive
+        ChildSlot = i;
+        break;
+    }
+
+    if (ChildSlot >= 0 && !IsLinkControl && data[43] == 2 && SenderUid != 0 && SenderUid != ChildDevices[ChildSlot].UID)
+    {
+        NoteDescendant(SenderUid, ChildSlot, Now);
+    }
+    portEXIT_CRITICAL(&CriticalSection);
+
+    if (IsFromParent) ParentDevice.LastHeartbeatUs = Now;
+    MeshNoteLinkSequence(LinkTable, data, SourceAddress);
+
+
+    // One hop delivery time of a child's own data, in slotted mode the latency of its slot.
+    // Only packets the child made, its UID is known from its heartbeats, and never backfilled ones.
+    LinkQuality SenderLink{};
+    if (ChildSlot >= 0 && data[43] == 2 && !IsLinkControl && !(data[38] & PACKET_FLAG_STORED) &&
+        LinkTable.GetLinkByUid(SenderUid, SenderLink) && SenderLink.Ip == SourceAddress.sin_addr.s_addr && Clock.IsSynced())
+    {
+        uint64_t SentMeshUs = 0;
+        memcpy(&SentMeshUs, data + 24, sizeof(SentMeshUs));
+        LinkTable.OnDelivery(SourceAddress.sin_addr.s_addr, Clock.MeshFromLocalUs(Now) - (int64_t)SentMeshUs);
+    }
+
+
+    
+    const uint8_t* Payload = data + PACKET_HEADER_SIZE;
+
+    switch(PacketType)
+    {
+        case PACKET_TYPE_ROUTE_WITHDRAWN:
+            if (IsFromParent) PostMeshEvent(MeshEventType::RouteWithdrawn);
+            break;
+
+        case PACKET_TYPE_HEARTBEAT:
+        {
+            if (PayloadSize < sizeof(MeshHeartbeatPayload)) break;
+            MeshHeartbeatPayload Heartbeat{};
+            memcpy(&Heartbeat, Payload, sizeof(Heartbeat));
+            LinkTable.OnHeartbeat(SourceAddress.sin_addr.s_addr, SenderUid, Heartbeat);
+            break;
+        }
+
+        case PACKET_TYPE_ECHO_REQUEST:
+        {
+            // Answer straight back to the sender, the payload is its own timestamp
+            if (PayloadSize < sizeof(MeshEchoPayload)) break;
+            sockaddr_in ReplyAddress = SourceAddress;
+            ReplyAddress.sin_port = htons(UdpPort);
+            SendLinkControl(ReplyAddress, PACKET_TYPE_ECHO_REPLY, Payload, sizeof(MeshEchoPayload));
+            break;
+        }
+
+        case PACKET_TYPE_ECHO_REPLY:
+        {
+            if (PayloadSize < sizeof(MeshEchoPayload)) break;
+            MeshEchoPayload Echo{};
+            memcpy(&Echo, Payload, sizeof(Echo));
+            LinkTable.OnEchoReply(SourceAddress.sin_addr.s_addr, Now - (int64_t)Echo.SentUs);
+            break;
+        }
+
+        case PACKET_TYPE_TIME_SYNC_REQUEST:
+        {
+            // Answered from our own clock, so a child's error includes ours
+            if (PayloadSize < sizeof(MeshTimeSyncPayload)) break;
+            MeshTimeSyncPayload Request{}, Reply{};
+            memcpy(&Request, Payload, sizeof(Request));
+            Clock.PrepareReply(Request, Now, Reply);
+
+            sockaddr_in ReplyAddress = SourceAddress;
+            ReplyAddress.sin_port = htons(UdpPort);
+            SendLinkControl(ReplyAddress, PACKET_TYPE_TIME_SYNC_REPLY, &Reply, sizeof(Reply));
+            break;
+        }
+
+        case PACKET_TYPE_TIME_SYNC_REPLY:
+        {
+            if (PayloadSize < sizeof(MeshTimeSyncPayload) || !IsFromUpstream(SourceAddress)) break;
+            MeshTimeSyncPayload Reply{};
+            memcpy(&Reply, Payload, sizeof(Reply));
+            Clock.OnReply(Reply, Now);
+            break;
+        }
+
+        case PACKET_TYPE_CYCLE_MARKER:
+        {
+            // Forwarded to the children like any subtree broadcast, the times in it are mesh time so the delay does not matter
+            if (data[43] != MESH_FORWARD_SUBTREE || !IsFromUpstream(SourceAddress) || PayloadSize < sizeof(MeshCycleMarker)) break;
+            MeshCycleMarker Marker{};
+            memcpy(&Marker, Payload, sizeof(Marker));
+            Clock.OnCycleMarker(Marker);
+            break;
+        }
+
+        case PACKET_TYPE_OTA_BEGIN:
+        case PACKET_TYPE_OTA_CHUNK:
+        case PACKET_TYPE_OTA_COMMIT:
+            if (data[43] == MESH_FORWARD_SUBTREE && IsFromUpstream(SourceAddress)) HandleOtaPacket(PacketType, Payload, PayloadSize);
+            break;
+
+        case PACKET_TYPE_PREFERRED_PARENT:
+        {
+            // Routed down by UID, the relays on the way pass it on and only the node named acts on it
+            uint64_t DestinationUid = 0;
+            memcpy(&DestinationUid, data + 16, sizeof(DestinationUid));
+            if (data[43] != MESH_FORWARD_DOWNSTREAM || !IsFromUpstream(SourceAddress)) break;
+            if (DestinationUid != WifiFactory::GetNodeUid() || PayloadSize < sizeof(MeshPreferredParent)) break;
+
+            PostMeshEvent(MeshEventType::PreferredParent, Payload, sizeof(MeshPreferredParent));
+            break;
+        }
+
+        case PACKET_TYPE_NEIGHBOUR_REPORT:
+        {
+            // Passing upstream anyway, a direct child's own report says where it could go if steered.
+            // A descendant's report arrives from the same address, so the sender must be the child itself.
+            bool IsChildReport = false;
+            if (ChildSlot >= 0)
+            {
+                portENTER_CRITICAL(&CriticalSection);
+                IsChildReport = ChildDevices[ChildSlot].UID != 0 && ChildDevices[ChildSlot].UID == SenderUid;
+                portEXIT_CRITICAL(&CriticalSection);
+            }
+            if (IsChildReport) NoteChildAlternative(ChildSlot, Payload, PayloadSize);
+            break;
+        }
+
+        default:
+            // A scheduled command to the whole subtree, held here as well as passed on to the children
+            if (data[43] == MESH_FORWARD_SUBTREE && IsFromUpstream(SourceAddress)) MeshHoldCommand(Commands, Clock, data, PayloadSize);
+            break;
+    }
+
+}
+
+
+
+bool AccessPointStation::IsFromUpstream(const sockaddr_in& SourceAddress) const
+{
+    in_addr ParentIp{};
+    if (ParentDevice.IpAddress[0] != '\0' && inet_pton(AF_INET, ParentDevice.IpAddress, &ParentIp) == 1 &&
+        ParentIp.s_addr == SourceAddress.sin_addr.s_addr) return true;
+
+    // At hop 1 the master's packets come through its router, from the master's own address
+    sockaddr_in Upstream{};
+    return GetUpstreamAddress(Upstream) && Upstream.sin_addr.s_addr == SourceAddress.sin_addr.s_addr;
+}
+
+
+
+void AccessPointStation::HandleOtaPacket(uint8_t PacketType, const uint8_t* Payload, uint16_t PayloadSize)
+{
+    switch (PacketType)
+    {
+        case PACKET_TYPE_OTA_BEGIN:  Ota.OnBegin(Payload, PayloadSize);  break;
+        case PACKET_TYPE_OTA_CHUNK:  Ota.OnChunk(Payload, PayloadSize);  break;
+        case PACKET_TYPE_OTA_COMMIT: Ota.OnCommit(Payload, PayloadSize); break;
+        default: break;
+    }
+}
+
+
+
+bool AccessPointStation::OtaStatusSender(const uint8_t* Payload, size_t Length)
+{
+    if (ApStaClassInstance == nullptr) return false;
+
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(MeshOtaStatusHeader) + MESH_OTA_BITMAP_SIZE + 2];
+    size_t PacketLength = MeshBuildPacket(Payload, Length, PACKET_TYPE_OTA_STATUS, 2, TxBuffer, sizeof(TxBuffer));
+    if (PacketLength == 0) return false;
+
+    // Not stored on failure, the sender polls again and a stale bitmap is of no use
+    return ApStaClassInstance->SendUpstream(TxBuffer, PacketLength);
+}
+
+
+
+bool AccessPointStation::SendUpstream(const uint8_t* Data, size_t Length)
+{
+    if (IsRootGateway) return ForwardToHost(Data, (int)Length);
+
+    sockaddr_in Destination{};
+    if (!IsConnectedToHost() || UdpSocket < 0 || !GetUpstreamAddress(Destination)) return false;
+
+    size_t Sent = SendData(Data, (int)Length, Destination);
+    NoteLinkTx(Destination, (int)Sent);
+    return Sent > 0;
+}
+
+
+
+bool AccessPointStation::BackfillSender(const uint8_t* Data, size_t Length)
+{
+    return ApStaClassInstance != nullptr && ApStaClassInstance->SendUpstream(Data, Length);
+}
+
+
+
+bool AccessPointStation::EnableSlottedTx(uint32_t CycleUs, uint8_t SlotCount)
+{
+    // The host link is not shared with neighbours, nothing to gain from waiting
+    if (IsRootGateway) return false;
+
+    Slots.SetPosition(WifiFactory::GetNodeUid(), MyHopCount);
+    return Slots.Enable(CycleUs, SlotCount, &Clock, &AccessPointStation::BackfillSender);
+}
+
+
+
+bool AccessPointStation::TakeDueCommand(int64_t CycleStartUs, MeshCommand& Out)
+{
+    uint32_t NowCycle = 0;
+    const bool IsCycleKnown = MeshCycleAt(Clock, CycleStartUs, true, NowCycle);
+    return Commands.TakeDue(IsCycleKnown, NowCycle, Out);
+}
+
+
+
+void AccessPointStation::SendNeighbourReport()
+{
+    if (!IsConnectedToHost()) return;
+
+    MeshNeighbourReportHeader Header{};
+    Header.ParentUid = (IsRootGateway || IsMasterFound) ? 0 : ParentDevice.UID;
+    Header.HopCount = MyHopCount;
+    Header.MaxChildren = ChildLimit;
+    Header.MasterRssi = ScanMasterRssi;
+    if (IsRootGateway) Header.Flags |= MESH_REPORT_FLAG_ROOT;
+    if (PreferredParentUntilUs > esp_timer_get_time()) Header.Flags |= MESH_REPORT_FLAG_PREFERENCE;
+
+    uint8_t Payload[UDP_PACKET_SIZE];
+    const size_t Length = MeshBuildNeighbourReport(ScanNeighbours, LinkTable, Header, Payload, sizeof(Payload));
+
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + UDP_PACKET_SIZE + 2];
+    const size_t PacketLength = MeshBuildPacket(Payload, Length, PACKET_TYPE_NEIGHBOUR_REPORT, 2, TxBuffer, sizeof(TxBuffer));
+
+    // Not stored on failure, a stale neighbour list is of no use to the optimizer
+    if (PacketLength > 0 && SendUpstream(TxBuffer, PacketLength)) TopologyStats.ReportsSent++;
+}
+
+
+
+MeshTopologyStats AccessPointStation::GetTopologyStats() const
+{
+    MeshTopologyStats Copy = TopologyStats;
+    Copy.PreferredParentUid = PreferredParentUid;
+
+    const int64_t RemainingUs = PreferredParentUntilUs - esp_timer_get_time();
+    Copy.PreferenceRemainingMs = (RemainingUs > 0) ? RemainingUs / 1000 : 0;
+    return Copy;
+}
+
+
+
+MeshAdmissionStats AccessPointStation::GetAdmissionStats() const
+{
+    MeshAdmissionStats Copy = AdmissionStats;
+    Copy.ChildLimit = ChildLimit;
+    Copy.ApMaxConnection = ApMaxConnection;
+    return Copy;
+}
+
+
+
+size_t AccessPointStation::SendPacket(const uint8_t* Payload, size_t PayloadLength, uint8_t PacketType, int64_t SampledUs)
+{
+    // The cycle it was sampled in, not sent in, it may wait for a slot or in the backlog. 0 while the cycle is not known.
+    uint32_t Cycle = 0;
+    MeshCycleAt(Clock, SampledUs != 0 ? SampledUs : esp_timer_get_time(), SampledUs != 0, Cycle);
+
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + UDP_PACKET_SIZE + 2];
+    size_t Length = MeshBuildPacket(Payload, PayloadLength, PacketType, 2, TxBuffer, sizeof(TxBuffer), Cycle);
+    if (Length == 0) return 0;
+
+    // Fresh data goes straight out or into its slot, it never waits behind the backlog.
+    // The hop count is given every time, the slot follows every re-parent.
+    Slots.SetPosition(WifiFactory::GetNodeUid(), MyHopCount);
+    if (IsConnectedToHost() && Slots.Hold(TxBuffer, Length)) return Length;
+
+    const bool IsSent = SendUpstream(TxBuffer, Length);
+    Slots.NoteFreeSend(IsSent);
+    if (IsSent) return Length;
+
+    Backlog.Store(TxBuffer, Length);
+    return 0;
+}
+
+
+
+void AccessPointStation::OtaBeforeRestart()
+{
+    // The new image may have been built as a leaf, this node stays a relay, promoted or not
+    WifiFactory::SetConfiguredRole(MeshRole::Relay, ApStaClassInstance != nullptr && ApStaClassInstance->IsPromoted);
+}
+
+size_t AccessPointStation::PrepareTxPacket(const uint8_t* rxData,
+                                         int rxLength,
+                                         uint8_t* txBuffer,
+                                         int& txLength)
+{
+
+    txLength = 0;
+
+    if (!rxData || !txBuffer) return 0;
+    if (rxLength < 48) return 0;
+
+    constexpr int headerSize = 48;
+    constexpr int terminatorSize = 2;
+    const uint8_t PacketType = rxData[37];
+    const uint8_t ForwardMode  = rxData[43];
+
+    uint16_t PayloadSize = 0;
+    if (!MeshValidateFraming(rxData, rxLength, &PayloadSize)) return 0;
+
+    // Link control, consumed by ProcessData and never forwarded
+    if (MeshIsLinkControl(PacketType)) return 0;
+    int ExpectedSize = headerSize + PayloadSize + terminatorSize;
+
+
+
+    // A downstream packet addressed to this node ends here, like one sent to it directly
+    uint64_t DestinationUid = 0;
+    memcpy(&DestinationUid, rxData + 16, sizeof(DestinationUid));
+    const bool IsForThisNode = ForwardMode == 0 || (ForwardMode == 1 && DestinationUid == WifiFactory::GetNodeUid());
+
+
+
+    // FORWARD PACKET
+    if (!IsForThisNode) 
+    {
+        memcpy(txBuffer, rxData, ExpectedSize);
+        txLength = ExpectedSize;
+        return txLength;
+    }
+
+
+    
+    // PROCESS PACKET
+    else
+    {
+        if (PayloadSize > MaxPayload) return 0;
+        if (MeshHoldCommand(Commands, Clock, rxData, PayloadSize)) return 0;
+        if (PacketType == PACKET_TYPE_PREFERRED_PARENT) return 0; // Acted on in ProcessData, not an application payload
+
+        const uint8_t* PayloadPtr = rxData + headerSize;
+
+        // ====================================
+        //      FILL INTERNAL DATA
+        // ====================================
+
+        PayloadSeq++;
+        memcpy(LatestPayload, PayloadPtr, PayloadSize);
+        LatestPayloadSize = PayloadSize;
+        LatestPayloadType = PacketType;
+        LatestPayloadUs   = esp_timer_get_time();
+        PayloadSeq++; 
+
+        return 0;
+    }
+}
+
+bool AccessPointStation::DetermineDestinationAddress(const sockaddr_in& SourceAddress, const uint8_t* Data, int DataLength, sockaddr_in& DestinationAddress)
+{
+
+    if (!Data) return 0;
+    if (DataLength < 48 + 2) return 0;
+
+    const uint8_t ForwardMode = Data[43];
+
+    switch (ForwardMode)
+    {
+        case 0: // Return to sender
+            DestinationAddress = SourceAddress;
+            return true;
+            break;
+
+
+
+        case 1: // Downstream, to the child that is or leads to the destination
+        {
+            uint64_t DestinationUid = 0;
+            memcpy(&DestinationUid, Data + 16, sizeof(DestinationUid));
+            char ChildIp[16] = {0};
+
+            portENTER_CRITICAL(&ApStaClassInstance->CriticalSection);
+            const int Slot = ApStaClassInstance->FindChildForUid(DestinationUid, esp_timer_get_time());
+            if (Slot >= 0) memcpy(ChildIp, ApStaClassInstance->ChildDevices[Slot].IpAddress, sizeof(ChildIp));
+            portEXIT_CRITICAL(&ApStaClassInstance->CriticalSection);
+
+            if (ChildIp[0] == '\0') return false;
+
+            sockaddr_in Destination{};
+            Destination.sin_family = AF_INET;
+            Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
+
+            if (inet_pton(AF_INET, ChildIp, &Destination.sin_addr) != 1)
+            {
+                return false;
+            }
+
+            DestinationAddress = Destination;
+
+            return true;
+            break;
+        }
+        
+
+
+        case 2: // Upstream
+        {
+            sockaddr_in Destination{};
+            Destination.sin_family = AF_INET;
+            Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
+
+            if (IsMasterFound)
+            {
+                if (inet_pton(AF_INET, "192.168.0.254", &Destination.sin_addr) != 1)
+                {
+                    return false;
+                }
+            }
+            else 
+            {
+                if (inet_pton(AF_INET,
+                  ApStaClassInstance->ParentDevice.IpAddress,
+                  &Destination.sin_addr) != 1)
+                {
+                    return false;
+                }
+            }
+
+            DestinationAddress = Destination;
+
+            return true;
+            break;
+        }
+
+
+
+        default:
+            return false;
+            break;
+    }
+}
+
+
+
+
+size_t AccessPointStation::SendData(const uint8_t* Data, int Length, const sockaddr_in& DestinationAddress)
+{
+    if (!Data) return 0;
+    if (Length <= 0) return 0;
+    if (ApStaClassInstance->UdpSocket < 0) return 0;
+
+    int SentBytes = MeshSendOnLink(ApStaClassInstance->UdpSocket,
+                                   ApStaClassInstance->LinkTable,
+                                   Data,
+                                   (size_t)Length,
+                                   DestinationAddress);
+
+    if (SentBytes < 0)
+    {
+        return 0;
+    }
+
+    return static_cast<size_t>(SentBytes);
+}
+
+void AccessPointStation::EnableRootGateway(bool (*Uplink)(const uint8_t* Data, size_t Length), uint32_t CapacityBytesPerS)
+{
+    if (SystemInitialized || Uplink == nullptr) return;
+
+    IsRootGateway = true;
+    HostUplink = Uplink;
+    if (CapacityBytesPerS > 0) UplinkCapacityBytesPerS = CapacityBytesPerS;
+
+    // The root is the top of every path, nothing to withdraw and nobody above it
+    MyHopCount = 0;
+    MyPathCost = 0;
+    MyAncestorDigest = MeshDigestBitsForUid(WifiFactory::GetNodeUid());
+    MyRootUid = WifiFactory::GetNodeUid();
+    IsRouteWithdrawn = false;
+
+    // Built with CONFIG_ESP_ROOT_GATEWAY and flashed from the host it is wired to, a mesh image would not be a root
+    Ota.Disable();
+}
+
+
+
+bool AccessPointStation::ForwardToHost(const uint8_t* Data, int Length)
+{
+    uint16_t PayloadSize = 0;
+    if (HostUplink == nullptr || !MeshValidateFraming(Data, Length, &PayloadSize)) return false;
+
+    // Link control stays inside the mesh
+    if (MeshIsLinkControl(Data[37])) return false;
+
+    const size_t FrameLength = PACKET_HEADER_SIZE + PayloadSize + 2;
+    if (!HostUplink(Data, FrameLength))
+    {
+        GatewayStats.HostSendFailures++;
+        UplinkTxFailures++;
+        return false;
+    }
+
+    const int64_t Now = esp_timer_get_time();
+    GatewayStats.FramesToHost++;
+    UplinkTxBytes += FrameLength;
+    LastUplinkTxUs = Now;
+    if (BootStats.FirstPacketUs == 0) BootStats.FirstPacketUs = Now;
+    return true;
+}
+
+
+
+void AccessPointStation::SendRootAnnounce()
+{
+    if (!IsRootGateway) return;
+
+    // A busy host link costs more, so joining nodes favour the quieter gateway
+    if (!IsRouteWithdrawn)
+    {
+        MyPathCost = (uint16_t)((MyUplinkLoad / 10) * MESH_ROOT_LOAD_COST);
+        UpdateBeaconMetadata();
+    }
+
+    MeshRootAnnounce Announce{};
+    Announce.PathCost = (MyHopCount == 255) ? MESH_PATH_COST_INFINITE : MyPathCost;
+    Announce.UplinkLoad = MyUplinkLoad;
+    Announce.ChildCount = ActiveChildren;
+    Announce.FramesToHost = GatewayStats.FramesToHost;
+
+    // Sent while withdrawn too, the ack is what brings the route back
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(Announce) + 2];
+    const size_t Length = MeshBuildPacket((const uint8_t*)&Announce, sizeof(Announce), PACKET_TYPE_ROOT_ANNOUNCE, 2, TxBuffer, sizeof(TxBuffer));
+    if (Length > 0 && ForwardToHost(TxBuffer, (int)Length)) GatewayStats.AnnouncesSent++;
+}
+
+
+
+void AccessPointStation::CheckHostLink()
+{
+    if (!IsRootGateway) return;
+
+    // Nothing to lose before the first frame, a master without a root registry never acks
+    const int64_t LastRxUs = LastHostRxUs;
+    const bool IsAlive = LastRxUs != 0 && esp_timer_get_time() - LastRxUs <= (int64_t)MESH_ROOT_HOST_TIMEOUT_MS * 1000;
+    if (IsAlive == GatewayStats.IsHostAlive) return;
+
+    GatewayStats.IsHostAlive = IsAlive;
+
+    if (!IsAlive)
+    {
+        // Same withdrawal as a lost parent, the subtree rescans and joins another root
+        GatewayStats.HostLossCount++;
+        DeclareParentLost("Host link silent");
+        return;
+    }
+
+    if (IsRouteWithdrawn)
+    {
+        IsRouteWithdrawn = false;
+        MyHopCount = 0;
+        MyPathCost = (uint16_t)((MyUplinkLoad / 10) * MESH_ROOT_LOAD_COST);
+        MyAncestorDigest = MeshDigestBitsForUid(WifiFactory::GetNodeUid());
+        UpdateBeaconMetadata();
+
+        if (IsRuntimeLoggingEnabled) ESP_LOGW(STA_TAG, "Host link back, root route restored");
+    }
+}
+
+
+
+bool AccessPointStation::InjectFromHost(const uint8_t* Data, size_t Length)
+{
+    if (!IsRootGateway) return false;
+
+    if (Length > 1500 || !MeshValidateFraming(Data, (int)Length, nullptr))
+    {
+        GatewayStats.HostFramesDropped++;
+        return false;
+    }
+
+    const int64_t Now = esp_timer_get_time();
+    GatewayStats.FramesFromHost++;
+    LastHostRxUs = Now;
+
+
+    // The master's answer to a root announce, it only proves the host link works
+    if (Data[37] == PACKET_TYPE_ROOT_ANNOUNCE)
+    {
+        GatewayStats.AnnounceAcks++;
+        return true;
+    }
+
+
+    // The master's clock, the rest of the mesh follows this node
+    if (Data[37] == PACKET_TYPE_TIME_SYNC_REPLY)
+    {
+        const uint16_t PayloadSize = ((uint16_t)Data[2] << 8) | Data[3];
+        if (PayloadSize < sizeof(MeshTimeSyncPayload)) return false;
+
+        MeshTimeSyncPayload Reply{};
+        memcpy(&Reply, Data + PACKET_HEADER_SIZE, sizeof(Reply));
+        Clock.OnReply(Reply, Now);
+        return true;
+    }
+
+
+    // ForwardingMode 0 is for this node, PrepareTxPacket keeps it as the latest payload
+    uint8_t TxBuffer[1500];
+    int TxLength = 0;
+    PrepareTxPacket(Data, (int)Length, TxBuffer, TxLength);
+    if (TxLength <= 0) return true;
+
+
+    // Subtree broadcast from the master covers the whole mesh
+    if (TxBuffer[43] == MESH_FORWARD_SUBTREE)
+    {
+        uint16_t PayloadSize = ((uint16_t)TxBuffer[2] << 8) | TxBuffer[3];
+        if (TxBuffer[37] == PACKET_TYPE_CYCLE_MARKER && PayloadSize >= sizeof(MeshCycleMarker))
+        {
+            MeshCycleMarker Marker{};
+            memcpy(&Marker, TxBuffer + PACKET_HEADER_SIZE, sizeof(Marker));
+            Clock.OnCycleMarker(Marker);
+        }
+        MeshHoldCommand(Commands, Clock, TxBuffer, PayloadSize);
+        HandleOtaPacket(TxBuffer[37], TxBuffer + PACKET_HEADER_SIZE, PayloadSize);
+        SendToChildren(TxBuffer, TxLength);
+        return true;
+    }
+
+
+    // Downstream, same child lookup as a packet arriving from a parent
+    sockaddr_in Destination{};
+    if (!DetermineDestinationAddress(sockaddr_in{}, TxBuffer, TxLength, Destination))
+    {
+        GatewayStats.HostFramesDropped++;
+        return false;
+    }
+
+    size_t Sent = SendData(TxBuffer, TxLength, Destination);
+    NoteLinkTx(Destination, (int)Sent);
+
+    return Sent > 0;
+}
+
+
+
+void AccessPointStation::ReceiveTask(void* pvParameters)
+{
+    uint8_t ReceiveBuffer[1500];
+    int ReceivedBytes = 0;
+    uint8_t SendBuffer[1500];
+    int SendBytes = 0;
+
+    while(true)
+    {
+        sockaddr_in SourceAddress{}, DestinationAddress{};
+        socklen_t AddressLength = sizeof(SourceAddress);
+
+        ReceivedBytes = recvfrom(ApStaClassInstance->UdpSocket,
+                                ReceiveBuffer,
+                                sizeof(ReceiveBuffer),
+                                0,
+                                (sockaddr*)&SourceAddress,
+                                &AddressLength);
+
+        if (ReceivedBytes > 0)
+        {
+            ApStaClassInstance->ProcessData(ReceiveBuffer, ReceivedBytes, SourceAddress);
+
+            // The root stands in for the master, everything its subtree sends goes to the host
+            if (ApStaClassInstance->IsRootGateway)
+            {
+                ApStaClassInstance->ForwardToHost(ReceiveBuffer, ReceivedBytes);
+                continue;
+            }
+
+            SendBytes = 0;
+
+            ApStaClassInstance->PrepareTxPacket(ReceiveBuffer, ReceivedBytes, SendBuffer, SendBytes);
+
+            if (SendBytes <= 0)
+            {
+                continue;
+            }
+
+            // Subtree broadcast, one copy to each child. Only accepted from above, so it can never loop.
+            if (SendBuffer[43] == MESH_FORWARD_SUBTREE)
+            {
+                if (ApStaClassInstance->IsFromUpstream(SourceAddress)) ApStaClassInstance->SendToChildren(SendBuffer, SendBytes);
+                continue;
+            }
+
+            if (!ApStaClassInstance->DetermineDestinationAddress(SourceAddress, SendBuffer, SendBytes, DestinationAddress))
+            {
+                continue;
+            }
+
+            size_t Sent = ApStaClassInstance->SendData(SendBuffer, SendBytes, DestinationAddress);
+
+            ApStaClassInstance->NoteLinkTx(DestinationAddress, (int)Sent);
+        }
+
+        vTaskDelay(1);
+    }
+
+    vTaskDelete(nullptr);
+}
+
+void AccessPointStation::TransmitTask(void* pvParameters)
+{
+    uint8_t localBuf[1500];
+    int localLen = 0;
+
+    TickType_t LastHeartbeat{};
+
+    while(true)
+    {
+        bool Send = false;
+
+        portENTER_CRITICAL(&ApStaClassInstance->TxCriticalSection);
+
+        if (ApStaClassInstance->PreparedTxLength > 0)
+        {
+            localLen = ApStaClassInstance->PreparedTxLength;
+            memcpy(localBuf, ApStaClassInstance->PreparedTxPacket, localLen);
+            ApStaClassInstance->PreparedTxLength = 0;
+            memset(ApStaClassInstance->PreparedTxPacket, 0, sizeof(ApStaClassInstance->PreparedTxPacket));
+
+            Send = true;
+        }
+
+        portEXIT_CRITICAL(&ApStaClassInstance->TxCriticalSection);
+
+        if (Send && ApStaClassInstance->IsRootGateway)
+        {
+            Send = false;
+            ApStaClassInstance->ForwardToHost(localBuf, localLen);
+        }
+
+        if (Send)
+        {
+            Send = false;
+            sockaddr_in Destination{};
+            Destination.sin_family = AF_INET;
+            Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
+
+            if (ApStaClassInstance->IsMasterFound) inet_pton(AF_INET, "192.168.0.254", &Destination.sin_addr);
+            else inet_pton(AF_INET, ApStaClassInstance->ParentDevice.IpAddress, &Destination.sin_addr);
+
+            int Sent = MeshSendOnLink(ApStaClassInstance->UdpSocket,
+                                      ApStaClassInstance->LinkTable,
+                                      localBuf,
+                                      (size_t)localLen,
+                                      Destination);
+
+            ApStaClassInstance->NoteLinkTx(Destination, Sent);
+        }
+
+        vTaskDelay(pdMS_TO_TICKS(1));
+    }
+
+    vTaskDelete(nullptr);
+}
+
+
+
+bool AccessPointStation::StartUdp(uint16_t Port, uint8_t Core)
+{
+    if (ApStaClassInstance->UdpStarted) return true;
+    
+    // We only start UDP if we have an IP (either as an AP or a STA)
+    if (!ApStaClassInstance->IsConnectedToParent && ApStaClassInstance->ActiveChildren == 0) 
+    {
+        if (!ApStaClassInstance->ApIpAcquired) return false;
+    }
+    
+    if (Port == 0) return false;
+
+    // Create socket
+    ApStaClassInstance->UdpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (ApStaClassInstance->UdpSocket < 0)
+    {
+        ApStaClassInstance->UdpSocket = -1;
+        return false;
+    }
+
+    // Bind
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(Port);
+    addr.sin_addr.s_addr = htonl(INADDR_ANY); // Listens on both AP and STA interfaces
+
+    if (bind(ApStaClassInstance->UdpSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    {
+        close(ApStaClassInstance->UdpSocket);
+        ApStaClassInstance->UdpSocket = -1;
+        return false;
+    }
+
+    // Socket Timeout (Essential for the RX task loop to breathe)
+    timeval tv;
+    tv.tv_sec = 0;
+    tv.tv_usec = 10000; // Increased to 10ms for better CPU efficiency in dual-mode
+    setsockopt(ApStaClassInstance->UdpSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+    if (ApStaClassInstance->ReceiveTaskHandle != nullptr) 
+    {
+        vTaskDelete(ApStaClassInstance->ReceiveTaskHandle);
+        ApStaClassInstance->ReceiveTaskHandle = nullptr;
+    }
+
+    if (ApStaClassInstance->TransmitTaskHandle != nullptr) 
+    {
+        vTaskDelete(ApStaClassInstance->TransmitTaskHandle);
+        ApStaClassInstance->TransmitTaskHandle = nullptr;
+    }
+
+    // Receive holds two 1500 byte datagrams and runs the whole forwarding path under them: packet
+    // handling, an lwIP send and, on a root, the host link. Transmit holds one and ends in the same
+    // sends. Logging from the deepest of those calls needs another 1 KB or so.
+    if (xTaskCreatePinnedToCore(&AccessPointStation::ReceiveTask,
+                                "ApStaUdpRx",
+                                8192,
+                                nullptr,
+                                5,
+                                &ApStaClassInstance->ReceiveTaskHandle,
+                                Core) != pdPASS)
+    {
+        close(ApStaClassInstance->UdpSocket);
+        ApStaClassInstance->UdpSocket = -1;
+        ApStaClassInstance->ReceiveTaskHandle = nullptr;
+        return false;
+    }
+
+    if (xTaskCreatePinnedToCore(&AccessPointStation::TransmitTask,
+                                "ApStaUdpTx",
+                                6144,
+                                nullptr,
+                                5,
+                                &ApStaClassInstance->TransmitTaskHandle,
+                                Core) != pdPASS)
+    {
+        close(ApStaClassInstance->UdpSocket);
+        ApStaClassInstance->UdpSocket = -1;
+        ApStaClassInstance->TransmitTaskHandle = nullptr;
+        return false;
+    }
+
+    ApStaClassInstance->UdpStarted = true;
+    if (ApStaClassInstance->IsRuntimeLoggingEnabled) ESP_LOGI("UDP", "Transmit and Receive tasks started on Port %d", Port);
+    
+    return true;
+}
+
+bool AccessPointStation::StopUdp()
+{
+    if (!ApStaClassInstance->UdpStarted) return true;
+
+    ApStaClassInstance->UdpStarted = false;
+
+    if (ApStaClassInstance->ReceiveTaskHandle != nullptr)
+    {
+        vTaskDelete(ApStaClassInstance->ReceiveTaskHandle);
+        vTaskDelete(ApStaClassInstance->TransmitTaskHandle);
+        ApStaClassInstance->ReceiveTaskHandle = nullptr;
+        ApStaClassInstance->TransmitTaskHandle = nullptr;
+    }
+
+    if (ApStaClassInstance->UdpSocket >= 0)
+    {
+        // shutdown() ensures all pending sends/receives are terminated
+        shutdown(ApStaClassInstance->UdpSocket, SHUT_RDWR);
+        close(ApStaClassInstance->UdpSocket);
+        ApStaClassInstance->UdpSocket = -1;
+    }
+
+    if (ApStaClassInstance->IsRuntimeLoggingEnabled)
+    {
+        ESP_LOGW("UDP", "Transmit and Receive tasks Stopped");
+    }
+
+    return true;
+}
+
+
+
+bool AccessPointStation::SetupWifi()
+{
+    // Steps run back to back, a failing step returns false and is retried from
+    // the same state on the next call
+    while (SetupState != 100)
+    {
+        switch (SetupState) 
+        {
+            case 0: // NVS
+                Error = nvs_flash_init();
+                if (Error == ESP_ERR_NVS_NO_FREE_PAGES || Error == ESP_ERR_NVS_NEW_VERSION_FOUND)
+                {
+                    if (nvs_flash_erase() != ESP_OK) return false;
+                    Error = nvs_flash_init();
+                }
+                if (Error != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 1: // Netif Core
+                if (esp_netif_init() != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 2: // Event loop
+                if (esp_event_loop_create_default() != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 3: // Create Dual Interfaces, the AP alone on a root
+                if (!IsRootGateway && ApStaClassInstance->StaNetif == nullptr) ApStaClassInstance->StaNetif = esp_netif_create_default_wifi_sta();
+                if (ApStaClassInstance->ApNetif == nullptr) ApStaClassInstance->ApNetif = esp_netif_create_default_wifi_ap();
+                if ((!IsRootGateway && ApStaClassInstance->StaNetif == nullptr) || ApStaClassInstance->ApNetif == nullptr) return false;
+                SetupState++;
+                break;
+
+
+
+            case 4: // Wi-Fi init
+                if (esp_wifi_init(&WifiDriverConfig) != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 5: // Country
+                memcpy(WifiCountry.cc, "GB", 2);
+                WifiCountry.schan = 1;
+                WifiCountry.nchan = 13;
+                WifiCountry.policy = WIFI_COUNTRY_POLICY_AUTO;
+                if (esp_wifi_set_country(&WifiCountry) != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 6: // Mesh event queue + deadline timers, then register the 3 Handlers
+                if (MeshEventQueue == nullptr) MeshEventQueue = xQueueCreate(MESH_EVENT_QUEUE_LENGTH, sizeof(MeshEvent));
+                if (MeshEventQueue == nullptr) return false;
+
+                if (DeadlineTimers[(size_t)MeshEventType::ScanDeadline] == nullptr &&
+                    !(CreateDeadlineTimer(MeshEventType::ScanDeadline, "MeshScan") &&
+                      CreateDeadlineTimer(MeshEventType::BeaconDeadline, "MeshBeacon") &&
+                      CreateDeadlineTimer(MeshEventType::KeepaliveDeadline, "MeshKeepalive") &&
+                      CreateDeadlineTimer(MeshEventType::LivenessDeadline, "MeshLiveness") &&
+                      CreateDeadlineTimer(MeshEventType::EchoDeadline, "MeshEcho") &&
+                      CreateDeadlineTimer(MeshEventType::BackfillDeadline, "MeshBackfill") &&
+                      CreateDeadlineTimer(MeshEventType::ReportDeadline, "MeshReport") &&
+                      CreateDeadlineTimer(MeshEventType::RootAnnounceDeadline, "MeshRootAnnounce") &&
+                      CreateDeadlineTimer(MeshEventType::TimeSyncDeadline, "MeshTimeSync"))) return false;
+
+                // 1. Station WiFi Handler
+                esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                                    &AccessPointStation::StaWifiEventHandler, nullptr, nullptr);
+                // 2. AP WiFi Handler
+                esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                                    &AccessPointStation::ApWifiEventHandler, nullptr, nullptr);
+                // 3. Consolidated IP Handler
+                esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID,
+                                                    &AccessPointStation::IpEventHandler, nullptr, nullptr);
+                SetupState++;
+                break;
+
+
+
+            case 7: // Configure AP + STA settings
+                memset(&StaWifiServiceConfig, 0, sizeof(wifi_config_t));
+                memset(&ApWifiServiceConfig, 0, sizeof(wifi_config_t));
+
+                // STATION: master credentials
+                strncpy((char*)StaWifiServiceConfig.sta.ssid, PARENT_SSID, 31);
+                strncpy((char*)StaWifiServiceConfig.sta.password, PARENT_PASS, 63);
+
+                // Set PMF to capable (standard for WPA2)
+                StaWifiServiceConfig.sta.pmf_cfg.capable = true;
+                StaWifiServiceConfig.sta.pmf_cfg.required = false;
+
+                ApWifiServiceConfig.ap.pmf_cfg.capable = true;
+                ApWifiServiceConfig.ap.pmf_cfg.required = false;
+
+                // ACCESS POINT: Dynamic naming
+                snprintf((char*)ApWifiServiceConfig.ap.ssid, sizeof(ApWifiServiceConfig.ap.ssid), 
+                        "node%d", (int)WifiFactory::GetNodeUid());
+                
+                ApWifiServiceConfig.ap.ssid_len = strlen((char*)ApWifiServiceConfig.ap.ssid);
+
+                // Ensure password is set and is at least 8 characters
+                strncpy((char*)ApWifiServiceConfig.ap.password, MY_PASS, 63);
+
+                ApWifiServiceConfig.ap.max_connection = MAX_STA_CONN; 
+            
+                ApWifiServiceConfig.ap.authmode = WIFI_AUTH_WPA2_PSK;
+                ApWifiServiceConfig.ap.channel = 6; 
+                SetupState++;
+                break;
+
+
+
+            case 8: // Set mode to APSTA, AP only on a root
+                if (esp_wifi_set_mode(IsRootGateway ? WIFI_MODE_AP : WIFI_MODE_APSTA) != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 9: // Apply Configs to specific interfaces
+                if (!IsRootGateway && esp_wifi_set_config(WIFI_IF_STA, &StaWifiServiceConfig) != ESP_OK) return false;
+                if (esp_wifi_set_config(WIFI_IF_AP, &ApWifiServiceConfig) != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 10: // Register callbacks for vendor information
+            if (esp_wifi_set_vendor_ie_cb(WifiVendorIeCb, this) != ESP_OK) return false;
+                SetupState++;
+                break;
+
+
+
+            case 11: // Start Wi-Fi & Initial Beacon
+                // Read before the driver starts, StaStart uses it to skip the first scan
+                if (!IsRootGateway) LoadParentCache();
+
+                // Read before the mesh task starts, the liveness check reverts a promotion nobody needs
+                IsPromoted = !IsRootGateway && WifiFactory::IsPromotedRole();
+
+                if (esp_wifi_start() != ESP_OK) return false;
+
+                // Start by advertising "Inifinity" hop until we get an IP, a busy driver is retried on the next beacon refresh
+                ApStaClassInstance->UpdateBeaconMetadata();
+
+                // Create the Mesh Management Task
+                xTaskCreatePinnedToCore
+                (
+                    &AccessPointStation::MeshTask,   // Function pointer
+                    "MeshTask",                      // Task name
+                    4096,                            // Stack size
+                    this,                            // Pass 'this' as pvParameters
+                    5,                               // Priority (Medium)
+                    &MeshTaskHandle,                 // Task handle
+                    UdpCore                          // Use the core assigned in constructor
+                );
+                SetupState = 100;
+                break;
+
+
+
+            default:
+                return false;
+        }
+    }
+
+    if (!SystemInitialized)
+    {
+        SystemInitialized = true;
+        BootStats.SetupDoneUs = esp_timer_get_time();
+        if (IsRuntimeLoggingEnabled) ESP_LOGI(STA_TAG, "WiFi setup complete %lld ms after boot", BootStats.SetupDoneUs / 1000);
+
+        // Not fatal, a single app partition table only loses mesh updates
+        if (!Ota.Start(UdpCore, WifiFactory::GetNodeUid(), &AccessPointStation::OtaStatusSender, 
+                       &AccessPointStation::OtaBeforeRestart, IsRuntimeLoggingEnabled))
+        {
+            ESP_LOGE(STA_TAG, "Mesh firmware updates unavailable");
+        }
+
+        if (MESH_STORE_FORWARD_BYTES > 0 && 
+            !Backlog.Init(MESH_STORE_FORWARD_BYTES, MESH_BACKFILL_BYTES_PER_S, MESH_STORE_FORWARD_IN_PSRAM, &AccessPointStation::BackfillSender))
+        {
+            ESP_LOGE(STA_TAG, "No memory for the store-and-forward buffer, data sent during an outage is lost");
+        }
+    }
+
+    return true;
+}
+
+
+
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                              STA (Leaf Node)                                 //
+//                                                                              //
+//==============================================================================// 
+
+#define LEAF_TAG "Leaf"
+
+static Station* StaClassInstance;
+
+static const uint8_t MESH_PROMOTE_SCAN_COUNT = 2; // Consecutive scans a seeking neighbour must appear in before we promote
+static const uint32_t MESH_PROMOTE_SLOT_MS = 20000; // One backoff slot, a promoted leaf restarts as a relay and the neighbour joins it within this
+static const uint8_t MESH_PROMOTE_UID_SLOTS = 3;   // Backoff slots per hop, picked by UID
+static const uint8_t MESH_PROMOTE_MAX_HOP = 4;     // Leaves further out share the slots of this hop
+
+
+
+Station::Station(uint8_t CoreToUse, uint16_t Port, bool EnableRuntimeLogging)
+{
+    StaClassInstance = this;
+    MeshTimeSource = &Clock;
+    UdpCore = CoreToUse;
+    UdpPort = Port;
+    IsRuntimeLoggingEnabled = EnableRuntimeLogging;
+}
+
+
+
+Station::~Station()
+{
+    ;
+}
+
+
+
+void Station::WifiEventHandler(void* arg, esp_event_base_t event_base,
+                               int32_t event_id, void* event_data)
+{
+    if (StaClassInstance == nullptr || event_base != WIFI_EVENT) return;
+
+    switch (event_id)
+    {
+        case WIFI_EVENT_STA_START:
+            StaClassInstance->PostLeafEvent(MeshEventType::StaStart);
+            break;
+
+        case WIFI_EVENT_SCAN_DONE:
+            StaClassInstance->PostLeafEvent(MeshEventType::ScanDone);
+            break;
+
+        case WIFI_EVENT_STA_CONNECTED:
+            StaClassInstance->PostLeafEvent(MeshEventType::StaConnected, event_data, sizeof(wifi_event_sta_connected_t));
+            break;
+
+        case WIFI_EVENT_STA_DISCONNECTED:
+            StaClassInstance->PostLeafEvent(MeshEventType::StaDisconnected, event_data, sizeof(wifi_event_sta_disconnected_t));
+            break;
+    }
+}
+
+
+
+void Station::IpEventHandler(void* arg, esp_event_base_t event_base,
+                             int32_t event_id, void* event_data)
+{
+    if (StaClassInstance == nullptr || event_base != IP_EVENT) return;
+
+    switch (event_id)
+    {
+        case IP_EVENT_STA_GOT_IP:
+            StaClassInstance->PostLeafEvent(MeshEventType::GotIp, event_data, sizeof(ip_event_got_ip_t));
+            break;
+
+        case IP_EVENT_STA_LOST_IP:
+            StaClassInstance->PostLeafEvent(MeshEventType::LostIp);
+            break;
+    }
+}
+
+
+
+bool Station::PostLeafEvent(MeshEventType Type, const void* Data, size_t Length)
 {
-    if (ApStaClassInstance == nullptr || event_base != WIFI_EVENT) return;
+    if (LeafEventQueue == nullptr) return false;
 
-    if (event_id == WIFI_EVENT_AP_STACONNECTED) 
+    MeshEvent Event{};
+    Event.Type = Type;
+    Event.PostedUs = esp_timer_get_time();
+    if (Data != nullptr) memcpy(&Event.Data, Data, std::min(Length, sizeof(Event.Data)));
+
+    if (xQueueSend(LeafEventQueue, &Event, 0) != pdTRUE)
     {
-        wifi_event_ap_staconnected_t* Event = (wifi_event_ap_staconnected_t*)event_data;
-        
-        WifiDevice child;
-        memset(&child, 0, sizeof(WifiDevice)); // Precise: Clear memory for string safety
-        child.TimeOfConnection = esp_timer_get_time();
-        child.aid = Event->aid;
-        child.HopCount = 255; // Initialized as unknown
-        child.LastHeartbeatUs = child.TimeOfConnection;
-        child.ChildrenCount = 0;
-        memcpy(child.MacId, Event->mac, 6);
-        child.IpAddress[0] = '\0'; 
-
-        ApStaClassInstance->ChildDevices.push_back(child);
-
-        if (ApStaClassInstance->IsRuntimeLoggingEnabled) 
-        {
-            ESP_LOGW("MESH_AP", "Child Joined | MAC: " MACSTR " | AID: %d", 
-                     MAC2STR(Event->mac), Event->aid);
-        }
+        DroppedLeafEvents++;
+        return false;
+    }
+    return true;
+}
 
-        ApStaClassInstance->UpdateBeaconMetadata(
-            ApStaClassInstance->MyHopCount,
-            (uint8_t)ApStaClassInstance->ChildDevices.size()
-        );
-    } 
 
 
+void Station::LeafTask(void* pvParameters)
+{
+    MeshEvent Event{};
 
-    else if (event_id == WIFI_EVENT_AP_STADISCONNECTED) 
+    while (true)
     {
-        wifi_event_ap_stadisconnected_t* Event = (wifi_event_ap_stadisconnected_t*)event_data;
-        
-        if (ApStaClassInstance->IsRuntimeLoggingEnabled) {
-            ESP_LOGE("MESH_AP", "Child Left | MAC: " MACSTR, MAC2STR(Event->mac));
-        }
-
-        // Precise removal using Erase-Remove Idiom
-        auto& list = ApStaClassInstance->ChildDevices;
-        list.erase(std::remove_if(list.begin(), list.end(), [&](const WifiDevice& d) {
-            return memcmp(d.MacId, Event->mac, 6) == 0;
-        }), list.end());
+        if (xQueueReceive(StaClassInstance->LeafEventQueue, &Event, portMAX_DELAY) != pdTRUE) continue;
+        if (Event.Type >= MeshEventType::Count) continue;
 
-        ApStaClassInstance->UpdateBeaconMetadata(
-            ApStaClassInstance->MyHopCount,
-            (uint8_t)ApStaClassInstance->ChildDevices.size()
-        );
+        StaClassInstance->HandleLeafEvent(Event);
     }
+
+    vTaskDelete(NULL);
 }
 
-void AccessPointStation::StaWifiEventHandler(void* arg, esp_event_base_t event_base,
-                                            int32_t event_id, void* event_data)
-{
-    if (ApStaClassInstance == nullptr || event_base != WIFI_EVENT) return;
 
-    switch (event_id) 
+
+void Station::HandleLeafEvent(const MeshEvent& Event)
+{
+    switch (Event.Type)
     {
-        case WIFI_EVENT_STA_START:
-            ApStaClassInstance->IsConnectedToParent = false;
-            ApStaClassInstance->ApIpAcquired = false;
-            ApStaClassInstance->StopUdp();
+        case MeshEventType::StaStart:
+            InitiateScan();
             break;
 
 
 
-        case WIFI_EVENT_SCAN_DONE:
-            // This is the trigger for our connection logic
-            if (ApStaClassInstance->IsRuntimeLoggingEnabled) {
-                ESP_LOGI(STA_TAG, "WiFi Scan Complete. Parsing results...");
-            }
-            ApStaClassInstance->ParseScanResults();
-            ApStaClassInstance->IsScanning = false;
+        case MeshEventType::ScanDone:
+            IsScanning = false;
+            ParseScanResults();
 
-            if (ApStaClassInstance->IsConnectedToParent &&
-                ApStaClassInstance->ApIpAcquired &&
-                ApStaClassInstance->IsCandidateValid)
+            if (!IsConnected && !IsConnecting && ParentWifiRecord.ssid[0] != '\0')
             {
-
-                const uint8_t curHop = ApStaClassInstance->ParentDevice.HopCount;
-                const uint8_t newHop = ApStaClassInstance->CandidateHop;
-
-                if (newHop < curHop) 
-                {
-                    ApStaClassInstance->RoamRequested = true;
-                    if (ApStaClassInstance->IsRuntimeLoggingEnabled) 
-                    {
-                        ESP_LOGW(STA_TAG, "Roam requested: current hop %u -> candidate hop %u",
-                                curHop, newHop);
-                    }
-                }
+                ConnectToParent();
             }
-
             break;
 
 
 
-        case WIFI_EVENT_STA_CONNECTED: 
-        {
-            wifi_event_sta_connected_t* Event = static_cast<wifi_event_sta_connected_t*>(event_data);
-            ApStaClassInstance->IsConnecting = false;
-            ApStaClassInstance->IsConnectedToParent = true;
-            
-            ApStaClassInstance->ParentDevice.TimeOfConnection = esp_timer_get_time();
-            ApStaClassInstance->ParentDevice.aid = Event->aid;
-            memcpy(ApStaClassInstance->ParentDevice.MacId, Event->bssid, 6);
+        case MeshEventType::StaConnected:
+            IsConnecting = false;
+            IsConnected = true;
+            ApWifiDevice.TimeOfConnection = esp_timer_get_time();
+            ApWifiDevice.aid = Event.Data.StaConnected.aid;
+            memcpy(ApWifiDevice.MacId, Event.Data.StaConnected.bssid, 6);
 
-            if (ApStaClassInstance->IsRuntimeLoggingEnabled) {
-                ESP_LOGW(STA_TAG, "Hardware Link to Parent Established");
-            }
+            if (IsRuntimeLoggingEnabled) ESP_LOGW(LEAF_TAG, "Link to parent established");
             break;
-        }
 
 
 
-        case WIFI_EVENT_STA_DISCONNECTED:
-        {
-            // Precise State Reset
-            ApStaClassInstance->IsConnecting = false;
-            ApStaClassInstance->IsConnectedToParent = false;
-            ApStaClassInstance->ApIpAcquired = false;
-            
-            // Poison the route and wifi data
-            ApStaClassInstance->MyHopCount = 255; 
-            ApStaClassInstance->ParentDevice.HopCount = 255;
-            ApStaClassInstance->IsConnectedToParent = false;
-            ApStaClassInstance->IsMasterFound = false;
-            ApStaClassInstance->ParentWifiRecord.ssid[0] = '\0';
-            ApStaClassInstance->UpdateBeaconMetadata(255, ApStaClassInstance->ChildDevices.size());
-            
-            ApStaClassInstance->StopUdp();
-            
-            if (ApStaClassInstance->IsRuntimeLoggingEnabled) {
-                 wifi_event_sta_disconnected_t* Event = (wifi_event_sta_disconnected_t*)event_data;
-                 ESP_LOGE(STA_TAG, "Parent Lost (Reason: %d). System will re-scan soon...", Event->reason);
-            }
+        case MeshEventType::StaDisconnected:
+            IsConnecting = false;
+            IsConnected = false;
+            ApIpAcquired = false;
+            MyHopCount = 255;
+            ParentWifiRecord.ssid[0] = '\0';
+            ApWifiDevice.IpAddress[0] = '\0';
+            LinkTable.RemoveParent();
+            StopUdp();
+
+            if (IsRuntimeLoggingEnabled) ESP_LOGE(LEAF_TAG, "Parent lost (Reason: %d). Re-scanning now...", Event.Data.StaDisconnected.reason);
 
+            if (!IsScanning) InitiateScan();
             break;
-        }
-    }
-}
 
-void AccessPointStation::IpEventHandler(void* arg, esp_event_base_t event_base,
-                                         int32_t event_id, void* event_data)
-{
-    if (ApStaClassInstance == nullptr || event_base != IP_EVENT) return;
 
-    switch (event_id)
-    {
-        case IP_EVENT_STA_GOT_IP:
+
+        case MeshEventType::GotIp:
         {
-            ip_event_got_ip_t* Event = static_cast<ip_event_got_ip_t*>(event_data);
+            const ip_event_got_ip_t* IpEvent = &Event.Data.GotIp;
 
-            // 1. Convert IP addresses to strings
-            char GwStr[16] = {0};
-            esp_ip4addr_ntoa(&Event->ip_info.gw, GwStr, sizeof(GwStr));
-            char MyStr[16] = {0};
-            esp_ip4addr_ntoa(&Event->ip_info.ip, MyStr, sizeof(MyStr));
+            esp_ip4addr_ntoa(&IpEvent->ip_info.gw, ApWifiDevice.IpAddress, sizeof(ApWifiDevice.IpAddress));
+            esp_ip4addr_ntoa(&IpEvent->ip_info.ip, MyIpAddress, sizeof(MyIpAddress));
 
-            // 2. Store internal station data
-            strncpy(ApStaClassInstance->ParentDevice.IpAddress, GwStr, 15);
-            strncpy(ApStaClassInstance->MyStaIpAddress, MyStr, 15);
-            
-            // 3. Update State Flags
-            ApStaClassInstance->ApIpAcquired = true;
-            ApStaClassInstance->IsConnectedToParent = true;
+            ApIpAcquired = true;
+            IsConnected = true;
+            MyHopCount = IsMasterParent ? 1 : (uint8_t)(ApWifiDevice.HopCount + 1);
+            ApWifiDevice.LastHeartbeatUs = esp_timer_get_time();
 
-            // 4. MESH LOGIC: Path Validation
-            // If connected to a Mesh node, increment. 
-            // If connected to a standard router (255), we assume it's the Root (0) and we become 1.
-            if (ApStaClassInstance->ParentDevice.HopCount != 255) 
-            {
-                ApStaClassInstance->MyHopCount = ApStaClassInstance->ParentDevice.HopCount + 1;
-            }
-            else 
+            sockaddr_in Upstream{};
+            if (GetUpstreamAddress(Upstream))
             {
-                 ApStaClassInstance->MyHopCount = 1; 
-                 ApStaClassInstance->ParentDevice.HopCount = 0; 
+                LinkTable.AddLink(Upstream.sin_addr.s_addr, ParentWifiRecord.bssid, true);
             }
+            Clock.OnParentChanged();
 
-            // 5. Broadcast our new status (Host + 1)
-            ApStaClassInstance->UpdateBeaconMetadata(ApStaClassInstance->MyHopCount, (uint8_t)ApStaClassInstance->ChildDevices.size());
-
-            // 6. Start UDP
-            bool UdpStartedOk = ApStaClassInstance->StartUdp(ApStaClassInstance->UdpPort, ApStaClassInstance->UdpCore);
+            // Announce ourselves at once, the parent learns our UID from the first packet
+            bool UdpStartedOk = StartUdp(UdpPort, UdpCore);
+            if (UdpStartedOk) SendKeepalive(false);
 
-            // 7. Simple Runtime Logging
-            if (ApStaClassInstance->IsRuntimeLoggingEnabled)
+            if (IsRuntimeLoggingEnabled)
             {
-                ESP_LOGI(STA_TAG, "STA Connected. IP: %s, GW: %s, My Hop: %d", MyStr, GwStr, ApStaClassInstance->MyHopCount);
-                if (!UdpStartedOk) ESP_LOGE(STA_TAG, "UDP failed to start on port %d", ApStaClassInstance->UdpPort);
+                ESP_LOGI(LEAF_TAG, "Connected. IP: %s, GW: %s, My Hop: %d", MyIpAddress, ApWifiDevice.IpAddress, MyHopCount);
+                if (!UdpStartedOk) ESP_LOGE(LEAF_TAG, "UDP failed to start on port %d", UdpPort);
             }
             break;
         }
- 
 
 
-        case IP_EVENT_AP_STAIPASSIGNED:
-        {
-            // Get the IP that was just assigned
-            ip_event_ap_staipassigned_t* Event = static_cast<ip_event_ap_staipassigned_t*>(event_data);
-            
-            char AssignedIp[16];
-            esp_ip4addr_ntoa(&Event->ip, AssignedIp, sizeof(AssignedIp));
 
+        case MeshEventType::LostIp:
+            ApIpAcquired = false;
+            StopUdp();
+            break;
 
-            // In a mesh, the most recent device to connect is the one getting the IP.
-            // We search our vector from NEWEST to OLDEST (reverse iterator).
-            bool matched = false;
-            for (auto it = ApStaClassInstance->ChildDevices.rbegin(); it != ApStaClassInstance->ChildDevices.rend(); ++it)
-            {
-                // If the IpAddress is still empty, this is our target.
-                if (it->IpAddress[0] == '\0') 
-                {
-                    strncpy(it->IpAddress, AssignedIp, sizeof(it->IpAddress) - 1);
-                    it->IpAddress[sizeof(it->IpAddress) - 1] = '\0';
-                    
-                    if (ApStaClassInstance->IsRuntimeLoggingEnabled) {
-                        ESP_LOGW("MESH_AP", "Linked IP %s to Child MAC " MACSTR, AssignedIp, MAC2STR(it->MacId));
-                    }
-                    matched = true;
-                    break;
-                }
-            }
 
-            if (!matched && ApStaClassInstance->IsRuntimeLoggingEnabled) {
-                ESP_LOGE("MESH_AP", "Received IP assignment %s but found no matching child!", AssignedIp);
-            }
-            break;
-        }
 
+        case MeshEventType::RouteWithdrawn:
+            if (!IsConnected) break;
+            if (IsRuntimeLoggingEnabled) ESP_LOGE(LEAF_TAG, "Parent withdrew its route, disconnecting");
+            esp_wifi_disconnect();
+            break;
 
-        
-        case IP_EVENT_STA_LOST_IP:
-        {
-            ApStaClassInstance->ApIpAcquired = false;
-            memset(ApStaClassInstance->MyStaIpAddress, 0, 16);
 
-            // MESH LOGIC: Poison the route
-            ApStaClassInstance->MyHopCount = 255; 
-            ApStaClassInstance->UpdateBeaconMetadata(ApStaClassInstance->MyHopCount, (uint8_t)ApStaClassInstance->ChildDevices.size());
 
-            ApStaClassInstance->StopUdp();
-            
-            if (ApStaClassInstance->IsRuntimeLoggingEnabled) ESP_LOGE(STA_TAG, "STA lost IP");
+        case MeshEventType::PreferredParent:
+            SetPreferredParent(Event.Data.PreferredParent);
             break;
-        }
-    }
-}
 
 
 
+        case MeshEventType::KeepaliveDeadline:
+            OnLinkTick();
+            break;
 
 
-void AccessPointStation::WifiVendorIeCb(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi) 
-{
-    const vendor_ie_data_t* data = vnd_ie;
 
-    if (data == nullptr) return;
+        case MeshEventType::PromoteDeadline:
+            if (!IsPromotionPending) break;
 
-    if (data->length < 4) return;
-    if (data->vendor_oui[0] != MESH_OUI_0 || 
-        data->vendor_oui[1] != MESH_OUI_1 || 
-        data->vendor_oui[2] != MESH_OUI_2) return;
+            // Nobody served the neighbour during our backoff, one more look before we restart
+            IsPromotionRecheck = true;
+            if (!IsScanning) InitiateScan();
+            break;
 
-    if (ApStaClassInstance->IsRuntimeLoggingEnabled) 
-    {
-        ESP_LOGW(STA_TAG, "IE Detected from %02x:%02x:%02x:%02x:%02x:%02x | OUI: %02x%02x%02x | Hops %d | Children %d", 
-                sa[0], sa[1], sa[2], sa[3], sa[4], sa[5],
-                data->vendor_oui[0], data->vendor_oui[1], data->vendor_oui[2],
-                data->payload[0],
-                data->payload[1]);
+
+
+        default:
+            break;
     }
+}
 
-    for (int i = 0; i < 20; i++)
-    {
-        // If macid is already in system
-        if (memcmp(ApStaClassInstance->CallbackIeData[i].MacId, sa, 6)) return;
 
-        if (!ApStaClassInstance->CallbackIeData[i].IsValid)
-        {
-            memcpy(ApStaClassInstance->CallbackIeData[i].MacId, sa, 6);
 
-            ApStaClassInstance->CallbackIeData[i].HopCount = data->payload[0];
-            ApStaClassInstance->CallbackIeData[i].ChildCount = data->payload[1];
-            ApStaClassInstance->CallbackIeData[i].IsValid = true;
+void Station::WifiVendorIeCb(void *ctx, wifi_vendor_ie_type_t type, const uint8_t sa[6], const vendor_ie_data_t *vnd_ie, int rssi)
+{
+    MeshIePayload Payload;
+    if (StaClassInstance == nullptr || !MeshParseIe(vnd_ie, Payload)) return;
 
-            break;
-        }
-    }
+    portENTER_CRITICAL(&StaClassInstance->CriticalSection);
+    MeshCacheIe(StaClassInstance->CallbackIeData, sa, Payload, rssi);
+    portEXIT_CRITICAL(&StaClassInstance->CriticalSection);
+
+    StaClassInstance->LinkTable.OnRssi(sa, (int8_t)rssi);
 }
 
-bool AccessPointStation::InitiateMeshScan()
+
+
+bool Station::InitiateScan()
 {
     wifi_scan_config_t scan_config = {};
     scan_config.show_hidden = false;
     scan_config.scan_type = WIFI_SCAN_TYPE_ACTIVE;
-    
-    // Non-blocking scan start
+
     if (esp_wifi_scan_start(&scan_config, false) == ESP_OK)
     {
-        IsScanning = true; 
+        IsScanning = true;
         return true;
     }
     return false;
 }
 
-void AccessPointStation::UpdateBeaconMetadata(uint8_t Hop, uint8_t Children)
-{
-    // Define the structure exactly as expected by the hardware
-    typedef struct 
-    {
-        vendor_ie_data_t header;
-        uint8_t payload[2];
-    } __attribute__((packed)) mesh_vendor_ie_t;
-
-
-    mesh_vendor_ie_t my_ie;
-    my_ie.header.element_id = 0xDD;
-    my_ie.header.length = 5; // 3 (OUI) + 2 (Payload)
-    my_ie.header.vendor_oui[0] = MESH_OUI_0;
-    my_ie.header.vendor_oui[1] = MESH_OUI_1;
-    my_ie.header.vendor_oui[2] = MESH_OUI_2;
-    my_ie.payload[0] = Hop;
-    my_ie.payload[1] = Children;
-
-    esp_wifi_set_vendor_ie(false, WIFI_VND_IE_TYPE_BEACON, WIFI_VND_IE_ID_0, nullptr);
-    esp_wifi_set_vendor_ie(false, WIFI_VND_IE_TYPE_PROBE_RESP, WIFI_VND_IE_ID_1, nullptr);
-
-    esp_err_t res_bcn = esp_wifi_set_vendor_ie(true, WIFI_VND_IE_TYPE_BEACON, WIFI_VND_IE_ID_0, (vendor_ie_data_t*)&my_ie);
-    esp_err_t res_prb = esp_wifi_set_vendor_ie(true, WIFI_VND_IE_TYPE_PROBE_RESP, WIFI_VND_IE_ID_1, (vendor_ie_data_t*)&my_ie);
 
-    if (IsRuntimeLoggingEnabled) 
-    {
-        if (res_bcn == ESP_OK && res_prb == ESP_OK) 
-        {
-            ESP_LOGW(STA_TAG, "Mesh IE Broadcast Updated: Hop %d, Children %d", Hop, Children);
-        } 
-        else 
-        {
-            ESP_LOGE(STA_TAG, "IE Update Deferred (Driver Busy): 0x%x", res_bcn);
-        }
-    }
-}
 
-void AccessPointStation::ParseScanResults()
+void Station::ParseScanResults()
 {
     uint16_t ApCount = 0;
-    uint8_t CurrentBestHop = 255; 
-    uint8_t CurrentBestChildren = 255;
 
-    
     Error = esp_wifi_scan_get_ap_num(&ApCount);
     if (ApCount == 0 || Error != ESP_OK) return;
 
-
     std::vector<wifi_ap_record_t> ApList(ApCount);
     Error = esp_wifi_scan_get_ap_records(&ApCount, ApList.data());
     if (Error != ESP_OK) return;
 
 
-    wifi_ap_record_t* BestAp = nullptr;
-    bool MasterFound = false; 
-
-
-    for (int i = 0; i < ApCount; i++) 
+    // Work on a copy, the vendor IE callback keeps writing while we parse
+    MeshMetadata IeCache[MESH_IE_CACHE_SIZE];
+    portENTER_CRITICAL(&CriticalSection);
+    memcpy(IeCache, CallbackIeData, sizeof(IeCache));
+    memset(CallbackIeData, 0, sizeof(CallbackIeData));
+    const uint64_t PreferredUid = PreferredParentUid;
+    const int64_t PreferredUntilUs = PreferredParentUntilUs;
+    portEXIT_CRITICAL(&CriticalSection);
+
+
+    // A leaf has no descendants, so no path-vector check is needed, only
+    // routed parents with a free slot are candidates
+    const wifi_ap_record_t* BestAp = nullptr;
+    uint32_t BestScore = UINT32_MAX;
+    uint8_t BestHop = 255;
+    uint64_t BestUid = 0;
+    bool BestIsMaster = false;
+    bool IsNeighbourSeeking = false;
+    int8_t MasterRssi = 0;
+
+    for (int i = 0; i < ApCount; i++)
     {
-        if (IsRuntimeLoggingEnabled) 
+        if (ENABLE_MASTER_CONNECTION == true && strcmp((char*)ApList[i].ssid, PARENT_SSID) == 0)
         {
-            ESP_LOGW(STA_TAG, "Scan Index [%d] SSID: %s | RSSI: %d | Channel: %d", 
-                    i, (char*)ApList[i].ssid, ApList[i].rssi, ApList[i].primary);
+            // Scored on path cost like the root gateways, 1 while the master names a node
+            const uint32_t Score = MeshRouterScore(PreferredUid, PreferredUntilUs, ApList[i].rssi);
+            MasterRssi = ApList[i].rssi;
+
+            if (Score < BestScore)
+            {
+                BestAp = &ApList[i];
+                BestScore = Score;
+                BestHop = 0;
+                BestUid = 0;
+                BestIsMaster = true;
+            }
+            continue; // Keep going, seeking neighbours still need to be seen
         }
 
+        if (strstr((char*)ApList[i].ssid, "node") == nullptr) continue;
 
-        if (ENABLE_MASTER_CONNECTION == true && strcmp((char*)ApList[i].ssid, "SturdyAP") == 0) 
+        for (int j = 0; j < (int)MESH_IE_CACHE_SIZE; j++)
         {
-            BestAp = &ApList[i];   
-            CurrentBestHop = 0;
-            CurrentBestChildren = 0; 
-            MasterFound = true;         
-            if (IsRuntimeLoggingEnabled) ESP_LOGW(STA_TAG, ">>> Master (SturdyAP) Found!");
-            break; 
-        } 
+            if (!IeCache[j].IsValid || memcmp(ApList[i].bssid, IeCache[j].MacId, 6) != 0) continue;
 
+            if (IeCache[j].Flags & MESH_IE_FLAG_SEEKING_PARENT) IsNeighbourSeeking = true;
 
-        else if (strstr((char*)ApList[i].ssid, "node") != nullptr) 
-        {
-            bool foundVendorData = false;
-            
-            for (int j = 0; j < 20; j++) 
+            if (IeCache[j].HopCount != 255 && IeCache[j].FreeChildSlots > 0)
             {
-                // if wifi record matches IE scan by BSSID
-                if (CallbackIeData[j].IsValid && 
-                    memcmp(ApList[i].bssid, CallbackIeData[j].MacId, 6) == 0) 
+                const uint32_t Score = MeshIsPreferredParent(PreferredUid, PreferredUntilUs, false, IeCache[j].Uid) ? 
+                                       0 : MeshParentScore(IeCache[j]);
+                if (Score < BestScore)
                 {
+                    BestAp = &ApList[i];
+                    BestScore = Score;
+                    BestHop = IeCache[j].HopCount;
+                    BestUid = IeCache[j].Uid;
+                    BestIsMaster = false;
+                }
+            }
+            break;
+        }
+    }
 
-                    // Hop count unset, device leads nowhere
-                    if (CallbackIeData[j].HopCount == 255)
-                    {
-                        if (IsRuntimeLoggingEnabled) 
-                        {
-                            ESP_LOGW(STA_TAG, "  -- Ignoring node (Hop = 255)");
-                        }
-                        break;
-                    }
-
-
-                    // Max connections on device already
-                    if (CallbackIeData[j].ChildCount >= MAX_STA_CONN) 
-                    {
-                        if (IsRuntimeLoggingEnabled) 
-                        {
-                            ESP_LOGW(STA_TAG, "  -- Ignoring node (Full Children: %d/%d)",
-                                    CallbackIeData[j].ChildCount, MAX_STA_CONN);
-                        }
-                        break;
-                    }
 
+    // Everything heard is reported to the master, usable as a parent or not
+    portENTER_CRITICAL(&CriticalSection);
+    memcpy(ScanNeighbours, IeCache, sizeof(ScanNeighbours));
+    ScanMasterRssi = MasterRssi;
+    portEXIT_CRITICAL(&CriticalSection);
 
-                    foundVendorData = true;
-                    if (IsRuntimeLoggingEnabled) 
-                    {
-                        ESP_LOGW(STA_TAG, "  -- Match Found in IE Cache! Hop: %d, Children: %d", 
-                                CallbackIeData[j].HopCount, CallbackIeData[j].ChildCount);
-                    }
 
+    const bool IsBestPreferred = BestAp != nullptr && MeshIsPreferredParent(PreferredUid, PreferredUntilUs, BestIsMaster, BestUid);
 
-                    // Better hops
-                    if (CallbackIeData[j].HopCount < CurrentBestHop)
-                    {
-                        BestAp = &ApList[i];
-                        CurrentBestHop = CallbackIeData[j].HopCount;
-                        CurrentBestChildren = CallbackIeData[j].ChildCount;
+    if (BestAp != nullptr && !IsConnected && !IsConnecting)
+    {
+        ParentWifiRecord = *BestAp;
+        ApWifiDevice.UID = BestUid;
+        ApWifiDevice.HopCount = BestHop;
+        ApWifiDevice.Rssi = BestAp->rssi;
+        IsMasterParent = BestIsMaster;
+    }
 
-                        if (IsRuntimeLoggingEnabled) 
-                        {
-                            ESP_LOGW(STA_TAG, "  -- New Best Match, Better Hop Count");
-                        }
-                    }
+    // Follow the master's plan through the normal reconnect, the rescan after
+    // the disconnect picks the preferred parent again
+    else if (IsBestPreferred && IsConnectedToHost() && 
+             !MeshIsPreferredParent(PreferredUid, PreferredUntilUs, IsMasterParent, ApWifiDevice.UID))
+    {
+        if (IsRuntimeLoggingEnabled) ESP_LOGW(LEAF_TAG, "Moving to the parent preferred by the master (UID %llu)", BestUid);
+        TopologyStats.PreferredRoams++;
+        esp_wifi_disconnect();
+        return;
+    }
 
 
-                    // Same hops, less children
-                    else if (CallbackIeData[j].HopCount == CurrentBestHop 
-                        && CallbackIeData[j].ChildCount < CurrentBestChildren)
-                    {
-                        BestAp = &ApList[i];
-                        CurrentBestChildren = CallbackIeData[j].ChildCount;
+    // Only a leaf with a route can help. Two scans in a row filter out a relay
+    // that is seeking only for the moment it takes to rejoin after a reboot.
+    SeekingNeighbourScans = (IsNeighbourSeeking && IsConnectedToHost()) ? SeekingNeighbourScans + 1 : 0;
 
-                        if (IsRuntimeLoggingEnabled) 
-                        {
-                            ESP_LOGW(STA_TAG, "  -- New Best Match, Better Children Count");
-                        }
-                    }
-                    
-                    break; 
-                }
-            }
+    const bool IsRecheck = IsPromotionRecheck;
+    IsPromotionRecheck = false;
 
-            if (!foundVendorData && IsRuntimeLoggingEnabled) 
-            {
-                ESP_LOGE(STA_TAG, "  -- Node found but no good Vendor IE data in cache.");
-            }
-        }
+    if (IsPromotionPending && SeekingNeighbourScans == 0)
+    {
+        // Another leaf got there first, the neighbour found a parent itself, or we lost our route
+        esp_timer_stop(PromoteTimer);
+        IsPromotionPending = false;
+        if (IsRuntimeLoggingEnabled) ESP_LOGW(LEAF_TAG, "Promotion cancelled, no neighbour is seeking a parent any more");
     }
 
-
-    if (BestAp != nullptr)
+    else if (IsPromotionPending && IsRecheck)
     {
-        IsCandidateValid = true;
-        IsCandidateMaster = MasterFound;
-        CandidateWifiRecord = *BestAp;
-        CandidateHop = CurrentBestHop;
-        CandidateChildren = CurrentBestChildren;
-
-        if (!IsConnectedToParent && !IsConnecting)
-        {
-            IsMasterFound = IsCandidateMaster;
-            ParentWifiRecord = CandidateWifiRecord;
-            ParentDevice.HopCount = CandidateHop;
-            ParentDevice.ChildrenCount = CandidateChildren;
-
-            MyHopCount = (CandidateHop == 255) ? 255 : (uint8_t)(CandidateHop + 1);
-        }
+        Promote("Neighbour is seeking a parent");
     }
 
-    else
+    else if (!IsPromotionPending && SeekingNeighbourScans >= MESH_PROMOTE_SCAN_COUNT)
     {
-        IsCandidateValid = false;
+        const uint32_t BackoffMs = GetPromoteBackoffMs();
+        if (esp_timer_start_once(PromoteTimer, (uint64_t)BackoffMs * 1000) == ESP_OK) IsPromotionPending = true;
+        if (IsRuntimeLoggingEnabled) ESP_LOGW(LEAF_TAG, "Neighbour is seeking a parent, promoting in %lu ms unless it is served", (unsigned long)BackoffMs);
     }
+}
 
-    memset(CallbackIeData, 0, sizeof(CallbackIeData));
 
-    IsScanning = false;
+
+uint32_t Station::GetPromoteBackoffMs() const
+{
+    // Nearer the root first, it gives the neighbour the shorter route, then spread by UID
+    const uint8_t Hop = std::min<uint8_t>(std::max<uint8_t>(MyHopCount, 1), MESH_PROMOTE_MAX_HOP);
+    const uint32_t Slot = (uint32_t)(Hop - 1) * MESH_PROMOTE_UID_SLOTS + (uint32_t)(WifiFactory::GetNodeUid() % MESH_PROMOTE_UID_SLOTS);
+    return Slot * MESH_PROMOTE_SLOT_MS;
 }
 
-void AccessPointStation::ConnectToBestAp()
+
+
+void Station::ConnectToParent()
 {
-    esp_wifi_disconnect();
     wifi_config_t sta_config = {};
-    
 
-    if (IsMasterFound) 
+    if (IsMasterParent)
     {
-        ESP_LOGW(STA_TAG, "ConnectToBestAp: Root Master Found! Connecting to: %s | Pass: %s", PARENT_SSID, PARENT_PASS);
         strncpy((char*)sta_config.sta.ssid, PARENT_SSID, sizeof(sta_config.sta.ssid));
         strncpy((char*)sta_config.sta.password, PARENT_PASS, sizeof(sta_config.sta.password));
     }
 
-
-    else 
+    else
     {
-        ESP_LOGW(STA_TAG, "ConnectToBestAp: Master NOT found. Connecting to Mesh Parent SSID: %s | Pass: %s", (char*)ParentWifiRecord.ssid, MY_PASS);
         memcpy(sta_config.sta.ssid, ParentWifiRecord.ssid, sizeof(sta_config.sta.ssid));
         strncpy((char*)sta_config.sta.password, MY_PASS, sizeof(sta_config.sta.password));
     }
 
-
     sta_config.sta.bssid_set = true;
     memcpy(sta_config.sta.bssid, ParentWifiRecord.bssid, 6);
     sta_config.sta.channel = ParentWifiRecord.primary;
+    sta_config.sta.pmf_cfg.capable = true;
+    sta_config.sta.pmf_cfg.required = false;
 
+    if (IsRuntimeLoggingEnabled) 
+    {
+        ESP_LOGW(LEAF_TAG, "Connecting to %s | BSSID: " MACSTR " | Channel: %d", 
+                 (char*)sta_config.sta.ssid, MAC2STR(sta_config.sta.bssid), sta_config.sta.channel);
+    }
 
-    ESP_LOGW(STA_TAG, "Connection details: BSSID: " MACSTR " | Channel: %d", 
-             MAC2STR(sta_config.sta.bssid), sta_config.sta.channel);
-    ESP_ERROR_CHECK(esp_wifi_set_config(WIFI_IF_STA, &sta_config));
-
+    if (esp_wifi_set_config(WIFI_IF_STA, &sta_config) != ESP_OK) return;
 
+    IsConnecting = true;
     esp_wifi_connect();
 }
 
-void AccessPointStation::MeshTask(void* pvParameters)
+
+
+void Station::Promote(const char* Reason)
 {
-    uint8_t Counter = 1;
-    
-    while (true)
+    // A relay cannot be brought up next to the running leaf (both are singletons
+    // owning the driver), so store the new role and come back up as one. Stored
+    // as a promotion, the relay turns back into a leaf once it has no children.
+    if (!WifiFactory::SetConfiguredRole(MeshRole::Relay, true))
     {
-        // 10 second counter, increments of 100ms
-        vTaskDelay(pdMS_TO_TICKS(100));
-        Counter ++;
-        if (Counter >= 101) Counter = 1;
+        ESP_LOGE(LEAF_TAG, "Promotion (%s) failed, role could not be stored", Reason);
+        return;
+    }
 
+    ESP_LOGW(LEAF_TAG, "Promoting to relay (%s), restarting", Reason);
+    esp_restart();
+}
 
-        // 5s
-        if (Counter % 50 == 0) 
-        {                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                        
-            ApStaClassInstance->UpdateBeaconMetadata(
-                ApStaClassInstance->MyHopCount,
-                (uint8_t)ApStaClassInstance->ChildDevices.size()
-            );
-        }
 
 
-        // 2s
-        if (Counter % 20 == 0)
-        {
-            if (!ApStaClassInstance->IsScanning && !ApStaClassInstance->IsConnecting) ApStaClassInstance->InitiateMeshScan();
+void Station::LinkTimerCallback(void* arg)
+{
+    Station* Instance = static_cast<Station*>(arg);
+    if (Instance != nullptr) Instance->PostLeafEvent(MeshEventType::KeepaliveDeadline);
+}
 
-            
-            if (!ApStaClassInstance->IsConnectedToParent &&
-                !ApStaClassInstance->IsConnecting &&
-                ApStaClassInstance->ParentWifiRecord.ssid[0] != '\0')
-            {
-                ApStaClassInstance->IsConnecting = true;
-                ApStaClassInstance->ConnectToBestAp();
-            }
 
-            if (ApStaClassInstance->IsConnectedToParent &&
-                !ApStaClassInstance->IsConnecting &&
-                ApStaClassInstance->RoamRequested &&
-                ApStaClassInstance->IsCandidateValid)
-            {
-                ApStaClassInstance->RoamRequested = false;
-                ApStaClassInstance->IsConnecting = true;
 
-                ApStaClassInstance->IsMasterFound = ApStaClassInstance->IsCandidateMaster;
-                ApStaClassInstance->ParentWifiRecord = ApStaClassInstance->CandidateWifiRecord;
-                ApStaClassInstance->ParentDevice.HopCount = ApStaClassInstance->CandidateHop;
-                ApStaClassInstance->MyHopCount =
-                    (ApStaClassInstance->CandidateHop == 255) ? 255 : (uint8_t)(ApStaClassInstance->CandidateHop + 1);
+void Station::PromoteTimerCallback(void* arg)
+{
+    Station* Instance = static_cast<Station*>(arg);
+    if (Instance != nullptr) Instance->PostLeafEvent(MeshEventType::PromoteDeadline);
+}
 
-                ESP_LOGW(STA_TAG, "Roaming now to %s (hop %u)",
-                        (char*)ApStaClassInstance->ParentWifiRecord.ssid,
-                        ApStaClassInstance->ParentDevice.HopCount);
 
-                esp_wifi_disconnect();
-                vTaskDelay(pdMS_TO_TICKS(200));
-                ApStaClassInstance->ConnectToBestAp();
-            }
+
+void Station::OnLinkTick()
+{
+    LinkTicks++;
+    const int64_t Now = esp_timer_get_time();
+    const int64_t DeadlineUs = (int64_t)MESH_HEARTBEAT_MISS_LIMIT * MESH_HEARTBEAT_PERIOD_MS * 1000;
+
+
+    if (IsConnectedToHost())
+    {
+        // The master's router does not send heartbeats, a hop 1 leaf relies on WiFi events
+        if (!IsMasterParent && Now - (int64_t)ApWifiDevice.LastHeartbeatUs > DeadlineUs)
+        {
+            if (IsRuntimeLoggingEnabled) ESP_LOGE(LEAF_TAG, "Parent missed heartbeats, disconnecting");
+            esp_wifi_disconnect();
+            return;
         }
 
+        SendKeepalive(true);
+
+        if (LinkTicks % (MESH_ECHO_PERIOD_MS / MESH_HEARTBEAT_PERIOD_MS) == 0) SendEchoRequest();
 
-        // 0.5s
-        if (Counter % 5 == 0)
+        if (LinkTicks % (MESH_TIME_SYNC_PERIOD_MS / MESH_HEARTBEAT_PERIOD_MS) == 0) SendTimeSyncRequest();
+
+        if (!IsScanning && LinkTicks % (MESH_LEAF_SCAN_PERIOD_MS / MESH_HEARTBEAT_PERIOD_MS) == 0)
         {
-            if (ApStaClassInstance->IsConnectedToParent && ApStaClassInstance->ApIpAcquired)
-            {
-                uint8_t TxBuffer[64]{};
-                uint8_t HeartbeatValue = 79;
-                size_t Length = ApStaClassInstance->CreatePacket(&HeartbeatValue, 1, 255, TxBuffer, sizeof(TxBuffer));
-            
-                if (Length > 48)
-                {
-                    sockaddr_in Destination{};
-                    Destination.sin_family = AF_INET;
-                    Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
-                    if (ApStaClassInstance->IsMasterFound)
-                    {
-                        inet_pton(AF_INET, "192.168.0.254",
-                                &Destination.sin_addr);
-                    }
-                    else 
-                    {
-                        inet_pton(AF_INET, ApStaClassInstance->ParentDevice.IpAddress,
-                                &Destination.sin_addr);
-                    }
-                    int Sent = sendto(ApStaClassInstance->UdpSocket,
-                            TxBuffer,
-                            Length,
-                            0,
-                            (sockaddr*)&Destination,
-                            sizeof(Destination));
-
-                    if (Sent < 0 && ApStaClassInstance->IsRuntimeLoggingEnabled) ESP_LOGE(STA_TAG, "Heartbeat sendto failed (errno=%d)", errno);
-                }
-            }
+            InitiateScan();
         }
+
+        if (LinkTicks % (MESH_NEIGHBOUR_REPORT_PERIOD_MS / MESH_HEARTBEAT_PERIOD_MS) == 0) SendNeighbourReport();
     }
 
-    vTaskDelete(NULL);
+    else if (!IsConnecting && !IsScanning && 
+             LinkTicks % (MESH_SCAN_PERIOD_MS / MESH_HEARTBEAT_PERIOD_MS) == 0)
+    {
+        InitiateScan();
+    }
 }
 
 
 
+bool Station::GetUpstreamAddress(sockaddr_in& DestinationAddress) const
+{
+    sockaddr_in Destination{};
+    Destination.sin_family = AF_INET;
+    Destination.sin_port   = htons(UdpPort);
 
+    const char* UpstreamIp = IsMasterParent ? "192.168.0.254" : ApWifiDevice.IpAddress;
+    if (UpstreamIp[0] == '\0' || inet_pton(AF_INET, UpstreamIp, &Destination.sin_addr) != 1) return false;
 
-size_t AccessPointStation::CreatePacket(const uint8_t* DataToInclude,
-                    size_t DataLength,
-                    uint8_t PacketType,
-                    uint8_t* PacketOut,
-                    size_t OutputBufferSize)
-{
-    if (!DataToInclude) return 0;
-    if (!PacketOut) return 0;
-    if (DataLength > 65535) return 0;
-    if (PacketType == 0) return 0;
-    if (OutputBufferSize < DataLength + 48 + 2) return 0;
+    DestinationAddress = Destination;
+    return true;
+}
 
-    PacketHeader TempHeader{};
 
-    TempHeader.startDelimiter = PACKET_START_DELIMITER;
-    TempHeader.payloadSize = DataLength;
-    TempHeader.slaveUid = CONFIG_ESP_NODE_UID;
-    //TempHeader.messageCounter = 0;
-    TempHeader.senderTimestampUs = (uint64_t)esp_timer_get_time();
-    TempHeader.prevCycleTimeUs = 0;
-    TempHeader.chainedSlaveCount = 0;
-    TempHeader.PacketType = PacketType;
-    TempHeader.flags = 0;
-    TempHeader.headerVersion = 1;
-    TempHeader.networkId = 0;
-    TempHeader.chainDistance = 0;
-    TempHeader.ttl = 10;
-    TempHeader.crc32 = 0;
 
-    uint8_t* p = PacketOut;
+void Station::SendKeepalive(bool OnlyIfIdle)
+{
+    if (UdpSocket < 0) return;
 
-    memcpy(p, &TempHeader, sizeof(PacketHeader));
-    memcpy(p + sizeof(PacketHeader), DataToInclude, DataLength);
-    memcpy(p + sizeof(PacketHeader) + DataLength, &PACKET_END_DELIMITER, 2);
+    const int64_t Now = esp_timer_get_time();
+    if (OnlyIfIdle && Now - LastTxUs < (int64_t)MESH_HEARTBEAT_PERIOD_MS * 1000)
+    {
+        KeepaliveStats.UpstreamSuppressed++;
+        KeepaliveStats.UpstreamBytesSaved += PACKET_HEADER_SIZE + sizeof(MeshHeartbeatPayload) + 2;
+        return;
+    }
 
-    return PACKET_HEADER_SIZE + DataLength + sizeof(PACKET_END_DELIMITER);
+    sockaddr_in Destination{};
+    if (!GetUpstreamAddress(Destination)) return;
+
+    MeshHeartbeatPayload Heartbeat{};
+    LinkTable.PrepareHeartbeat(Destination.sin_addr.s_addr, Heartbeat);
+    SendLinkControl(Destination, PACKET_TYPE_HEARTBEAT, &Heartbeat, sizeof(Heartbeat));
+    KeepaliveStats.UpstreamSent++;
 }
 
 
-void AccessPointStation::ProcessData(uint8_t* data, int length)
+
+void Station::SendEchoRequest()
 {
-    if (data == nullptr || length <= 48) return;
-    if (data[0] != 0xB5 || data[1] != 0x02) return;
+    // The master's router does not answer, so only a mesh parent is probed
+    sockaddr_in Destination{};
+    if (IsMasterParent || !GetUpstreamAddress(Destination)) return;
 
-    constexpr int headerSize = 48;
-    constexpr int terminatorSize = 2;
-    uint16_t PayloadSize = (static_cast<uint16_t>(data[2]) << 8) | static_cast<uint16_t>(data[3]);
-    int terminatorIndex = headerSize + PayloadSize;
+    MeshEchoPayload Echo{};
+    Echo.SentUs = (uint64_t)esp_timer_get_time();
+    if (SendLinkControl(Destination, PACKET_TYPE_ECHO_REQUEST, &Echo, sizeof(Echo)) > 0) LinkTable.OnEchoSent(Destination.sin_addr.s_addr);
+}
 
-    if (length < terminatorIndex + terminatorSize) return;
-    if (data[terminatorIndex] != 0x03 || data[terminatorIndex + 1] != 0x5B) return;
 
-    uint8_t PacketType = data[37];
 
+void Station::SendTimeSyncRequest()
+{
+    // The master answers at hop 1 as well, through its router
+    sockaddr_in Destination{};
+    if (!GetUpstreamAddress(Destination)) return;
 
-    
-    switch(PacketType)
-    {
-        case 0xFF:  // Heartbeat
-            LastHeartbeatUs = esp_timer_get_time();
-            break;
+    MeshTimeSyncPayload Request{};
+    Clock.PrepareRequest(Request);
+    SendLinkControl(Destination, PACKET_TYPE_TIME_SYNC_REQUEST, &Request, sizeof(Request));
+}
 
-        default:
-            break;
-    }
 
+
+int Station::SendLinkControl(const sockaddr_in& Destination, uint8_t PacketType, const void* Payload, size_t PayloadLength)
+{
+    if (UdpSocket < 0) return -1;
+
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(MeshTimeSyncPayload) + 2]{};  // Largest link control payload
+    size_t Length = MeshBuildPacket((const uint8_t*)Payload, PayloadLength, PacketType, 0, TxBuffer, sizeof(TxBuffer));
+    if (Length <= PACKET_HEADER_SIZE) return -1;
+
+    int Sent = MeshSendOnLink(UdpSocket, LinkTable, TxBuffer, Length, Destination);
+    if (Sent > 0) LastTxUs = esp_timer_get_time();
+    return Sent;
 }
 
-size_t AccessPointStation::PrepareTxPacket(const uint8_t* rxData,
-                                         int rxLength,
-                                         uint8_t* txBuffer,
-                                         int& txLength)
+
+
+size_t Station::SendPacket(const uint8_t* Payload, size_t PayloadLength, uint8_t PacketType, int64_t SampledUs)
 {
+    // The cycle it was sampled in, not sent in, it may wait for a slot or in the backlog. 0 while the cycle is not known.
+    uint32_t Cycle = 0;
+    MeshCycleAt(Clock, SampledUs != 0 ? SampledUs : esp_timer_get_time(), SampledUs != 0, Cycle);
 
-    txLength = 0;
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + UDP_PACKET_SIZE + 2];
+    size_t Length = MeshBuildPacket(Payload, PayloadLength, PacketType, 2, TxBuffer, sizeof(TxBuffer), Cycle);
+    if (Length == 0) return 0;
 
-    if (!rxData || !txBuffer) return 0;
-    if (rxLength < 48) return 0;
+    // Fresh data goes straight out or into its slot, it never waits behind the backlog
+    Slots.SetPosition(WifiFactory::GetNodeUid(), MyHopCount);
+    if (IsConnectedToHost() && Slots.Hold(TxBuffer, Length)) return Length;
 
-    constexpr int headerSize = 48;
-    constexpr int terminatorSize = 2;
-    const uint8_t PacketType = rxData[37];
-    const uint8_t ForwardMode  = rxData[43];
+    const bool IsSent = SendUpstream(TxBuffer, Length);
+    Slots.NoteFreeSend(IsSent);
+    if (IsSent) return Length;
 
-    uint16_t PayloadSize = (static_cast<uint16_t>(rxData[2]) << 8) | static_cast<uint16_t>(rxData[3]);
-    int ExpectedSize = headerSize + PayloadSize + terminatorSize;
-    int TermIndex = headerSize + PayloadSize;
-    
-    if (rxLength < ExpectedSize) return 0;
-    if (rxData[TermIndex] != 0x03 || rxData[TermIndex + 1] != 0x5B) return 0;
+    Backlog.Store(TxBuffer, Length);
+    return 0;
+}
 
 
 
-    // FORWARD PACKET
-    if (ForwardMode != 00) 
-    {
-        memcpy(txBuffer, rxData, ExpectedSize);
-        txLength = ExpectedSize;
-        return txLength;
-    }
+bool Station::SendUpstream(const uint8_t* Data, size_t Length)
+{
+    sockaddr_in Destination{};
+    if (!IsConnectedToHost() || UdpSocket < 0 || !GetUpstreamAddress(Destination)) return false;
 
+    int Sent = MeshSendOnLink(UdpSocket, LinkTable, Data, Length, Destination);
+    if (Sent <= 0) return false;
 
-    
-    // PROCESS PACKET
-    else
-    {
-        if (PayloadSize > MaxPayload) return 0;
+    LastTxUs = esp_timer_get_time();
+    return true;
+}
 
-        const uint8_t* PayloadPtr = rxData + headerSize;
 
-        // ====================================
-        //      FILL INTERNAL DATA
-        // ====================================
 
-        PayloadSeq++;
-        memcpy(LatestPayload, PayloadPtr, PayloadSize);
-        LatestPayloadSize = PayloadSize;
-        LatestPayloadType = PacketType;
-        LatestPayloadUs   = esp_timer_get_time();
-        PayloadSeq++; 
+bool Station::BackfillSender(const uint8_t* Data, size_t Length)
+{
+    return StaClassInstance != nullptr && StaClassInstance->SendUpstream(Data, Length);
+}
 
-        return 0;
-    }
+
+
+bool Station::EnableSlottedTx(uint32_t CycleUs, uint8_t SlotCount)
+{
+    Slots.SetPosition(WifiFactory::GetNodeUid(), MyHopCount);
+    return Slots.Enable(CycleUs, SlotCount, &Clock, &Station::BackfillSender);
 }
 
-bool AccessPointStation::DetermineDestinationAddress(const sockaddr_in& SourceAddress, const uint8_t* Data, int DataLength, sockaddr_in& DestinationAddress)
+
+
+bool Station::TakeDueCommand(int64_t CycleStartUs, MeshCommand& Out)
 {
+    uint32_t NowCycle = 0;
+    const bool IsCycleKnown = MeshCycleAt(Clock, CycleStartUs, true, NowCycle);
+    return Commands.TakeDue(IsCycleKnown, NowCycle, Out);
+}
 
-    if (!Data) return 0;
-    if (DataLength < 48 + 2) return 0;
 
-    const uint8_t ForwardMode = Data[43];
 
-    switch (ForwardMode)
-    {
-        case 0: // Return to sender
-            DestinationAddress = SourceAddress;
-            return true;
-            break;
+void Station::SendNeighbourReport()
+{
+    MeshMetadata Neighbours[MESH_IE_CACHE_SIZE];
+    MeshNeighbourReportHeader Header{};
 
+    portENTER_CRITICAL(&CriticalSection);
+    memcpy(Neighbours, ScanNeighbours, sizeof(Neighbours));
+    Header.MasterRssi = ScanMasterRssi;
+    const bool IsFollowing = PreferredParentUntilUs > esp_timer_get_time();
+    portEXIT_CRITICAL(&CriticalSection);
 
+    Header.ParentUid = IsMasterParent ? 0 : ApWifiDevice.UID;
+    Header.HopCount = MyHopCount;
+    Header.MaxChildren = 0;
+    Header.Flags = MESH_REPORT_FLAG_LEAF | (IsFollowing ? MESH_REPORT_FLAG_PREFERENCE : 0);
 
-        case 1: // Downstream
-        {
-            const uint8_t* DestinationUid = Data + 16;
-            int MatchIndex = -1;
+    uint8_t Payload[UDP_PACKET_SIZE];
+    const size_t Length = MeshBuildNeighbourReport(Neighbours, LinkTable, Header, Payload, sizeof(Payload));
 
-            for (size_t i = 0; i < ApStaClassInstance->ChildDevices.size(); i++)
-            {
-                // Compare 8-byte UID
-                if (memcmp(&ApStaClassInstance->ChildDevices[i].UID, DestinationUid, 8) == 0)
-                {
-                    MatchIndex = i;
-                    break;
-                }
-            }
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + UDP_PACKET_SIZE + 2];
+    const size_t PacketLength = MeshBuildPacket(Payload, Length, PACKET_TYPE_NEIGHBOUR_REPORT, 2, TxBuffer, sizeof(TxBuffer));
 
-            if (MatchIndex < 0) return false;
+    // Not stored on failure, the next report replaces it
+    if (PacketLength > 0 && SendUpstream(TxBuffer, PacketLength)) TopologyStats.ReportsSent++;
+}
 
-            sockaddr_in Destination{};
-            Destination.sin_family = AF_INET;
-            Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
 
-            if (inet_pton(AF_INET,
-              ApStaClassInstance->ChildDevices[MatchIndex].IpAddress,
-              &Destination.sin_addr) != 1)
-            {
-                return false;
-            }
 
-            DestinationAddress = Destination;
+void Station::SetPreferredParent(const MeshPreferredParent& Preferred)
+{
+    const uint32_t HoldMs = std::min(Preferred.HoldMs, MESH_PREFERRED_PARENT_MAX_HOLD_MS);
 
-            return true;
-            break;
-        }
-        
+    portENTER_CRITICAL(&CriticalSection);
+    PreferredParentUid = Preferred.ParentUid;
+    PreferredParentUntilUs = (HoldMs == 0) ? 0 : esp_timer_get_time() + (int64_t)HoldMs * 1000;
+    TopologyStats.PreferencesReceived++;
+    portEXIT_CRITICAL(&CriticalSection);
 
+    if (IsRuntimeLoggingEnabled) ESP_LOGW(LEAF_TAG, "Preferred parent UID %llu for %lu ms", Preferred.ParentUid, (unsigned long)HoldMs);
 
-        case 2: // Upstream
-        {
-            sockaddr_in Destination{};
-            Destination.sin_family = AF_INET;
-            Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
+    // The move itself happens in ParseScanResults, once the preferred parent has been seen
+    if (HoldMs > 0 && !IsScanning && !IsConnecting) InitiateScan();
+}
 
-            if (IsMasterFound)
-            {
-                if (inet_pton(AF_INET, "192.168.0.254", &Destination.sin_addr) != 1)
-                {
-                    return false;
-                }
-            }
-            else 
-            {
-                if (inet_pton(AF_INET,
-                  ApStaClassInstance->ParentDevice.IpAddress,
-                  &Destination.sin_addr) != 1)
-                {
-                    return false;
-                }
-            }
 
-            DestinationAddress = Destination;
 
-            return true;
-            break;
-        }
+MeshTopologyStats Station::GetTopologyStats() const
+{
+    portENTER_CRITICAL(&CriticalSection);
+    MeshTopologyStats Copy = TopologyStats;
+    Copy.PreferredParentUid = PreferredParentUid;
+    const int64_t RemainingUs = PreferredParentUntilUs - esp_timer_get_time();
+    portEXIT_CRITICAL(&CriticalSection);
+
+    Copy.PreferenceRemainingMs = (RemainingUs > 0) ? RemainingUs / 1000 : 0;
+    return Copy;
+}
 
 
 
-        default:
-            return false;
-            break;
-    }
+void Station::BackfillTimerCallback(void* arg)
+{
+    Station* Instance = static_cast<Station*>(arg);
+    if (Instance == nullptr) return;
+
+    if (Instance->IsConnectedToHost()) Instance->Backlog.Backfill();
+
+    const uint32_t DelayMs = Instance->Backlog.IsEmpty() ? MESH_HEARTBEAT_PERIOD_MS : MESH_BACKFILL_PERIOD_MS;
+    esp_timer_start_once(Instance->BackfillTimer, (uint64_t)DelayMs * 1000);
 }
 
 
 
+bool Station::OtaStatusSender(const uint8_t* Payload, size_t Length)
+{
+    if (StaClassInstance == nullptr || !StaClassInstance->IsConnectedToHost() || StaClassInstance->UdpSocket < 0) return false;
+
+    // A full bitmap is larger than SendPacket takes
+    uint8_t TxBuffer[PACKET_HEADER_SIZE + sizeof(MeshOtaStatusHeader) + MESH_OTA_BITMAP_SIZE + 2];
+    size_t PacketLength = MeshBuildPacket(Payload, Length, PACKET_TYPE_OTA_STATUS, 2, TxBuffer, sizeof(TxBuffer));
 
-size_t AccessPointStation::SendData(const uint8_t* Data, int Length, const sockaddr_in& DestinationAddress)
+    sockaddr_in Destination{};
+    if (PacketLength == 0 || !StaClassInstance->GetUpstreamAddress(Destination)) return false;
+
+    int Sent = MeshSendOnLink(StaClassInstance->UdpSocket, StaClassInstance->LinkTable, TxBuffer, PacketLength, Destination);
+    if (Sent > 0) StaClassInstance->LastTxUs = esp_timer_get_time();
+    return Sent > 0;
+}
+
+
+
+void Station::OtaBeforeRestart()
 {
-    if (!Data) return 0;
-    if (Length <= 0) return 0;
-    if (ApStaClassInstance->UdpSocket < 0) return 0;
+    // The new image may have been built as a relay, this node stays a leaf
+    WifiFactory::SetConfiguredRole(MeshRole::Leaf);
+}
 
-    int SentBytes = sendto(ApStaClassInstance->UdpSocket,
-                           Data,
-                           Length,
-                           0,
-                           (const sockaddr*)&DestinationAddress,
-                           sizeof(DestinationAddress));
 
-    if (SentBytes < 0)
-    {
-        return 0;
-    }
 
-    return static_cast<size_t>(SentBytes);
+size_t Station::GetDataFromBuffer(bool* IsDataAvailable, uint8_t* DataToReceive)
+{
+    if (IsDataAvailable == nullptr || DataToReceive == nullptr) return 0;
+
+    portENTER_CRITICAL(&CriticalSection);
+    const size_t Length = LastPositionWritten;
+    if (Length > 0) memcpy(DataToReceive, RxData, Length);
+    LastPositionWritten = 0;
+    portEXIT_CRITICAL(&CriticalSection);
+
+    *IsDataAvailable = Length > 0;
+    return Length;
 }
 
-void AccessPointStation::ReceiveTask(void* pvParameters)
+
+
+void Station::ProcessPacket(const uint8_t* Data, int Length, const sockaddr_in& SourceAddress)
 {
-    uint8_t ReceiveBuffer[1500];
-    int ReceivedBytes = 0;
-    uint8_t SendBuffer[1500];
-    int SendBytes = 0;
+    uint16_t PayloadSize = 0;
+    if (!MeshValidateFraming(Data, Length, &PayloadSize)) return;
 
-    while(true)
+    PacketHeader Header;
+    memcpy(&Header, Data, sizeof(PacketHeader));
+
+
+    // Any valid packet from the parent proves the link is alive
+    in_addr ParentIp{};
+    if (ApWifiDevice.IpAddress[0] != '\0' &&
+        inet_pton(AF_INET, ApWifiDevice.IpAddress, &ParentIp) == 1 &&
+        ParentIp.s_addr == SourceAddress.sin_addr.s_addr)
     {
-        sockaddr_in SourceAddress{}, DestinationAddress{};
-        socklen_t AddressLength = sizeof(SourceAddress);
+        ApWifiDevice.LastHeartbeatUs = esp_timer_get_time();
+    }
+    MeshNoteLinkSequence(LinkTable, Data, SourceAddress);
+
+
+    // Downstream packets for other UIDs never reach a leaf unless a parent mis-routes
+    if (Header.ForwardingMode == 1 && Header.destinationUid != WifiFactory::GetNodeUid()) return;
 
-        ReceivedBytes = recvfrom(ApStaClassInstance->UdpSocket,
-                                ReceiveBuffer,
-                                sizeof(ReceiveBuffer),
-                                0,
-                                (sockaddr*)&SourceAddress,
-                                &AddressLength);
 
-        if (ReceivedBytes > 0)
-        {
-            ApStaClassInstance->ProcessData(ReceiveBuffer, ReceivedBytes);
+    // Anything that drops the link or restarts the node must come from the parent, not any host on the subnet
+    sockaddr_in Upstream{};
+    const bool IsFromParent = GetUpstreamAddress(Upstream) && Upstream.sin_addr.s_addr == SourceAddress.sin_addr.s_addr;
 
-            SendBytes = 0;
 
-            ApStaClassInstance->PrepareTxPacket(ReceiveBuffer, ReceivedBytes, SendBuffer, SendBytes);
+    const uint8_t* Payload = Data + PACKET_HEADER_SIZE;
 
-            if (SendBytes <= 0)
-            {
-                continue;
-            }
+    switch (Header.PacketType)
+    {
+        case PACKET_TYPE_HEARTBEAT:
+        {
+            if (PayloadSize < sizeof(MeshHeartbeatPayload)) break;
+            MeshHeartbeatPayload Heartbeat{};
+            memcpy(&Heartbeat, Payload, sizeof(Heartbeat));
+            LinkTable.OnHeartbeat(SourceAddress.sin_addr.s_addr, Header.slaveUid, Heartbeat);
+            break;
+        }
 
-            if (!ApStaClassInstance->DetermineDestinationAddress(SourceAddress, SendBuffer, SendBytes, DestinationAddress))
-            {
-                continue;
-            }
+        case PACKET_TYPE_ECHO_REQUEST:
+        {
+            if (PayloadSize < sizeof(MeshEchoPayload)) break;
+            sockaddr_in ReplyAddress = SourceAddress;
+            ReplyAddress.sin_port = htons(UdpPort);
+            SendLinkControl(ReplyAddress, PACKET_TYPE_ECHO_REPLY, Payload, sizeof(MeshEchoPayload));
+            break;
+        }
 
-            ApStaClassInstance->SendData(SendBuffer, SendBytes, DestinationAddress);
+        case PACKET_TYPE_ECHO_REPLY:
+        {
+            if (PayloadSize < sizeof(MeshEchoPayload)) break;
+            MeshEchoPayload Echo{};
+            memcpy(&Echo, Payload, sizeof(Echo));
+            LinkTable.OnEchoReply(SourceAddress.sin_addr.s_addr, esp_timer_get_time() - (int64_t)Echo.SentUs);
+            break;
         }
 
-        vTaskDelay(1);
-    }
+        case PACKET_TYPE_TIME_SYNC_REPLY:
+        {
+            // A leaf has no children to answer, it only follows its parent
+            if (PayloadSize < sizeof(MeshTimeSyncPayload) || !IsFromParent) break;
 
-    vTaskDelete(nullptr);
-}
+            MeshTimeSyncPayload Reply{};
+            memcpy(&Reply, Payload, sizeof(Reply));
+            Clock.OnReply(Reply, esp_timer_get_time());
+            break;
+        }
 
-void AccessPointStation::TransmitTask(void* pvParameters)
-{
-    uint8_t localBuf[1500];
-    int localLen = 0;
+        // A leaf has no children, the subtree broadcast ends here
+        case PACKET_TYPE_CYCLE_MARKER:
+        {
+            if (Header.ForwardingMode != MESH_FORWARD_SUBTREE || PayloadSize < sizeof(MeshCycleMarker)) break;
+            MeshCycleMarker Marker{};
+            memcpy(&Marker, Payload, sizeof(Marker));
+            Clock.OnCycleMarker(Marker);
+            break;
+        }
 
-    TickType_t LastHeartbeat{};
+        case PACKET_TYPE_OTA_BEGIN:
+            if (Header.ForwardingMode == MESH_FORWARD_SUBTREE) Ota.OnBegin(Payload, PayloadSize);
+            break;
 
-    while(true)
-    {
-        bool Send = false;
+        case PACKET_TYPE_OTA_CHUNK:
+            if (Header.ForwardingMode == MESH_FORWARD_SUBTREE) Ota.OnChunk(Payload, PayloadSize);
+            break;
 
-        portENTER_CRITICAL(&ApStaClassInstance->TxCriticalSection);
+        case PACKET_TYPE_OTA_COMMIT:
+            if (Header.ForwardingMode == MESH_FORWARD_SUBTREE) Ota.OnCommit(Payload, PayloadSize);
+            break;
 
-        if (ApStaClassInstance->PreparedTxLength > 0)
+        // Routed down by UID from the parent, only the node named in destinationUid acts on it
+        case PACKET_TYPE_PREFERRED_PARENT:
         {
-            localLen = ApStaClassInstance->PreparedTxLength;
-            memcpy(localBuf, ApStaClassInstance->PreparedTxPacket, localLen);
-            ApStaClassInstance->PreparedTxLength = 0;
-            memset(ApStaClassInstance->PreparedTxPacket, 0, sizeof(ApStaClassInstance->PreparedTxPacket));
+            if (Header.ForwardingMode != MESH_FORWARD_DOWNSTREAM || Header.destinationUid != WifiFactory::GetNodeUid() || !IsFromParent) break;
+            if (PayloadSize < sizeof(MeshPreferredParent)) break;
 
-            Send = true;
+            PostLeafEvent(MeshEventType::PreferredParent, Payload, sizeof(MeshPreferredParent));
+            break;
         }
 
-        portEXIT_CRITICAL(&ApStaClassInstance->TxCriticalSection);
+        case PACKET_TYPE_ROUTE_WITHDRAWN:
+            if (IsFromParent) PostLeafEvent(MeshEventType::RouteWithdrawn);
+            break;
 
-        if (Send)
-        {
-            Send = false;
-            sockaddr_in Destination{};
-            Destination.sin_family = AF_INET;
-            Destination.sin_port   = htons(ApStaClassInstance->UdpPort);
+        // Restarts the node, so only when addressed to this node by UID, never on a broadcast
+        case PACKET_TYPE_PROMOTE:
+            if (!IsFromParent || Header.ForwardingMode != 1 || Header.destinationUid != WifiFactory::GetNodeUid()) break;
+            Promote("Promote packet received");
+            break;
 
-            if (ApStaClassInstance->IsMasterFound) inet_pton(AF_INET, "192.168.0.254", &Destination.sin_addr);
-            else inet_pton(AF_INET, ApStaClassInstance->ParentDevice.IpAddress, &Destination.sin_addr);
+        default:
+            if (MeshHoldCommand(Commands, Clock, Data, PayloadSize)) break;
+            if (Length > (int)sizeof(RxData)) break;
 
-            sendto(ApStaClassInstance->UdpSocket,
-                   localBuf,
-                   localLen,
-                   0,
-                   (const sockaddr*)&Destination,
-                   sizeof(Destination));
-        }
+            portENTER_CRITICAL(&CriticalSection);
+            memcpy(RxData, Data, Length);
+            LastPositionWritten = (uint16_t)Length;
+            portEXIT_CRITICAL(&CriticalSection);
+            break;
+    }
+}
 
-        vTaskDelay(pdMS_TO_TICKS(1));
+
+
+void Station::UdpRxTask(void* pvParameters)
+{
+    uint8_t ReceiveBuffer[1500];
+
+    while (true)
+    {
+        sockaddr_in SourceAddress{};
+        socklen_t AddressLength = sizeof(SourceAddress);
+
+        int ReceivedBytes = recvfrom(StaClassInstance->UdpSocket,
+                                     ReceiveBuffer,
+                                     sizeof(ReceiveBuffer),
+                                     0,
+                                     (sockaddr*)&SourceAddress,
+                                     &AddressLength);
+
+        if (ReceivedBytes > 0) StaClassInstance->ProcessPacket(ReceiveBuffer, ReceivedBytes, SourceAddress);
+
+        vTaskDelay(1);
     }
 
     vTaskDelete(nullptr);
@@ -1030,282 +4221,256 @@ void AccessPointStation::TransmitTask(void* pvParameters)
 
 
 
-bool AccessPointStation::StartUdp(uint16_t Port, uint8_t Core)
+bool Station::StartUdp(uint16_t Port, uint8_t Core)
 {
-    if (ApStaClassInstance->UdpStarted) return true;
-    
-    // We only start UDP if we have an IP (either as an AP or a STA)
-    if (!ApStaClassInstance->IsConnectedToParent && ApStaClassInstance->ChildDevices.empty()) 
-    {
-        if (!ApStaClassInstance->ApIpAcquired) return false;
-    }
-    
-    if (Port == 0) return false;
+    if (UdpStarted) return true;
+    if (!ApIpAcquired || Port == 0) return false;
 
-    // Create socket
-    ApStaClassInstance->UdpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-    if (ApStaClassInstance->UdpSocket < 0)
+    UdpSocket = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
+    if (UdpSocket < 0)
     {
-        ApStaClassInstance->UdpSocket = -1;
+        UdpSocket = -1;
         return false;
     }
 
-    // Bind
     sockaddr_in addr;
     memset(&addr, 0, sizeof(addr));
     addr.sin_family = AF_INET;
     addr.sin_port = htons(Port);
-    addr.sin_addr.s_addr = htonl(INADDR_ANY); // Listens on both AP and STA interfaces
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
 
-    if (bind(ApStaClassInstance->UdpSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+    if (bind(UdpSocket, (struct sockaddr*)&addr, sizeof(addr)) != 0)
     {
-        close(ApStaClassInstance->UdpSocket);
-        ApStaClassInstance->UdpSocket = -1;
+        close(UdpSocket);
+        UdpSocket = -1;
         return false;
     }
 
-    // Socket Timeout (Essential for the RX task loop to breathe)
     timeval tv;
     tv.tv_sec = 0;
-    tv.tv_usec = 10000; // Increased to 10ms for better CPU efficiency in dual-mode
-    setsockopt(ApStaClassInstance->UdpSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
-
-    if (ApStaClassInstance->ReceiveTaskHandle != nullptr) 
-    {
-        vTaskDelete(ApStaClassInstance->ReceiveTaskHandle);
-        ApStaClassInstance->ReceiveTaskHandle = nullptr;
-    }
-
-    if (ApStaClassInstance->TransmitTaskHandle != nullptr) 
-    {
-        vTaskDelete(ApStaClassInstance->TransmitTaskHandle);
-        ApStaClassInstance->TransmitTaskHandle = nullptr;
-    }
+    tv.tv_usec = 10000;
+    setsockopt(UdpSocket, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
 
-    if (xTaskCreatePinnedToCore(&AccessPointStation::ReceiveTask,
-                                "ApStaUdpRx",
+    // One task is enough, a leaf never forwards
+    if (xTaskCreatePinnedToCore(&Station::UdpRxTask,
+                                "StaUdpRx",
                                 4096,
                                 nullptr,
                                 5,
-                                &ApStaClassInstance->ReceiveTaskHandle,
+                                &UdpRxTaskHandle,
                                 Core) != pdPASS)
     {
-        close(ApStaClassInstance->UdpSocket);
-        ApStaClassInstance->UdpSocket = -1;
-        ApStaClassInstance->ReceiveTaskHandle = nullptr;
+        close(UdpSocket);
+        UdpSocket = -1;
+        UdpRxTaskHandle = nullptr;
         return false;
     }
 
-    if (xTaskCreatePinnedToCore(&AccessPointStation::TransmitTask,
-                                "ApStaUdpTx",
-                                4096,
-                                nullptr,
-                                5,
-                                &ApStaClassInstance->TransmitTaskHandle,
-                                Core) != pdPASS)
-    {
-        close(ApStaClassInstance->UdpSocket);
-        ApStaClassInstance->UdpSocket = -1;
-        ApStaClassInstance->TransmitTaskHandle = nullptr;
-        return false;
-    }
+    UdpStarted = true;
+    if (IsRuntimeLoggingEnabled) ESP_LOGI("UDP", "Leaf receive task started on Port %d", Port);
 
-    ApStaClassInstance->UdpStarted = true;
-    if (ApStaClassInstance->IsRuntimeLoggingEnabled) ESP_LOGI("UDP", "Transmit and Receive tasks started on Port %d", Port);
-    
     return true;
 }
 
-bool AccessPointStation::StopUdp()
+
+
+bool Station::StopUdp()
 {
-    if (!ApStaClassInstance->UdpStarted) return true;
+    if (!UdpStarted) return true;
 
-    ApStaClassInstance->UdpStarted = false;
+    UdpStarted = false;
 
-    if (ApStaClassInstance->ReceiveTaskHandle != nullptr)
+    if (UdpRxTaskHandle != nullptr)
     {
-        vTaskDelete(ApStaClassInstance->ReceiveTaskHandle);
-        vTaskDelete(ApStaClassInstance->TransmitTaskHandle);
-        ApStaClassInstance->ReceiveTaskHandle = nullptr;
-        ApStaClassInstance->TransmitTaskHandle = nullptr;
+        vTaskDelete(UdpRxTaskHandle);
+        UdpRxTaskHandle = nullptr;
     }
 
-    if (ApStaClassInstance->UdpSocket >= 0)
+    if (UdpSocket >= 0)
     {
-        // shutdown() ensures all pending sends/receives are terminated
-        shutdown(ApStaClassInstance->UdpSocket, SHUT_RDWR);
-        close(ApStaClassInstance->UdpSocket);
-        ApStaClassInstance->UdpSocket = -1;
+        shutdown(UdpSocket, SHUT_RDWR);
+        close(UdpSocket);
+        UdpSocket = -1;
     }
 
-    if (ApStaClassInstance->IsRuntimeLoggingEnabled)
-    {
-        ESP_LOGW("UDP", "Transmit and Receive tasks Stopped");
-    }
+    if (IsRuntimeLoggingEnabled) ESP_LOGW("UDP", "Leaf receive task stopped");
 
     return true;
 }
 
 
 
-bool AccessPointStation::SetupWifi()
+bool Station::SetupWifi()
 {
-    switch (SetupState) 
+    // Same steps as the relay without the AP interface, AP config and beacon IE
+    while (SetupState != 100)
     {
-        case 0: // NVS
-            Error = nvs_flash_init();
-            if (Error == ESP_ERR_NVS_NO_FREE_PAGES || Error == ESP_ERR_NVS_NEW_VERSION_FOUND)
-            {
-                if (nvs_flash_erase() != ESP_OK) return false;
+        switch (SetupState)
+        {
+            case 0: // NVS
                 Error = nvs_flash_init();
-            }
-            if (Error != ESP_OK) return false;
-            SetupState++;
-            break;
+                if (Error == ESP_ERR_NVS_NO_FREE_PAGES || Error == ESP_ERR_NVS_NEW_VERSION_FOUND)
+                {
+                    if (nvs_flash_erase() != ESP_OK) return false;
+                    Error = nvs_flash_init();
+                }
+                if (Error != ESP_OK) return false;
+                SetupState++;
+                break;
 
 
 
-        case 1: // Netif Core
-            if (esp_netif_init() != ESP_OK) return false;
-            SetupState++;
-            break;
+            case 1: // Netif Core
+                if (esp_netif_init() != ESP_OK) return false;
+                SetupState++;
+                break;
 
 
 
-        case 2: // Event loop
-            if (esp_event_loop_create_default() != ESP_OK) return false;
-            SetupState++;
-            break;
+            case 2: // Event loop
+                if (esp_event_loop_create_default() != ESP_OK) return false;
+                SetupState++;
+                break;
 
 
 
-        case 3: // Create Dual Interfaces
-            ApStaClassInstance->StaNetif = esp_netif_create_default_wifi_sta();
-            ApStaClassInstance->ApNetif = esp_netif_create_default_wifi_ap();
-            if (ApStaClassInstance->StaNetif == nullptr || ApStaClassInstance->ApNetif == nullptr) return false;
-            SetupState++;
-            break;
+            case 3: // STA interface only
+                StaNetif = esp_netif_create_default_wifi_sta();
+                if (StaNetif == nullptr) return false;
+                SetupState++;
+                break;
 
 
 
-        case 4: // Wi-Fi init
-            if (esp_wifi_init(&WifiDriverConfig) != ESP_OK) return false;
-            SetupState++;
-            break;
+            case 4: // Wi-Fi init
+                if (esp_wifi_init(&WifiDriverConfig) != ESP_OK) return false;
+                SetupState++;
+                break;
 
 
 
-        case 5: // Country
-            memcpy(WifiCountry.cc, "GB", 2);
-            WifiCountry.schan = 1;
-            WifiCountry.nchan = 13;
-            WifiCountry.policy = WIFI_COUNTRY_POLICY_AUTO;
-            if (esp_wifi_set_country(&WifiCountry) != ESP_OK) return false;
-            SetupState++;
-            break;
+            case 5: // Country
+                memcpy(WifiCountry.cc, "GB", 2);
+                WifiCountry.schan = 1;
+                WifiCountry.nchan = 13;
+                WifiCountry.policy = WIFI_COUNTRY_POLICY_AUTO;
+                if (esp_wifi_set_country(&WifiCountry) != ESP_OK) return false;
+                SetupState++;
+                break;
 
 
 
-        case 6: // Register the 3 Handlers
-            // 1. Station WiFi Handler
-            esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
-                                                &AccessPointStation::StaWifiEventHandler, nullptr, nullptr);
-            // 2. AP WiFi Handler
-            esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
-                                                &AccessPointStation::ApWifiEventHandler, nullptr, nullptr);
-            // 3. Consolidated IP Handler
-            esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID,
-                                                &AccessPointStation::IpEventHandler, nullptr, nullptr);
-            SetupState++;
-            break;
+            case 6: // Leaf event queue and task, link, promotion and backfill timers, then register the handlers
+                if (LeafEventQueue == nullptr) LeafEventQueue = xQueueCreate(MESH_EVENT_QUEUE_LENGTH, sizeof(MeshEvent));
+                if (LeafEventQueue == nullptr) return false;
 
+                if (LeafTaskHandle == nullptr &&
+                    xTaskCreatePinnedToCore(&Station::LeafTask, "LeafTask", 4096, this, 5, &LeafTaskHandle, UdpCore) != pdPASS)
+                {
+                    LeafTaskHandle = nullptr;
+                    return false;
+                }
 
+                if (LinkTimer == nullptr)
+                {
+                    esp_timer_create_args_t TimerArgs = {};
+                    TimerArgs.callback = &Station::LinkTimerCallback;
+                    TimerArgs.arg = this;
+                    TimerArgs.name = "LeafLink";
+                    if (esp_timer_create(&TimerArgs, &LinkTimer) != ESP_OK) return false;
+                }
 
-        case 7: // Configure AP + STA settings
-            memset(&StaWifiServiceConfig, 0, sizeof(wifi_config_t));
-            memset(&ApWifiServiceConfig, 0, sizeof(wifi_config_t));
+                if (PromoteTimer == nullptr)
+                {
+                    esp_timer_create_args_t TimerArgs = {};
+                    TimerArgs.callback = &Station::PromoteTimerCallback;
+                    TimerArgs.arg = this;
+                    TimerArgs.name = "LeafPromote";
+                    if (esp_timer_create(&TimerArgs, &PromoteTimer) != ESP_OK) return false;
+                }
 
-            // STATION: master credentials
-            strncpy((char*)StaWifiServiceConfig.sta.ssid, PARENT_SSID, 31);
-            strncpy((char*)StaWifiServiceConfig.sta.password, PARENT_PASS, 63);
+                if (BackfillTimer == nullptr)
+                {
+                    esp_timer_create_args_t TimerArgs = {};
+                    TimerArgs.callback = &Station::BackfillTimerCallback;
+                    TimerArgs.arg = this;
+                    TimerArgs.name = "LeafBackfill";
+                    if (esp_timer_create(&TimerArgs, &BackfillTimer) != ESP_OK) return false;
+                }
 
-            // Set PMF to capable (standard for WPA2)
-            StaWifiServiceConfig.sta.pmf_cfg.capable = true;
-            StaWifiServiceConfig.sta.pmf_cfg.required = false;
+                esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                                    &Station::WifiEventHandler, nullptr, nullptr);
+                esp_event_handler_instance_register(IP_EVENT, ESP_EVENT_ANY_ID,
+                                                    &Station::IpEventHandler, nullptr, nullptr);
+                SetupState++;
+                break;
 
-            ApWifiServiceConfig.ap.pmf_cfg.capable = true;
-            ApWifiServiceConfig.ap.pmf_cfg.required = false;
 
-            // ACCESS POINT: Dynamic naming
-            snprintf((char*)ApWifiServiceConfig.ap.ssid, sizeof(ApWifiServiceConfig.ap.ssid), 
-                    "node%d", CONFIG_ESP_NODE_UID);
-                
-            ApWifiServiceConfig.ap.ssid_len = strlen((char*)ApWifiServiceConfig.ap.ssid);
 
-            // Ensure password is set and is at least 8 characters
-            strncpy((char*)ApWifiServiceConfig.ap.password, MY_PASS, 63);
+            case 7: // STA config, the parent is chosen from the first scan
+                memset(&WifiServiceConfig, 0, sizeof(wifi_config_t));
+                strncpy((char*)WifiServiceConfig.sta.ssid, PARENT_SSID, 31);
+                strncpy((char*)WifiServiceConfig.sta.password, PARENT_PASS, 63);
+                WifiServiceConfig.sta.pmf_cfg.capable = true;
+                WifiServiceConfig.sta.pmf_cfg.required = false;
+                SetupState++;
+                break;
 
-            ApWifiServiceConfig.ap.max_connection = MAX_STA_CONN; 
-            
-            ApWifiServiceConfig.ap.authmode = WIFI_AUTH_WPA2_PSK;
-            ApWifiServiceConfig.ap.channel = 6; 
-            SetupState++;
-            break;
 
 
+            case 8: // Set mode to STA
+                if (esp_wifi_set_mode(WIFI_MODE_STA) != ESP_OK) return false;
+                SetupState++;
+                break;
 
-        case 8: // Set mode to APSTA
-            if (esp_wifi_set_mode(WIFI_MODE_APSTA) != ESP_OK) return false;
-            SetupState++;
-            break;
 
 
+            case 9: // Apply config
+                if (esp_wifi_set_config(WIFI_IF_STA, &WifiServiceConfig) != ESP_OK) return false;
+                SetupState++;
+                break;
 
-        case 9: // Apply Configs to specific interfaces
-            if (esp_wifi_set_config(WIFI_IF_STA, &StaWifiServiceConfig) != ESP_OK) return false;
-            if (esp_wifi_set_config(WIFI_IF_AP, &ApWifiServiceConfig) != ESP_OK) return false;
-            SetupState++;
-            break;
 
 
+            case 10: // Register callback for vendor information
+                if (esp_wifi_set_vendor_ie_cb(WifiVendorIeCb, this) != ESP_OK) return false;
+                SetupState++;
+                break;
 
-        case 10: // Register callbacks for vendor information
-        if (esp_wifi_set_vendor_ie_cb(WifiVendorIeCb, this) != ESP_OK) return false;
-            SetupState++;
-            break;
 
 
+            case 11: // Start Wi-Fi, STA_START kicks off the first scan
+                if (esp_wifi_start() != ESP_OK) return false;
+                if (esp_timer_start_periodic(LinkTimer, (uint64_t)MESH_HEARTBEAT_PERIOD_MS * 1000) != ESP_OK) return false;
+                if (esp_timer_start_once(BackfillTimer, (uint64_t)MESH_HEARTBEAT_PERIOD_MS * 1000) != ESP_OK) return false;
+                SetupState = 100;
+                break;
 
-        case 11: // Start Wi-Fi & Initial Beacon
-            if (esp_wifi_start() != ESP_OK) return false;
-            
-            vTaskDelay(pdMS_TO_TICKS(100));
 
-            // Start by advertising "Inifinity" hop until we get an IP
-            ApStaClassInstance->UpdateBeaconMetadata(255, 0);
 
-            // Create the Mesh Management Task
-            xTaskCreatePinnedToCore
-            (
-                &AccessPointStation::MeshTask,   // Function pointer
-                "MeshTask",                      // Task name
-                4096,                            // Stack size
-                this,                            // Pass 'this' as pvParameters
-                5,                               // Priority (Medium)
-                &MeshTaskHandle,                 // Task handle
-                UdpCore                          // Use the core assigned in constructor
-            );
-            SetupState = 100;
-            break;
+            default:
+                return false;
+        }
+    }
 
+    if (!SystemInitialized)
+    {
+        SystemInitialized = true;
+        if (IsRuntimeLoggingEnabled) ESP_LOGI(LEAF_TAG, "Leaf WiFi setup complete");
 
-            
-        case 100:
-            SystemInitialized = true;
-            break;
+        if (!Ota.Start(UdpCore, WifiFactory::GetNodeUid(), &Station::OtaStatusSender, &Station::OtaBeforeRestart, IsRuntimeLoggingEnabled))
+        {
+            ESP_LOGE(LEAF_TAG, "Mesh firmware updates unavailable");
+        }
+
+        if (MESH_STORE_FORWARD_BYTES > 0 && 
+            !Backlog.Init(MESH_STORE_FORWARD_BYTES, MESH_BACKFILL_BYTES_PER_S, MESH_STORE_FORWARD_IN_PSRAM, &Station::BackfillSender))
+        {
+            ESP_LOGE(LEAF_TAG, "No memory for the store-and-forward buffer, data sent during an outage is lost");
+        }
     }
 
-    return (SetupState == 100);
+    return true;
 }
 
 
@@ -1323,29 +4488,30 @@ bool AccessPointStation::SetupWifi()
 
 #define FACTORY_TAG "Factory"
 
-// Station* WifiFactory::CreateStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging)
-// {
-//     if (StaClassInstance != nullptr)
-//     {
-//         return StaClassInstance;
-//     }
+Station* WifiFactory::CreateStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging)
+{
+    if (StaClassInstance != nullptr)
+    {
+        return StaClassInstance;
+    }
 
-//     if (ApStaClassInstance != nullptr) // Placeholder for access point and ApSta pointers
-//     {
-//         return nullptr;
-//     }
+    if (ApStaClassInstance != nullptr) // Both own the WiFi driver
+    {
+        return nullptr;
+    }
 
-//     StaClassInstance = new Station(CoreToUse, UdpPort, EnableRuntimeLogging);
+    GetNodeUid(); // Loaded before any task can build a packet
+    StaClassInstance = new Station(CoreToUse, UdpPort, EnableRuntimeLogging);
 
-//     if (StaClassInstance == nullptr)
-//     {
-//         ESP_LOGE(FACTORY_TAG, "Failed to create Station instance!");
-//         return nullptr;
-//     }
+    if (StaClassInstance == nullptr)
+    {
+        ESP_LOGE(FACTORY_TAG, "Failed to create Station instance!");
+        return nullptr;
+    }
 
-//     ESP_LOGW(FACTORY_TAG, "Station instance created successfully");
-//     return StaClassInstance;
-// }
+    ESP_LOGW(FACTORY_TAG, "Station instance created successfully");
+    return StaClassInstance;
+}
 
 AccessPointStation* WifiFactory::CreateAccessPointStation(uint8_t CoreToUse, uint16_t UdpPort, bool EnableRuntimeLogging)
 {
@@ -1354,12 +4520,12 @@ AccessPointStation* WifiFactory::CreateAccessPointStation(uint8_t CoreToUse, uin
         return ApStaClassInstance;
     }
 
-    if (false)
-    //if (StaClassInstance != nullptr) // Placeholder for access point and ApSta pointers
+    if (StaClassInstance != nullptr) // Both own the WiFi driver
     {
         return nullptr;
     }
 
+    GetNodeUid(); // The constructor builds the ancestor digest from it
     ApStaClassInstance = new AccessPointStation(CoreToUse, UdpPort, EnableRuntimeLogging);
 
     if (ApStaClassInstance == nullptr)
@@ -1370,4 +4536,113 @@ AccessPointStation* WifiFactory::CreateAccessPointStation(uint8_t CoreToUse, uin
 
     ESP_LOGW(FACTORY_TAG, "AccessPointStation instance created successfully");
     return ApStaClassInstance;
-}
\ No newline at end of file
+}
+
+
+
+// The factory runs before SetupWifi, so NVS may not be up yet
+static bool MeshInitNvs()
+{
+    esp_err_t Error = nvs_flash_init();
+    if (Error == ESP_ERR_NVS_NO_FREE_PAGES || Error == ESP_ERR_NVS_NEW_VERSION_FOUND)
+    {
+        nvs_flash_erase();
+        Error = nvs_flash_init();
+    }
+    return Error == ESP_OK;
+}
+
+
+
+MeshRole WifiFactory::GetConfiguredRole()
+{
+    // Wired to the host, never changed at runtime
+#ifdef CONFIG_ESP_ROOT_GATEWAY
+    return MeshRole::Root;
+#endif
+
+#ifdef CONFIG_ESP_LEAF_NODE
+    MeshRole Role = MeshRole::Leaf;
+#else
+    MeshRole Role = MeshRole::Relay;
+#endif
+
+    if (!MeshInitNvs()) return Role;
+
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READONLY, &Handle) != ESP_OK) return Role;
+
+    uint8_t Stored = 0;
+    if (nvs_get_u8(Handle, MESH_NVS_ROLE_KEY, &Stored) == ESP_OK && Stored <= (uint8_t)MeshRole::Leaf)
+    {
+        Role = (MeshRole)Stored;
+    }
+    nvs_close(Handle);
+
+    return Role;
+}
+
+
+
+uint64_t WifiFactory::GetNodeUid()
+{
+    // Read once, before the first class is created, and constant after that
+    static uint64_t NodeUid = 0;
+    if (NodeUid != 0) return NodeUid;
+
+    const uint64_t BuildUid = (uint64_t)CONFIG_ESP_NODE_UID;
+    uint64_t StoredUid = 0;
+
+    nvs_handle_t Handle;
+    if (!MeshInitNvs() || nvs_open(MESH_NVS_NAMESPACE, NVS_READWRITE, &Handle) != ESP_OK)
+    {
+        NodeUid = (BuildUid != 0) ? BuildUid : 1;
+        return NodeUid;
+    }
+
+    nvs_get_u64(Handle, MESH_NVS_UID_KEY, &StoredUid);
+
+    if (BuildUid != 0) NodeUid = BuildUid;
+    else if (StoredUid != 0) NodeUid = StoredUid;
+    else
+    {
+        // Never had a UID, the STA MAC is unique and stays the same across images
+        uint8_t Mac[6]{};
+        esp_read_mac(Mac, ESP_MAC_WIFI_STA);
+        for (int i = 0; i < 6; i++) NodeUid = (NodeUid << 8) | Mac[i];
+    }
+
+    if (StoredUid != NodeUid && nvs_set_u64(Handle, MESH_NVS_UID_KEY, NodeUid) == ESP_OK) nvs_commit(Handle);
+    nvs_close(Handle);
+
+    return NodeUid;
+}
+
+
+
+bool WifiFactory::SetConfiguredRole(MeshRole Role, bool IsPromotion)
+{
+    nvs_handle_t Handle;
+    if (nvs_open(MESH_NVS_NAMESPACE, NVS_READWRITE, &Handle) != ESP_OK) return false;
+
+    bool IsStored = nvs_set_u8(Handle, MESH_NVS_ROLE_KEY, (uint8_t)Role) == ESP_OK && 
+                    nvs_set_u8(Handle, MESH_NVS_PROMOTED_KEY, IsPromotion ? 1 : 0) == ESP_OK && 
+                    nvs_commit(Handle) == ESP_OK;
+    nvs_close(Handle);
+
+    return IsStored;
+}
+
+
+
+bool WifiFactory::IsPromotedRole()
+{
+    nvs_handle_t Handle;
+    if (!MeshInitNvs() || nvs_open(MESH_NVS_NAMESPACE, NVS_READONLY, &Handle) != ESP_OK) return false;
+
+    uint8_t Promoted = 0;
+    nvs_get_u8(Handle, MESH_NVS_PROMOTED_KEY, &Promoted);
+    nvs_close(Handle);
+
+    return Promoted != 0;
+}
@@ -4,6 +4,7 @@
 #include "GpioClass.h"
 #include "TimerClass.h"
 #include "WifiClass.h"
+#include "SerialClass.h"
 #include "UtilitiesClass.h"
 #include "packet_processors.h"
 #include "tests.h"
@@ -30,15 +31,77 @@ AccessPointStation* WifiApSta = nullptr;
 uint64_t Uid = CONFIG_ESP_NODE_UID;
 uint8_t MainState = 0;
 uint64_t CyclicCalls = 0;
+uint64_t SlowCalls = 0;
+uint64_t CommandsApplied = 0;
+bool IsLedCommanded = false;
 uint8_t CyclicState = 0;
 uint8_t TestFails = 0;
 
 
+
+// Exactly one of WifiSta / WifiApSta exists, depending on the configured role
+static bool IsWifiConnected()
+{
+    return WifiApSta ? WifiApSta->IsConnectedToHost() : WifiSta->IsConnectedToHost();
+}
+
+static uint8_t GetWifiHopCount()
+{
+    return WifiApSta ? WifiApSta->GetHopCount() : WifiSta->GetHopCount();
+}
+
+
+
+// Root gateway glue, the mesh and the serial link only know each other through these
+static bool SendFrameToHost(const uint8_t* Data, size_t Length)
+{
+    return SerialClass::GetInstance().SendFrame(Data, Length);
+}
+
+static void ReceiveFrameFromHost(const uint8_t* Data, size_t Length)
+{
+    WifiApSta->InjectFromHost(Data, Length);
+}
+
+
+
+#ifdef CONFIG_ESP_CYCLE_PHASE_LOCK
+// Phase lock glue, the timer only needs the master's period and where a local time falls in its cycle
+static bool GetMasterCyclePhase(int64_t LocalUs, uint32_t& PeriodUs, uint32_t& PhaseUs)
+{
+    uint64_t Cycle = 0;
+    return WifiApSta ? WifiApSta->GetMasterCycle(LocalUs, Cycle, PhaseUs, PeriodUs) :
+                       WifiSta->GetMasterCycle(LocalUs, Cycle, PhaseUs, PeriodUs);
+}
+#endif
+
+
+// The board's one actuator is the onboard LED, a command's first three bytes are its colour.
+// Set from the cyclic task, so every node a command went to changes colour in the same cycle.
+static void ApplyCommand(const MeshCommand& Command)
+{
+    CommandsApplied++;
+    if (Command.Length < 3) return;
+
+    GpioClass::GetInstance().ChangeOnboardLedColour(Command.Data[0], Command.Data[1], Command.Data[2]);
+    IsLedCommanded = true;
+}
+
+
+
 void CyclicTask1(void* pvParameters)
 {
     CyclicCalls++;
 
-    if (!WifiApSta->IsConnectedToHost()) CyclicState = 99;
+    // Commands the master scheduled for this cycle, every node they were sent to takes them in the same one
+    static MeshCommand Command;
+    const int64_t CycleStartUs = TimerClass::GetInstance().GetCycleStartUs();
+    while (WifiApSta ? WifiApSta->TakeDueCommand(CycleStartUs, Command) : WifiSta->TakeDueCommand(CycleStartUs, Command))
+    {
+        ApplyCommand(Command);
+    }
+
+    if (!IsWifiConnected()) CyclicState = 99;
 
     switch(CyclicState)
     {
@@ -54,12 +117,36 @@ void CyclicTask1(void* pvParameters)
 
 
 
+// Released every 100 periods by the scheduler, in whichever phase is least loaded
+void SlowTask1(void* pvParameters)
+{
+    SlowCalls++;
+}
+
+
+
 extern "C" void app_main(void)
 {
 
-    // Init singleton instances
-    //WifiSta = WifiFactory::CreateStation(1, 10050, true);
-    WifiApSta = WifiFactory::CreateAccessPointStation(1, 10050, true);
+    // Init singleton instances, leaf or relay from Kconfig unless a promotion stored a role
+    const MeshRole Role = WifiFactory::GetConfiguredRole();
+    if (Role == MeshRole::Leaf) WifiSta = WifiFactory::CreateStation(1, 10050, true);
+    else WifiApSta = WifiFactory::CreateAccessPointStation(1, 10050, true);
+
+    if (Role == MeshRole::Root)
+    {
+        WifiApSta->EnableRootGateway(SendFrameToHost, SerialClass::GetCapacityBytesPerS());
+        if (!SerialClass::GetInstance().SetupSlipLink(ReceiveFrameFromHost, 1)) ESP_LOGE(TAG, "Root gateway host link failed to start");
+    }
+    Uid = WifiFactory::GetNodeUid(); // Kept across mesh firmware updates, may differ from CONFIG_ESP_NODE_UID
+
+#ifdef CONFIG_ESP_TDMA_SLOTTED_TX
+    // Slots are cut from the cyclic period, which every node shares
+    const bool IsSlotted = WifiApSta ? WifiApSta->EnableSlottedTx(CONFIG_ESP_CYCLIC_TASK_PERIOD, CONFIG_ESP_TDMA_SLOT_COUNT) :
+                                       WifiSta->EnableSlottedTx(CONFIG_ESP_CYCLIC_TASK_PERIOD, CONFIG_ESP_TDMA_SLOT_COUNT);
+    if (!IsSlotted) ESP_LOGW(TAG, "Slotted transmission not used on this node, sending free-for-all");
+#endif
+
     TimerClass::GetInstance();
     GpioClass::GetInstance();
     UtilitiesClass::GetInstance();
@@ -84,28 +171,53 @@ extern "C" void app_main(void)
                 break;
 
 
-            case 2: // Start cyclic task
-                if (TimerClass::GetInstance().SetupCyclicTask(CyclicTask1, 0)) MainState = 3;
+            case 2: // Start cyclic task and the slower scheduled tasks
+            {
+                const TimerTaskConfig Slow = {SlowTask1, nullptr, "Slow Task 1", 100, TIMER_PHASE_AUTO, 0, 500, 5000, 0};
+                if (TimerClass::GetInstance().SetupCyclicTask(CyclicTask1, 0) &&
+                    TimerClass::GetInstance().RegisterTask(Slow)) MainState = 3;
                 else MainState = 99;
+
+#ifdef CONFIG_ESP_JITTER_BENCHMARK
+                static const uint32_t JitterPeriodsUs[] = {50, 100, 1000};
+                static TimerJitterBenchmark Jitter[3];
+                TimerClass::GetInstance().BenchmarkIsrJitter(JitterPeriodsUs, 3, 1000, Jitter);
+#endif
+
+#ifdef CONFIG_ESP_OVERRUN_BENCHMARK
+                static TimerOverrunBenchmark Benchmark[TIMER_OVERRUN_POLICY_COUNT];
+                TimerClass::GetInstance().BenchmarkOverrunPolicies(3000, 5, Benchmark);
+#endif
+
+#ifdef CONFIG_ESP_CYCLE_PHASE_LOCK
+                // Acquires once the clock is synchronised and the first cycle marker is in
+                if (MainState == 3) TimerClass::GetInstance().SetPhaseReference(GetMasterCyclePhase);
+#endif
                 break;
+            }
 
 
             case 3: // Connect to wifi
                 GpioClass::GetInstance().ChangeOnboardLedColour(255, 165, 0);
-                WifiApSta->SetupWifi();
-                if (WifiApSta->IsConnectedToHost()) MainState = 4;
+                if (WifiApSta) WifiApSta->SetupWifi();
+                else WifiSta->SetupWifi();
+                if (IsWifiConnected()) MainState = 4;
                 break;
 
 
             case 4: // Normal operation
 
-                if(WifiApSta->GetHopCount() == 1) GpioClass::GetInstance().ChangeOnboardLedColour(0, 255, 0);
-                if(WifiApSta->GetHopCount() == 2) GpioClass::GetInstance().ChangeOnboardLedColour(0, 200, 50);
-                if(WifiApSta->GetHopCount() == 3) GpioClass::GetInstance().ChangeOnboardLedColour(0, 150, 100);
-                if(WifiApSta->GetHopCount() == 4) GpioClass::GetInstance().ChangeOnboardLedColour(0, 50, 200);
-                if(WifiApSta->GetHopCount() == 5) GpioClass::GetInstance().ChangeOnboardLedColour(0, 0, 255);
+                // Hop colours until the master takes the LED over
+                if (!IsLedCommanded)
+                {
+                    if(GetWifiHopCount() == 1) GpioClass::GetInstance().ChangeOnboardLedColour(0, 255, 0);
+                    if(GetWifiHopCount() == 2) GpioClass::GetInstance().ChangeOnboardLedColour(0, 200, 50);
+                    if(GetWifiHopCount() == 3) GpioClass::GetInstance().ChangeOnboardLedColour(0, 150, 100);
+                    if(GetWifiHopCount() == 4) GpioClass::GetInstance().ChangeOnboardLedColour(0, 50, 200);
+                    if(GetWifiHopCount() == 5) GpioClass::GetInstance().ChangeOnboardLedColour(0, 0, 255);
+                }
 
-                if (not WifiApSta->IsConnectedToHost()) MainState = 3;
+                if (not IsWifiConnected()) MainState = 3;
                 else
                 {
                     float temp = UtilitiesClass::GetInstance().GetChipTemperatureC();
@@ -120,15 +232,199 @@ extern "C" void app_main(void)
 
                     printf(BOLD GREEN "│" RESET "  " BOLD "SYSTEM METRICS" RESET "              " BOLD GREEN "│" RESET "  " BOLD "NETWORK STATUS" RESET "             " BOLD GREEN "│" RESET "\n");
                     printf(BOLD GREEN "│" RESET "  Uptime: " CYAN "%8llu ms" RESET "         " BOLD GREEN "│" RESET "  RSSI:     " YELLOW "%7.2f dBm" RESET "      " BOLD GREEN "│" RESET "\n", uptime, rssi);
-                    printf(BOLD GREEN "│" RESET "  Heap:   " CYAN "%8zu B " RESET "         " BOLD GREEN "│" RESET "  My IP:  " GREEN "%15s" RESET "    " BOLD GREEN "│" RESET "\n", heap, WifiApSta->GetMyIpAddress());
-                    printf(BOLD GREEN "│" RESET "  Temp:   " CYAN "%8.2f C " RESET "         " BOLD GREEN "│" RESET "  GW IP: " GREEN "%15s" RESET "     " BOLD GREEN "│" RESET "\n", temp, WifiApSta->GetParentIpAddress());
-                    printf(BOLD GREEN "│" RESET "                              " BOLD GREEN "│" RESET "  Hop Count: " YELLOW "%-5i" RESET "           " BOLD GREEN "│" RESET "\n", WifiApSta->GetHopCount());
-                    printf(BOLD GREEN "│" RESET "                              " BOLD GREEN "│" RESET "  Children Count: " YELLOW "%zu" RESET "          " BOLD GREEN "│" RESET "\n", WifiApSta->GetNumChildren());
-
-                    printf(BOLD GREEN "├──────────────────────────────┴─────────────────────────────┤" RESET "\n");
+                    printf(BOLD GREEN "│" RESET "  Heap:   " CYAN "%8zu B " RESET "         " BOLD GREEN "│" RESET "  My IP:  " GREEN "%15s" RESET "    " BOLD GREEN "│" RESET "\n", heap, WifiApSta ? WifiApSta->GetMyIpAddress() : WifiSta->GetMyIpAddress());
+                    printf(BOLD GREEN "│" RESET "  Temp:   " CYAN "%8.2f C " RESET "         " BOLD GREEN "│" RESET "  GW IP: " GREEN "%15s" RESET "     " BOLD GREEN "│" RESET "\n", temp, WifiApSta ? WifiApSta->GetParentIpAddress() : WifiSta->GetGatewayIpAddress());
+                    printf(BOLD GREEN "│" RESET "                              " BOLD GREEN "│" RESET "  Hop Count: " YELLOW "%-5i" RESET "           " BOLD GREEN "│" RESET "\n", GetWifiHopCount());
+                    printf(BOLD GREEN "│" RESET "                              " BOLD GREEN "│" RESET "  Children Count: " YELLOW "%zu" RESET "          " BOLD GREEN "│" RESET "\n", WifiApSta ? WifiApSta->GetNumChildren() : (size_t)0);
+
+                    if (WifiApSta)
+                    {
+                        MeshFailoverStats failover = WifiApSta->GetFailoverStats();
+                        printf(BOLD GREEN "├──────────────────────────────┴─────────────────────────────┤" RESET "\n");
+                        printf(BOLD GREEN "│" RESET "  " BOLD "MESH FAILOVER" RESET "                                             " BOLD GREEN "│" RESET "\n");
+                        printf(BOLD GREEN "│" RESET "  Losses: " YELLOW "%-4lu" RESET " HB Timeouts: " YELLOW "%-4lu" RESET " Withdrawn Rx: " YELLOW "%-4lu" RESET "      " BOLD GREEN "│" RESET "\n",
+                               (unsigned long)failover.ParentLossCount, (unsigned long)failover.HeartbeatTimeouts, (unsigned long)failover.RouteWithdrawalsReceived);
+                        printf(BOLD GREEN "│" RESET "  Detect: " YELLOW "%-6lld ms" RESET " Failover: " YELLOW "%-6lld ms" RESET " Worst: " YELLOW "%-6lld ms" RESET " " BOLD GREEN "│" RESET "\n",
+                               failover.LastDetectionUs / 1000, failover.LastFailoverUs / 1000, failover.WorstFailoverUs / 1000);
+
+                        MeshKeepaliveStats keepalive = WifiApSta->GetKeepaliveStats();
+                        printf(BOLD GREEN "│" RESET "  Keepalives Up: " YELLOW "%-6lu" RESET " Suppressed: " YELLOW "%-6lu" RESET " Saved: " YELLOW "%-7llu B" RESET BOLD GREEN "│" RESET "\n",
+                               (unsigned long)keepalive.UpstreamSent, (unsigned long)keepalive.UpstreamSuppressed, keepalive.UpstreamBytesSaved);
+
+                        MeshEventLatency scanLatency = WifiApSta->GetEventLatency(MeshEventType::ScanDone);
+                        MeshEventLatency lossLatency = WifiApSta->GetEventLatency(MeshEventType::StaDisconnected);
+                        printf(BOLD GREEN "│" RESET "  Event Max: ScanDone " YELLOW "%-7lu us" RESET " Disconnect " YELLOW "%-7lu us" RESET "  " BOLD GREEN "│" RESET "\n",
+                               (unsigned long)scanLatency.MaxUs, (unsigned long)lossLatency.MaxUs);
+
+                        MeshBootStats boot = WifiApSta->GetBootStats();
+                        printf(BOLD GREEN "│" RESET "  Boot (%s): Setup " YELLOW "%-5lld" RESET " IP " YELLOW "%-5lld" RESET " 1st Pkt " YELLOW "%-5lld ms" RESET "   " BOLD GREEN "│" RESET "\n",
+                               boot.IsWarmStart ? "warm" : "cold", boot.SetupDoneUs / 1000, boot.FirstIpUs / 1000, boot.FirstPacketUs / 1000);
+
+                        if (WifiApSta->IsRoot())
+                        {
+                            MeshGatewayStats gateway = WifiApSta->GetGatewayStats();
+                            printf(BOLD GREEN "│" RESET "  Host Link: To " YELLOW "%-8lu" RESET " From " YELLOW "%-8lu" RESET " Dropped " YELLOW "%-6lu" RESET "   " BOLD GREEN "│" RESET "\n",
+                                   (unsigned long)gateway.FramesToHost, (unsigned long)gateway.FramesFromHost, 
+                                   (unsigned long)(gateway.HostFramesDropped + gateway.HostSendFailures));
+                            printf(BOLD GREEN "│" RESET "  Announce: Sent " YELLOW "%-8lu" RESET " Acks " YELLOW "%-8lu" RESET " Host " YELLOW "%-4s" RESET "           " BOLD GREEN "│" RESET "\n",
+                                   (unsigned long)gateway.AnnouncesSent, (unsigned long)gateway.AnnounceAcks, gateway.IsHostAlive ? "up" : "down");
+                        }
+                        printf(BOLD GREEN "│" RESET "  Root: " YELLOW "%-20llu" RESET "                                " BOLD GREEN "│" RESET "\n", WifiApSta->GetRootUid());
+                    }
+                    else
+                    {
+                        MeshKeepaliveStats keepalive = WifiSta->GetKeepaliveStats();
+                        printf(BOLD GREEN "├──────────────────────────────┴─────────────────────────────┤" RESET "\n");
+                        printf(BOLD GREEN "│" RESET "  " BOLD "LEAF NODE" RESET "                                                 " BOLD GREEN "│" RESET "\n");
+                        printf(BOLD GREEN "│" RESET "  Keepalives Up: " YELLOW "%-6lu" RESET " Suppressed: " YELLOW "%-6lu" RESET " Saved: " YELLOW "%-7llu B" RESET BOLD GREEN "│" RESET "\n",
+                               (unsigned long)keepalive.UpstreamSent, (unsigned long)keepalive.UpstreamSuppressed, keepalive.UpstreamBytesSaved);
+                    }
+
+                    LinkQuality parentLink{};
+                    bool hasParentLink = WifiApSta ? WifiApSta->GetParentLinkQuality(parentLink) : WifiSta->GetParentLinkQuality(parentLink);
+                    printf(BOLD GREEN "├────────────────────────────────────────────────────────────┤" RESET "\n");
+                    printf(BOLD GREEN "│" RESET "  " BOLD "LINK QUALITY" RESET "                                              " BOLD GREEN "│" RESET "\n");
+                    if (hasParentLink)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Parent ETX " YELLOW "%5.2f" RESET " Loss " YELLOW "%5.1f%%" RESET " RTT " YELLOW "%6.0f us" RESET " RSSI " YELLOW "%4.0f" RESET "  " BOLD GREEN "│" RESET "\n",
+                               parentLink.Etx, parentLink.LossRate * 100.0f, parentLink.RttUs, parentLink.RssiDbm);
+                    }
+
+                    // Worst child by ETX, the link most likely to need a new parent
+                    LinkQuality links[LINK_TABLE_SIZE];
+                    size_t linkCount = WifiApSta ? WifiApSta->GetLinkQualities(links, LINK_TABLE_SIZE) : 0;
+                    const LinkQuality* worstChild = nullptr;
+                    for (size_t i = 0; i < linkCount; i++)
+                    {
+                        if (!links[i].IsParent && (worstChild == nullptr || links[i].Etx > worstChild->Etx)) worstChild = &links[i];
+                    }
+                    if (worstChild != nullptr)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Worst Child ETX " YELLOW "%5.2f" RESET " Loss " YELLOW "%5.1f%%" RESET " RTT " YELLOW "%6.0f us" RESET "    " BOLD GREEN "│" RESET "\n",
+                               worstChild->Etx, worstChild->LossRate * 100.0f, worstChild->RttUs);
+                    }
+
+                    // Hop error is this node's measured residual against its parent, total adds the parents' errors up to the master
+                    MeshClockStats clock = WifiApSta ? WifiApSta->GetClockStats() : WifiSta->GetClockStats();
+                    if (clock.SamplesApplied > 0)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Clock S" YELLOW "%-3u" RESET " Hop err " YELLOW "%5lu" RESET " us Total " YELLOW "%5lu" RESET " us " YELLOW "%6.1f" RESET " ppm     " BOLD GREEN "│" RESET "\n",
+                               clock.IsSynced ? (unsigned)clock.Stratum : 0u, (unsigned long)clock.JitterUs, (unsigned long)clock.ErrorUs, clock.DriftPpm);
+                    }
+
+                    // Send failures are the stack refusing a packet while the air is busy, compare them across the two modes
+                    MeshTdmaStats slots = WifiApSta ? WifiApSta->GetSlotStats() : WifiSta->GetSlotStats();
+                    if (slots.IsEnabled)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Slot " YELLOW "%2u/%-2u" RESET " Wait " YELLOW "%6.0f" RESET " us Late " YELLOW "%-5lu" RESET " Fail " YELLOW "%lu/%-6lu" RESET "  " BOLD GREEN "│" RESET "\n",
+                               slots.Slot, slots.SlotCount, slots.MeanHoldUs, (unsigned long)slots.LateSlots,
+                               (unsigned long)slots.SendFailures, (unsigned long)slots.FreeSendFailures);
+                    }
+
+                    // Lead is how many cycles the closest command had to spare on arrival, late ones missed their cycle
+                    MeshCommandStats commands = WifiApSta ? WifiApSta->GetCommandStats() : WifiSta->GetCommandStats();
+                    if (commands.Held > 0)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Cmd " YELLOW "%-6lu" RESET " On time " YELLOW "%-6lu" RESET " Late " YELLOW "%-4lu" RESET " Lead min " YELLOW "%+5ld" RESET "        " BOLD GREEN "│" RESET "\n",
+                               (unsigned long)commands.Held, (unsigned long)commands.Applied,
+                               (unsigned long)(commands.AppliedLate + commands.Unscheduled), (long)commands.MinLeadCycles);
+                    }
+
+                    // A child's delivery time is the latency of its slot, the slowest one is shown
+                    const LinkQuality* slowestChild = nullptr;
+                    for (size_t i = 0; i < linkCount; i++)
+                    {
+                        if (!links[i].IsParent && links[i].HasDelivery && (slowestChild == nullptr || links[i].DeliveryUs > slowestChild->DeliveryUs)) slowestChild = &links[i];
+                    }
+                    if (slowestChild != nullptr)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Slowest Child Delivery " YELLOW "%6.0f us" RESET " Max " YELLOW "%7lu us" RESET "       " BOLD GREEN "│" RESET "\n",
+                               slowestChild->DeliveryUs, (unsigned long)slowestChild->MaxDeliveryUs);
+                    }
+
+                    MeshOtaStats ota = WifiApSta ? WifiApSta->GetOtaStats() : WifiSta->GetOtaStats();
+                    if (ota.State != MeshOtaState::Idle && ota.State != MeshOtaState::Disabled)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Firmware %08lx: " YELLOW "%4u/%-4u" RESET " chunks, state " YELLOW "%u" RESET "            " BOLD GREEN "│" RESET "\n",
+                               (unsigned long)ota.ImageId, ota.ReceivedCount, ota.ChunkCount, (unsigned)ota.State);
+                    }
+
+                    StoreForwardStats backlog = WifiApSta ? WifiApSta->GetBacklogStats() : WifiSta->GetBacklogStats();
+                    if (backlog.StoredPackets > 0 || backlog.DroppedOldest > 0)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Backlog " YELLOW "%4zu/%-4zu" RESET " KB " YELLOW "%5lu" RESET " pkts Drop " YELLOW "%-5lu" RESET " Fill " YELLOW "%6lu" RESET " B/s" BOLD GREEN "│" RESET "\n",
+                               backlog.UsedBytes / 1024, backlog.CapacityBytes / 1024, (unsigned long)backlog.StoredPackets,
+                               (unsigned long)backlog.DroppedOldest, (unsigned long)backlog.MeasuredBackfillBytesPerS);
+                    }
+
+                    MeshTopologyStats topology = WifiApSta ? WifiApSta->GetTopologyStats() : WifiSta->GetTopologyStats();
+                    if (topology.PreferenceRemainingMs > 0)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Preferred parent " YELLOW "%-20llu" RESET " for " YELLOW "%6lld" RESET " s        " BOLD GREEN "│" RESET "\n",
+                               topology.PreferredParentUid, topology.PreferenceRemainingMs / 1000);
+                    }
+
+                    if (WifiApSta)
+                    {
+                        MeshAdmissionStats admission = WifiApSta->GetAdmissionStats();
+                        printf(BOLD GREEN "│" RESET "  Child limit " YELLOW "%2u/%-2u" RESET " AP " YELLOW "%2u" RESET " Rejected " YELLOW "%-5lu" RESET " Steered " YELLOW "%-5lu" RESET "  " BOLD GREEN "│" RESET "\n",
+                               admission.ChildLimit, MAX_STA_CONN, admission.ApMaxConnection,
+                               (unsigned long)admission.JoinsRejected, (unsigned long)admission.ChildrenSteered);
+                    }
+
+                    printf(BOLD GREEN "├────────────────────────────────────────────────────────────┤" RESET "\n");
                     printf(BOLD GREEN "│" RESET "  " BOLD "TASK EXECUTION" RESET "                                            " BOLD GREEN "│" RESET "\n");
                     printf(BOLD GREEN "│" RESET "  Cyclic Calls: " YELLOW "%-10llu" RESET "                                  " BOLD GREEN "│" RESET "\n", CyclicCalls);
                     printf(BOLD GREEN "│" RESET "  Cyclic State: " YELLOW "%-5i" RESET "                                       " BOLD GREEN "│" RESET "\n", CyclicState);
+
+                    // Since boot, p99.9 is what the control loop has to be designed for
+                    static TimerCycleStats cycle;
+                    TimerClass::GetInstance().GetCycleStats(cycle, false);
+                    printf(BOLD GREEN "│" RESET "  Wake p99.9 " YELLOW "%5lu" RESET " us Exec p99.9 " YELLOW "%5lu" RESET " us Max " YELLOW "%6lu" RESET " us     " BOLD GREEN "│" RESET "\n",
+                           (unsigned long)cycle.WakeLatency.PercentileUs(0.999f), (unsigned long)cycle.Execution.PercentileUs(0.999f),
+                           (unsigned long)cycle.Execution.MaxUs);
+                    printf(BOLD GREEN "│" RESET "  Jitter p99.9 " YELLOW "%5lu" RESET " us Slack min " YELLOW "%6lu" RESET " us Overruns " YELLOW "%-4lu" RESET "     " BOLD GREEN "│" RESET "\n",
+                           (unsigned long)cycle.PeriodJitter.PercentileUs(0.999f), (unsigned long)cycle.Slack.MinUs, (unsigned long)cycle.Overruns);
+
+                    static TimerAutoTuneStats tune;
+                    TimerClass::GetInstance().GetAutoTuneStats(tune);
+                    printf(BOLD GREEN "│" RESET "  Period " YELLOW "%6lu" RESET " us Worst " YELLOW "%6lu" RESET " us Tune " YELLOW "%-3s" RESET " Changes " YELLOW "%-4lu" RESET " " BOLD GREEN "│" RESET "\n",
+                           (unsigned long)tune.PeriodUs, (unsigned long)tune.WorstResponseUs, tune.IsEnabled ? "on" : "off",
+                           (unsigned long)tune.Changes);
+
+                    // Error is where the last alarm fell against the master's cycle start, p99.9 is over the locked updates
+                    static TimerPhaseLockStats phase;
+                    static const char* const phaseNames[] = {"Off", "Acquire", "Locked", "Holdover"};
+                    TimerClass::GetInstance().GetPhaseLockStats(phase, false);
+                    if (phase.State != TimerPhaseLockState::Off)
+                    {
+                        printf(BOLD GREEN "│" RESET "  Phase " YELLOW "%-8s" RESET " Err " YELLOW "%+6ld" RESET " us p99.9 " YELLOW "%5lu" RESET " us " YELLOW "%+6.1f" RESET " ppm " BOLD GREEN "│" RESET "\n",
+                               phaseNames[(uint8_t)phase.State], (long)phase.PhaseErrorUs,
+                               (unsigned long)phase.PhaseError.PercentileUs(0.999f), phase.RateTrimPpm);
+                    }
+
+                    static TimerOverrunStats overrun;
+                    static const char* const policyNames[TIMER_OVERRUN_POLICY_COUNT] = {"Skip", "CatchUp", "Degraded", "Restart"};
+                    TimerClass::GetInstance().GetOverrunStats(overrun, false);
+                    printf(BOLD GREEN "│" RESET "  Policy " YELLOW "%-8s" RESET " Late max " YELLOW "%6lu" RESET " us Recover max " YELLOW "%6lu" RESET " us " BOLD GREEN "│" RESET "\n",
+                           policyNames[(uint8_t)overrun.Policy], (unsigned long)overrun.Duration.MaxUs,
+                           (unsigned long)overrun.Recovery[(uint8_t)overrun.Policy].MaxUs);
+                    printf(BOLD GREEN "│" RESET "  Skipped " YELLOW "%-5lu" RESET " Caught up " YELLOW "%-5lu" RESET " Degraded " YELLOW "%-3lu" RESET " Restarts " YELLOW "%-3lu" RESET " " BOLD GREEN "│" RESET "\n",
+                           (unsigned long)overrun.SkippedReleases, (unsigned long)overrun.CaughtUpReleases,
+                           (unsigned long)overrun.DegradedEntries, (unsigned long)overrun.Restarts);
+
+                    uint32_t misses = 0, budget = 0, trips = 0;
+                    for (uint8_t i = 0; i < TimerClass::GetInstance().GetScheduledTaskCount(); i++)
+                    {
+                        static TimerTaskStats task;
+                        if (!TimerClass::GetInstance().GetScheduledTaskStats(i, task, false)) continue;
+                        misses += task.DeadlineMisses;
+                        budget += task.BudgetOverruns;
+                        trips += task.WatchdogTrips;
+                    }
+                    printf(BOLD GREEN "│" RESET "  Sched " YELLOW "%u" RESET " Peak " YELLOW "%5lu" RESET " us Miss " YELLOW "%-4lu" RESET " Budget " YELLOW "%-4lu" RESET " WDT " YELLOW "%-4lu" RESET "  " BOLD GREEN "│" RESET "\n",
+                           TimerClass::GetInstance().GetScheduledTaskCount(), (unsigned long)TimerClass::GetInstance().GetPlannedPeakLoadUs(),
+                           (unsigned long)misses, (unsigned long)budget, (unsigned long)trips);
                     printf(BOLD GREEN "└────────────────────────────────────────────────────────────┘" RESET "\n");
                     vTaskDelay(pdMS_TO_TICKS(900));
                 }
@@ -0,0 +1,794 @@
+// Author - Ben Sturdy
+// Host side of the root gateway serial link (Linux).
+//
+//   slip_bridge bridge <serial device> <master ip> [port] [baud]
+//       Forwards every SLIP frame from the root gateway to the master as one UDP
+//       datagram, and every datagram from the master back down the serial link.
+//       The slaveUid in each packet header still identifies the node, so the
+//       master sees per-node traffic without a router in between.
+//
+//   slip_bridge pty-gateway [nodes] [period ms]
+//       Stands in for a root gateway on a pseudo terminal, for testing without
+//       hardware. Prints the pty path, sends a packet from each simulated node
+//       every period, and answers downstream packets addressed to a simulated
+//       node with a packet from that node. The simulated nodes also take part
+//       in firmware updates, dropping about 5% of the chunks each. The gateway
+//       itself announces as root UID 100 once a second, like a real root.
+//
+//   slip_bridge ota <serial device> <image.bin> [baud] [chunk interval ms]
+//       Sends a firmware image to every node through the root gateway. The
+//       image goes down the tree once, then the nodes are polled for their
+//       chunk bitmaps and only the missing chunks are sent again, until every
+//       node has the whole image. Then every node is told to switch to it.
+//
+// Build (from this folder):
+//   g++ -std=c++17 -O2 -Wall -I../components/SerialClassLib/include -o slip_bridge slip_bridge.cpp
+//
+// Test without hardware:
+//   ./slip_bridge pty-gateway 3 100          -> prints e.g. /dev/pts/5
+//   ./slip_bridge bridge /dev/pts/5 127.0.0.1 10050
+//   ./slip_bridge ota /dev/pts/5 build/Implementation1.bin
+
+#include "SlipCodec.h"
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+static const size_t MAX_FRAME_SIZE = 1500;
+static const uint16_t DEFAULT_PORT = 10050;
+static const uint16_t PACKET_START_DELIMITER = 0xB502;
+static const uint16_t PACKET_END_DELIMITER = 0x035B;
+
+// Same values as WifiClass.h and MeshOta.h
+static const uint8_t PACKET_TYPE_OTA_BEGIN = 0xFA;
+static const uint8_t PACKET_TYPE_OTA_CHUNK = 0xF9;
+static const uint8_t PACKET_TYPE_OTA_COMMIT = 0xF8;
+static const uint8_t PACKET_TYPE_OTA_STATUS = 0xF7;
+static const uint8_t PACKET_TYPE_ROOT_ANNOUNCE = 0xF4;
+static const uint8_t FORWARD_UPSTREAM = 2;
+static const uint8_t FORWARD_SUBTREE = 3;
+static const uint16_t OTA_CHUNK_SIZE = 1024;
+static const uint16_t OTA_MAX_CHUNKS = 1024;
+
+// Same layout as PacketHeader in WifiClass.h
+#pragma pack(push, 1)
+struct PacketHeader
+{
+    uint16_t startDelimiter;
+    uint16_t payloadSize;
+    uint32_t reserved0;
+    uint64_t slaveUid;
+    uint64_t destinationUid;
+    uint64_t senderTimestampUs;
+    uint32_t prevCycleTimeUs;
+    uint8_t  chainedSlaveCount;
+    uint8_t  PacketType;
+    uint8_t  flags;
+    uint8_t  headerVersion;
+    uint8_t  networkId;
+    uint8_t  chainDistance;
+    uint8_t  ttl;
+    uint8_t  ForwardingMode;
+    uint32_t crc32;
+};
+#pragma pack(pop)
+static_assert(sizeof(PacketHeader) == 48, "PacketHeader must be 48 bytes");
+
+// Same layouts as MeshOta.h
+#pragma pack(push, 1)
+struct OtaBegin
+{
+    uint32_t ImageId;
+    uint32_t ImageSize;
+    uint32_t ImageCrc;
+    uint16_t ChunkSize;
+    uint16_t ChunkCount;
+};
+
+struct OtaChunkHeader
+{
+    uint32_t ImageId;
+    uint16_t Index;
+    uint16_t Length;
+    uint32_t Crc;
+};
+
+struct OtaCommit
+{
+    uint32_t ImageId;
+    uint16_t RestartDelayMs;
+};
+
+struct OtaStatusHeader
+{
+    uint32_t ImageId;
+    uint16_t ChunkCount;
+    uint16_t ReceivedCount;
+    uint8_t  State;
+};
+
+// Same layout as MeshRootAnnounce in WifiClass.h
+struct RootAnnounce
+{
+    uint16_t PathCost;
+    uint8_t  UplinkLoad;
+    uint8_t  ChildCount;
+    uint32_t FramesToHost;
+};
+#pragma pack(pop)
+
+enum OtaState : uint8_t { OtaIdle, OtaErasing, OtaReceiving, OtaComplete, OtaCommitted, OtaInstalled, OtaDisabled };
+
+
+
+
+
+static uint64_t NowUs()
+{
+    timespec Time{};
+    clock_gettime(CLOCK_MONOTONIC, &Time);
+    return (uint64_t)Time.tv_sec * 1000000ULL + (uint64_t)Time.tv_nsec / 1000ULL;
+}
+
+
+
+static speed_t BaudToSpeed(int Baud)
+{
+    switch (Baud)
+    {
+        case 115200:  return B115200;
+        case 230400:  return B230400;
+        case 460800:  return B460800;
+        case 921600:  return B921600;
+        case 1500000: return B1500000;
+        case 2000000: return B2000000;
+        case 3000000: return B3000000;
+        default:      return B921600;
+    }
+}
+
+
+
+static bool SetRawMode(int Fd, int Baud)
+{
+    termios Options{};
+    if (tcgetattr(Fd, &Options) != 0) return false;
+
+    cfmakeraw(&Options);
+    Options.c_cflag |= CLOCAL | CREAD;
+    Options.c_cc[VMIN] = 0;
+    Options.c_cc[VTIME] = 0;
+    cfsetispeed(&Options, BaudToSpeed(Baud));
+    cfsetospeed(&Options, BaudToSpeed(Baud));
+
+    return tcsetattr(Fd, TCSANOW, &Options) == 0;
+}
+
+
+
+// Same checks as the nodes: start bytes, big-endian size, end bytes
+static bool ValidateFraming(const uint8_t* Data, size_t Length)
+{
+    if (Length < sizeof(PacketHeader) + 2) return false;
+    if (memcmp(Data, &PACKET_START_DELIMITER, 2) != 0) return false;
+
+    const size_t PayloadSize = ((size_t)Data[2] << 8) | Data[3];
+    if (Length < sizeof(PacketHeader) + PayloadSize + 2) return false;
+
+    return memcmp(Data + sizeof(PacketHeader) + PayloadSize, &PACKET_END_DELIMITER, 2) == 0;
+}
+
+
+
+static bool WriteFrame(int Fd, const uint8_t* Data, size_t Length)
+{
+    uint8_t Encoded[SlipMaxEncodedSize(MAX_FRAME_SIZE)];
+    size_t EncodedLength = SlipEncode(Data, Length, Encoded, sizeof(Encoded));
+    if (EncodedLength == 0) return false;
+
+    size_t Written = 0;
+    while (Written < EncodedLength)
+    {
+        ssize_t Result = write(Fd, Encoded + Written, EncodedLength - Written);
+        if (Result < 0)
+        {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return false;
+        }
+        Written += (size_t)Result;
+    }
+    return true;
+}
+
+
+
+// zlib CRC32, what esp_rom_crc32_le(0, ...) computes on the nodes
+static uint32_t Crc32(uint32_t Crc, const uint8_t* Data, size_t Length)
+{
+    Crc = ~Crc;
+    for (size_t i = 0; i < Length; i++)
+    {
+        Crc ^= Data[i];
+        for (int Bit = 0; Bit < 8; Bit++) Crc = (Crc >> 1) ^ (0xEDB88320u & (0u - (Crc & 1u)));
+    }
+    return ~Crc;
+}
+
+
+
+static size_t BuildPacket(uint64_t SlaveUid, uint8_t PacketType, const uint8_t* Payload, size_t PayloadLength, uint8_t* Out,
+                          uint8_t ForwardingMode = FORWARD_UPSTREAM)
+{
+    PacketHeader Header{};
+    Header.startDelimiter = PACKET_START_DELIMITER;
+    Header.payloadSize = htons((uint16_t)PayloadLength);
+    Header.slaveUid = SlaveUid;
+    Header.senderTimestampUs = NowUs();
+    Header.PacketType = PacketType;
+    Header.flags = 0x01;
+    Header.headerVersion = 1;
+    Header.networkId = 1;
+    Header.ttl = 10;
+    Header.ForwardingMode = ForwardingMode;
+
+    memcpy(Out, &Header, sizeof(Header));
+    memcpy(Out + sizeof(Header), Payload, PayloadLength);
+    memcpy(Out + sizeof(Header) + PayloadLength, &PACKET_END_DELIMITER, 2);
+    return sizeof(Header) + PayloadLength + 2;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                  Bridge                                      //
+//                                                                              //
+//==============================================================================//
+
+static int RunBridge(const char* Device, const char* MasterIp, uint16_t Port, int Baud)
+{
+    int SerialFd = open(Device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (SerialFd < 0 || !SetRawMode(SerialFd, Baud))
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", Device, strerror(errno));
+        return 1;
+    }
+
+    int UdpFd = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in Local{};
+    Local.sin_family = AF_INET;
+    Local.sin_port = htons(Port);
+    Local.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    sockaddr_in Master{};
+    Master.sin_family = AF_INET;
+    Master.sin_port = htons(Port);
+
+    if (UdpFd < 0 || inet_pton(AF_INET, MasterIp, &Master.sin_addr) != 1)
+    {
+        fprintf(stderr, "Bad master address %s\n", MasterIp);
+        return 1;
+    }
+
+    // Bind the mesh port so the master can answer the way it answers a node.
+    // A master on this same host already owns it, then take any port.
+    if (bind(UdpFd, (sockaddr*)&Local, sizeof(Local)) != 0)
+    {
+        Local.sin_port = 0;
+        bind(UdpFd, (sockaddr*)&Local, sizeof(Local));
+    }
+
+    printf("Bridging %s <-> %s:%u\n", Device, MasterIp, Port);
+
+    SlipDecoder<MAX_FRAME_SIZE> Decoder;
+    uint64_t ToMaster = 0, ToMesh = 0, Invalid = 0;
+    uint64_t LastReportUs = NowUs();
+
+    pollfd Fds[2] = {{SerialFd, POLLIN, 0}, {UdpFd, POLLIN, 0}};
+
+    while (true)
+    {
+        if (poll(Fds, 2, 1000) < 0 && errno != EINTR) break;
+
+        if (Fds[0].revents & POLLIN)
+        {
+            uint8_t Chunk[4096];
+            ssize_t Read = read(SerialFd, Chunk, sizeof(Chunk));
+
+            for (ssize_t i = 0; i < Read; i++)
+            {
+                size_t FrameLength = Decoder.Push(Chunk[i]);
+                if (FrameLength == 0) continue;
+
+                if (!ValidateFraming(Decoder.GetFrame(), FrameLength))
+                {
+                    Invalid++;
+                    continue;
+                }
+
+                sendto(UdpFd, Decoder.GetFrame(), FrameLength, 0, (sockaddr*)&Master, sizeof(Master));
+                ToMaster++;
+            }
+        }
+
+        if (Fds[1].revents & POLLIN)
+        {
+            uint8_t Datagram[MAX_FRAME_SIZE];
+            ssize_t Received = recv(UdpFd, Datagram, sizeof(Datagram), 0);
+
+            if (Received > 0 && ValidateFraming(Datagram, (size_t)Received) && WriteFrame(SerialFd, Datagram, (size_t)Received)) ToMesh++;
+            else if (Received > 0) Invalid++;
+        }
+
+        if (NowUs() - LastReportUs >= 5000000ULL)
+        {
+            LastReportUs = NowUs();
+            printf("To master: %llu | To mesh: %llu | Invalid: %llu | SLIP dropped: %u\n",
+                   (unsigned long long)ToMaster, (unsigned long long)ToMesh,
+                   (unsigned long long)Invalid, Decoder.GetDroppedFrameCount());
+            fflush(stdout);
+        }
+    }
+
+    return 0;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                               PTY Gateway                                    //
+//                                                                              //
+//==============================================================================//
+
+// A simulated node's side of a firmware update
+struct SimulatedOta
+{
+    OtaBegin Begin{};
+    std::vector<uint8_t> Bitmap;
+    uint16_t ReceivedCount = 0;
+    uint8_t State = OtaIdle;
+};
+
+static void SendSimulatedOtaStatus(int Fd, uint64_t Uid, const SimulatedOta& Ota)
+{
+    uint8_t Payload[sizeof(OtaStatusHeader) + OTA_MAX_CHUNKS / 8];
+    OtaStatusHeader Status{Ota.Begin.ImageId, Ota.Begin.ChunkCount, Ota.ReceivedCount, Ota.State};
+    memcpy(Payload, &Status, sizeof(Status));
+    memcpy(Payload + sizeof(Status), Ota.Bitmap.data(), Ota.Bitmap.size());
+
+    uint8_t Packet[MAX_FRAME_SIZE];
+    size_t Length = BuildPacket(Uid, PACKET_TYPE_OTA_STATUS, Payload, sizeof(Status) + Ota.Bitmap.size(), Packet);
+    WriteFrame(Fd, Packet, Length);
+}
+
+static void HandleSimulatedOta(int Fd, uint64_t Uid, SimulatedOta& Ota, uint8_t PacketType, const uint8_t* Payload, size_t Length)
+{
+    if (PacketType == PACKET_TYPE_OTA_BEGIN && Length >= sizeof(OtaBegin))
+    {
+        OtaBegin Begin;
+        memcpy(&Begin, Payload, sizeof(Begin));
+        if (Begin.ChunkCount == 0 || Begin.ChunkCount > OTA_MAX_CHUNKS) return;
+
+        if (Begin.ImageId != Ota.Begin.ImageId)
+        {
+            Ota.Begin = Begin;
+            Ota.Bitmap.assign((Begin.ChunkCount + 7) / 8, 0);
+            Ota.ReceivedCount = 0;
+            Ota.State = OtaReceiving;
+        }
+        SendSimulatedOtaStatus(Fd, Uid, Ota);
+    }
+
+    else if (PacketType == PACKET_TYPE_OTA_CHUNK && Length >= sizeof(OtaChunkHeader) && Ota.State == OtaReceiving)
+    {
+        OtaChunkHeader Chunk;
+        memcpy(&Chunk, Payload, sizeof(Chunk));
+        if (Chunk.ImageId != Ota.Begin.ImageId || Chunk.Index >= Ota.Begin.ChunkCount) return;
+        if (Length < sizeof(Chunk) + Chunk.Length || Crc32(0, Payload + sizeof(Chunk), Chunk.Length) != Chunk.Crc) return;
+        if (rand() % 100 < 5) return; // Lost on this node's branch
+
+        uint8_t& Byte = Ota.Bitmap[Chunk.Index / 8];
+        const uint8_t Mask = (uint8_t)(1u << (Chunk.Index % 8));
+        if (Byte & Mask) return;
+
+        Byte |= Mask;
+        if (++Ota.ReceivedCount == Ota.Begin.ChunkCount)
+        {
+            Ota.State = OtaComplete;
+            SendSimulatedOtaStatus(Fd, Uid, Ota);
+        }
+    }
+
+    else if (PacketType == PACKET_TYPE_OTA_COMMIT && Length >= sizeof(OtaCommit) && Ota.State == OtaComplete)
+    {
+        Ota.State = OtaCommitted;
+        SendSimulatedOtaStatus(Fd, Uid, Ota);
+    }
+}
+
+
+
+static int RunPtyGateway(int Nodes, int PeriodMs)
+{
+    int MasterFd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (MasterFd < 0 || grantpt(MasterFd) != 0 || unlockpt(MasterFd) != 0)
+    {
+        fprintf(stderr, "Cannot create pty: %s\n", strerror(errno));
+        return 1;
+    }
+
+    SetRawMode(MasterFd, 921600);
+    fcntl(MasterFd, F_SETFL, O_NONBLOCK);
+
+    printf("%s\n", ptsname(MasterFd));
+    printf("Simulating %d nodes (UID 101..%d), one packet each every %d ms\n", Nodes, 100 + Nodes, PeriodMs);
+    fflush(stdout);
+
+    SlipDecoder<MAX_FRAME_SIZE> Decoder;
+    uint64_t NextSendUs = NowUs();
+    uint64_t NextAnnounceUs = NowUs();
+    uint32_t Counter = 0;
+    uint32_t FramesSent = 0;
+    std::vector<SimulatedOta> Ota(Nodes);
+
+    while (true)
+    {
+        pollfd Fd = {MasterFd, POLLIN, 0};
+        poll(&Fd, 1, 10);
+
+        if (Fd.revents & POLLIN)
+        {
+            uint8_t Chunk[4096];
+            ssize_t Read = read(MasterFd, Chunk, sizeof(Chunk));
+
+            for (ssize_t i = 0; i < Read; i++)
+            {
+                size_t FrameLength = Decoder.Push(Chunk[i]);
+                if (FrameLength == 0 || !ValidateFraming(Decoder.GetFrame(), FrameLength)) continue;
+
+                PacketHeader Header;
+                memcpy(&Header, Decoder.GetFrame(), sizeof(Header));
+
+                // Firmware update, every simulated node is below the root
+                if (Header.ForwardingMode == FORWARD_SUBTREE)
+                {
+                    for (int Node = 0; Node < Nodes; Node++)
+                    {
+                        HandleSimulatedOta(MasterFd, 101 + Node, Ota[Node], Header.PacketType,
+                                           Decoder.GetFrame() + sizeof(Header), ntohs(Header.payloadSize));
+                    }
+                    continue;
+                }
+
+                // The master's ack, the root gateway keeps it
+                if (Header.PacketType == PACKET_TYPE_ROOT_ANNOUNCE) continue;
+
+                printf("Downstream: type %u to UID %llu, %zu bytes\n", Header.PacketType,
+                       (unsigned long long)Header.destinationUid, FrameLength);
+                fflush(stdout);
+
+                // Answer for a simulated node, echoing the payload
+                if (Header.ForwardingMode == 1 && Header.destinationUid > 100 && Header.destinationUid <= 100ULL + Nodes)
+                {
+                    uint8_t Reply[MAX_FRAME_SIZE];
+                    size_t Length = BuildPacket(Header.destinationUid, Header.PacketType, Decoder.GetFrame() + sizeof(Header),
+                                                ntohs(Header.payloadSize), Reply);
+                    WriteFrame(MasterFd, Reply, Length);
+                }
+            }
+        }
+
+        if (NowUs() >= NextSendUs)
+        {
+            NextSendUs += (uint64_t)PeriodMs * 1000ULL;
+            Counter++;
+
+            for (int Node = 1; Node <= Nodes; Node++)
+            {
+                uint8_t Packet[128];
+                size_t Length = BuildPacket(100 + Node, 1, (const uint8_t*)&Counter, sizeof(Counter), Packet);
+                if (WriteFrame(MasterFd, Packet, Length)) FramesSent++;
+            }
+        }
+
+        if (NowUs() >= NextAnnounceUs)
+        {
+            NextAnnounceUs += 1000000ULL;
+
+            RootAnnounce Announce{0, 0, (uint8_t)Nodes, FramesSent};
+            uint8_t Packet[128];
+            size_t Length = BuildPacket(100, PACKET_TYPE_ROOT_ANNOUNCE, (const uint8_t*)&Announce, sizeof(Announce), Packet);
+            if (WriteFrame(MasterFd, Packet, Length)) FramesSent++;
+        }
+    }
+
+    return 0;
+}
+
+
+
+
+
+//==============================================================================//
+//                                                                              //
+//                                 OTA Sender                                   //
+//                                                                              //
+//==============================================================================//
+
+struct OtaNode
+{
+    uint8_t State = OtaIdle;
+    uint16_t ReceivedCount = 0;
+    std::vector<uint8_t> Bitmap;
+};
+
+static const char* OtaStateName(uint8_t State)
+{
+    static const char* Names[] = {"idle", "erasing", "receiving", "complete", "committed", "installed", "root"};
+    return State <= OtaDisabled ? Names[State] : "?";
+}
+
+
+
+// Reads status reports for TimeoutMs. Returns the number of reports read.
+static int CollectOtaStatus(int Fd, SlipDecoder<MAX_FRAME_SIZE>& Decoder, uint32_t ImageId, std::map<uint64_t, OtaNode>& Nodes, int TimeoutMs)
+{
+    int Reports = 0;
+    const uint64_t EndUs = NowUs() + (uint64_t)TimeoutMs * 1000ULL;
+
+    while (true)
+    {
+        const uint64_t Now = NowUs();
+        if (Now >= EndUs) break;
+
+        pollfd Poll = {Fd, POLLIN, 0};
+        if (poll(&Poll, 1, (int)((EndUs - Now) / 1000ULL) + 1) <= 0 || !(Poll.revents & POLLIN)) continue;
+
+        uint8_t Chunk[4096];
+        ssize_t Read = read(Fd, Chunk, sizeof(Chunk));
+
+        for (ssize_t i = 0; i < Read; i++)
+        {
+            size_t FrameLength = Decoder.Push(Chunk[i]);
+            if (FrameLength == 0 || !ValidateFraming(Decoder.GetFrame(), FrameLength)) continue;
+
+            PacketHeader Header;
+            memcpy(&Header, Decoder.GetFrame(), sizeof(Header));
+            const size_t PayloadSize = ntohs(Header.payloadSize);
+            if (Header.PacketType != PACKET_TYPE_OTA_STATUS || PayloadSize < sizeof(OtaStatusHeader)) continue;
+
+            OtaStatusHeader Status;
+            memcpy(&Status, Decoder.GetFrame() + sizeof(Header), sizeof(Status));
+            if (Status.ImageId != ImageId) continue;
+
+            OtaNode& Node = Nodes[Header.slaveUid];
+            if (Node.State != Status.State)
+            {
+                printf("  node %llu: %s (%u/%u chunks)\n", (unsigned long long)Header.slaveUid,
+                       OtaStateName(Status.State), Status.ReceivedCount, Status.ChunkCount);
+                fflush(stdout);
+            }
+
+            Node.State = Status.State;
+            Node.ReceivedCount = Status.ReceivedCount;
+
+            const size_t BitmapLength = (Status.ChunkCount + 7) / 8;
+            if (PayloadSize >= sizeof(Status) + BitmapLength)
+            {
+                Node.Bitmap.assign(Decoder.GetFrame() + sizeof(Header) + sizeof(Status),
+                                   Decoder.GetFrame() + sizeof(Header) + sizeof(Status) + BitmapLength);
+            }
+            Reports++;
+        }
+    }
+
+    return Reports;
+}
+
+
+
+static bool IsOtaNodeDone(const OtaNode& Node)
+{
+    return Node.State == OtaComplete || Node.State == OtaCommitted || Node.State == OtaInstalled || Node.State == OtaDisabled;
+}
+
+
+
+static int RunOta(const char* Device, const char* ImagePath, int Baud, int IntervalMs)
+{
+    FILE* File = fopen(ImagePath, "rb");
+    if (File == nullptr)
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", ImagePath, strerror(errno));
+        return 1;
+    }
+
+    std::vector<uint8_t> Image;
+    uint8_t Buffer[4096];
+    size_t Read;
+    while ((Read = fread(Buffer, 1, sizeof(Buffer), File)) > 0) Image.insert(Image.end(), Buffer, Buffer + Read);
+    fclose(File);
+
+    const uint16_t ChunkCount = (uint16_t)((Image.size() + OTA_CHUNK_SIZE - 1) / OTA_CHUNK_SIZE);
+    if (Image.empty() || Image.size() > (size_t)OTA_MAX_CHUNKS * OTA_CHUNK_SIZE)
+    {
+        fprintf(stderr, "Image must be 1 to %u bytes\n", OTA_MAX_CHUNKS * OTA_CHUNK_SIZE);
+        return 1;
+    }
+
+    int SerialFd = open(Device, O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (SerialFd < 0 || !SetRawMode(SerialFd, Baud))
+    {
+        fprintf(stderr, "Cannot open %s: %s\n", Device, strerror(errno));
+        return 1;
+    }
+
+    OtaBegin Begin{};
+    Begin.ImageCrc = Crc32(0, Image.data(), Image.size());
+    Begin.ImageId = Begin.ImageCrc ? Begin.ImageCrc : 1; // Same image, same transfer, so an interrupted run resumes
+    Begin.ImageSize = (uint32_t)Image.size();
+    Begin.ChunkSize = OTA_CHUNK_SIZE;
+    Begin.ChunkCount = ChunkCount;
+
+    uint8_t Packet[MAX_FRAME_SIZE];
+    SlipDecoder<MAX_FRAME_SIZE> Decoder;
+    std::map<uint64_t, OtaNode> Nodes;
+    const uint64_t StartUs = NowUs();
+
+    auto SendBegin = [&]()
+    {
+        size_t Length = BuildPacket(0, PACKET_TYPE_OTA_BEGIN, (const uint8_t*)&Begin, sizeof(Begin), Packet, FORWARD_SUBTREE);
+        WriteFrame(SerialFd, Packet, Length);
+    };
+
+    auto SendChunk = [&](uint16_t Index)
+    {
+        uint8_t Payload[sizeof(OtaChunkHeader) + OTA_CHUNK_SIZE];
+        OtaChunkHeader Chunk{};
+        Chunk.ImageId = Begin.ImageId;
+        Chunk.Index = Index;
+        Chunk.Length = (uint16_t)std::min<size_t>(OTA_CHUNK_SIZE, Image.size() - (size_t)Index * OTA_CHUNK_SIZE);
+        Chunk.Crc = Crc32(0, Image.data() + (size_t)Index * OTA_CHUNK_SIZE, Chunk.Length);
+        memcpy(Payload, &Chunk, sizeof(Chunk));
+        memcpy(Payload + sizeof(Chunk), Image.data() + (size_t)Index * OTA_CHUNK_SIZE, Chunk.Length);
+
+        size_t Length = BuildPacket(0, PACKET_TYPE_OTA_CHUNK, Payload, sizeof(Chunk) + Chunk.Length, Packet, FORWARD_SUBTREE);
+        WriteFrame(SerialFd, Packet, Length);
+
+        // Paces the stream to what the serial link and the slowest flash can take
+        CollectOtaStatus(SerialFd, Decoder, Begin.ImageId, Nodes, IntervalMs);
+    };
+
+    printf("Image %08x: %zu bytes in %u chunks\n", Begin.ImageId, Image.size(), ChunkCount);
+
+
+    // Announce, and give every node time to erase its partition
+    printf("Announcing, waiting for the nodes to erase...\n");
+    fflush(stdout);
+    for (int Round = 0; Round < 10; Round++)
+    {
+        SendBegin();
+        CollectOtaStatus(SerialFd, Decoder, Begin.ImageId, Nodes, 3000);
+
+        bool IsAnyErasing = false;
+        for (auto& Entry : Nodes) IsAnyErasing |= Entry.second.State == OtaErasing || Entry.second.State == OtaIdle;
+        if (!Nodes.empty() && !IsAnyErasing) break;
+    }
+
+    if (Nodes.empty())
+    {
+        fprintf(stderr, "No node answered\n");
+        return 1;
+    }
+
+
+    // One pass down the tree, every node hears every chunk from its own parent
+    printf("Streaming to %zu nodes...\n", Nodes.size());
+    fflush(stdout);
+    for (uint16_t Index = 0; Index < ChunkCount; Index++) SendChunk(Index);
+
+
+    // Repair, resend the union of what is still missing anywhere
+    for (int Round = 1; Round <= 30; Round++)
+    {
+        SendBegin();
+        CollectOtaStatus(SerialFd, Decoder, Begin.ImageId, Nodes, 3000);
+
+        std::vector<uint16_t> Missing;
+        for (uint16_t Index = 0; Index < ChunkCount; Index++)
+        {
+            for (auto& Entry : Nodes)
+            {
+                const OtaNode& Node = Entry.second;
+                if (IsOtaNodeDone(Node)) continue;
+
+                const bool IsStored = Node.Bitmap.size() > (size_t)Index / 8 && (Node.Bitmap[Index / 8] & (1u << (Index % 8)));
+                if (!IsStored)
+                {
+                    Missing.push_back(Index);
+                    break;
+                }
+            }
+        }
+
+        if (Missing.empty()) break;
+
+        printf("Repair round %d: %zu chunks\n", Round, Missing.size());
+        fflush(stdout);
+        for (uint16_t Index : Missing) SendChunk(Index);
+    }
+
+
+    size_t DoneCount = 0;
+    for (auto& Entry : Nodes) DoneCount += IsOtaNodeDone(Entry.second) ? 1 : 0;
+
+    if (DoneCount != Nodes.size())
+    {
+        fprintf(stderr, "%zu of %zu nodes have the image, not committing\n", DoneCount, Nodes.size());
+        return 1;
+    }
+
+
+    // Every node has a verified image, switch them all over
+    OtaCommit Commit{Begin.ImageId, 2000};
+    for (int Repeat = 0; Repeat < 3; Repeat++)
+    {
+        size_t Length = BuildPacket(0, PACKET_TYPE_OTA_COMMIT, (const uint8_t*)&Commit, sizeof(Commit), Packet, FORWARD_SUBTREE);
+        WriteFrame(SerialFd, Packet, Length);
+        CollectOtaStatus(SerialFd, Decoder, Begin.ImageId, Nodes, 1000);
+    }
+
+    printf("Image %08x sent to %zu nodes in %.1f s\n", Begin.ImageId, Nodes.size(), (NowUs() - StartUs) / 1e6);
+    return 0;
+}
+
+
+
+
+
+int main(int argc, char** argv)
+{
+    if (argc >= 4 && strcmp(argv[1], "bridge") == 0)
+    {
+        uint16_t Port = (argc >= 5) ? (uint16_t)atoi(argv[4]) : DEFAULT_PORT;
+        int Baud = (argc >= 6) ? atoi(argv[5]) : 921600;
+        return RunBridge(argv[2], argv[3], Port, Baud);
+    }
+
+    if (argc >= 2 && strcmp(argv[1], "pty-gateway") == 0)
+    {
+        int Nodes = (argc >= 3) ? atoi(argv[2]) : 3;
+        int PeriodMs = (argc >= 4) ? atoi(argv[3]) : 100;
+        return RunPtyGateway(Nodes > 0 ? Nodes : 1, PeriodMs > 0 ? PeriodMs : 100);
+    }
+
+    if (argc >= 4 && strcmp(argv[1], "ota") == 0)
+    {
+        int Baud = (argc >= 5) ? atoi(argv[4]) : 921600;
+        int IntervalMs = (argc >= 6) ? atoi(argv[5]) : 15;
+        return RunOta(argv[2], argv[3], Baud, IntervalMs > 0 ? IntervalMs : 15);
+    }
+
+    fprintf(stderr, "Usage:\n"
+                    "  %s bridge <serial device> <master ip> [port] [baud]\n"
+                    "  %s pty-gateway [nodes] [period ms]\n"
+                    "  %s ota <serial device> <image.bin> [baud] [chunk interval ms]\n", argv[0], argv[0], argv[0]);
+    return 2;
+}